@@ -0,0 +1,756 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+ * Throughput and latency of the sdw.h entry points
+ *
+ * Each case runs in <WORKERS> workers started together, worker processes
+ * by default or with -t threads of one process. libsdw is thread-safe, a
+ * worker thread has its own bus connection as a worker process has, the
+ * threads share the caches of the library. One JSON object per case,
+ * mode and worker count is written to stdout. Run it through
+ * bench/bench.sh, which provides the bus and bench/fake_manager.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "sdw.h"
+
+#define MAX_UNIT_NAME_LEN       64
+#define MAX_WORKERS             64
+#define MAIN_PID_BASE           10000   // see bench/fake_manager.cpp
+#define WARMUP                  10
+#define BENCH_UNIT_FILES        30      // units per sdw_enable_units()
+#define BENCH_PIDS              64      // PIDs per sdw_get_units_by_pids()
+
+extern char *optarg;
+extern int optind;
+
+typedef struct {
+    const char *name;
+    int (*fn)(unsigned i);      // i selects the unit, rc < 0 is an error
+} bench_case_t;
+
+// sent by each worker after the run, followed by the samples in ns
+typedef struct {
+    uint64_t ts_begin;
+    uint64_t ts_end;
+    uint64_t n;
+    uint64_t errors;
+} bench_result_t;
+
+// one worker thread of -t
+typedef struct {
+    const bench_case_t *c;
+    pthread_barrier_t *start;
+    bench_result_t result;
+    uint64_t *samples;          // cfg.iterations
+    int rc;
+} bench_thread_t;
+
+struct {
+    unsigned workers = 1;
+    bool threads = false;
+    unsigned iterations = 2000;
+    unsigned units = 64;
+    const char *worker_case = NULL;     // set in the worker processes
+    int start_fd = -1;
+} cfg;
+
+static char (*names)[MAX_UNIT_NAME_LEN];
+
+static const char *bench_unit(unsigned i) {
+    return names[i % cfg.units];
+}
+
+static unsigned bench_pid(unsigned i) {
+    return MAIN_PID_BASE + i % cfg.units;
+}
+
+static int bench_get_version(unsigned i) {
+    char *version = NULL;
+    int rc;
+
+    (void) i;
+    rc = sdw_get_version(&version);
+    free(version);
+    return rc;
+}
+
+static int bench_get_version_r(unsigned i) {
+    char buf[64];
+
+    (void) i;
+    return sdw_get_version_r(buf, sizeof(buf));
+}
+
+#define BENCH_STATE(NAME)                                       \
+static int bench_get_##NAME(unsigned i) {                       \
+    char *state = NULL;                                         \
+    int rc = sdw_get_##NAME(bench_unit(i), &state);             \
+    free(state);                                                \
+    return rc;                                                  \
+}                                                               \
+static int bench_get_##NAME##_r(unsigned i) {                   \
+    char buf[64];                                               \
+    return sdw_get_##NAME##_r(bench_unit(i), buf, sizeof(buf)); \
+}
+
+BENCH_STATE(activestate)
+BENCH_STATE(substate)
+BENCH_STATE(loadstate)
+BENCH_STATE(unitfilestate)
+
+#define BENCH_VALUE(NAME, TYPE)                                 \
+static int bench_get_##NAME(unsigned i) {                       \
+    TYPE value;                                                 \
+    return sdw_get_##NAME(bench_unit(i), &value);               \
+}
+
+BENCH_VALUE(mainpid, unsigned)
+BENCH_VALUE(controlpid, unsigned)
+BENCH_VALUE(nrestarts, unsigned)
+BENCH_VALUE(exec_main_status, int)
+BENCH_VALUE(memory_current, uint64_t)
+BENCH_VALUE(active_enter_timestamp, uint64_t)
+BENCH_VALUE(need_daemon_reload, int)
+BENCH_VALUE(unit_job, unsigned)
+
+static int bench_get_unit_by_pid(unsigned i) {
+    char *unit_name = NULL;
+    int rc = sdw_get_unit_by_pid(bench_pid(i), &unit_name);
+
+    free(unit_name);
+    return rc;
+}
+
+static int bench_get_unit_by_pid_r(unsigned i) {
+    char buf[MAX_UNIT_NAME_LEN];
+
+    return sdw_get_unit_by_pid_r(bench_pid(i), buf, sizeof(buf));
+}
+
+static int bench_get_units_by_pids(unsigned i) {
+    unsigned pids[BENCH_PIDS];
+    char **units = NULL;
+    int rc;
+
+    for (unsigned k = 0; k < BENCH_PIDS; k++)
+        pids[k] = bench_pid(i + k);
+
+    rc = sdw_get_units_by_pids(pids, BENCH_PIDS, &units);
+    free(units);
+    return rc;
+}
+
+static int bench_check_pid(unsigned i) {
+    return sdw_check_pid(bench_unit(i), bench_pid(i));
+}
+
+static int bench_check_controlpid(unsigned i) {
+    return sdw_check_controlpid(bench_unit(i), 0);
+}
+
+static int bench_start(unsigned i) {
+    return sdw_start(bench_unit(i));
+}
+
+static int bench_stop(unsigned i) {
+    return sdw_stop(bench_unit(i));
+}
+
+static int bench_restart(unsigned i) {
+    return sdw_restart(bench_unit(i));
+}
+
+static int bench_restart_wait(unsigned i) {
+    return sdw_restart(bench_unit(i), 5);
+}
+
+static int bench_enable(unsigned i) {
+    return sdw_enable(bench_unit(i));
+}
+
+static int bench_disable(unsigned i) {
+    return sdw_disable(bench_unit(i));
+}
+
+static int bench_enable_units(unsigned i) {
+    const char *list[BENCH_UNIT_FILES + 1];
+
+    for (unsigned k = 0; k < BENCH_UNIT_FILES; k++)
+        list[k] = bench_unit(i + k);
+    list[BENCH_UNIT_FILES] = NULL;
+
+    return sdw_enable_units(list);
+}
+
+static int bench_disable_units(unsigned i) {
+    const char *list[BENCH_UNIT_FILES + 1];
+
+    for (unsigned k = 0; k < BENCH_UNIT_FILES; k++)
+        list[k] = bench_unit(i + k);
+    list[BENCH_UNIT_FILES] = NULL;
+
+    return sdw_disable_units(list);
+}
+
+static int bench_list_units(unsigned i) {
+    const char *patterns[] = { "fake-*.service", NULL };
+    char **units = NULL;
+    int rc;
+
+    (void) i;
+    rc = sdw_list_units(patterns, &units);
+    free(units);
+    return rc;
+}
+
+static int bench_reload(unsigned i) {
+    (void) i;
+    return sdw_reload();
+}
+
+static int bench_encode(unsigned i) {
+    char *encoded = NULL;
+    int rc = sdw_encode(bench_unit(i), &encoded);
+
+    free(encoded);
+    return rc;
+}
+
+static int bench_decode(unsigned i) {
+    char *decoded = NULL;
+    int rc = sdw_decode("fake_2d1_2eservice", &decoded);
+
+    (void) i;
+    free(decoded);
+    return rc;
+}
+
+static int bench_parse_activestate(unsigned i) {
+    (void) i;
+    return sdw_parse_activestate("deactivating");
+}
+
+static int bench_parse_substate(unsigned i) {
+    (void) i;
+    return sdw_parse_substate("running");
+}
+
+static int bench_notify_ready(unsigned i) {
+    (void) i;
+    return sdw_notify_ready();
+}
+
+static int bench_notify_mainpid(unsigned i) {
+    return sdw_notify_mainpid(bench_pid(i));
+}
+
+static int bench_status_publish(unsigned i) {
+    char status[32];
+
+    snprintf(status, sizeof(status), "processed %u", i);
+    return sdw_status_publish(status);
+}
+
+static int bench_get_stats(unsigned i) {
+    sdw_stats_t stats;
+
+    (void) i;
+    return sdw_get_stats(&stats);
+}
+
+// jobs run last so that StopUnit does not change the other results,
+// RestartUnit leaves all units running
+static const bench_case_t cases[] = {
+    { "sdw_get_version", bench_get_version },
+    { "sdw_get_version_r", bench_get_version_r },
+    { "sdw_get_activestate", bench_get_activestate },
+    { "sdw_get_activestate_r", bench_get_activestate_r },
+    { "sdw_get_substate", bench_get_substate },
+    { "sdw_get_substate_r", bench_get_substate_r },
+    { "sdw_get_loadstate", bench_get_loadstate },
+    { "sdw_get_loadstate_r", bench_get_loadstate_r },
+    { "sdw_get_unitfilestate", bench_get_unitfilestate },
+    { "sdw_get_unitfilestate_r", bench_get_unitfilestate_r },
+    { "sdw_get_mainpid", bench_get_mainpid },
+    { "sdw_get_controlpid", bench_get_controlpid },
+    { "sdw_get_nrestarts", bench_get_nrestarts },
+    { "sdw_get_exec_main_status", bench_get_exec_main_status },
+    { "sdw_get_memory_current", bench_get_memory_current },
+    { "sdw_get_active_enter_timestamp", bench_get_active_enter_timestamp },
+    { "sdw_get_need_daemon_reload", bench_get_need_daemon_reload },
+    { "sdw_get_unit_job", bench_get_unit_job },
+    { "sdw_get_unit_by_pid", bench_get_unit_by_pid },
+    { "sdw_get_unit_by_pid_r", bench_get_unit_by_pid_r },
+    { "sdw_get_units_by_pids", bench_get_units_by_pids },
+    { "sdw_list_units", bench_list_units },
+    { "sdw_check_pid", bench_check_pid },
+    { "sdw_check_controlpid", bench_check_controlpid },
+    { "sdw_encode", bench_encode },
+    { "sdw_decode", bench_decode },
+    { "sdw_parse_activestate", bench_parse_activestate },
+    { "sdw_parse_substate", bench_parse_substate },
+    { "sdw_notify_ready", bench_notify_ready },
+    { "sdw_notify_mainpid", bench_notify_mainpid },
+    { "sdw_status_publish", bench_status_publish },
+    { "sdw_get_stats", bench_get_stats },
+    { "sdw_enable", bench_enable },
+    { "sdw_disable", bench_disable },
+    { "sdw_enable_units", bench_enable_units },
+    { "sdw_disable_units", bench_disable_units },
+    { "sdw_reload", bench_reload },
+    { "sdw_start", bench_start },
+    { "sdw_stop", bench_stop },
+    { "sdw_restart", bench_restart },
+    { "sdw_restart_wait", bench_restart_wait },
+};
+
+static void usage(void) {
+    printf("usage: bench [-j <WORKERS>] [-t] [-n <ITERATIONS>] [-u <UNITS>] "
+           "[<CASE>...]\n"
+           "    -j <WORKERS>      parallel workers, default 1\n"
+           "    -t                workers are threads, default processes\n"
+           "    -n <ITERATIONS>   calls per worker and case, default 2000\n"
+           "    -u <UNITS>        units served by fake_manager, default 64\n"
+           "cases:\n");
+    for (const bench_case_t &c : cases)
+        printf("    %s\n", c.name);
+    exit(1);
+}
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int bench_write(int fd, const void *buf, size_t len) {
+    const char *p = (const char *) buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return 0;
+}
+
+static int bench_read(int fd, void *buf, size_t len) {
+    char *p = (char *) buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, p, len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return 0;
+}
+
+static const bench_case_t *bench_find(const char *name) {
+    for (const bench_case_t &c : cases)
+        if (strcmp(c.name, name) == 0)
+            return &c;
+
+    return NULL;
+}
+
+// connect the calling worker and warm up its caches, rc of the connect
+static int bench_warmup(const bench_case_t *c) {
+    int rc = sdw_is_supported();
+
+    for (unsigned i = 0; 0 == rc && i < WARMUP; i++)
+        c->fn(i);
+
+    return rc;
+}
+
+// the timed calls of one worker
+static void bench_loop(const bench_case_t *c, bench_result_t *result,
+                       uint64_t *samples) {
+    uint64_t ts;
+
+    memset(result, 0, sizeof(*result));
+    result->n = cfg.iterations;
+    result->ts_begin = bench_now_ns();
+
+    for (unsigned i = 0; i < cfg.iterations; i++) {
+        ts = bench_now_ns();
+        if (c->fn(i) < 0)
+            result->errors++;
+        samples[i] = bench_now_ns() - ts;
+    }
+
+    result->ts_end = bench_now_ns();
+}
+
+// worker thread: warm up, wait for the others, run
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = (bench_thread_t *) arg;
+
+    t->rc = bench_warmup(t->c);
+    pthread_barrier_wait(t->start);
+    if (0 == t->rc)
+        bench_loop(t->c, &t->result, t->samples);
+
+    return NULL;
+}
+
+// worker process: warm up, report ready, wait for the start, run, send
+// results
+static int bench_worker(void) {
+    const bench_case_t *c = bench_find(cfg.worker_case);
+    bench_result_t result;
+    uint64_t *samples;
+    char go;
+    int rc;
+
+    samples = (uint64_t *) calloc(cfg.iterations, sizeof(uint64_t));
+    if (NULL == c || NULL == samples)
+        return 1;
+
+    rc = bench_warmup(c);
+    if (bench_write(STDOUT_FILENO, &rc, sizeof(rc)) != 0 || 0 != rc)
+        return 1;
+
+    // blocks until the parent closes the start pipe
+    if (read(cfg.start_fd, &go, 1) < 0)
+        return 1;
+
+    bench_loop(c, &result, samples);
+
+    if (bench_write(STDOUT_FILENO, &result, sizeof(result)) != 0 ||
+        bench_write(STDOUT_FILENO, samples,
+                    cfg.iterations * sizeof(uint64_t)) != 0)
+        return 1;
+
+    free(samples);
+    return 0;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of the sorted samples
+static double bench_percentile(const uint64_t *samples, size_t n, double p) {
+    size_t rank = (size_t) (p * (double) n + 0.999999);
+
+    return (double) samples[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+// add the result of a worker to the totals of the case
+static void bench_add(const bench_result_t *result, size_t *n,
+                      uint64_t *errors, uint64_t *ts_begin, uint64_t *ts_end) {
+    *n += result->n;
+    *errors += result->errors;
+    if (result->ts_begin < *ts_begin)
+        *ts_begin = result->ts_begin;
+    if (result->ts_end > *ts_end)
+        *ts_end = result->ts_end;
+}
+
+// run c in cfg.workers threads of this process, the samples are stored
+// in place, 0 if all of them ran
+static int bench_run_threads(const bench_case_t *c, uint64_t *samples,
+                             size_t *n, uint64_t *errors, uint64_t *ts_begin,
+                             uint64_t *ts_end) {
+    pthread_t tids[MAX_WORKERS];
+    bench_thread_t t[MAX_WORKERS];
+    pthread_barrier_t start;
+    unsigned w;
+    int rc = 0;
+
+    // the workers and this thread, the workers start together
+    if (pthread_barrier_init(&start, NULL, cfg.workers + 1) != 0)
+        return 1;
+
+    for (w = 0; w < cfg.workers; w++) {
+        t[w].c = c;
+        t[w].start = &start;
+        t[w].samples = samples + (size_t) w * cfg.iterations;
+        t[w].rc = 0;
+        if (pthread_create(&tids[w], NULL, bench_thread, &t[w]) != 0) {
+            fprintf(stderr, "bench: worker thread failed\n");
+            exit(1);            // the others wait for it at the barrier
+        }
+    }
+
+    pthread_barrier_wait(&start);
+
+    for (w = 0; w < cfg.workers; w++) {
+        pthread_join(tids[w], NULL);
+        if (0 != t[w].rc)
+            rc = 1;
+        else
+            bench_add(&t[w].result, n, errors, ts_begin, ts_end);
+    }
+
+    pthread_barrier_destroy(&start);
+
+    return rc;
+}
+
+// run c in cfg.workers fresh processes, their samples are read into
+// samples, 0 if all of them ran
+static int bench_run_processes(const char *self, const bench_case_t *c,
+                               uint64_t *samples, size_t *n,
+                               uint64_t *errors, uint64_t *ts_begin,
+                               uint64_t *ts_end) {
+    char iterations[16], units[16], start_fd[16];
+    int fds[MAX_WORKERS];
+    pid_t pids[MAX_WORKERS];
+    bench_result_t result;
+    int start[2];
+    int status, rc = 0;
+    unsigned w, started = 0;
+
+    if (pipe(start) != 0)
+        return 1;
+
+    snprintf(iterations, sizeof(iterations), "%u", cfg.iterations);
+    snprintf(units, sizeof(units), "%u", cfg.units);
+    snprintf(start_fd, sizeof(start_fd), "%d", start[0]);
+
+    // fresh processes, libsdw connects in its constructor and sd-bus
+    // connections must not be shared across fork()
+    for (w = 0; w < cfg.workers; w++) {
+        int out[2];
+
+        if (pipe(out) != 0)
+            break;
+
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            close(out[0]);
+            close(out[1]);
+            break;
+        }
+
+        if (0 == pids[w]) {
+            close(start[1]);
+            close(out[0]);
+            dup2(out[1], STDOUT_FILENO);
+            execl(self, self, "-W", c->name, "-S", start_fd, "-n",
+                  iterations, "-u", units, (char *) NULL);
+            _exit(127);
+        }
+
+        close(out[1]);
+        fds[w] = out[0];
+        started++;
+    }
+
+    for (w = 0; w < started; w++)
+        if (bench_read(fds[w], &status, sizeof(status)) != 0 || 0 != status)
+            rc = 1;
+
+    close(start[0]);
+    close(start[1]);            // releases all workers at once
+
+    for (w = 0; w < started; w++) {
+        if (0 == rc && bench_read(fds[w], &result, sizeof(result)) == 0 &&
+            bench_read(fds[w], samples + *n,
+                       result.n * sizeof(uint64_t)) == 0)
+            bench_add(&result, n, errors, ts_begin, ts_end);
+        else
+            rc = 1;
+
+        close(fds[w]);
+        waitpid(pids[w], NULL, 0);
+    }
+
+    return 0 != rc || started != cfg.workers;
+}
+
+// start cfg.workers workers for c, collect and print their results
+static int bench_run(const char *self, const bench_case_t *c) {
+    uint64_t *samples = NULL;
+    uint64_t ts_begin = UINT64_MAX, ts_end = 0, errors = 0;
+    size_t n = 0;
+    int rc;
+    double wall;
+
+    samples = (uint64_t *) calloc((size_t) cfg.workers * cfg.iterations,
+                                  sizeof(uint64_t));
+    if (NULL == samples)
+        return 1;
+
+    if (cfg.threads)
+        rc = bench_run_threads(c, samples, &n, &errors, &ts_begin, &ts_end);
+    else
+        rc = bench_run_processes(self, c, samples, &n, &errors, &ts_begin,
+                                 &ts_end);
+
+    if (0 != rc || 0 == n) {
+        fprintf(stderr, "bench: %s failed\n", c->name);
+        free(samples);
+        return 1;
+    }
+
+    qsort(samples, n, sizeof(uint64_t), bench_cmp);
+    wall = (double) (ts_end - ts_begin) / 1e9;
+
+    printf("{\"case\":\"%s\",\"mode\":\"%s\",\"workers\":%u,\"ops\":%zu"
+           ",\"errors\":%" PRIu64 ",\"ops_per_sec\":%.1f,\"p50_usec\":%.3f"
+           ",\"p99_usec\":%.3f,\"max_usec\":%.3f}\n", c->name,
+           cfg.threads ? "threads" : "processes", cfg.workers, n, errors,
+           wall > 0 ? (double) n / wall : 0.0,
+           bench_percentile(samples, n, 0.50),
+           bench_percentile(samples, n, 0.99),
+           (double) samples[n - 1] / 1000.0);
+    fflush(stdout);
+
+    free(samples);
+    return 0;
+}
+
+// receiver of the NOTIFY_SOCKET messages sent by the notify cases
+static void *bench_notify_thread(void *arg) {
+    int fd = *(int *) arg;
+    char buf[256];
+
+    while (recv(fd, buf, sizeof(buf), 0) >= 0 || EINTR == errno)
+        ;
+
+    return NULL;
+}
+
+static int bench_notify_socket(void) {
+    static int fd;
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    // abstract socket, nothing to clean up
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+             "sdw-bench-%d", (int) getpid());
+
+    if (bind(fd, (struct sockaddr *) &addr,
+             offsetof(struct sockaddr_un, sun_path) + 1 +
+             strlen(addr.sun_path + 1)) != 0)
+        return -1;
+
+    // inherited by the workers, sd_notify() maps '@' to abstract
+    addr.sun_path[0] = '@';
+    setenv("NOTIFY_SOCKET", addr.sun_path, 1);
+
+    return pthread_create(&tid, NULL, bench_notify_thread, &fd);
+}
+
+int main(int argc, char **argv) {
+    int c, rc = 0;
+
+    while ((c = getopt(argc, argv, "j:tn:u:W:S:h")) != -1) {
+        switch (c) {
+            case 'j':
+                cfg.workers = (unsigned) atoi(optarg);
+                break;
+            case 't':
+                cfg.threads = true;
+                break;
+            case 'n':
+                cfg.iterations = (unsigned) atoi(optarg);
+                break;
+            case 'u':
+                cfg.units = (unsigned) atoi(optarg);
+                break;
+            case 'W':
+                cfg.worker_case = optarg;
+                break;
+            case 'S':
+                cfg.start_fd = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (0 == cfg.workers || cfg.workers > MAX_WORKERS ||
+        0 == cfg.iterations || 0 == cfg.units)
+        usage();
+
+    names = (char (*)[MAX_UNIT_NAME_LEN]) calloc(cfg.units,
+                                                 MAX_UNIT_NAME_LEN);
+    if (NULL == names)
+        return 1;
+    for (unsigned i = 0; i < cfg.units; i++)
+        snprintf(names[i], MAX_UNIT_NAME_LEN, "fake-%u.service", i);
+
+    // the MainPIDs of the fake units are no processes, ask the manager
+    sdw_set_pid_lookup(SDW_PID_LOOKUP_BUS);
+
+    if (NULL != cfg.worker_case)
+        return bench_worker();
+
+    if (sdw_is_supported() != 0) {
+        fprintf(stderr, "bench: no systemd manager on the bus\n");
+        return 1;
+    }
+
+    if (bench_notify_socket() != 0) {
+        fprintf(stderr, "bench: NOTIFY_SOCKET: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            const bench_case_t *bc = bench_find(argv[i]);
+
+            if (NULL == bc)
+                usage();
+            rc |= bench_run("/proc/self/exe", bc);
+        }
+    } else {
+        for (const bench_case_t &bc : cases)
+            rc |= bench_run("/proc/self/exe", &bc);
+    }
+
+    return rc;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# run bench/bench against a private dbus-daemon and bench/fake_manager,
+# no systemd is needed
+#
+# usage: bench/bench.sh [<bench options>] [<CASE>...]
+#
+# BENCH_WORKERS lists the worker counts, default "1 4", BENCH_MODES the
+# kind of workers, default "processes threads". The results are written
+# to stdout as one JSON object per line
+
+set -e
+
+dir=$(cd "$(dirname "$0")" && pwd)
+. "$dir/bus.sh"
+
+for mode in ${BENCH_MODES:-processes threads}; do
+    threads=
+    [ "$mode" = threads ] && threads=-t
+    for workers in ${BENCH_WORKERS:-1 4}; do
+        "$dir/bench" -j "$workers" $threads -u "${BENCH_UNITS:-64}" "$@"
+    done
+done
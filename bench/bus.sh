@@ -0,0 +1,42 @@
+#
+# sourced by bench/bench.sh and bench/stress.sh: starts a private
+# dbus-daemon and bench/fake_manager serving ${BENCH_UNITS:-64} units
+# whose jobs take ${BENCH_JOB_MSEC:-0} ms, exports DBUS_SYSTEM_BUS_ADDRESS
+# and stops both on exit
+#
+# expects $dir, the directory of the scripts
+#
+
+tmp=$(mktemp -d)
+bus_pid=
+fake_pid=
+
+cleanup() {
+    [ -n "$fake_pid" ] && kill "$fake_pid" 2>/dev/null
+    [ -n "$bus_pid" ] && kill "$bus_pid" 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+cat > "$tmp/bus.conf" <<CONF
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>custom</type>
+  <listen>unix:path=$tmp/bus.sock</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+    <allow user="*"/>
+  </policy>
+</busconfig>
+CONF
+
+bus_pid=$(dbus-daemon --config-file="$tmp/bus.conf" --fork --print-pid)
+
+DBUS_SYSTEM_BUS_ADDRESS="unix:path=$tmp/bus.sock"
+export DBUS_SYSTEM_BUS_ADDRESS
+
+fake_pid=$("$dir/fake_manager" "${BENCH_UNITS:-64}" "${BENCH_JOB_MSEC:-0}")
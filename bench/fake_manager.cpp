@@ -0,0 +1,573 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+ * Minimal org.freedesktop.systemd1 manager for bench/bench.sh
+ *
+ * Serves the units fake-0.service .. fake-<n-1>.service on the bus of
+ * DBUS_SYSTEM_BUS_ADDRESS. Jobs finish immediately or after
+ * <JOB_MSEC>, JobRemoved and PropertiesChanged are emitted like systemd
+ * does. The process forks into the background once the bus name is
+ * owned and prints its PID.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <systemd/sd-bus.h>
+
+#define MAX_UNIT_NAME_LEN       64
+#define MAX_UNIT_PATH_LEN       256
+#define MAIN_PID_BASE           10000   // MainPID of fake-<i> is base + i
+#define MAX_PENDING_JOBS        4096    // running with JOB_MSEC
+
+typedef struct {
+    char name[MAX_UNIT_NAME_LEN];
+    char path[MAX_UNIT_PATH_LEN];
+    const char *active;
+    const char *sub;
+    unsigned main_pid;
+    bool enabled;
+    unsigned n_restarts;
+} fake_unit_t;
+
+static const char fake_service[] = "org.freedesktop.systemd1";
+static const char fake_object_path[] = "/org/freedesktop/systemd1";
+static const char fake_unit_path[] = "/org/freedesktop/systemd1/unit";
+static const char fake_interface_mgr[] = "org.freedesktop.systemd1.Manager";
+static const char fake_interface_props[] = "org.freedesktop.DBus.Properties";
+static const char fake_no_such_unit[] = "org.freedesktop.systemd1.NoSuchUnit";
+
+static sd_bus *bus = NULL;
+static fake_unit_t *units = NULL;
+static unsigned n_units = 64;
+static unsigned job_id = 0;
+static unsigned job_msec = 0;
+
+// job whose JobRemoved is due at ts_due
+typedef struct {
+    uint64_t ts_due;
+    unsigned id;
+    fake_unit_t *unit;
+} fake_job_t;
+
+static fake_job_t jobs[MAX_PENDING_JOBS];
+static unsigned job_head = 0;   // next due
+static unsigned job_tail = 0;
+
+// escape like sd_bus_path_encode()
+static void fake_label_escape(const char *s, char *buf, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t o = 0;
+
+    for (const char *f = s; '\0' != *f && o + 4 < len; f++) {
+        if ((*f >= 'a' && *f <= 'z') || (*f >= 'A' && *f <= 'Z') ||
+            (f > s && *f >= '0' && *f <= '9')) {
+            buf[o++] = *f;
+        } else {
+            buf[o++] = '_';
+            buf[o++] = hex[(unsigned char) *f >> 4];
+            buf[o++] = hex[(unsigned char) *f & 15];
+        }
+    }
+    buf[o] = '\0';
+}
+
+static fake_unit_t *fake_find_unit(const char *name) {
+    for (unsigned i = 0; i < n_units; i++)
+        if (strcmp(units[i].name, name) == 0)
+            return &units[i];
+
+    return NULL;
+}
+
+static fake_unit_t *fake_find_path(const char *path) {
+    for (unsigned i = 0; i < n_units; i++)
+        if (strcmp(units[i].path, path) == 0)
+            return &units[i];
+
+    return NULL;
+}
+
+// append property prop of u (of the manager if u is NULL) as variant
+static int fake_append_property(sd_bus_message *msg, fake_unit_t *u,
+                                const char *prop) {
+    if (NULL == u) {
+        if (strcmp(prop, "Version") == 0)
+            return sd_bus_message_append(msg, "v", "s", "252 (fake)");
+        return -ENOENT;
+    }
+
+    if (strcmp(prop, "ActiveState") == 0)
+        return sd_bus_message_append(msg, "v", "s", u->active);
+    if (strcmp(prop, "SubState") == 0)
+        return sd_bus_message_append(msg, "v", "s", u->sub);
+    if (strcmp(prop, "LoadState") == 0)
+        return sd_bus_message_append(msg, "v", "s", "loaded");
+    if (strcmp(prop, "Id") == 0)
+        return sd_bus_message_append(msg, "v", "s", u->name);
+    if (strcmp(prop, "MainPID") == 0)
+        return sd_bus_message_append(msg, "v", "u", u->main_pid);
+    if (strcmp(prop, "ControlPID") == 0)
+        return sd_bus_message_append(msg, "v", "u", 0);
+    if (strcmp(prop, "NRestarts") == 0)
+        return sd_bus_message_append(msg, "v", "u", u->n_restarts);
+    if (strcmp(prop, "ControlGroup") == 0) {
+        char cgroup[sizeof(u->name) + 16];
+
+        snprintf(cgroup, sizeof(cgroup), "/system.slice/%s", u->name);
+        return sd_bus_message_append(msg, "v", "s", cgroup);
+    }
+    if (strcmp(prop, "ExecMainStatus") == 0)
+        return sd_bus_message_append(msg, "v", "i", 0);
+    if (strcmp(prop, "MemoryCurrent") == 0)
+        return sd_bus_message_append(msg, "v", "t",
+                                     (uint64_t) 1 << 20);
+    if (strcmp(prop, "ActiveEnterTimestampMonotonic") == 0)
+        return sd_bus_message_append(msg, "v", "t", (uint64_t) 1000000);
+    if (strcmp(prop, "NeedDaemonReload") == 0)
+        return sd_bus_message_append(msg, "v", "b", 0);
+    if (strcmp(prop, "Job") == 0)
+        return sd_bus_message_append(msg, "v", "(uo)", 0, "/");
+
+    return -ENOENT;
+}
+
+static int fake_get_property(sd_bus_message *m, fake_unit_t *u) {
+    sd_bus_message *reply = NULL;
+    const char *interface, *prop;
+    int rc;
+
+    rc = sd_bus_message_read(m, "ss", &interface, &prop);
+    if (rc < 0)
+        return rc;
+
+    rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc < 0)
+        return rc;
+
+    rc = fake_append_property(reply, u, prop);
+    if (rc < 0) {
+        sd_bus_message_unref(reply);
+        return sd_bus_reply_method_errorf(m,
+                        "org.freedesktop.DBus.Error.UnknownProperty",
+                        "unknown property %s", prop);
+    }
+
+    rc = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+// like PID 1 the states change on the Unit interface, MainPID on Service
+static void fake_emit_changed(fake_unit_t *u) {
+    static const struct {
+        const char *interface;
+        const char *props[2];
+    } changes[] = {
+        { "org.freedesktop.systemd1.Unit", { "ActiveState", "SubState" } },
+        { "org.freedesktop.systemd1.Service", { "MainPID", NULL } },
+    };
+    sd_bus_message *msg;
+
+    for (const auto &c : changes) {
+        msg = NULL;
+        if (sd_bus_message_new_signal(bus, &msg, u->path, fake_interface_props,
+                                      "PropertiesChanged") < 0)
+            return;
+
+        sd_bus_message_append(msg, "s", c.interface);
+        sd_bus_message_open_container(msg, 'a', "{sv}");
+        for (const char *prop : c.props) {
+            if (NULL == prop)
+                break;
+            sd_bus_message_open_container(msg, 'e', "sv");
+            sd_bus_message_append(msg, "s", prop);
+            fake_append_property(msg, u, prop);
+            sd_bus_message_close_container(msg);
+        }
+        sd_bus_message_close_container(msg);
+        sd_bus_message_append(msg, "as", 0);
+
+        sd_bus_send(bus, msg, NULL);
+        sd_bus_message_unref(msg);
+    }
+}
+
+static uint64_t fake_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void fake_job_removed(unsigned id, const fake_unit_t *u) {
+    char job[MAX_UNIT_PATH_LEN];
+
+    snprintf(job, sizeof(job), "%s/job/%u", fake_object_path, id);
+    sd_bus_emit_signal(bus, fake_object_path, fake_interface_mgr,
+                       "JobRemoved", "uoss", id, job, u->name, "done");
+}
+
+// finish the jobs that are due, returns the usec until the next one
+static uint64_t fake_jobs_due(void) {
+    uint64_t now = fake_now_usec();
+    fake_job_t *j;
+
+    while (job_head != job_tail) {
+        j = &jobs[job_head % MAX_PENDING_JOBS];
+        if (j->ts_due > now)
+            return j->ts_due - now;
+
+        fake_job_removed(j->id, j->unit);
+        job_head++;
+    }
+
+    return (uint64_t) -1;
+}
+
+static int fake_list_units(sd_bus_message *m) {
+    sd_bus_message *reply = NULL;
+    char **patterns = NULL;
+    bool match;
+    int rc;
+
+    rc = sd_bus_message_skip(m, "as");  // states
+    if (rc >= 0)
+        rc = sd_bus_message_read_strv(m, &patterns);
+    if (rc >= 0)
+        rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(reply, 'a', "(ssssssouso)");
+
+    for (unsigned i = 0; rc >= 0 && i < n_units; i++) {
+        match = NULL == patterns || NULL == patterns[0];
+        for (char **p = patterns; !match && NULL != *p; p++)
+            match = fnmatch(*p, units[i].name, 0) == 0;
+        if (!match)
+            continue;
+
+        rc = sd_bus_message_append(reply, "(ssssssouso)", units[i].name,
+                                   "fake unit", "loaded", units[i].active,
+                                   units[i].sub, "", units[i].path, 0, "",
+                                   "/");
+    }
+
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(reply);
+    if (rc >= 0)
+        rc = sd_bus_send(NULL, reply, NULL);
+
+    for (char **p = patterns; NULL != p && NULL != *p; p++)
+        free(*p);
+    free(patterns);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+static int fake_job(sd_bus_message *m, const char *member) {
+    const char *name, *mode;
+    char job[MAX_UNIT_PATH_LEN];
+    fake_unit_t *u;
+    int rc;
+
+    rc = sd_bus_message_read(m, "ss", &name, &mode);
+    if (rc < 0)
+        return rc;
+
+    u = fake_find_unit(name);
+    if (NULL == u)
+        return sd_bus_reply_method_errorf(m, fake_no_such_unit,
+                                          "Unit %s not found.", name);
+
+    snprintf(job, sizeof(job), "%s/job/%u", fake_object_path, ++job_id);
+    rc = sd_bus_reply_method_return(m, "o", job);
+    if (rc < 0)
+        return rc;
+
+    if (strcmp(member, "StopUnit") == 0) {
+        u->active = "inactive";
+        u->sub = "dead";
+        u->main_pid = 0;
+    } else {
+        if (strcmp(member, "RestartUnit") == 0)
+            u->n_restarts++;
+        u->active = "active";
+        u->sub = "running";
+        u->main_pid = MAIN_PID_BASE + (unsigned) (u - units);
+    }
+
+    fake_emit_changed(u);
+
+    if (0 == job_msec || job_tail - job_head >= MAX_PENDING_JOBS) {
+        fake_job_removed(job_id, u);
+        return 1;
+    }
+
+    jobs[job_tail % MAX_PENDING_JOBS].ts_due = fake_now_usec() +
+        (uint64_t) job_msec * 1000;
+    jobs[job_tail % MAX_PENDING_JOBS].id = job_id;
+    jobs[job_tail % MAX_PENDING_JOBS].unit = u;
+    job_tail++;
+
+    return 1;
+}
+
+static int fake_unit_files(sd_bus_message *m, bool enable) {
+    sd_bus_message *reply = NULL;
+    const char *name;
+    fake_unit_t *u;
+    int rc;
+
+    rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc < 0)
+        return rc;
+
+    if (enable)
+        sd_bus_message_append(reply, "b", 0);   // carries_install_info
+
+    sd_bus_message_enter_container(m, 'a', "s");
+    sd_bus_message_open_container(reply, 'a', "(sss)");
+    while (sd_bus_message_read(m, "s", &name) > 0) {
+        u = fake_find_unit(name);
+        if (NULL == u || u->enabled == enable)
+            continue;
+
+        u->enabled = enable;
+        sd_bus_message_append(reply, "(sss)", enable ? "symlink" : "unlink",
+                              "/etc/systemd/system/multi-user.target.wants",
+                              name);
+    }
+    sd_bus_message_exit_container(m);
+    sd_bus_message_close_container(reply);
+
+    rc = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+static int fake_manager(sd_bus_message *m, void *userdata,
+                        sd_bus_error *error) {
+    const char *member = sd_bus_message_get_member(m);
+    const char *name;
+    fake_unit_t *u;
+    unsigned pid;
+    int rc;
+
+    (void) userdata;
+    (void) error;
+
+    if (sd_bus_message_is_method_call(m, fake_interface_props, "Get"))
+        return fake_get_property(m, NULL);
+
+    if (!sd_bus_message_is_method_call(m, fake_interface_mgr, NULL) ||
+        NULL == member)
+        return 0;
+
+    if (strcmp(member, "StartUnit") == 0 || strcmp(member, "StopUnit") == 0 ||
+        strcmp(member, "RestartUnit") == 0)
+        return fake_job(m, member);
+
+    if (strcmp(member, "GetUnitByPID") == 0) {
+        rc = sd_bus_message_read(m, "u", &pid);
+        if (rc < 0)
+            return rc;
+
+        for (unsigned i = 0; i < n_units; i++)
+            if (0 != pid && units[i].main_pid == pid)
+                return sd_bus_reply_method_return(m, "o", units[i].path);
+
+        return sd_bus_reply_method_errorf(m,
+                        "org.freedesktop.systemd1.NoUnitForPID",
+                        "PID %u does not belong to any loaded unit.", pid);
+    }
+
+    if (strcmp(member, "GetUnitFileState") == 0) {
+        rc = sd_bus_message_read(m, "s", &name);
+        if (rc < 0)
+            return rc;
+
+        u = fake_find_unit(name);
+        if (NULL == u)
+            return sd_bus_reply_method_errorf(m, fake_no_such_unit,
+                                              "Unit %s not found.", name);
+
+        return sd_bus_reply_method_return(m, "s", u->enabled ?
+                                          "enabled" : "disabled");
+    }
+
+    if (strcmp(member, "GetUnitProcesses") == 0) {
+        char cgroup[MAX_UNIT_NAME_LEN + 16];
+
+        rc = sd_bus_message_read(m, "s", &name);
+        if (rc < 0)
+            return rc;
+
+        u = fake_find_unit(name);
+        if (NULL == u)
+            return sd_bus_reply_method_errorf(m, fake_no_such_unit,
+                                              "Unit %s not found.", name);
+
+        snprintf(cgroup, sizeof(cgroup), "/system.slice/%s", u->name);
+        if (0 == u->main_pid)
+            return sd_bus_reply_method_return(m, "a(sus)", 0);
+        return sd_bus_reply_method_return(m, "a(sus)", 1, cgroup,
+                                          u->main_pid, "/usr/bin/fake");
+    }
+
+    if (strcmp(member, "ListUnitsByPatterns") == 0)
+        return fake_list_units(m);
+
+    if (strcmp(member, "EnableUnitFiles") == 0)
+        return fake_unit_files(m, true);
+    if (strcmp(member, "DisableUnitFiles") == 0)
+        return fake_unit_files(m, false);
+
+    if (strcmp(member, "Reload") == 0 || strcmp(member, "Subscribe") == 0)
+        return sd_bus_reply_method_return(m, "");
+
+    return 0;
+}
+
+static int fake_unit(sd_bus_message *m, void *userdata,
+                     sd_bus_error *error) {
+    fake_unit_t *u;
+
+    (void) userdata;
+    (void) error;
+
+    if (!sd_bus_message_is_method_call(m, fake_interface_props, "Get"))
+        return 0;
+
+    u = fake_find_path(sd_bus_message_get_path(m));
+    if (NULL == u)
+        return sd_bus_reply_method_errorf(m, fake_no_such_unit,
+                                          "Unit %s not found.",
+                                          sd_bus_message_get_path(m));
+
+    return fake_get_property(m, u);
+}
+
+static int fake_init(void) {
+    char encoded[MAX_UNIT_NAME_LEN * 3];
+    int rc;
+
+    units = (fake_unit_t *) calloc(n_units, sizeof(fake_unit_t));
+    if (NULL == units)
+        return -ENOMEM;
+
+    for (unsigned i = 0; i < n_units; i++) {
+        snprintf(units[i].name, sizeof(units[i].name), "fake-%u.service", i);
+        fake_label_escape(units[i].name, encoded, sizeof(encoded));
+        snprintf(units[i].path, sizeof(units[i].path), "%s/%s",
+                 fake_unit_path, encoded);
+        units[i].active = "active";
+        units[i].sub = "running";
+        units[i].main_pid = MAIN_PID_BASE + i;
+        units[i].enabled = true;
+    }
+
+    rc = sd_bus_open_system(&bus);
+    if (rc < 0)
+        return rc;
+
+    rc = sd_bus_add_object(bus, NULL, fake_object_path, fake_manager, NULL);
+    if (rc < 0)
+        return rc;
+
+    rc = sd_bus_add_fallback(bus, NULL, fake_unit_path, fake_unit, NULL);
+    if (rc < 0)
+        return rc;
+
+    return sd_bus_request_name(bus, fake_service, 0);
+}
+
+int main(int argc, char **argv) {
+    int ready[2];
+    pid_t pid;
+    int fd;
+    int rc = 0;
+
+    if (argc > 1)
+        n_units = (unsigned) atoi(argv[1]);
+    if (argc > 2)
+        job_msec = (unsigned) atoi(argv[2]);
+
+    if (0 == n_units) {
+        fprintf(stderr, "usage: fake_manager [<UNITS> [<JOB_MSEC>]]\n");
+        return 1;
+    }
+
+    // sd-bus connections do not survive fork(), connect in the child
+    // and report readiness through the pipe
+    if (pipe(ready) != 0)
+        return 1;
+
+    pid = fork();
+    if (pid < 0)
+        return 1;
+
+    if (pid > 0) {
+        close(ready[1]);
+        if (read(ready[0], &rc, sizeof(rc)) != sizeof(rc) || rc < 0) {
+            fprintf(stderr, "fake_manager: %s\n", strerror(-rc));
+            return 1;
+        }
+        printf("%d\n", (int) pid);
+        return 0;
+    }
+
+    // detach from the caller, e.g. a shell waiting for the PID
+    close(ready[0]);
+    setsid();
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+
+    rc = fake_init();
+    if (write(ready[1], &rc, sizeof(rc)) != sizeof(rc) || rc < 0)
+        return 1;
+    close(ready[1]);
+
+    for (;;) {
+        rc = sd_bus_process(bus, NULL);
+        if (rc < 0)
+            return 1;
+        if (rc > 0) {
+            fake_jobs_due();
+            continue;
+        }
+
+        rc = sd_bus_wait(bus, fake_jobs_due());
+        if (rc < 0 && -EINTR != rc)
+            return 1;
+    }
+}
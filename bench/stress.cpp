@@ -0,0 +1,416 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+ * Multi-threaded stress of the sdw.h entry points
+ *
+ * For every thread count the threads of one process call libsdw for
+ * <DURATION> seconds with a mix of 70% property reads, 20% start, stop
+ * and restart jobs waited for on units owned by the thread and 10%
+ * sd_notify messages. Now and then a thread reads a unit that does not
+ * exist and checks that sdw_get_error_message() names its own unit.
+ * A job whose JobRemoved does not arrive within the wait counts as lost.
+ *
+ * One JSON object per thread count is written to stdout, scaling is the
+ * throughput relative to the first thread count. The exit code
+ * is 1 if any call failed, a job was lost or an error message was
+ * mixed up. Run it through bench/stress.sh for bench/fake_manager on a
+ * private bus, or with -s against the in-process simulated manager.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sdw.h"
+
+#define MAX_UNIT_NAME_LEN       64
+#define MAX_THREADS             256
+#define MAX_RUNS                16
+#define MAIN_PID_BASE           10000   // see bench/fake_manager.cpp
+#define MISSING_EVERY           64      // ops between two missing unit reads
+
+extern char *optarg;
+extern int optind;
+
+typedef struct {
+    pthread_t tid;
+    unsigned index;
+    unsigned seed;
+    uint64_t ops;
+    uint64_t reads;
+    uint64_t jobs;
+    uint64_t notifies;
+    uint64_t errors;
+    uint64_t lost_jobs;
+    uint64_t error_mismatch;
+} stress_thread_t;
+
+struct {
+    unsigned threads[MAX_RUNS] = { 1, 2, 4 };
+    unsigned runs = 3;
+    unsigned duration = 2;
+    unsigned units = 64;
+    unsigned wait_sec = 5;
+    bool sim = false;
+} cfg;
+
+static char (*names)[MAX_UNIT_NAME_LEN];
+static unsigned n_threads;              // of the current run
+static pthread_barrier_t start_barrier;
+static bool stop;
+static uint64_t notify_received;
+
+static void usage(void) {
+    printf("usage: stress [-t <THREADS>[,<THREADS>...]] [-d <DURATION>] "
+           "[-u <UNITS>] [-w <WAIT>] [-s]\n"
+           "    -t <THREADS>      thread counts, default 1,2,4\n"
+           "    -d <DURATION>     seconds per thread count, default 2\n"
+           "    -u <UNITS>        units served by the manager, default 64,\n"
+           "                      at least the highest thread count\n"
+           "    -w <WAIT>         seconds until a job counts as lost, "
+           "default 5\n"
+           "    -s                in-process simulated manager instead of "
+           "the bus\n");
+    exit(1);
+}
+
+static uint64_t stress_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void stress_rc(stress_thread_t *t, int rc) {
+    if (SDW_ETIMEOUT == rc)
+        t->lost_jobs++;
+    else if (rc < 0)
+        t->errors++;
+}
+
+static void stress_read(stress_thread_t *t, unsigned u) {
+    char buf[MAX_UNIT_NAME_LEN];
+    unsigned value;
+    int rc;
+
+    switch (rand_r(&t->seed) % 4) {
+        case 0:
+            rc = sdw_get_activestate_r(names[u], buf, sizeof(buf));
+            break;
+        case 1:
+            rc = sdw_get_mainpid(names[u], &value);
+            break;
+        case 2:
+            rc = sdw_get_nrestarts(names[u], &value);
+            break;
+        default:
+            // units of other threads may be stopped and have no MainPID
+            u = u - u % n_threads + t->index;
+            if (u >= cfg.units)
+                u = t->index;
+            rc = sdw_get_unit_by_pid_r(MAIN_PID_BASE + u, buf, sizeof(buf));
+            break;
+    }
+
+    t->reads++;
+    stress_rc(t, rc);
+}
+
+// the error of a read of a missing unit must not be one of another thread
+static void stress_missing(stress_thread_t *t) {
+    char name[MAX_UNIT_NAME_LEN], buf[MAX_UNIT_NAME_LEN];
+
+    snprintf(name, sizeof(name), "stress-missing-%u.service", t->index);
+
+    t->reads++;
+    if (sdw_get_activestate_r(name, buf, sizeof(buf)) >= 0 ||
+        NULL == strstr(sdw_get_error_message(), name))
+        t->error_mismatch++;
+}
+
+// jobs only on units of this thread, their state is known to it
+static void stress_job(stress_thread_t *t) {
+    unsigned owned = (cfg.units - t->index + n_threads - 1) / n_threads;
+    unsigned u = t->index + n_threads * (rand_r(&t->seed) % owned);
+
+    if (rand_r(&t->seed) % 2) {
+        t->jobs++;
+        stress_rc(t, sdw_restart(names[u], cfg.wait_sec));
+        return;
+    }
+
+    t->jobs += 2;
+    stress_rc(t, sdw_stop(names[u], cfg.wait_sec));
+    stress_rc(t, sdw_start(names[u], cfg.wait_sec));
+}
+
+static void stress_notify(stress_thread_t *t) {
+    char status[64];
+
+    t->notifies++;
+    if (t->notifies % 2) {
+        stress_rc(t, sdw_notify_mainpid((unsigned) getpid()));
+        return;
+    }
+
+    snprintf(status, sizeof(status), "thread %u op %" PRIu64, t->index,
+             t->ops);
+    stress_rc(t, sdw_status_publish(status));
+}
+
+static void *stress_thread(void *arg) {
+    stress_thread_t *t = (stress_thread_t *) arg;
+    unsigned r;
+
+    pthread_barrier_wait(&start_barrier);
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        r = (unsigned) rand_r(&t->seed) % 100;
+
+        if (0 == t->ops % MISSING_EVERY)
+            stress_missing(t);
+        else if (r < 70)
+            stress_read(t, (unsigned) rand_r(&t->seed) % cfg.units);
+        else if (r < 90)
+            stress_job(t);
+        else
+            stress_notify(t);
+
+        t->ops++;
+    }
+
+    return NULL;
+}
+
+// run n threads for cfg.duration, print the results, 1 if they failed
+static int stress_run(unsigned n, double *base_ops_per_sec) {
+    stress_thread_t *threads, sum;
+    uint64_t ts_begin, ts_end, received;
+    unsigned started = 0;
+    double wall, ops_per_sec;
+
+    threads = (stress_thread_t *) calloc(n, sizeof(stress_thread_t));
+    if (NULL == threads)
+        return 1;
+
+    n_threads = n;
+    __atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+    pthread_barrier_init(&start_barrier, NULL, n + 1);
+    received = __atomic_load_n(&notify_received, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < n; i++) {
+        threads[i].index = i;
+        threads[i].seed = i + 1;
+        if (pthread_create(&threads[i].tid, NULL, stress_thread,
+                           &threads[i]) != 0)
+            break;
+        started++;
+    }
+
+    if (started != n) {
+        // the barrier never opens, nothing else to do
+        fprintf(stderr, "stress: only %u of %u threads started\n",
+                started, n);
+        exit(1);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    ts_begin = stress_now_ns();
+    sleep(cfg.duration);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    // the threads release their bus connections on exit
+    memset(&sum, 0, sizeof(sum));
+    for (unsigned i = 0; i < n; i++) {
+        pthread_join(threads[i].tid, NULL);
+        sum.ops += threads[i].ops;
+        sum.reads += threads[i].reads;
+        sum.jobs += threads[i].jobs;
+        sum.notifies += threads[i].notifies;
+        sum.errors += threads[i].errors;
+        sum.lost_jobs += threads[i].lost_jobs;
+        sum.error_mismatch += threads[i].error_mismatch;
+    }
+    ts_end = stress_now_ns();
+    pthread_barrier_destroy(&start_barrier);
+
+    sdw_status_flush();
+    usleep(100000);             // let the receiver catch up
+    received = __atomic_load_n(&notify_received, __ATOMIC_RELAXED) - received;
+
+    wall = (double) (ts_end - ts_begin) / 1e9;
+    ops_per_sec = wall > 0 ? (double) sum.ops / wall : 0.0;
+    if (0.0 == *base_ops_per_sec)
+        *base_ops_per_sec = ops_per_sec;
+
+    printf("{\"threads\":%u,\"seconds\":%.3f,\"ops\":%" PRIu64
+           ",\"ops_per_sec\":%.1f,\"scaling\":%.2f,\"reads\":%" PRIu64
+           ",\"jobs\":%" PRIu64 ",\"notifies\":%" PRIu64
+           ",\"notify_received\":%" PRIu64 ",\"errors\":%" PRIu64
+           ",\"lost_jobs\":%" PRIu64 ",\"error_mismatch\":%" PRIu64 "}\n",
+           n, wall, sum.ops, ops_per_sec,
+           *base_ops_per_sec > 0 ? ops_per_sec / *base_ops_per_sec : 0.0,
+           sum.reads, sum.jobs, sum.notifies, received, sum.errors,
+           sum.lost_jobs, sum.error_mismatch);
+    fflush(stdout);
+
+    free(threads);
+
+    return 0 != sum.errors || 0 != sum.lost_jobs || 0 != sum.error_mismatch;
+}
+
+// receiver of the NOTIFY_SOCKET messages
+static void *stress_notify_thread(void *arg) {
+    int fd = *(int *) arg;
+    char buf[256];
+
+    while (recv(fd, buf, sizeof(buf), 0) >= 0 || EINTR == errno)
+        __atomic_add_fetch(&notify_received, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static int stress_notify_socket(void) {
+    static int fd;
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    // abstract socket, nothing to clean up
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+             "sdw-stress-%d", (int) getpid());
+
+    if (bind(fd, (struct sockaddr *) &addr,
+             offsetof(struct sockaddr_un, sun_path) + 1 +
+             strlen(addr.sun_path + 1)) != 0)
+        return -1;
+
+    // before any thread of libsdw may read it, '@' means abstract
+    addr.sun_path[0] = '@';
+    setenv("NOTIFY_SOCKET", addr.sun_path, 1);
+
+    return pthread_create(&tid, NULL, stress_notify_thread, &fd);
+}
+
+static void stress_threads(char *arg) {
+    char *save = NULL;
+
+    cfg.runs = 0;
+    for (char *s = strtok_r(arg, ",", &save); NULL != s;
+         s = strtok_r(NULL, ",", &save)) {
+        if (cfg.runs == MAX_RUNS)
+            usage();
+        cfg.threads[cfg.runs] = (unsigned) atoi(s);
+        if (0 == cfg.threads[cfg.runs] || cfg.threads[cfg.runs] > MAX_THREADS)
+            usage();
+        cfg.runs++;
+    }
+}
+
+int main(int argc, char **argv) {
+    sdw_transport_t transport;
+    double base = 0.0;
+    unsigned max = 0;
+    int c, rc = 0;
+
+    while ((c = getopt(argc, argv, "t:d:u:w:sh")) != -1) {
+        switch (c) {
+            case 't':
+                stress_threads(optarg);
+                break;
+            case 'd':
+                cfg.duration = (unsigned) atoi(optarg);
+                break;
+            case 'u':
+                cfg.units = (unsigned) atoi(optarg);
+                break;
+            case 'w':
+                cfg.wait_sec = (unsigned) atoi(optarg);
+                break;
+            case 's':
+                cfg.sim = true;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    for (unsigned r = 0; r < cfg.runs; r++)
+        if (cfg.threads[r] > max)
+            max = cfg.threads[r];
+
+    if (optind != argc || 0 == cfg.runs || 0 == cfg.duration ||
+        0 == cfg.wait_sec || cfg.units < max)
+        usage();
+
+    names = (char (*)[MAX_UNIT_NAME_LEN]) calloc(cfg.units,
+                                                 MAX_UNIT_NAME_LEN);
+    if (NULL == names)
+        return 1;
+
+    for (unsigned i = 0; i < cfg.units; i++)
+        snprintf(names[i], MAX_UNIT_NAME_LEN, "fake-%u.service", i);
+
+    // the MainPIDs of the fake units are no processes, ask the manager
+    sdw_set_pid_lookup(SDW_PID_LOOKUP_BUS);
+
+    if (stress_notify_socket() != 0) {
+        perror("stress: notify socket");
+        return 1;
+    }
+
+    if (cfg.sim) {
+        sdw_sim_config_t sim;
+
+        memset(&sim, 0, sizeof(sim));
+        sim.units = cfg.units;
+        if (sdw_sim_transport(&sim, &transport) != 0 ||
+            sdw_set_transport(&transport) != 0) {
+            fprintf(stderr, "stress: simulated manager failed\n");
+            return 1;
+        }
+    }
+
+    if (sdw_is_supported() != 0) {
+        fprintf(stderr, "stress: no manager, run bench/stress.sh\n");
+        return 1;
+    }
+
+    // every unit running, so that every job has a defined outcome
+    for (unsigned i = 0; i < cfg.units; i++)
+        sdw_start(names[i], cfg.wait_sec);
+
+    for (unsigned r = 0; r < cfg.runs; r++)
+        rc |= stress_run(cfg.threads[r], &base);
+
+    free(names);
+
+    return rc;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# run bench/stress (or the binary given in STRESS, e.g. bench/stress-tsan)
+# against a private dbus-daemon and bench/fake_manager, no systemd is
+# needed
+#
+# usage: bench/stress.sh [<stress options>]
+#
+# one JSON object per thread count is written to stdout, the exit code
+# of stress is kept
+
+set -e
+
+dir=$(cd "$(dirname "$0")" && pwd)
+. "$dir/bus.sh"
+
+rc=0
+"${STRESS:-$dir/stress}" -u "${BENCH_UNITS:-64}" "$@" || rc=$?
+exit $rc
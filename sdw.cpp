@@ -16,45 +16,140 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
 #include <regex.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
+#include <systemd/sd-journal.h>
+#include <new>
+#ifdef SDW_USDT
+#include <sys/sdt.h>
+#endif
+
+#include "sdw.hpp"
 
-#include "sdw.h"
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open          434     // Linux 5.3, same on all architectures
+#endif
 
-#define MAX_UNIT_NAME_LEN       64
+#define MAX_UNIT_NAME_LEN       256     // UNIT_NAME_MAX of systemd
 #define MAX_RESPONSE_LEN        256
+#define MAX_UNIT_PATH_LEN       (MAX_UNIT_NAME_LEN * 3 + 64)    // encoded name
+#define MAX_STATUS_LEN          256
+#define MAX_CGROUP_LEN          4096    // /proc/<pid>/cgroup, v1 lists all hierarchies
+#define PID_CACHE_SIZE          4096    // units of PIDs, direct mapped
+#define PID_CACHE_LOCKS         64      // lock stripes of the PID cache
+#define PID_CACHE_TTL_USEC      30000000ULL     // a process may change its unit
+#define PID_BATCH_CHUNK         64      // PIDs a batch worker takes at once
+#define PID_BATCH_THREADS       8       // batch workers at most
+#define RES_BUCKETS             256     // hash chains of the resource cache
+#define RES_MAX_UNITS           512     // units whose cgroup files stay open
+#define RES_BUF_LEN             8192    // memory.stat is the largest file
+#define PRESSURE_EVENTS         16      // epoll events per epoll_wait()
+#define WATCH_BUCKETS           256     // hash chains of a watch
+#define WATCH_MAX_UNITS         4096    // units whose last values a watch keeps
+#define WATCH_STATE_LEN         32      // longest ActiveState or SubState
+#define CGROUP_MAX_DEPTH        16      // child cgroups sdw_get_unit_pids() reads
+#define PIDFD_ATTEMPTS          3       // MainPID changed during pidfd_open()
+#define STATUS_INTERVAL_MS      1000    // default STATUS= rate limit
+#define STATS_WORDS             (sizeof(sdw_stats_t) / sizeof(uint64_t))
+#define LOG_MSG_LEN             256
+#define LOG_RING_SIZE           64      // records per thread, power of 2
+#define LOG_DRAIN_MS            20      // drain interval of the log thread
+#define JOURNAL_QUEUE_LEN       256     // entries per batch
+#define JOURNAL_FLUSH_MS        100     // send interval of the journal thread
+#define JOURNAL_BURST           200     // entries per JOURNAL_INTERVAL_MS
+#define JOURNAL_INTERVAL_MS     1000
+#define JOURNAL_FIELD_LEN       (LOG_MSG_LEN + 32)
+
+// static probes for bpftrace/systemtap, a nop if not attached
+#ifdef SDW_USDT
+#define SDWI_PROBE_BEGIN(ev)                                            \
+    STAP_PROBE4(sdw, op__begin, (ev)->op, (ev)->unit, (ev)->path,       \
+                (ev)->member)
+#define SDWI_PROBE_END(ev)                                              \
+    STAP_PROBE6(sdw, op__end, (ev)->op, (ev)->unit, (ev)->path,         \
+                (ev)->job, (ev)->duration_usec, (ev)->rc)
+#else
+#define SDWI_PROBE_BEGIN(ev)
+#define SDWI_PROBE_END(ev)
+#endif
+
+// highest trace level compiled in, -DSDW_LOG_LEVEL_MAX=0 drops all
+// info and debug logging including the argument evaluation
+#ifndef SDW_LOG_LEVEL_MAX
+#define SDW_LOG_LEVEL_MAX       2       // SDW_LOG_DEBUG
+#endif
+
+static_assert(SDW_LOG_LEVEL_MAX >= 0 && SDW_LOG_LEVEL_MAX <= 2,
+              "SDW_LOG_LEVEL_MAX must be 0 (error), 1 (info) or 2 (debug)");
+
+// trc_level is read-mostly, a relaxed load on the logging path
+#define TRC_LEVEL       __atomic_load_n(&trc_level, __ATOMIC_RELAXED)
+
+// usable in if constexpr, the runtime check is discarded with the body
+#define LOG_COMPILED(level)     ((level) <= SDW_LOG_LEVEL_MAX)
 
 #define LOG_DEBUG(fmt, ...)                                             \
     do {                                                                \
-      if (2 <= trc_level) {                                             \
-        fprintf(stdout, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__);       \
+      if constexpr (LOG_COMPILED(SDW_LOG_DEBUG)) {                      \
+        if (SDW_LOG_DEBUG <= TRC_LEVEL)                                 \
+          sdwi_log(SDW_LOG_DEBUG, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__); \
       }                                                                 \
     } while (0)
 
 #define LOG_INFO(fmt, ...)                                              \
     do {                                                                \
-      if (1 <= trc_level) {                                             \
-        fprintf(stdout, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__);       \
+      if constexpr (LOG_COMPILED(SDW_LOG_INFO)) {                       \
+        if (SDW_LOG_INFO <= TRC_LEVEL)                                  \
+          sdwi_log(SDW_LOG_INFO, "%s: " fmt, __FUNCTION__, ##__VA_ARGS__); \
       }                                                                 \
     } while (0)
 
 #define LOG_ERROR(fmt, ...)                                     \
     do {                                                        \
+        last_error.pending = false;                             \
         last_error_msg[0] = '\0';                               \
         snprintf(last_error_msg, sizeof(last_error_msg),        \
                   "%s: " fmt, __FUNCTION__, ##__VA_ARGS__);     \
-        fprintf(stderr, last_error_msg);                        \
+        if (__atomic_load_n(&log_errors, __ATOMIC_RELAXED))     \
+            sdwi_log(SDW_LOG_ERROR, "%s", last_error_msg);      \
     } while (0)
 
+// failed D-Bus call, formatted only by sdw_get_error_message()
+#define LOG_CALL_ERROR(op, error, rc, ...)                      \
+    sdwi_error_call(__FUNCTION__, op, error, rc, ##__VA_ARGS__)
+
 typedef struct {
     char name[MAX_UNIT_NAME_LEN];
-    char encoded[MAX_UNIT_NAME_LEN];
+    char encoded[MAX_UNIT_NAME_LEN * 3];    // each char may become _xx
 } unit_t;
 
+// context of the last failed D-Bus call, see LOG_CALL_ERROR()
+typedef struct {
+    bool pending;               // not yet formatted into last_error_msg
+    const char *func;
+    int op;                     // SDW_OP_*
+    int errnum;
+    uint32_t pid;               // GetUnitByPID only
+    const char *member;         // static property name or NULL
+    char bus_error[MAX_RESPONSE_LEN];   // D-Bus error name
+    char unit[MAX_UNIT_PATH_LEN];       // unit name or object path
+} error_ctx_t;
+
 // internal types are named sdbus instead of sd_bus
 typedef enum {
     SDBUS_START_UNIT = 0,
@@ -73,22 +168,227 @@ typedef struct {
     job_status_t status;
     time_t ts_end;
     unsigned wait_sec;
+    sd_bus *bus;                // ref, the match, the call and the wait
     sd_bus_slot *slot;
     char *path;                 // /org/freedesktop/systemd1/job/993490
-    char *result;
+    int result;                 // SDW_JOB_RESULT_*
+    char unit[MAX_UNIT_NAME_LEN];       // of the job, for the trace hooks
 } job_info_t;
 
-typedef union {
-    char *s;
-    unsigned u;
-    int d;
-} response_t;
+// last values of a watched unit, see sdwi_watch_diff()
+typedef struct watch_unit {
+    struct watch_unit *next;
+    char name[MAX_UNIT_NAME_LEN];
+    uint64_t used;              // sdw_watch.signals of the last change
+    int known;                  // SDW_CHANGE_* of the values below
+    char active_state[WATCH_STATE_LEN];
+    char sub_state[WATCH_STATE_LEN];
+    uint32_t main_pid;
+} watch_unit_t;
+
+struct sdw_watch {
+    pthread_t owner;            // the only thread that may process it
+    sd_bus *bus;                // connection of owner, referenced
+    sd_bus_slot *slot;          // PropertiesChanged match
+    char **patterns;            // NULL: all units
+    sdw_unit_change_fn_t fn;
+    void *userdata;
+    int reported;               // since sdw_watch_process() was called
+    uint64_t signals;           // PropertiesChanged of matching units
+    watch_unit_t *buckets[WATCH_BUCKETS];
+    unsigned n_units;
+};
+
+// one watched cgroup file of a unit, see sdw_pressure_add()
+typedef struct {
+    char unit[MAX_UNIT_NAME_LEN];
+    int type;                   // one SDW_PRESSURE_*
+    int fd;                     // -1 once the cgroup was removed
+    uint64_t oom;               // memory.events as last read
+    uint64_t oom_kill;
+} pressure_src_t;
+
+struct sdw_pressure {
+    int epfd;
+    sdw_pressure_fn_t fn;
+    void *userdata;
+    pressure_src_t *src;        // epoll data is the index
+    unsigned n_src;
+    unsigned max_src;
+};
+
+// one measured D-Bus operation, see sdwi_op_begin()
+typedef struct {
+    sdw_trace_event_t ev;
+    uint64_t ts_begin;          // CLOCK_MONOTONIC in usec
+} op_t;
+
+// see sdw_set_trace_hooks()
+typedef struct {
+    sdw_trace_hook_t begin;
+    sdw_trace_hook_t end;
+    void *userdata;
+} trace_hooks_t;
+
+// daemon reloads of the enable and disable functions, a reload covers
+// the changes counted in seq when it starts, see sdw_set_reload_policy()
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // wakes the reload thread
+    pthread_cond_t done_cond;   // a reload finished
+    int policy;                 // SDW_RELOAD_*
+    unsigned window_ms;
+    bool thread_started;
+    bool failed;                // a deferred reload failed
+    uint64_t seq;               // deferred changes
+    uint64_t taken;             // seq covered by the last started reload
+    uint64_t done;              // seq covered by the finished reloads
+    uint64_t ts_due;            // CLOCK_MONOTONIC usec of the pending one
+} reload_t;
+
+// coalescing STATUS= publisher, see sdw_status_publish()
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool thread_started;
+    bool pending;               // next[] is newer than last[]
+    unsigned interval_ms;       // minimum interval between two sends
+    struct timespec ts_sent;    // CLOCK_MONOTONIC of the last send
+    char next[MAX_STATUS_LEN];  // latest value, not yet sent
+    char last[MAX_STATUS_LEN];  // value the service manager has seen
+} status_pub_t;
+
+// per thread single producer ring of log records, the consumers (the
+// log thread and sdw_log_flush()) are serialized by log_backend.lock
+typedef struct log_ring {
+    struct log_ring *next;      // list of all rings, never unlinked
+    int in_use;                 // owned by a running thread
+    unsigned head;              // next record to write, producer only
+    unsigned tail;              // next record to read, consumer only
+    struct {
+        int level;
+        char msg[LOG_MSG_LEN];
+    } rec[LOG_RING_SIZE];
+} log_ring_t;
+
+// unit the manager told for a process, valid while the PID still has its
+// start time, see sdw_get_units_by_pids()
+typedef struct {
+    uint32_t pid;               // 0: empty
+    unsigned gen;               // transport_gen of the lookup
+    uint64_t start;             // start time of the process in clock ticks
+    uint64_t expires;           // CLOCK_MONOTONIC usec
+    char unit[MAX_UNIT_NAME_LEN];
+} pid_cache_entry_t;
+
+// cgroup files of sdw_get_unit_resources(), index into res_unit_t.fd
+enum {
+    RES_MEMORY_CURRENT = 0,
+    RES_MEMORY_STAT,
+    RES_CPU_STAT,
+    RES_IO_STAT,
+    RES_PIDS_CURRENT,
+    RES_FILES
+};
+
+// "key value" of memory.stat and cpu.stat, "key=value" of io.stat
+typedef struct {
+    const char *key;
+    size_t offset;              // uint64_t in sdw_unit_resources_t
+} res_field_t;
+
+// open cgroup files of a unit, see sdw_get_unit_resources()
+typedef struct res_unit {
+    struct res_unit *next;
+    char name[MAX_UNIT_NAME_LEN];
+    char cgroup[MAX_UNIT_PATH_LEN];     // ControlGroup, "" to be asked
+    bool open;                  // fd[] opened for cgroup
+    int fd[RES_FILES];          // -1 if the file is not there
+    uint64_t used;              // res_cache.clock of the last lookup
+} res_unit_t;
+
+// resource cache, the files are read under the lock into buf
+typedef struct {
+    pthread_mutex_t lock;
+    res_unit_t *buckets[RES_BUCKETS];
+    unsigned n_units;
+    uint64_t clock;             // lookups, orders the units by use
+    char buf[RES_BUF_LEN];
+} res_cache_t;
+
+// growing result of sdw_get_unit_pids()
+typedef struct {
+    unsigned *pids;
+    size_t n;
+    size_t max;
+} pid_list_t;
+
+// one sdw_get_units_by_pids() call shared by its workers
+typedef struct {
+    const unsigned *pids;
+    char **units;               // slot of each PID, emptied if not found
+    uint64_t *start;            // start time of each PID, 0 unknown
+    bool *ask_bus;              // left to the manager
+    size_t n;
+    size_t next;                // next chunk, atomic
+    int mode;                   // SDW_PID_LOOKUP_*
+    unsigned gen;
+    uint64_t now;
+} pid_batch_t;
+
+// asynchronous log backend, see sdw_log_set_async()
+typedef struct {
+    pthread_mutex_t lock;       // serializes the consumers
+    pthread_t thread;
+    bool async;                 // records go to the rings
+    bool stop;                  // the log thread shall exit
+    bool thread_started;
+    log_ring_t *rings;          // lock-free push, see sdwi_log_ring()
+    uint64_t dropped;           // records lost on full rings
+    sdw_log_fn_t fn;            // NULL writes to stdout/stderr
+    void *userdata;
+} log_backend_t;
+
+// one journal entry, op < 0 for log records
+typedef struct {
+    int priority;               // syslog priority
+    int op;                     // SDW_OP_*
+    int rc;
+    uint64_t duration_usec;
+    char unit[MAX_UNIT_NAME_LEN];
+    char job[MAX_RESPONSE_LEN];
+    char msg[LOG_MSG_LEN];
+} journal_entry_t;
+
+// journald sink, see sdw_journal_enable()
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // wakes the journal thread
+    pthread_cond_t sent;        // the journal thread sent its batch
+    pthread_t thread;
+    int flags;                  // SDW_JOURNAL_*
+    bool thread_started;
+    bool stop;                  // the journal thread shall exit
+    bool sending;               // batch is being sent, unlocked
+    journal_entry_t *queue;     // filled by the callers
+    journal_entry_t *batch;     // sent by the journal thread
+    unsigned n_queued;
+    unsigned n_window;          // entries in the current rate window
+    uint64_t ts_window;         // begin of the rate window in usec
+    uint64_t suppressed;        // entries dropped by the rate limit
+} journal_sink_t;
 
 #ifdef SDW_DLSYM
 // sd_bus function declarations
 typedef int (*fn_sd_bus_open_system_t)
  (sd_bus ** ret);
 
+typedef sd_bus *(*fn_sd_bus_ref_t)
+ (sd_bus * bus);
+
+typedef sd_bus *(*fn_sd_bus_unref_t)
+ (sd_bus * bus);
+
 typedef int (*fn_sd_bus_call_method_t)
  (sd_bus * bus,
   const char *destination,
@@ -114,15 +414,15 @@ typedef int (*fn_sd_bus_get_property_t)
   const char *member,
   sd_bus_error * ret_error, sd_bus_message ** reply, const char *type);
 
-typedef int (*fn_sd_bus_path_encode_t)
- (const char *prefix, const char *external_id, char **ret_path);
-
 typedef int (*fn_sd_bus_path_decode_t)
  (const char *path, const char *prefix, char **ret_external_id);
 
 typedef int (*fn_sd_notify_t)
  (int unset_environment, const char *state);
 
+typedef int (*fn_sd_journal_sendv_t)
+ (const struct iovec * iov, int n);
+
 typedef int (*fn_sd_bus_cal_method_t)
  (sd_bus ** ret);
 
@@ -149,6 +449,35 @@ typedef int (*fn_sd_bus_message_enter_container_t)
 typedef int (*fn_sd_bus_message_exit_container_t)
  (sd_bus_message * m);
 
+typedef int (*fn_sd_bus_message_skip_t)
+ (sd_bus_message * m, const char *types);
+
+typedef const char *(*fn_sd_bus_message_get_path_t)
+ (sd_bus_message * m);
+
+typedef int (*fn_sd_bus_get_fd_t)
+ (sd_bus * bus);
+
+typedef int (*fn_sd_bus_is_open_t)
+ (sd_bus * bus);
+
+typedef int (*fn_sd_bus_message_new_method_call_t)
+ (sd_bus * bus,
+  sd_bus_message ** m,
+  const char *destination,
+  const char *path, const char *interface, const char *member);
+
+typedef int (*fn_sd_bus_message_append_strv_t)
+ (sd_bus_message * m, char **l);
+
+typedef int (*fn_sd_bus_message_append_t)
+ (sd_bus_message * m, const char *types, ...);
+
+typedef int (*fn_sd_bus_call_t)
+ (sd_bus * bus,
+  sd_bus_message * m,
+  uint64_t usec, sd_bus_error * ret_error, sd_bus_message ** reply);
+
 // sd_bus function pointer
 static fn_sd_bus_add_match_t fn_sd_bus_add_match;
 static fn_sd_bus_call_method_t fn_sd_bus_call_method;
@@ -158,13 +487,23 @@ static fn_sd_bus_message_read_t fn_sd_bus_message_read;
 static fn_sd_bus_message_unref_t fn_sd_bus_message_unref;
 static fn_sd_bus_open_system_t fn_sd_bus_open_system;
 static fn_sd_bus_path_decode_t fn_sd_bus_path_decode;
-static fn_sd_bus_path_encode_t fn_sd_bus_path_encode;
 static fn_sd_bus_process_t fn_sd_bus_process;
+static fn_sd_bus_ref_t fn_sd_bus_ref;
+static fn_sd_bus_unref_t fn_sd_bus_unref;
 static fn_sd_bus_slot_unref_t fn_sd_bus_slot_unref;
 static fn_sd_bus_wait_t fn_sd_bus_wait;
 static fn_sd_notify_t fn_sd_notify;
+static fn_sd_journal_sendv_t fn_sd_journal_sendv;
 static fn_sd_bus_message_enter_container_t fn_sd_bus_message_enter_container;
 static fn_sd_bus_message_exit_container_t fn_sd_bus_message_exit_container;
+static fn_sd_bus_message_skip_t fn_sd_bus_message_skip;
+static fn_sd_bus_message_get_path_t fn_sd_bus_message_get_path;
+static fn_sd_bus_get_fd_t fn_sd_bus_get_fd;
+static fn_sd_bus_is_open_t fn_sd_bus_is_open;
+static fn_sd_bus_message_new_method_call_t fn_sd_bus_message_new_method_call;
+static fn_sd_bus_message_append_strv_t fn_sd_bus_message_append_strv;
+static fn_sd_bus_message_append_t fn_sd_bus_message_append;
+static fn_sd_bus_call_t fn_sd_bus_call;
 
 #define FN_SD_BUS_ADD_MATCH fn_sd_bus_add_match
 #define FN_SD_BUS_CALL_METHOD fn_sd_bus_call_method
@@ -174,13 +513,23 @@ static fn_sd_bus_message_exit_container_t fn_sd_bus_message_exit_container;
 #define FN_SD_BUS_MESSAGE_UNREF fn_sd_bus_message_unref
 #define FN_SD_BUS_OPEN_SYSTEM fn_sd_bus_open_system
 #define FN_SD_BUS_PATH_DECODE fn_sd_bus_path_decode
-#define FN_SD_BUS_PATH_ENCODE fn_sd_bus_path_encode
 #define FN_SD_BUS_PROCESS fn_sd_bus_process
+#define FN_SD_BUS_REF fn_sd_bus_ref
+#define FN_SD_BUS_UNREF fn_sd_bus_unref
 #define FN_SD_BUS_SLOT_UNREF fn_sd_bus_slot_unref
 #define FN_SD_BUS_WAIT fn_sd_bus_wait
 #define FN_SD_NOTIFY fn_sd_notify
+#define FN_SD_JOURNAL_SENDV fn_sd_journal_sendv
 #define FN_SD_BUS_MESSAGE_ENTER_CONTAINER fn_sd_bus_message_enter_container
 #define FN_SD_BUS_MESSAGE_EXIT_CONTAINER fn_sd_bus_message_exit_container
+#define FN_SD_BUS_MESSAGE_SKIP fn_sd_bus_message_skip
+#define FN_SD_BUS_MESSAGE_GET_PATH fn_sd_bus_message_get_path
+#define FN_SD_BUS_GET_FD fn_sd_bus_get_fd
+#define FN_SD_BUS_IS_OPEN fn_sd_bus_is_open
+#define FN_SD_BUS_MESSAGE_NEW_METHOD_CALL fn_sd_bus_message_new_method_call
+#define FN_SD_BUS_MESSAGE_APPEND_STRV fn_sd_bus_message_append_strv
+#define FN_SD_BUS_MESSAGE_APPEND fn_sd_bus_message_append
+#define FN_SD_BUS_CALL fn_sd_bus_call
 
 #else
 
@@ -192,86 +541,711 @@ static fn_sd_bus_message_exit_container_t fn_sd_bus_message_exit_container;
 #define FN_SD_BUS_MESSAGE_UNREF sd_bus_message_unref
 #define FN_SD_BUS_OPEN_SYSTEM sd_bus_open_system
 #define FN_SD_BUS_PATH_DECODE sd_bus_path_decode
-#define FN_SD_BUS_PATH_ENCODE sd_bus_path_encode
 #define FN_SD_BUS_PROCESS sd_bus_process
+#define FN_SD_BUS_REF sd_bus_ref
+#define FN_SD_BUS_UNREF sd_bus_unref
 #define FN_SD_BUS_SLOT_UNREF sd_bus_slot_unref
 #define FN_SD_BUS_WAIT sd_bus_wait
 #define FN_SD_NOTIFY sd_notify
+#define FN_SD_JOURNAL_SENDV sd_journal_sendv
 #define FN_SD_BUS_MESSAGE_ENTER_CONTAINER sd_bus_message_enter_container
 #define FN_SD_BUS_MESSAGE_EXIT_CONTAINER sd_bus_message_exit_container
+#define FN_SD_BUS_MESSAGE_SKIP sd_bus_message_skip
+#define FN_SD_BUS_MESSAGE_GET_PATH sd_bus_message_get_path
+#define FN_SD_BUS_GET_FD sd_bus_get_fd
+#define FN_SD_BUS_IS_OPEN sd_bus_is_open
+#define FN_SD_BUS_MESSAGE_NEW_METHOD_CALL sd_bus_message_new_method_call
+#define FN_SD_BUS_MESSAGE_APPEND_STRV sd_bus_message_append_strv
+#define FN_SD_BUS_MESSAGE_APPEND sd_bus_message_append
+#define FN_SD_BUS_CALL sd_bus_call
 
 #endif
 
 static const char *sdbus_lib_name = "libsystemd.so.0";
 static const char sdbus_service_contact[] = "org.freedesktop.systemd1";
 static const char sdbus_object_path[] = "/org/freedesktop/systemd1";
+static const char sdbus_unit_path[] = "/org/freedesktop/systemd1/unit/";
 static const char sdbus_interface_mgr[] = "org.freedesktop.systemd1.Manager";
 static const char sdbus_interface_srv[] = "org.freedesktop.systemd1.Service";
 static const char sdbus_interface_unit[] = "org.freedesktop.systemd1.Unit";
+static const char sdbus_interface_scope[] = "org.freedesktop.systemd1.Scope";
+static const char sdbus_interface_slice[] = "org.freedesktop.systemd1.Slice";
+static const char sdbus_interface_socket[] = "org.freedesktop.systemd1.Socket";
+static const char sdbus_interface_mount[] = "org.freedesktop.systemd1.Mount";
+static const char sdbus_interface_swap[] = "org.freedesktop.systemd1.Swap";
 static const char sdbus_match[] = "type='signal',"
     "sender='org.freedesktop.systemd1',"
     "interface='org.freedesktop.systemd1.Manager',"
     "member='JobRemoved'," "path='/org/freedesktop/systemd1'";
+static const char sdbus_match_changed[] = "type='signal',"
+    "sender='org.freedesktop.systemd1',"
+    "interface='org.freedesktop.DBus.Properties',"
+    "member='PropertiesChanged',"
+    "path_namespace='/org/freedesktop/systemd1/unit'";
+static const char sdbus_error_subscribed[] =
+    "org.freedesktop.systemd1.AlreadySubscribed";
+static const char sdbus_error_no_unit_pid[] =
+    "org.freedesktop.systemd1.NoUnitForPID";
+static const char sdbus_error_esrch[] = "System.Error.ESRCH";
 static const char sdbus_prefix[] = "/test";     // prefix for {en,de}code
 
-static sd_bus *bus = NULL;      // reuse the sd_bus connection
-static char last_error_msg[512];
+static __thread sd_bus *bus = NULL;     // connection of the calling thread
+static __thread unsigned bus_gen;       // transport_gen it was opened with
+static pthread_key_t bus_key;           // releases bus at thread exit
+static pthread_once_t bus_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t transport_lock = PTHREAD_MUTEX_INITIALIZER;
+static sdw_transport_t transport;       // open == NULL: system bus
+static unsigned transport_gen;          // bumped by sdw_set_transport()
+static sdw_op_stats_t op_stats[SDW_OP_COUNT];   // see sdwi_op_end()
+static trace_hooks_t trace_hooks;
+static __thread char last_error_msg[SDW_MAX_ERROR_LEN];
+static __thread error_ctx_t last_error;
+static int log_errors = 0;      // see sdw_log_set_errors()
+static int pid_lookup = SDW_PID_LOOKUP_AUTO;   // see sdw_set_pid_lookup()
+static pid_cache_entry_t *pid_cache;    // NULL if allocation failed
+static pthread_mutex_t pid_cache_locks[PID_CACHE_LOCKS];
+static pthread_once_t pid_cache_once = PTHREAD_ONCE_INIT;
+static const char *cgroup_root;         // cgroup v2 mount, NULL if none
+static pthread_once_t cgroup_root_once = PTHREAD_ONCE_INIT;
+static res_cache_t res_cache = { PTHREAD_MUTEX_INITIALIZER, {}, 0, 0, {} };
 static int trc_level = 0;
-static enum { INITIAL = 0, CHECK_VERSION, LOADED, FAILED, INVALID_VERSION
-} lib_stat = INITIAL;
+static log_backend_t log_backend = {
+    PTHREAD_MUTEX_INITIALIZER, pthread_t(), false, false, false,
+    NULL, 0, NULL, NULL
+};
+static journal_sink_t journal_sink = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, pthread_t(), 0, false, false, false,
+    NULL, NULL, 0, 0, 0, 0
+};
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static __thread log_ring_t *log_ring;  // ring of the calling thread
+static reload_t reload = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, SDW_RELOAD_IMMEDIATE, 0, false, false,
+    0, 0, 0, 0
+};
+static status_pub_t status_pub = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    false, false, STATUS_INTERVAL_MS, {0, 0}, "", ""
+};
+// written by sdwi_connect() of any thread, read by sdw_is_supported()
+typedef enum { INITIAL = 0, CHECK_VERSION, LOADED, FAILED, INVALID_VERSION
+} lib_stat_t;
+static lib_stat_t lib_stat = INITIAL;
+static bool loaded = false;     // libsystemd functions resolved
+
+/*
+ * state names
+ *
+ * The state strings of systemd are decoded with a perfect hash:
+ * sdwi_find_seed() searches at compile time for a FNV-1a seed which
+ * maps every name of a table to its own slot, sdwi_phash_t builds the
+ * slot -> table index array from it. A lookup is one hash and one
+ * strcmp() to reject names which are not in the table.
+ */
+typedef struct {
+    const char *name;
+    int state;
+} state_name_t;
+
+static constexpr state_name_t active_states[] = {
+    {"activating", SDW_UNIT_ACTIVE_STAT_ACTIVATING},
+    {"active", SDW_UNIT_ACTIVE_STAT_ACTIVE},
+    {"reloading", SDW_UNIT_ACTIVE_STAT_RELOADING},
+    {"deactivating", SDW_UNIT_ACTIVE_STAT_DEACTIVATING},
+    {"inactive", SDW_UNIT_ACTIVE_STAT_INACTIVE},
+    {"failed", SDW_UNIT_ACTIVE_STAT_FAILED},
+    {"maintenance", SDW_UNIT_ACTIVE_STAT_MAINTENANCE},
+    {"refreshing", SDW_UNIT_ACTIVE_STAT_REFRESHING},
+};
+
+static constexpr state_name_t sub_states[] = {
+    {"start", SDW_UNIT_SUB_STAT_START},
+    {"running", SDW_UNIT_SUB_STAT_RUNNING},
+    {"stop-sigterm", SDW_UNIT_SUB_STAT_STOP_SIGTERM},
+    {"dead", SDW_UNIT_SUB_STAT_DEAD},
+    {"failed", SDW_UNIT_SUB_STAT_FAILED},
+    {"condition", SDW_UNIT_SUB_STAT_CONDITION},
+    {"start-pre", SDW_UNIT_SUB_STAT_START_PRE},
+    {"start-post", SDW_UNIT_SUB_STAT_START_POST},
+    {"exited", SDW_UNIT_SUB_STAT_EXITED},
+    {"reload", SDW_UNIT_SUB_STAT_RELOAD},
+    {"reload-signal", SDW_UNIT_SUB_STAT_RELOAD_SIGNAL},
+    {"reload-notify", SDW_UNIT_SUB_STAT_RELOAD_NOTIFY},
+    {"stop", SDW_UNIT_SUB_STAT_STOP},
+    {"stop-watchdog", SDW_UNIT_SUB_STAT_STOP_WATCHDOG},
+    {"stop-sigkill", SDW_UNIT_SUB_STAT_STOP_SIGKILL},
+    {"stop-post", SDW_UNIT_SUB_STAT_STOP_POST},
+    {"final-watchdog", SDW_UNIT_SUB_STAT_FINAL_WATCHDOG},
+    {"final-sigterm", SDW_UNIT_SUB_STAT_FINAL_SIGTERM},
+    {"final-sigkill", SDW_UNIT_SUB_STAT_FINAL_SIGKILL},
+    {"dead-before-auto-restart", SDW_UNIT_SUB_STAT_DEAD_BEFORE_AUTO_RESTART},
+    {"failed-before-auto-restart", SDW_UNIT_SUB_STAT_FAILED_BEFORE_AUTO_RESTART},
+    {"dead-resources-pinned", SDW_UNIT_SUB_STAT_DEAD_RESOURCES_PINNED},
+    {"auto-restart", SDW_UNIT_SUB_STAT_AUTO_RESTART},
+    {"auto-restart-queued", SDW_UNIT_SUB_STAT_AUTO_RESTART_QUEUED},
+    {"cleaning", SDW_UNIT_SUB_STAT_CLEANING},
+    {"start-chown", SDW_UNIT_SUB_STAT_START_CHOWN},
+    {"listening", SDW_UNIT_SUB_STAT_LISTENING},
+    {"stop-pre", SDW_UNIT_SUB_STAT_STOP_PRE},
+    {"stop-pre-sigterm", SDW_UNIT_SUB_STAT_STOP_PRE_SIGTERM},
+    {"stop-pre-sigkill", SDW_UNIT_SUB_STAT_STOP_PRE_SIGKILL},
+    {"mounting", SDW_UNIT_SUB_STAT_MOUNTING},
+    {"mounting-done", SDW_UNIT_SUB_STAT_MOUNTING_DONE},
+    {"mounted", SDW_UNIT_SUB_STAT_MOUNTED},
+    {"remounting", SDW_UNIT_SUB_STAT_REMOUNTING},
+    {"unmounting", SDW_UNIT_SUB_STAT_UNMOUNTING},
+    {"remounting-sigterm", SDW_UNIT_SUB_STAT_REMOUNTING_SIGTERM},
+    {"remounting-sigkill", SDW_UNIT_SUB_STAT_REMOUNTING_SIGKILL},
+    {"unmounting-sigterm", SDW_UNIT_SUB_STAT_UNMOUNTING_SIGTERM},
+    {"unmounting-sigkill", SDW_UNIT_SUB_STAT_UNMOUNTING_SIGKILL},
+    {"activating", SDW_UNIT_SUB_STAT_ACTIVATING},
+    {"activating-done", SDW_UNIT_SUB_STAT_ACTIVATING_DONE},
+    {"active", SDW_UNIT_SUB_STAT_ACTIVE},
+    {"deactivating", SDW_UNIT_SUB_STAT_DEACTIVATING},
+    {"deactivating-sigterm", SDW_UNIT_SUB_STAT_DEACTIVATING_SIGTERM},
+    {"deactivating-sigkill", SDW_UNIT_SUB_STAT_DEACTIVATING_SIGKILL},
+    {"waiting", SDW_UNIT_SUB_STAT_WAITING},
+    {"elapsed", SDW_UNIT_SUB_STAT_ELAPSED},
+    {"tentative", SDW_UNIT_SUB_STAT_TENTATIVE},
+    {"plugged", SDW_UNIT_SUB_STAT_PLUGGED},
+    {"abandoned", SDW_UNIT_SUB_STAT_ABANDONED},
+};
+
+static constexpr state_name_t load_states[] = {
+    {"stub", SDW_UNIT_LOAD_STAT_STUB},
+    {"loaded", SDW_UNIT_LOAD_STAT_LOADED},
+    {"not-found", SDW_UNIT_LOAD_STAT_NOT_FOUND},
+    {"bad-setting", SDW_UNIT_LOAD_STAT_BAD_SETTING},
+    {"error", SDW_UNIT_LOAD_STAT_ERROR},
+    {"merged", SDW_UNIT_LOAD_STAT_MERGED},
+    {"masked", SDW_UNIT_LOAD_STAT_MASKED},
+};
+
+static constexpr state_name_t job_results[] = {
+    {"done", SDW_JOB_RESULT_DONE},
+    {"canceled", SDW_JOB_RESULT_CANCELED},
+    {"timeout", SDW_JOB_RESULT_TIMEOUT},
+    {"failed", SDW_JOB_RESULT_FAILED},
+    {"dependency", SDW_JOB_RESULT_DEPENDENCY},
+    {"skipped", SDW_JOB_RESULT_SKIPPED},
+    {"invalid", SDW_JOB_RESULT_INVALID},
+    {"assert", SDW_JOB_RESULT_ASSERT},
+    {"unsupported", SDW_JOB_RESULT_UNSUPPORTED},
+    {"collected", SDW_JOB_RESULT_COLLECTED},
+    {"once", SDW_JOB_RESULT_ONCE},
+    {"frozen", SDW_JOB_RESULT_FROZEN},
+    {"concurrency", SDW_JOB_RESULT_CONCURRENCY},
+};
+
+static constexpr uint32_t sdwi_fnv1a(const char *s, uint32_t h) {
+    return '\0' == *s ? h : sdwi_fnv1a(s + 1, (h ^ (uint8_t) *s) * 16777619u);
+}
+
+static constexpr uint32_t sdwi_slot(const char *s, uint32_t seed,
+                                    uint32_t mask) {
+    return sdwi_fnv1a(s, 2166136261u ^ seed) & mask;
+}
+
+// C++11 constexpr functions are single return statements, hence the
+// loops over the tables below are written as recursions
+
+// entry i does not share its slot with any entry j, j+1, ...
+static constexpr bool sdwi_slot_unique(const state_name_t *t, size_t n,
+                                       uint32_t seed, uint32_t mask,
+                                       size_t i, size_t j) {
+    return j >= n ||
+        (sdwi_slot(t[i].name, seed, mask) != sdwi_slot(t[j].name, seed, mask)
+         && sdwi_slot_unique(t, n, seed, mask, i, j + 1));
+}
+
+static constexpr bool sdwi_seed_perfect(const state_name_t *t, size_t n,
+                                        uint32_t seed, uint32_t mask,
+                                        size_t i) {
+    return i >= n ||
+        (sdwi_slot_unique(t, n, seed, mask, i, i + 1) &&
+         sdwi_seed_perfect(t, n, seed, mask, i + 1));
+}
+
+static constexpr uint32_t sdwi_find_seed(const state_name_t *t, size_t n,
+                                         uint32_t mask, uint32_t seed) {
+    return sdwi_seed_perfect(t, n, seed, mask, 0) ?
+        seed : sdwi_find_seed(t, n, mask, seed + 1);
+}
+
+static constexpr int sdwi_slot_index(const state_name_t *t, size_t n,
+                                     uint32_t seed, uint32_t mask,
+                                     uint32_t slot, size_t i) {
+    return i >= n ? -1 :
+        (sdwi_slot(t[i].name, seed, mask) == slot ?
+         (int) i : sdwi_slot_index(t, n, seed, mask, slot, i + 1));
+}
+
+// compile time index sequence 0..N-1, split in halves to keep the
+// template recursion depth at log(N)
+template <size_t... I> struct sdwi_seq {
+};
+
+template <class A, class B> struct sdwi_seq_cat;
+
+template <size_t... I, size_t... J>
+struct sdwi_seq_cat<sdwi_seq<I...>, sdwi_seq<J...> > {
+    typedef sdwi_seq<I..., (sizeof...(I) + J)...> type;
+};
+
+template <size_t N> struct sdwi_make_seq {
+    typedef typename sdwi_seq_cat<typename sdwi_make_seq<N / 2>::type,
+                                  typename sdwi_make_seq<N - N / 2>::type>::
+        type type;
+};
+
+template <> struct sdwi_make_seq<0> {
+    typedef sdwi_seq<> type;
+};
+
+template <> struct sdwi_make_seq<1> {
+    typedef sdwi_seq<0> type;
+};
+
+template <const state_name_t *T, size_t N, size_t M,
+          class S = typename sdwi_make_seq<M>::type> struct sdwi_phash_t;
+
+template <const state_name_t *T, size_t N, size_t M, size_t... I>
+struct sdwi_phash_t<T, N, M, sdwi_seq<I...> > {
+    static_assert((M & (M - 1)) == 0, "table size must be a power of 2");
+    static_assert(N < 128 && N < M, "too many names for the table size");
+
+    static constexpr uint32_t mask = M - 1;
+    static constexpr uint32_t seed = sdwi_find_seed(T, N, mask, 0);
+    static constexpr int8_t slots[M] = {
+        (int8_t) sdwi_slot_index(T, N, seed, mask, I, 0)...
+    };
+
+    static int lookup(const char *name, int unknown) {
+        int i;
+
+        if (NULL == name)
+            return unknown;
+
+        i = slots[sdwi_slot(name, seed, mask)];
+        if (i < 0 || strcmp(T[i].name, name) != 0)
+            return unknown;
+
+        return T[i].state;
+    }
+};
+
+template <const state_name_t *T, size_t N, size_t M, size_t... I>
+constexpr int8_t sdwi_phash_t<T, N, M, sdwi_seq<I...> >::slots[M];
+
+#define SDWI_PHASH(TABLE, SIZE) \
+    sdwi_phash_t<TABLE, sizeof(TABLE) / sizeof(TABLE[0]), SIZE>
+
+typedef SDWI_PHASH(active_states, 32) active_state_hash_t;
+typedef SDWI_PHASH(sub_states, 512) sub_state_hash_t;
+typedef SDWI_PHASH(load_states, 32) load_state_hash_t;
+typedef SDWI_PHASH(job_results, 64) job_result_hash_t;
 
 /* static functions */
 static void sdwi_load_lib(void);
+static void sdwi_bus_release(void *b);
+static void sdwi_bus_key(void);
+static sd_bus *sdwi_bus(void);
+static int sdwi_connect(void);
 static int sdwi_check_version(const char *version);
 static char *sdwi_regex_match(const char *str, const char *pattern,
                                   unsigned want);
-static int sdwi_get_unit_by_pid(unsigned pid, char **ret_unit_name);
-static int sdwi_sdbus_cmd(const char *unit,
+static int sdwi_get_unit_by_pid(unsigned pid, char *buf, size_t len);
+static int sdwi_cgroup_unit(const char *path, char *buf, size_t len);
+static int sdwi_cgroup_unit_by_pid(unsigned pid, char *buf, size_t len);
+static int sdwi_pid_lookup_mode(void);
+static int sdwi_bus_unit_by_pid(unsigned pid, char *buf, size_t len,
+                                bool *no_unit);
+static uint64_t sdwi_pid_starttime(unsigned pid);
+static void sdwi_pid_cache_init(void);
+static bool sdwi_pid_cache_get(unsigned pid, uint64_t start, unsigned gen,
+                               uint64_t now, char *buf);
+static void sdwi_pid_cache_put(unsigned pid, uint64_t start, unsigned gen,
+                               uint64_t now, const char *unit);
+static void *sdwi_pid_batch_worker(void *arg);
+static void sdwi_cgroup_root_init(void);
+static int sdwi_get_control_group(const char *unit_name, char *buf,
+                                  size_t len);
+static res_unit_t *sdwi_res_find(const char *unit_name, bool add);
+static void sdwi_res_drop(res_unit_t *u);
+static void sdwi_res_close(res_unit_t *u);
+static int sdwi_res_open(res_unit_t *u);
+static void sdwi_res_parse(char *data, char sep, const res_field_t *fields,
+                           size_t n_fields, sdw_unit_resources_t *res);
+static int sdwi_res_read(res_unit_t *u, sdw_unit_resources_t *res);
+static int sdwi_unit_cgroup(const char *unit_name, char *buf, size_t len,
+                            bool refresh, bool *cached);
+static bool sdwi_pid_list_add(pid_list_t *list, unsigned pid);
+static int sdwi_cgroup_pids(int dir, unsigned depth, pid_list_t *list);
+static int sdwi_bus_unit_pids(const char *unit_name, pid_list_t *list);
+static void sdwi_pressure_parse(const char *data, sdw_pressure_event_t *ev);
+static void sdwi_pressure_events(const char *data, uint64_t *oom,
+                                 uint64_t *oom_kill);
+static int sdwi_pressure_report(sdw_pressure_t *pressure,
+                                pressure_src_t *src, uint32_t events);
+static int sdwi_sdbus_cmd(sd_bus *bus, const char *unit,
                               char **response, sdbus_cmd_t cmd);
+static int sdwi_strlcpy(char *buf, size_t len, const char *src);
+static int sdwi_strdup_result(int rc, const char *buf, char **ret);
+static int sdwi_label_escape(const char *label, char *buf, size_t len);
+static int sdwi_label_unescape(const char *label, char *buf, size_t len);
+static int sdwi_unit_path(const char *unit_name_encoded,
+                          char *buf, size_t len);
 static int sdwi_encode(unit_t *unit);
 static int sdwi_decode(unit_t *unit);
+static int sdwi_set_unit_name(unit_t *unit, const char *unit_name);
 static int sdwi_notify(int flag, const char *msg);
+static uint64_t sdwi_now_usec(void);
+static int sdwi_thread_start(pthread_t *tid, void *(*fn)(void *), void *arg,
+                             bool detached);
+static void sdwi_op_begin(op_t *op, int type, const char *unit,
+                          const char *path, const char *member);
+static void sdwi_op_end(op_t *op, int rc);
+static void sdwi_log(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void sdwi_log_write(int level, const char *msg);
+static void sdwi_log_ring_release(void *ring);
+static void sdwi_log_ring_key(void);
+static log_ring_t *sdwi_log_ring(void);
+static void sdwi_log_drain(void);
+static void *sdwi_log_thread(void *arg);
+static void sdwi_error_call(const char *func, const op_t *op,
+                            const sd_bus_error *error, int rc,
+                            uint32_t pid = 0);
+static void sdwi_error_format(void);
+static journal_entry_t *sdwi_journal_entry(int priority);
+static void sdwi_journal_log(int level, const char *msg);
+static void sdwi_journal_op(const sdw_trace_event_t *ev);
+static void sdwi_journal_send(const journal_entry_t *entry);
+static void *sdwi_journal_thread(void *arg);
+static bool sdwi_status_due(struct timespec *due);
+static int sdwi_status_send(void);
+static void *sdwi_status_thread(void *arg);
+static int sdwi_status_start_thread(void);
 static int sdwi_msg_handler(sd_bus_message *msg,
                                 void *userdata, sd_bus_error * error);
-static int sdwi_job_prepare(job_info_t *job);
+static int sdwi_job_prepare(job_info_t *job, const char *unit_name);
 static int sdwi_job_wait(job_info_t *job);
 static void sdwi_job_remove(job_info_t *job);
-static int sdwi_get_srv_property(const char *unit_name,
-                                 const char *property,
-                                 const char *response_format,
-                                 response_t *response);
-static int sdwi_get_unit_property(const char *unit_name,
-                                  const char *service,
-                                  const char *interface,
-                                  const char *property,
-                                  const char *response_format,
-                                  response_t *response);
-static int sdwi_get_property(const char *path,
-                             const char *service_contact,
-                             const char *interface,
-                             const char *property,
-                             const char *response_format,
-                             response_t *response);
-static int sdwi_get_unitfilestate(const char *unit_name, char **ret_state);
-static int sdwi_get_activestate(const char *unit_name_encoded, char **ret_state);
-static int sdwi_get_substate(const char *unit_name_encoded, char **ret_state);
+static watch_unit_t *sdwi_watch_unit(sdw_watch_t *watch, const char *name);
+static void sdwi_watch_diff(sdw_watch_t *watch, const char *name,
+                            sdw_unit_change_t *change, int invalidated);
+static int sdwi_watch_handler(sd_bus_message *msg,
+                              void *userdata, sd_bus_error *error);
+static int sdwi_get_unitfilestate(const char *unit_name,
+                                  char *buf, size_t len);
+static int sdwi_get_activestate(const unit_t *unit,
+                                char *buf, size_t len);
+static int sdwi_get_substate(const unit_t *unit,
+                             char *buf, size_t len);
+static int sdwi_get_loadstate(const unit_t *unit,
+                              char *buf, size_t len);
+static int sdwi_unit_files(bool enable, const char *const *unit_names,
+                           bool runtime, bool force);
 static int sdwi_enable(const char *unit_name, bool runtime, bool force);
 static int sdwi_disable(const char *unit_name, bool runtime);
+static int sdwi_reload_call(void);
+static int sdwi_reload(bool pending_only);
+static int sdwi_reload_changed(void);
+static void *sdwi_reload_thread(void *arg);
+
+/*
+ * typed properties
+ *
+ * A property is a descriptor type carrying its interface, name and C++
+ * type. The D-Bus signature, the reader and the trace output follow from
+ * the C++ type through sdwi_dbus_t<>, so reading a new property takes
+ * one SDWI_PROPERTY() line and a new D-Bus type one specialization.
+ */
+
+// "s": copied to a caller supplied buffer, buf == NULL discards it
+typedef struct {
+    char *buf;
+    size_t len;
+} strbuf_t;
+
+// "(uo)": job reference as in Unit.Job, id 0 means no job is pending
+typedef struct {
+    uint32_t id;
+    strbuf_t path;
+} job_ref_t;
+
+template <typename T> struct sdwi_dbus_t;
+
+template <> struct sdwi_dbus_t<uint32_t> {
+    static constexpr const char *signature() {
+        return "u";
+    }
+    static int read(sd_bus_message *msg, uint32_t *v) {
+        return FN_SD_BUS_MESSAGE_READ(msg, signature(), v);
+    }
+    static void format(const uint32_t *v, char *buf, size_t len) {
+        snprintf(buf, len, "%" PRIu32, *v);
+    }
+};
+
+template <> struct sdwi_dbus_t<int32_t> {
+    static constexpr const char *signature() {
+        return "i";
+    }
+    static int read(sd_bus_message *msg, int32_t *v) {
+        return FN_SD_BUS_MESSAGE_READ(msg, signature(), v);
+    }
+    static void format(const int32_t *v, char *buf, size_t len) {
+        snprintf(buf, len, "%" PRId32, *v);
+    }
+};
+
+template <> struct sdwi_dbus_t<uint64_t> {
+    static constexpr const char *signature() {
+        return "t";
+    }
+    static int read(sd_bus_message *msg, uint64_t *v) {
+        return FN_SD_BUS_MESSAGE_READ(msg, signature(), v);
+    }
+    static void format(const uint64_t *v, char *buf, size_t len) {
+        snprintf(buf, len, "%" PRIu64, *v);
+    }
+};
+
+template <> struct sdwi_dbus_t<bool> {
+    static constexpr const char *signature() {
+        return "b";
+    }
+    // D-Bus booleans are read as int
+    static int read(sd_bus_message *msg, bool *v) {
+        int b = 0;
+        int rc;
+
+        rc = FN_SD_BUS_MESSAGE_READ(msg, signature(), &b);
+        *v = (0 != b);
+
+        return rc;
+    }
+    static void format(const bool *v, char *buf, size_t len) {
+        snprintf(buf, len, "%s", *v ? "yes" : "no");
+    }
+};
+
+template <> struct sdwi_dbus_t<strbuf_t> {
+    static constexpr const char *signature() {
+        return "s";
+    }
+    // the string is owned by msg
+    static int read(sd_bus_message *msg, strbuf_t *v) {
+        const char *s = NULL;
+        int rc;
+
+        rc = FN_SD_BUS_MESSAGE_READ(msg, signature(), &s);
+        if (rc < 0)
+            return rc;
+
+        if (0 != sdwi_strlcpy(v->buf, v->len, s))
+            return -ERANGE;
+
+        return rc;
+    }
+    static void format(const strbuf_t *v, char *buf, size_t len) {
+        snprintf(buf, len, "%s", NULL == v->buf ? "" : v->buf);
+    }
+};
+
+// "s" without a copy, the string is owned by the message
+template <> struct sdwi_dbus_t<const char *> {
+    static constexpr const char *signature() {
+        return "s";
+    }
+    static int read(sd_bus_message *msg, const char **v) {
+        return FN_SD_BUS_MESSAGE_READ(msg, signature(), v);
+    }
+    static void format(const char *const *v, char *buf, size_t len) {
+        snprintf(buf, len, "%s", NULL == *v ? "" : *v);
+    }
+};
+
+template <> struct sdwi_dbus_t<job_ref_t> {
+    static constexpr const char *signature() {
+        return "(uo)";
+    }
+    static int read(sd_bus_message *msg, job_ref_t *v) {
+        const char *path = NULL;
+        int rc;
+
+        rc = FN_SD_BUS_MESSAGE_READ(msg, signature(), &v->id, &path);
+        if (rc < 0)
+            return rc;
+
+        if (0 != sdwi_strlcpy(v->path.buf, v->path.len, path))
+            return -ERANGE;
+
+        return rc;
+    }
+    static void format(const job_ref_t *v, char *buf, size_t len) {
+        snprintf(buf, len, "%" PRIu32, v->id);
+    }
+};
+
+#define SDWI_PROPERTY(ID, INTERFACE, NAME, TYPE)                       \
+    struct ID {                                                        \
+        typedef TYPE type;                                             \
+        static constexpr const char *interface() { return INTERFACE; } \
+        static constexpr const char *name() { return NAME; }           \
+    }
+
+SDWI_PROPERTY(prop_version, sdbus_interface_mgr, "Version", strbuf_t);
+SDWI_PROPERTY(prop_active_state, sdbus_interface_unit, "ActiveState",
+              strbuf_t);
+SDWI_PROPERTY(prop_sub_state, sdbus_interface_unit, "SubState", strbuf_t);
+SDWI_PROPERTY(prop_load_state, sdbus_interface_unit, "LoadState", strbuf_t);
+SDWI_PROPERTY(prop_job, sdbus_interface_unit, "Job", job_ref_t);
+SDWI_PROPERTY(prop_need_daemon_reload, sdbus_interface_unit,
+              "NeedDaemonReload", bool);
+SDWI_PROPERTY(prop_active_enter_timestamp, sdbus_interface_unit,
+              "ActiveEnterTimestampMonotonic", uint64_t);
+SDWI_PROPERTY(prop_main_pid, sdbus_interface_srv, "MainPID", uint32_t);
+SDWI_PROPERTY(prop_control_pid, sdbus_interface_srv, "ControlPID", uint32_t);
+SDWI_PROPERTY(prop_exec_main_status, sdbus_interface_srv, "ExecMainStatus",
+              int32_t);
+SDWI_PROPERTY(prop_n_restarts, sdbus_interface_srv, "NRestarts", uint32_t);
+SDWI_PROPERTY(prop_memory_current, sdbus_interface_srv, "MemoryCurrent",
+              uint64_t);
+SDWI_PROPERTY(prop_control_group, sdbus_interface_srv, "ControlGroup",
+              strbuf_t);
+SDWI_PROPERTY(prop_scope_control_group, sdbus_interface_scope,
+              "ControlGroup", strbuf_t);
+SDWI_PROPERTY(prop_slice_control_group, sdbus_interface_slice,
+              "ControlGroup", strbuf_t);
+SDWI_PROPERTY(prop_socket_control_group, sdbus_interface_socket,
+              "ControlGroup", strbuf_t);
+SDWI_PROPERTY(prop_mount_control_group, sdbus_interface_mount,
+              "ControlGroup", strbuf_t);
+SDWI_PROPERTY(prop_swap_control_group, sdbus_interface_swap,
+              "ControlGroup", strbuf_t);
+
+static constexpr bool sdwi_streq(const char *a, const char *b) {
+    return *a == *b && ('\0' == *a || sdwi_streq(a + 1, b + 1));
+}
+
+// T may differ from P::type if the signature is the same, e.g. a
+// borrowed const char * for a strbuf_t property. With ret_msg the reply
+// is handed over to the caller, for values pointing into it. unit_name
+// is NULL for properties of the manager.
+template <class P, typename T = typename P::type>
+static int sdwi_read_property(const char *unit_name, const char *path,
+                              T *value, sd_bus_message **ret_msg = NULL) {
+    typedef sdwi_dbus_t<T> dbus_t;
+
+    static_assert(sdwi_streq(dbus_t::signature(),
+                             sdwi_dbus_t<typename P::type>::signature()),
+                  "type does not match the property signature");
+
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *msg = NULL;
+    char trace[MAX_RESPONSE_LEN];
+    op_t op;
+    int rc = 0;
+
+    LOG_DEBUG("'%s' '%s' '%s' '%s'\n", sdbus_service_contact, path,
+              P::interface(), P::name());
+
+    sdwi_op_begin(&op, SDW_OP_GET_PROPERTY, unit_name, path, P::name());
+    rc = FN_SD_BUS_GET_PROPERTY(sdwi_bus(), sdbus_service_contact, path,
+                                P::interface(), P::name(), &error, &msg,
+                                dbus_t::signature());
+    sdwi_op_end(&op, rc);
+
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
+        goto cleanup;
+    }
+
+    /* Parse the response message */
+    rc = dbus_t::read(msg, value);
+
+    if (-ERANGE == rc) {
+        LOG_ERROR("unit property %s exceeds the buffer\n", P::name());
+        rc = SDW_ERANGE;
+        goto cleanup;
+    }
+
+    if (rc < 0) {
+        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
+        goto cleanup;
+    }
+
+    if constexpr (LOG_COMPILED(SDW_LOG_INFO)) {
+        if (SDW_LOG_INFO <= TRC_LEVEL) {
+            dbus_t::format(value, trace, sizeof(trace));
+            LOG_INFO("unit property %s: %s\n", P::name(), trace);
+        }
+    }
+
+    if (NULL != ret_msg) {
+        *ret_msg = msg;
+        msg = NULL;
+    }
+
+cleanup:
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
+
+    if (rc >= 0)
+        return 0;
+
+    if (SDW_ERANGE == rc)
+        return rc;
+
+    return SDW_EINVAL;
+}
+
+template <class P>
+static int sdwi_read_unit_property(const unit_t *unit,
+                                   typename P::type *value) {
+    char path[MAX_UNIT_PATH_LEN];
+    int rc;
+
+    rc = sdwi_unit_path(unit->encoded, path, sizeof(path));
+    if (0 != rc)
+        return rc;
+
+    return sdwi_read_property<P>(unit->name, path, value);
+}
+
+// the unit_name variant for the public getters
+template <class P>
+static int sdwi_get_unit_property(const char *unit_name,
+                                  typename P::type *value) {
+    unit_t unit;
+    int rc;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    rc = sdwi_encode(&unit);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_read_unit_property<P>(&unit, value);
+}
 
 __attribute__((constructor))
 static void sdwi_load_lib(void) {
 #ifdef SDW_DLSYM
     static void *hdl = NULL;
-#endif
     char *error = NULL;
-    response_t response;
-    int rc;
-
-    response.s = NULL;
+#endif
 
     memset(last_error_msg, 0, sizeof(last_error_msg));
 #ifdef SDW_DLSYM
-    lib_stat = FAILED;
+    __atomic_store_n(&lib_stat, FAILED, __ATOMIC_RELEASE);
     hdl = dlopen(sdbus_lib_name, RTLD_NOW);
     if (NULL == hdl) {
         LOG_ERROR("can't load %s\n", sdbus_lib_name);
@@ -294,47 +1268,129 @@ static void sdwi_load_lib(void) {
     DL_FUNCTION(sd_bus_message_unref);
     DL_FUNCTION(sd_bus_open_system);
     DL_FUNCTION(sd_bus_path_decode);
-    DL_FUNCTION(sd_bus_path_encode);
     DL_FUNCTION(sd_bus_process);
+    DL_FUNCTION(sd_bus_ref);
+    DL_FUNCTION(sd_bus_unref);
     DL_FUNCTION(sd_bus_slot_unref);
     DL_FUNCTION(sd_bus_wait);
     DL_FUNCTION(sd_notify);
+    DL_FUNCTION(sd_journal_sendv);
     DL_FUNCTION(sd_bus_message_enter_container);
     DL_FUNCTION(sd_bus_message_exit_container);
+    DL_FUNCTION(sd_bus_message_skip);
+    DL_FUNCTION(sd_bus_message_get_path);
+    DL_FUNCTION(sd_bus_get_fd);
+    DL_FUNCTION(sd_bus_is_open);
+    DL_FUNCTION(sd_bus_message_new_method_call);
+    DL_FUNCTION(sd_bus_message_append_strv);
+    DL_FUNCTION(sd_bus_message_append);
+    DL_FUNCTION(sd_bus_call);
 
 #undef DL_FUNCTION
 #endif
 
-    /* Connect to the system bus */
-    if (NULL == bus) {
-        int r = FN_SD_BUS_OPEN_SYSTEM(&bus);
-        if (r < 0) {
-            LOG_ERROR("failed to connect to systemd D-Bus: %s\n", strerror(-r));
-            goto cleanup;
-        }
+    loaded = true;
+
+    // dlerror() has nothing to say about a failed connection
+    if (sdwi_connect() == SDW_EINIT)
+        LOG_ERROR("can't connect to %s\n", sdbus_service_contact);
+    return;
+
+#ifdef SDW_DLSYM
+cleanup:
+    error = dlerror();
+    LOG_ERROR("dlerror: %s\n", NULL == error ? "unknown error" : error);
+#endif
+}
+
+// thread exit, the connection of the thread is released
+static void sdwi_bus_release(void *b) {
+    FN_SD_BUS_UNREF((sd_bus *) b);
+}
+
+static void sdwi_bus_key(void) {
+    pthread_key_create(&bus_key, sdwi_bus_release);
+}
+
+// connection of the calling thread, opened through the current transport
+// on first use, again after sdw_set_transport() and once the peer closed
+// it, NULL if that fails
+static sd_bus *sdwi_bus(void) {
+    sdw_transport_t t;
+    unsigned gen;
+    int rc;
+
+    gen = __atomic_load_n(&transport_gen, __ATOMIC_ACQUIRE);
+    if (NULL != bus && bus_gen == gen && FN_SD_BUS_IS_OPEN(bus) > 0)
+        return bus;
+
+    if (!loaded)
+        return NULL;
+
+    pthread_once(&bus_once, sdwi_bus_key);
+
+    if (NULL != bus) {
+        FN_SD_BUS_UNREF(bus);
+        bus = NULL;
+        pthread_setspecific(bus_key, NULL);
+    }
+
+    pthread_mutex_lock(&transport_lock);
+    t = transport;
+    gen = transport_gen;
+    pthread_mutex_unlock(&transport_lock);
+
+    if (NULL == t.open)
+        rc = FN_SD_BUS_OPEN_SYSTEM(&bus);
+    else
+        rc = t.open(&bus, t.userdata);
+
+    if (rc < 0) {
+        bus = NULL;
+        LOG_ERROR("failed to connect to systemd D-Bus: %s\n", strerror(-rc));
+        return NULL;
     }
 
-    lib_stat = INVALID_VERSION;
+    bus_gen = gen;
+    pthread_setspecific(bus_key, bus);
 
-    rc = sdwi_get_property(sdbus_object_path, sdbus_service_contact,
-                           sdbus_interface_mgr, "Version", "s", &response);
+    return bus;
+}
 
-    if (0 == rc && NULL != response.s) {
+// connect the calling thread and check the systemd version
+// the other threads see only the final state, not the steps of a
+// transport switch
+static int sdwi_connect(void) {
+    char version[MAX_RESPONSE_LEN];
+    lib_stat_t state = FAILED;
+    int rc;
 
-        rc = sdwi_check_version(response.s);
+    if (NULL == sdwi_bus()) {
+        rc = SDW_EINIT;
+        goto cleanup;
+    }
 
-        if (0 == rc) {
-            LOG_INFO("successfully loaded %s\n", sdbus_lib_name);
-            lib_stat = LOADED;
-        }
+    state = INVALID_VERSION;
 
-        free(response.s);
-        return;
+    rc = sdw_get_version_r(version, sizeof(version));
+    if (0 != rc) {
+        rc = SDW_EINIT;
+        goto cleanup;
+    }
+
+    rc = sdwi_check_version(version);
+    if (0 != rc) {
+        rc = SDW_EVERSION;
+        goto cleanup;
     }
 
+    LOG_INFO("successfully loaded %s\n", sdbus_lib_name);
+    state = LOADED;
+
 cleanup:
-    error = dlerror();
-    LOG_ERROR("dlerror: %s\n", NULL == error ? "unknown error" : error);
+    __atomic_store_n(&lib_stat, state, __ATOMIC_RELEASE);
+
+    return rc;
 }
 
 static char *sdwi_regex_match(const char *str, const char *pattern, unsigned want) {
@@ -410,264 +1466,714 @@ cleanup:
     return rc;
 }
 
-static int sdwi_get_unit_by_pid(unsigned pid, char **ret_unit_name) {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg = NULL;
-    int rc = 0;
-    char *unit_name = NULL;
+// unit types which have a cgroup below a slice, see sdwi_cgroup_unit()
+static const char *const cgroup_unit_suffixes[] = {
+    ".service", ".scope", ".socket", ".mount", ".swap", ".device",
+    ".target", ".timer", ".path", ".automount",
+};
+
+// unit of a cgroup path as systemd lays out the hierarchy, the first
+// component below the slices: /system.slice/foo.service/... is foo.service,
+// SDW_EINVAL if the path is not one of a unit, e.g. /lxc.payload.c1
+static int sdwi_cgroup_unit(const char *path, char *buf, size_t len) {
+    const char *p = path, *end, *dot;
+    bool unit;
+    size_t n;
+
+    // paths outside of the own cgroup namespace start with /..
+    if ('/' != *p)
+        return SDW_EINVAL;
 
-    // non alnum() characters are encoded as _xx in the dbus response
-    // request the encoded unit name and check the response
+    while ('/' == *p) {
+        p++;
+        end = strchrnul(p, '/');
+        n = (size_t) (end - p);
 
-    LOG_DEBUG("'%s' '%s' '%s' '%s' '%u'\n",
-              sdbus_service_contact, sdbus_object_path,
-              sdbus_interface_mgr, "GetUnitByPID", pid);
+        // systemd prefixes names it had to escape with '_', see cg_escape()
+        if (n > 0 && '_' == *p) {
+            p++;
+            n--;
+        }
 
-    rc = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                               sdbus_interface_mgr, "GetUnitByPID", &error,
-                               &msg, "u", pid);
-    if (rc < 0) {
-        LOG_ERROR("GetUnitByPID '%u' - failed: %s\n", pid, error.message);
-        goto cleanup;
+        dot = (const char *) memrchr(p, '.', n);
+        if (NULL == dot || dot == p || dot == end - 1)
+            return SDW_EINVAL;
+
+        if (end - dot == sizeof(".slice") - 1 &&
+            memcmp(dot, ".slice", sizeof(".slice") - 1) == 0) {
+            p = end;
+            continue;
+        }
+
+        unit = false;
+        for (const char *suffix : cgroup_unit_suffixes)
+            if ((size_t) (end - dot) == strlen(suffix) &&
+                memcmp(dot, suffix, end - dot) == 0)
+                unit = true;
+        if (!unit)
+            return SDW_EINVAL;
+
+        if (n >= len)
+            return SDW_ERANGE;
+
+        memcpy(buf, p, n);
+        buf[n] = '\0';
+        return 0;
     }
 
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "o", &unit_name);
-    if (0 > rc)
-        goto cleanup;
+    return SDW_EINVAL;
+}
 
-    if (unit_name != NULL)
-        *ret_unit_name = strdup(unit_name);
+// unit of a process from /proc/<pid>/cgroup, the unified hierarchy (0::)
+// or else the one of systemd on cgroup v1 (name=systemd), SDW_EINVAL if
+// it is not in the cgroup of a unit or the file can't be read
+static int sdwi_cgroup_unit_by_pid(unsigned pid, char *buf, size_t len) {
+    char data[MAX_CGROUP_LEN], file[64];
+    const char *v1 = NULL, *v2 = NULL;
+    char *line, *next, *eol;
+    size_t total = 0;
+    ssize_t n;
+    int fd, rc;
 
-    if (NULL != *ret_unit_name) {
-        LOG_INFO("unit '%s' found for PID '%u'\n", *ret_unit_name, pid);
-    } else {
-        LOG_INFO("no unit found for PID '%u'\n", pid);
-        rc = SDW_EINVAL;
+    if (0 == pid)
+        snprintf(file, sizeof(file), "/proc/self/cgroup");
+    else
+        snprintf(file, sizeof(file), "/proc/%u/cgroup", pid);
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_DEBUG("open '%s' failed: %s\n", file, strerror(errno));
+        return SDW_EINVAL;
     }
 
-cleanup:
-    FN_SD_BUS_ERROR_FREE(&error);
-    FN_SD_BUS_MESSAGE_UNREF(msg);
+    do {
+        n = read(fd, data + total, sizeof(data) - 1 - total);
+        if (n > 0)
+            total += (size_t) n;
+    } while ((n > 0 && total < sizeof(data) - 1) || (n < 0 && EINTR == errno));
+    close(fd);
+    data[total] = '\0';
+
+    for (line = data; '\0' != *line; line = next) {
+        eol = strchrnul(line, '\n');
+        next = '\0' == *eol ? eol : eol + 1;
+        *eol = '\0';
+
+        if (strncmp(line, "0::", 3) == 0)
+            v2 = line + 3;
+        else if (NULL != (line = strchr(line, ':')) &&
+                 strncmp(line, ":name=systemd:", 14) == 0)
+            v1 = line + 14;
+    }
 
-    if (rc >= 0)
+    // on hybrid setups the unified hierarchy may be left unused
+    rc = sdwi_cgroup_unit(NULL != v2 ? v2 : "", buf, len);
+    if (SDW_EINVAL == rc && NULL != v1)
+        rc = sdwi_cgroup_unit(v1, buf, len);
+    if (0 == rc)
+        LOG_INFO("unit '%s' found for PID '%u' in cgroupfs\n", buf, pid);
+    else
+        LOG_DEBUG("no unit for PID '%u' in '%s'\n", pid, file);
+
+    return rc;
+}
+
+// start time of a process in clock ticks after boot, field 22 of
+// /proc/<pid>/stat, tells a reused PID apart, 0 if it can't be read
+static uint64_t sdwi_pid_starttime(unsigned pid) {
+    char data[512], file[64];
+    const char *p;
+    ssize_t n;
+    int fd, field;
+
+    if (0 == pid)
+        snprintf(file, sizeof(file), "/proc/self/stat");
+    else
+        snprintf(file, sizeof(file), "/proc/%u/stat", pid);
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         return 0;
 
-    return SDW_EINVAL;
+    do {
+        n = read(fd, data, sizeof(data) - 1);
+    } while (n < 0 && EINTR == errno);
+    close(fd);
+
+    if (n <= 0)
+        return 0;
+    data[n] = '\0';
+
+    // comm (field 2) may contain blanks and parentheses, count after it
+    p = strrchr(data, ')');
+    if (NULL == p)
+        return 0;
+
+    for (field = 2; field < 22 && NULL != p; field++)
+        p = strchr(p + 1, ' ');
+
+    return NULL == p ? 0 : strtoull(p + 1, NULL, 10);
 }
 
-static int sdwi_enable(const char *unit_name, bool runtime, bool force) {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg = NULL;
-    int rc = 0;
-    char *change[3] = { NULL, NULL, NULL };     // a(sss)
-    int inst_info = 0;          // from sd_bus_message_read.3 -> "b" int * (NB not bool *)
+static void sdwi_pid_cache_init(void) {
+    for (unsigned i = 0; i < PID_CACHE_LOCKS; i++)
+        pthread_mutex_init(&pid_cache_locks[i], NULL);
 
-    LOG_DEBUG("SDBUS_ENABLE_UNIT - '%s' '%s' '%s' '%s' '%s' %d %d\n",
-              sdbus_service_contact, sdbus_object_path,
-              sdbus_interface_mgr, "EnableUnitFiles", unit_name, runtime,
-              force);
+    pid_cache = (pid_cache_entry_t *) calloc(PID_CACHE_SIZE,
+                                             sizeof(*pid_cache));
+}
 
-    rc = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                               sdbus_interface_mgr, "EnableUnitFiles", &error,
-                               &msg, "asbb", 1, unit_name, runtime, force);
+// copies the unit of (pid, start) to buf, MAX_UNIT_NAME_LEN bytes, if an
+// entry of the current transport has not expired
+static bool sdwi_pid_cache_get(unsigned pid, uint64_t start, unsigned gen,
+                               uint64_t now, char *buf) {
+    unsigned slot = pid % PID_CACHE_SIZE;
+    pid_cache_entry_t *e;
+    bool hit;
+
+    if (NULL == pid_cache || 0 == start)
+        return false;
+
+    e = &pid_cache[slot];
+    pthread_mutex_lock(&pid_cache_locks[slot % PID_CACHE_LOCKS]);
+    hit = e->pid == pid && e->start == start && e->gen == gen &&
+          e->expires > now;
+    if (hit)
+        memcpy(buf, e->unit, sizeof(e->unit));
+    pthread_mutex_unlock(&pid_cache_locks[slot % PID_CACHE_LOCKS]);
+
+    return hit;
+}
 
-    if (rc < 0) {
-        LOG_ERROR("failed to issue method call: %s\n", error.message);
-        goto cleanup;
+static void sdwi_pid_cache_put(unsigned pid, uint64_t start, unsigned gen,
+                               uint64_t now, const char *unit) {
+    unsigned slot = pid % PID_CACHE_SIZE;
+    pid_cache_entry_t *e;
+
+    if (NULL == pid_cache || 0 == start || 0 == pid)
+        return;
+
+    e = &pid_cache[slot];
+    pthread_mutex_lock(&pid_cache_locks[slot % PID_CACHE_LOCKS]);
+    e->pid = pid;
+    e->start = start;
+    e->gen = gen;
+    e->expires = now + PID_CACHE_TTL_USEC;
+    sdwi_strlcpy(e->unit, sizeof(e->unit), unit);
+    pthread_mutex_unlock(&pid_cache_locks[slot % PID_CACHE_LOCKS]);
+}
+
+// unified hierarchy, /sys/fs/cgroup/unified of hybrid setups has no
+// controllers but cpu.stat
+static void sdwi_cgroup_root_init(void) {
+    if (access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0)
+        cgroup_root = "/sys/fs/cgroup";
+    else if (access("/sys/fs/cgroup/unified/cgroup.controllers", F_OK) == 0)
+        cgroup_root = "/sys/fs/cgroup/unified";
+}
+
+// cgroup of a service below cgroup_root, SDW_EINVAL if it has none
+// because it is not running
+static int sdwi_get_control_group(const char *unit_name, char *buf,
+                                  size_t len) {
+    strbuf_t response = { buf, len };
+    const char *type = strrchr(unit_name, '.');
+    int rc;
+
+    // the interface of the unit type has the property
+    if (NULL == type)
+        type = "";
+
+    if (strcmp(type, ".service") == 0) {
+        rc = sdwi_get_unit_property<prop_control_group>(unit_name, &response);
+    } else if (strcmp(type, ".scope") == 0) {
+        rc = sdwi_get_unit_property<prop_scope_control_group>(unit_name,
+                                                              &response);
+    } else if (strcmp(type, ".slice") == 0) {
+        rc = sdwi_get_unit_property<prop_slice_control_group>(unit_name,
+                                                              &response);
+    } else if (strcmp(type, ".socket") == 0) {
+        rc = sdwi_get_unit_property<prop_socket_control_group>(unit_name,
+                                                               &response);
+    } else if (strcmp(type, ".mount") == 0) {
+        rc = sdwi_get_unit_property<prop_mount_control_group>(unit_name,
+                                                              &response);
+    } else if (strcmp(type, ".swap") == 0) {
+        rc = sdwi_get_unit_property<prop_swap_control_group>(unit_name,
+                                                             &response);
+    } else {
+        LOG_INFO("unit type of '%s' has no cgroup\n", unit_name);
+        rc = SDW_EINVAL;
     }
+    if (0 != rc)
+        return rc;
 
-    /* Parse the response message */
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "b", &inst_info);
+    if ('\0' == buf[0]) {
+        LOG_INFO("unit '%s' has no cgroup\n", unit_name);
+        return SDW_EINVAL;
+    }
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+    return 0;
+}
+
+static const char *const res_files[RES_FILES] = {
+    "memory.current", "memory.stat", "cpu.stat", "io.stat", "pids.current"
+};
+
+#define RES_FIELD(KEY, FIELD) { KEY, offsetof(sdw_unit_resources_t, FIELD) }
+
+static const res_field_t res_memory_stat[] = {
+    RES_FIELD("anon", memory_anon),
+    RES_FIELD("file", memory_file),
+    RES_FIELD("kernel_stack", memory_kernel_stack),
+    RES_FIELD("slab", memory_slab),
+    RES_FIELD("sock", memory_sock),
+    RES_FIELD("shmem", memory_shmem),
+    RES_FIELD("pgfault", memory_pgfault),
+    RES_FIELD("pgmajfault", memory_pgmajfault),
+};
+
+static const res_field_t res_cpu_stat[] = {
+    RES_FIELD("usage_usec", cpu_usage_usec),
+    RES_FIELD("user_usec", cpu_user_usec),
+    RES_FIELD("system_usec", cpu_system_usec),
+    RES_FIELD("nr_periods", cpu_nr_periods),
+    RES_FIELD("nr_throttled", cpu_nr_throttled),
+    RES_FIELD("throttled_usec", cpu_throttled_usec),
+};
+
+static const res_field_t res_io_stat[] = {
+    RES_FIELD("rbytes", io_rbytes),
+    RES_FIELD("wbytes", io_wbytes),
+    RES_FIELD("rios", io_rios),
+    RES_FIELD("wios", io_wios),
+};
+
+// the entry of unit_name, added and the least recently used unit dropped
+// if there are RES_MAX_UNITS, res_cache.lock held
+static res_unit_t *sdwi_res_find(const char *unit_name, bool add) {
+    res_unit_t **head, *u, *lru = NULL;
+
+    head = &res_cache.buckets[sdwi_fnv1a(unit_name, 2166136261u) %
+                              RES_BUCKETS];
+    for (u = *head; NULL != u; u = u->next) {
+        if (strcmp(u->name, unit_name) == 0) {
+            u->used = ++res_cache.clock;
+            return u;
+        }
     }
 
-    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "(sss)");
+    if (!add)
+        return NULL;
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+    if (res_cache.n_units >= RES_MAX_UNITS) {
+        for (unsigned i = 0; i < RES_BUCKETS; i++)
+            for (u = res_cache.buckets[i]; NULL != u; u = u->next)
+                if (NULL == lru || u->used < lru->used)
+                    lru = u;
+        LOG_DEBUG("cgroup files of '%s' closed for '%s'\n", lru->name,
+                  unit_name);
+        sdwi_res_drop(lru);
     }
 
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "(sss)", &change[0], &change[1],
-                                &change[2]);
+    u = (res_unit_t *) calloc(1, sizeof(*u));
+    if (NULL == u)
+        return NULL;
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+    sdwi_strlcpy(u->name, sizeof(u->name), unit_name);
+    for (int i = 0; i < RES_FILES; i++)
+        u->fd[i] = -1;
+    u->used = ++res_cache.clock;
+    u->next = *head;
+    *head = u;
+    res_cache.n_units++;
+
+    return u;
+}
+
+// remove u from the cache and close its files, res_cache.lock held
+static void sdwi_res_drop(res_unit_t *u) {
+    res_unit_t **pu;
+
+    pu = &res_cache.buckets[sdwi_fnv1a(u->name, 2166136261u) % RES_BUCKETS];
+    while (*pu != u)
+        pu = &(*pu)->next;
+    *pu = u->next;
+
+    sdwi_res_close(u);
+    free(u);
+    res_cache.n_units--;
+}
+
+static void sdwi_res_close(res_unit_t *u) {
+    for (int i = 0; i < RES_FILES; i++) {
+        if (u->fd[i] >= 0)
+            close(u->fd[i]);
+        u->fd[i] = -1;
     }
+    u->open = false;
+}
 
-    rc = FN_SD_BUS_MESSAGE_EXIT_CONTAINER(msg);
+// the files of the controllers enabled for the cgroup, SDW_EINVAL if
+// the cgroup is gone
+static int sdwi_res_open(res_unit_t *u) {
+    char path[MAX_UNIT_PATH_LEN + 32];
+    int dir;
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+    snprintf(path, sizeof(path), "%s%s", cgroup_root, u->cgroup);
+    dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+        LOG_INFO("open '%s' failed: %s\n", path, strerror(errno));
+        return SDW_EINVAL;
     }
 
-    if (inst_info) {
-        LOG_INFO("EnableUnitFiles %d '%s' '%s' '%s'\n", inst_info,
-                 change[0] == NULL ? "NULL" : change[0],
-                 change[1] == NULL ? "NULL" : change[1],
-                 change[2] == NULL ? "NULL" : change[2]);
-    } else {
-        LOG_INFO("EnableUnitFiles 0, 'NULL' 'NULL' 'NULL'\n");
+    for (int i = 0; i < RES_FILES; i++)
+        u->fd[i] = openat(dir, res_files[i], O_RDONLY | O_CLOEXEC);
+    close(dir);
+
+    u->open = true;
+    LOG_DEBUG("cgroup files of '%s' opened in '%s'\n", u->name, path);
+
+    return 0;
+}
+
+// adds the values of the known keys, one per line or, with sep '=',
+// any number per line after the device of io.stat
+static void sdwi_res_parse(char *data, char sep, const res_field_t *fields,
+                           size_t n_fields, sdw_unit_resources_t *res) {
+    char *line, *tok, *save_line, *save_tok, *value;
+    uint64_t *dst;
+
+    for (line = strtok_r(data, "\n", &save_line); NULL != line;
+         line = strtok_r(NULL, "\n", &save_line)) {
+        for (tok = '=' == sep ? strtok_r(line, " ", &save_tok) : line;
+             NULL != tok;
+             tok = '=' == sep ? strtok_r(NULL, " ", &save_tok) : NULL) {
+            value = strchr(tok, sep);
+            if (NULL == value)
+                continue;
+            *value++ = '\0';
+
+            for (size_t i = 0; i < n_fields; i++) {
+                if (strcmp(tok, fields[i].key) == 0) {
+                    dst = (uint64_t *) ((char *) res + fields[i].offset);
+                    *dst += strtoull(value, NULL, 10);
+                    break;
+                }
+            }
+        }
     }
+}
 
-cleanup:
-    FN_SD_BUS_ERROR_FREE(&error);
-    FN_SD_BUS_MESSAGE_UNREF(msg);
-    if (rc >= 0)
-        return 0;
+// pread() of the open files, reopened once if the cgroup was removed,
+// e.g. by a restart, res_cache.lock held
+static int sdwi_res_read(res_unit_t *u, sdw_unit_resources_t *res) {
+    char *buf = res_cache.buf;
+    bool stale = false;
+    ssize_t n;
+    int rc;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!u->open) {
+            rc = sdwi_res_open(u);
+            if (0 != rc)
+                return rc;
+        }
+
+        memset(res, 0, sizeof(*res));
+        stale = false;
+
+        for (int i = 0; i < RES_FILES && !stale; i++) {
+            if (u->fd[i] < 0)
+                continue;
+
+            n = pread(u->fd[i], buf, RES_BUF_LEN - 1, 0);
+            if (n < 0) {
+                stale = ENODEV == errno;
+                continue;
+            }
+            buf[n] = '\0';
+
+            switch (i) {
+                case RES_MEMORY_CURRENT:
+                    res->memory_current = strtoull(buf, NULL, 10);
+                    res->valid |= SDW_RES_MEMORY;
+                    break;
+                case RES_MEMORY_STAT:
+                    sdwi_res_parse(buf, ' ', res_memory_stat,
+                                   sizeof(res_memory_stat) /
+                                   sizeof(res_memory_stat[0]), res);
+                    res->valid |= SDW_RES_MEMORY;
+                    break;
+                case RES_CPU_STAT:
+                    sdwi_res_parse(buf, ' ', res_cpu_stat,
+                                   sizeof(res_cpu_stat) /
+                                   sizeof(res_cpu_stat[0]), res);
+                    res->valid |= SDW_RES_CPU;
+                    break;
+                case RES_IO_STAT:
+                    sdwi_res_parse(buf, '=', res_io_stat,
+                                   sizeof(res_io_stat) /
+                                   sizeof(res_io_stat[0]), res);
+                    res->valid |= SDW_RES_IO;
+                    break;
+                case RES_PIDS_CURRENT:
+                    res->pids_current = strtoull(buf, NULL, 10);
+                    res->valid |= SDW_RES_PIDS;
+                    break;
+            }
+        }
+
+        if (!stale)
+            return 0;
+
+        LOG_DEBUG("cgroup of '%s' removed, reopening\n", u->name);
+        sdwi_res_close(u);
+    }
 
+    memset(res, 0, sizeof(*res));
     return SDW_EINVAL;
 }
 
-static int sdwi_disable(const char *unit_name, bool runtime) {
-    int rc = 0;
-    char *change[3] = { NULL, NULL, NULL };     // a(sss)
+// ControlGroup of a service, remembered in the resource cache until
+// refresh, e.g. because the cgroup was removed, cached tells which one
+static int sdwi_unit_cgroup(const char *unit_name, char *buf, size_t len,
+                            bool refresh, bool *cached) {
+    res_unit_t *u;
+    int rc;
 
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg = NULL;
+    pthread_mutex_lock(&res_cache.lock);
+    u = sdwi_res_find(unit_name, false);
+    if (NULL != u && refresh) {
+        sdwi_res_drop(u);
+        u = NULL;
+    }
+    *cached = NULL != u && '\0' != u->cgroup[0];
+    if (*cached)
+        sdwi_strlcpy(buf, len, u->cgroup);
+    pthread_mutex_unlock(&res_cache.lock);
 
-    LOG_DEBUG("'%s' '%s' '%s' '%s' '%s' %d\n",
-              sdbus_service_contact, sdbus_object_path,
-              sdbus_interface_mgr, "DisableUnitFiles", unit_name, runtime);
+    if (*cached)
+        return 0;
 
-    rc = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                               sdbus_interface_mgr, "DisableUnitFiles", &error,
-                               &msg, "asb", 1, unit_name, runtime);
+    rc = sdwi_get_control_group(unit_name, buf, len);
+    if (0 != rc)
+        return rc;
 
-    if (rc < 0) {
-        LOG_ERROR("failed to issue method call: %s\n", error.message);
-        goto cleanup;
+    // the files are opened by the next sdw_get_unit_resources()
+    pthread_mutex_lock(&res_cache.lock);
+    u = sdwi_res_find(unit_name, true);
+    if (NULL != u && strcmp(u->cgroup, buf) != 0) {
+        sdwi_res_close(u);
+        sdwi_strlcpy(u->cgroup, sizeof(u->cgroup), buf);
     }
+    pthread_mutex_unlock(&res_cache.lock);
 
-    /* Parse the response message */
-    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "(sss)");
+    return 0;
+}
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+static bool sdwi_pid_list_add(pid_list_t *list, unsigned pid) {
+    unsigned *grown;
+
+    if (list->n == list->max) {
+        list->max = 0 == list->max ? 64 : 2 * list->max;
+        grown = (unsigned *) realloc(list->pids,
+                                     list->max * sizeof(unsigned));
+        if (NULL == grown)
+            return false;
+        list->pids = grown;
     }
+    list->pids[list->n++] = pid;
 
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "(sss)", &change[0], &change[1],
-                                &change[2]);
+    return true;
+}
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+// cgroup.procs of dir and of the cgroups below it, dir is closed. A
+// child cgroup removed meanwhile is skipped, SDW_EINVAL if dir's own
+// cgroup.procs cannot be read, -ENOMEM if list cannot grow
+static int sdwi_cgroup_pids(int dir, unsigned depth, pid_list_t *list) {
+    struct dirent *ent;
+    unsigned pid;
+    FILE *procs;
+    DIR *d;
+    int fd, rc = 0;
+
+    fd = openat(dir, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    procs = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (NULL == procs) {
+        if (fd >= 0)
+            close(fd);
+        close(dir);
+        return SDW_EINVAL;
     }
 
-    rc = FN_SD_BUS_MESSAGE_EXIT_CONTAINER(msg);
+    while (0 == rc && fscanf(procs, "%u", &pid) == 1)
+        if (!sdwi_pid_list_add(list, pid))
+            rc = -ENOMEM;
+    fclose(procs);
 
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
-        goto cleanup;
+    d = fdopendir(dir);
+    if (NULL == d) {
+        close(dir);
+        return rc;
     }
 
-    LOG_INFO("DisableUnitFiles '%s' '%s' '%s'\n",
-             change[0] == NULL ? "NULL" : change[0],
-             change[1] == NULL ? "NULL" : change[1],
-             change[2] == NULL ? "NULL" : change[2]);
+    while (0 == rc && depth < CGROUP_MAX_DEPTH && NULL != (ent = readdir(d))) {
+        if (DT_DIR != ent->d_type || '.' == ent->d_name[0])
+            continue;
 
-cleanup:
-    FN_SD_BUS_ERROR_FREE(&error);
-    FN_SD_BUS_MESSAGE_UNREF(msg);
+        fd = openat(dirfd(d), ent->d_name,
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
 
-    if (rc >= 0)
-        return 0;
+        if (sdwi_cgroup_pids(fd, depth + 1, list) == -ENOMEM)
+            rc = -ENOMEM;
+    }
+    closedir(d);
 
-    return SDW_EINVAL;
+    return rc;
 }
 
-static int sdwi_get_srv_property(const char *unit_name_encoded,
-                                 const char *property,
-                                 const char *response_format,
-                                 response_t *response) {
-    int rc = 0;
-    char *path = NULL;
+// GetUnitProcesses, a(sus) of cgroup, PID and command line
+static int sdwi_bus_unit_pids(const char *unit_name, pid_list_t *list) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *msg = NULL;
+    const char *cgroup, *cmdline;
+    uint32_t pid;
+    op_t op;
+    int rc;
+
+    if (NULL == sdwi_bus())
+        return SDW_EINIT;
 
-    rc = asprintf(&path, "%s/unit/%s", sdbus_object_path, unit_name_encoded);
-    if (-1 == rc) {
-        LOG_ERROR("asprintf() failed\n");
+    LOG_DEBUG("'%s' '%s' '%s' '%s' '%s'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, "GetUnitProcesses", unit_name);
+
+    sdwi_op_begin(&op, SDW_OP_GET_PROCESSES, unit_name, NULL, NULL);
+    rc = FN_SD_BUS_CALL_METHOD(sdwi_bus(), sdbus_service_contact,
+                               sdbus_object_path, sdbus_interface_mgr,
+                               "GetUnitProcesses", &error, &msg, "s",
+                               unit_name);
+    sdwi_op_end(&op, rc);
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
         goto cleanup;
     }
 
-    rc = sdwi_get_property(path, sdbus_service_contact, sdbus_interface_srv,
-                           property, response_format, response);
+    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "(sus)");
+    if (rc < 0)
+        goto invalid;
+
+    while ((rc = FN_SD_BUS_MESSAGE_READ(msg, "(sus)", &cgroup, &pid,
+                                        &cmdline)) > 0) {
+        if (!sdwi_pid_list_add(list, pid)) {
+            rc = -ENOMEM;
+            goto invalid;
+        }
+    }
+    if (rc < 0)
+        goto invalid;
+
+    LOG_INFO("GetUnitProcesses: %zu processes of '%s'\n", list->n,
+             unit_name);
+    goto cleanup;
+
+invalid:
+    LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
 
 cleanup:
-    if (NULL != path)
-        free(path);
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
 
-    return rc;
+    return rc < 0 ? SDW_EINVAL : 0;
 }
 
-static int sdwi_get_unit_property(const char *unit_name_encoded,
-                                  const char *service,
-                                  const char *interface,
-                                  const char *property,
-                                  const char *response_format,
-                                  response_t *response) {
-    int rc = 0;
-    char *path = NULL;
+// the cgroup of a process names its unit without a round trip, it is
+// the manager's view only if that is the manager of the system bus
+static int sdwi_pid_lookup_mode(void) {
+    int mode = __atomic_load_n(&pid_lookup, __ATOMIC_RELAXED);
 
-    rc = asprintf(&path, "%s/unit/%s", sdbus_object_path, unit_name_encoded);
-    if (-1 == rc) {
-        LOG_ERROR("intf() failed\n");
-        goto cleanup;
+    if (SDW_PID_LOOKUP_AUTO == mode) {
+        pthread_mutex_lock(&transport_lock);
+        if (NULL != transport.open)
+            mode = SDW_PID_LOOKUP_BUS;
+        pthread_mutex_unlock(&transport_lock);
     }
 
-    rc = sdwi_get_property(path, service, interface, property, response_format, response);
+    return mode;
+}
 
-cleanup:
-    if (NULL != path)
-        free(path);
+static int sdwi_get_unit_by_pid(unsigned pid, char *buf, size_t len) {
+    int mode = sdwi_pid_lookup_mode();
+    int rc;
 
-    return rc;
+    // the manager may know better than a path which only looks like
+    // the cgroup of a unit
+    if (SDW_PID_LOOKUP_BUS != mode) {
+        rc = sdwi_cgroup_unit_by_pid(pid, buf, len);
+        if (0 == rc || SDW_PID_LOOKUP_CGROUP == mode)
+            return rc;
+    }
+
+    return sdwi_bus_unit_by_pid(pid, buf, len, NULL);
 }
 
-static int sdwi_get_property(const char *path,
-                             const char *service_contact,
-                             const char *interface,
-                             const char *property,
-                             const char *response_format,
-                             response_t *response) {
+// no_unit tells that the call failed because the PID has no unit or no
+// longer exists, may be NULL
+static int sdwi_bus_unit_by_pid(unsigned pid, char *buf, size_t len,
+                                bool *no_unit) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message *msg = NULL;
     int rc = 0;
+    const char *path = NULL;
+    op_t op;
 
-    memset(response, 0, sizeof(response_t));
+    // the reply is the unit object path, non alnum() characters of the
+    // unit name are encoded as _xx, see sdwi_label_escape()
 
-    LOG_DEBUG("'%s' '%s' '%s' '%s'\n", service_contact, path, interface,
-              property);
-
-    rc = FN_SD_BUS_GET_PROPERTY(bus, service_contact, path,
-                                interface, property, &error, &msg,
-                                response_format);
+    LOG_DEBUG("'%s' '%s' '%s' '%s' '%u'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, "GetUnitByPID", pid);
 
+    sdwi_op_begin(&op, SDW_OP_GET_UNIT_BY_PID, NULL, NULL, NULL);
+    rc = FN_SD_BUS_CALL_METHOD(sdwi_bus(), sdbus_service_contact, sdbus_object_path,
+                               sdbus_interface_mgr, "GetUnitByPID", &error,
+                               &msg, "u", pid);
+    // the end hooks get the object path of the unit found
+    if (rc >= 0) {
+        rc = FN_SD_BUS_MESSAGE_READ(msg, "o", &path);
+        op.ev.path = path;
+    }
+    sdwi_op_end(&op, rc);
     if (rc < 0) {
-        LOG_ERROR("failed to issue method call: %s\n", error.message);
+        if (NULL != no_unit && NULL != error.name &&
+            (strcmp(error.name, sdbus_error_no_unit_pid) == 0 ||
+             strcmp(error.name, sdbus_error_esrch) == 0))
+            *no_unit = true;
+        LOG_CALL_ERROR(&op, &error, rc, pid);
         goto cleanup;
     }
 
-    /* Parse the response message */
-    rc = FN_SD_BUS_MESSAGE_READ(msg, response_format, response);
-
-    if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
+    if (NULL == path ||
+        strncmp(path, sdbus_unit_path, sizeof(sdbus_unit_path) - 1) != 0) {
+        LOG_INFO("no unit found for PID '%u'\n", pid);
+        if (NULL != no_unit)
+            *no_unit = true;
+        rc = SDW_EINVAL;
         goto cleanup;
     }
 
-    if (strcmp("s", response_format) == 0) {
-        response->s = strdup(response->s);
-        LOG_INFO("unit property %s: %s\n", property, response->s);
-    } else if (strcmp("u", response_format) == 0) {
-        LOG_INFO("unit property %s: %u\n", property, response->u);
+    // the message owns path, decode it into the caller's buffer
+    rc = sdwi_label_unescape(path + sizeof(sdbus_unit_path) - 1, buf, len);
+    if (0 != rc) {
+        LOG_ERROR("unit name of '%s' exceeds %zu bytes\n", path, len);
+        goto cleanup;
     }
 
+    LOG_INFO("unit '%s' found for PID '%u'\n", buf, pid);
+
 cleanup:
     FN_SD_BUS_ERROR_FREE(&error);
     FN_SD_BUS_MESSAGE_UNREF(msg);
@@ -675,88 +2181,448 @@ cleanup:
     if (rc >= 0)
         return 0;
 
+    if (SDW_ERANGE == rc)
+        return rc;
+
     return SDW_EINVAL;
 }
 
-static int sdwi_sdbus_cmd(const char *unit_name, char **response, sdbus_cmd_t cmd) {
+// EnableUnitFiles asbb or DisableUnitFiles asb of all names in one call,
+// the reply lists a(sss) of the changed links
+static int sdwi_unit_files(bool enable, const char *const *unit_names,
+                           bool runtime, bool force) {
+    const char *member = enable ? "EnableUnitFiles" : "DisableUnitFiles";
     sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg = NULL;
-    char *s = NULL;
-    int r = 0;
-    const char *c, *cmd_str[] = {
-        [SDBUS_START_UNIT] = "StartUnit",
-        [SDBUS_RESTART_UNIT] = "RestartUnit",
-        [SDBUS_STOP_UNIT] = "StopUnit"
-    };
+    sd_bus_message *call = NULL, *msg = NULL;
+    const char *change[3] = { NULL, NULL, NULL };       // a(sss)
+    int inst_info = 0;          // from sd_bus_message_read.3 -> "b" int * (NB not bool *)
+    unit_t unit;
+    size_t n;
+    op_t op;
+    int rc;
 
-    c = cmd_str[cmd];
+    if (NULL == unit_names || NULL == unit_names[0])
+        return SDW_EINVAL;
 
-    LOG_DEBUG("'%s' '%s' '%s' '%s' '%s'\n",
+    for (n = 0; NULL != unit_names[n]; n++) {
+        rc = sdwi_set_unit_name(&unit, unit_names[n]);
+        if (0 != rc)
+            return rc;
+    }
+
+    if (NULL == sdwi_bus())
+        return SDW_EINIT;
+
+    LOG_DEBUG("'%s' '%s' '%s' '%s' '%s' (%zu units) %d %d\n",
               sdbus_service_contact, sdbus_object_path,
-              sdbus_interface_mgr, c, unit_name);
+              sdbus_interface_mgr, member, unit_names[0], n, runtime, force);
+
+    // the journal entry names the unit of a single change only
+    sdwi_op_begin(&op, enable ? SDW_OP_ENABLE : SDW_OP_DISABLE,
+                  1 == n ? unit_names[0] : NULL, NULL, NULL);
+    rc = FN_SD_BUS_MESSAGE_NEW_METHOD_CALL(sdwi_bus(), &call,
+                                           sdbus_service_contact,
+                                           sdbus_object_path,
+                                           sdbus_interface_mgr, member);
+    if (rc >= 0)
+        rc = FN_SD_BUS_MESSAGE_APPEND_STRV(call, (char **) unit_names);
+    if (rc >= 0)
+        rc = enable ? FN_SD_BUS_MESSAGE_APPEND(call, "bb", runtime, force) :
+                      FN_SD_BUS_MESSAGE_APPEND(call, "b", runtime);
+    if (rc >= 0)
+        rc = FN_SD_BUS_CALL(sdwi_bus(), call, 0, &error, &msg);
+    sdwi_op_end(&op, rc);
 
-    r = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                              sdbus_interface_mgr, c, &error, &msg,
-                              "ss", unit_name, "replace");
-    if (r < 0) {
-        LOG_ERROR("%s '%s' - failed: %s\n", c, unit_name, error.message);
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
         goto cleanup;
     }
 
     /* Parse the response message */
-    r = FN_SD_BUS_MESSAGE_READ(msg, "o", &s);
-    if (r < 0 || NULL == s) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-r));
-        goto cleanup;
+    if (enable) {
+        rc = FN_SD_BUS_MESSAGE_READ(msg, "b", &inst_info);
+        if (rc < 0)
+            goto invalid;
     }
 
-    if (response != NULL)
-        *response = strdup(s);
+    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "(sss)");
+    if (rc < 0)
+        goto invalid;
 
-    LOG_INFO("%s: queued service job as %s.\n", c, s);
+    while ((rc = FN_SD_BUS_MESSAGE_READ(msg, "(sss)", &change[0], &change[1],
+                                        &change[2])) > 0)
+        LOG_INFO("%s %d '%s' '%s' '%s'\n", member, inst_info, change[0],
+                 change[1], change[2]);
+    if (rc < 0)
+        goto invalid;
+
+    rc = FN_SD_BUS_MESSAGE_EXIT_CONTAINER(msg);
+    if (rc < 0)
+        goto invalid;
+
+    if (NULL == change[0])
+        LOG_INFO("%s %d, no links changed for %zu units\n", member,
+                 inst_info, n);
+    goto cleanup;
+
+invalid:
+    LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
 
 cleanup:
     FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(call);
     FN_SD_BUS_MESSAGE_UNREF(msg);
 
-    if (r >= 0)
+    if (rc >= 0)
         return 0;
 
     return SDW_EINVAL;
 }
 
-static int sdwi_encode(unit_t *unit) {
-    char *buf = NULL;
-    int l, rc;
+static int sdwi_enable(const char *unit_name, bool runtime, bool force) {
+    const char *names[2] = { unit_name, NULL };
 
-    l = FN_SD_BUS_PATH_ENCODE(sdbus_prefix, unit->name, &buf);
+    return sdwi_unit_files(true, names, runtime, force);
+}
 
-    if (l < 0 || NULL == buf) {
-        LOG_ERROR("failed to encode '%s'\n", unit->name);
-        rc = SDW_EINVAL;
-        goto cleanup;
-    }
+static int sdwi_disable(const char *unit_name, bool runtime) {
+    const char *names[2] = { unit_name, NULL };
 
-    if (strlen(buf) <= (strlen(sdbus_prefix) + 1)) {
-        LOG_ERROR("invalid length of '%s'\n", buf);
-        rc = SDW_EINVAL;
-        goto cleanup;
-    }
-    // skip '<PREFIX>/'
-    strncpy(unit->encoded, (buf + strlen(sdbus_prefix) + 1),
-            sizeof(unit->encoded) - 1);
+    return sdwi_unit_files(false, names, runtime, false);
+}
 
-    LOG_DEBUG("encoded '%s' to '%s'\n", unit->name, unit->encoded);
+static int sdwi_reload_call(void) {
+    int rc = 0;
+    op_t op;
 
-    rc = 0;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *msg = NULL;
+
+    LOG_DEBUG("'%s' '%s' '%s' '%s'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, "Reload");
+
+    sdwi_op_begin(&op, SDW_OP_RELOAD, NULL, NULL, NULL);
+    rc = FN_SD_BUS_CALL_METHOD(sdwi_bus(), sdbus_service_contact, sdbus_object_path,
+                               sdbus_interface_mgr, "Reload", &error, &msg, "");
+    sdwi_op_end(&op, rc);
+
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
+        goto cleanup;
+    }
 
 cleanup:
-    if (NULL != buf)
-        free(buf);
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
+
+    if (rc >= 0)
+        return 0;
+
+    return SDW_EINVAL;
+}
+
+// Reload covering the deferred changes made so far. With pending_only
+// there is none if another thread took them already, and a failure is
+// left to sdw_reload_flush() to report
+static int sdwi_reload(bool pending_only) {
+    uint64_t target;
+    int rc;
+
+    pthread_mutex_lock(&reload.lock);
+    target = reload.seq;
+    if (pending_only && reload.taken == target) {
+        pthread_mutex_unlock(&reload.lock);
+        return 0;
+    }
+    if (reload.taken != target)
+        LOG_INFO("Reload for %" PRIu64 " deferred changes\n",
+                 target - reload.taken);
+    reload.taken = target;
+    pthread_mutex_unlock(&reload.lock);
+
+    rc = sdwi_reload_call();
+
+    pthread_mutex_lock(&reload.lock);
+    if (reload.done < target)
+        reload.done = target;
+    if (pending_only && 0 != rc)
+        reload.failed = true;
+    pthread_cond_broadcast(&reload.done_cond);
+    pthread_mutex_unlock(&reload.lock);
+
+    return rc;
+}
+
+// reloads the changes once their window passed, on its own connection
+static void *sdwi_reload_thread(void *arg) {
+    struct timespec due;
+
+    (void) arg;
+
+    pthread_mutex_lock(&reload.lock);
+
+    for (;;) {
+        while (reload.seq == reload.taken)
+            pthread_cond_wait(&reload.cond, &reload.lock);
+
+        if (sdwi_now_usec() < reload.ts_due) {
+            // changes made while sleeping join this reload
+            due.tv_sec = (time_t) (reload.ts_due / 1000000);
+            due.tv_nsec = (long) (reload.ts_due % 1000000) * 1000L;
+            pthread_mutex_unlock(&reload.lock);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+            pthread_mutex_lock(&reload.lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&reload.lock);
+        sdwi_reload(true);
+        pthread_mutex_lock(&reload.lock);
+    }
+
+    return NULL;
+}
+
+// unit files changed, reload as set by sdw_set_reload_policy()
+static int sdwi_reload_changed(void) {
+    bool deferred;
+
+    // the reload thread can't open a connection of its own then
+    pthread_mutex_lock(&transport_lock);
+    deferred = !transport.one_connection;
+    pthread_mutex_unlock(&transport_lock);
+
+    pthread_mutex_lock(&reload.lock);
+
+    if (SDW_RELOAD_NONE == reload.policy) {
+        pthread_mutex_unlock(&reload.lock);
+        return 0;
+    }
+
+    deferred = deferred && SDW_RELOAD_DEFERRED == reload.policy;
+
+    if (deferred && !reload.thread_started &&
+        sdwi_thread_start(NULL, sdwi_reload_thread, NULL, true) == 0)
+        reload.thread_started = true;
+
+    if (deferred && reload.thread_started) {
+        // the window starts with the first change not yet taken
+        if (reload.seq == reload.taken)
+            reload.ts_due = sdwi_now_usec() + reload.window_ms * 1000ULL;
+        reload.seq++;
+        pthread_cond_signal(&reload.cond);
+        pthread_mutex_unlock(&reload.lock);
+        return 0;
+    }
+
+    // immediate, or deferred without thread or connection of its own
+    pthread_mutex_unlock(&reload.lock);
+
+    return sdwi_reload(false);
+}
+
+// queue the job on bus, the connection that holds the JobRemoved match
+static int sdwi_sdbus_cmd(sd_bus *bus, const char *unit_name, char **response,
+                          sdbus_cmd_t cmd) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *msg = NULL;
+    char *s = NULL;
+    int r = 0;
+    const char *c, *cmd_str[] = {
+        [SDBUS_START_UNIT] = "StartUnit",
+        [SDBUS_RESTART_UNIT] = "RestartUnit",
+        [SDBUS_STOP_UNIT] = "StopUnit"
+    };
+    const int cmd_op[] = {
+        [SDBUS_START_UNIT] = SDW_OP_START_UNIT,
+        [SDBUS_RESTART_UNIT] = SDW_OP_RESTART_UNIT,
+        [SDBUS_STOP_UNIT] = SDW_OP_STOP_UNIT
+    };
+    op_t op;
+
+    c = cmd_str[cmd];
+
+    LOG_DEBUG("'%s' '%s' '%s' '%s' '%s'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, c, unit_name);
+
+    sdwi_op_begin(&op, cmd_op[cmd], unit_name, NULL, NULL);
+    r = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
+                              sdbus_interface_mgr, c, &error, &msg,
+                              "ss", unit_name, "replace");
+    if (r < 0) {
+        LOG_CALL_ERROR(&op, &error, r);
+        goto cleanup;
+    }
+
+    /* Parse the response message */
+    r = FN_SD_BUS_MESSAGE_READ(msg, "o", &s);
+    if (r < 0 || NULL == s) {
+        LOG_ERROR("failed to parse response message: %s\n", strerror(-r));
+        goto cleanup;
+    }
+
+    if (response != NULL)
+        *response = strdup(s);
+
+    LOG_INFO("%s: queued service job as %s.\n", c, s);
+
+cleanup:
+    // s is owned by msg
+    op.ev.job = s;
+    sdwi_op_end(&op, r);
+
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
+
+    if (r >= 0)
+        return 0;
+
+    return SDW_EINVAL;
+}
+
+// copy src to buf like strlcpy(), buf == NULL just discards src
+static int sdwi_strlcpy(char *buf, size_t len, const char *src) {
+    size_t n;
+
+    if (NULL == buf)
+        return 0;
+
+    n = strnlen(src, len);
+    if (n >= len) {
+        if (len > 0)
+            buf[0] = '\0';
+        return SDW_ERANGE;
+    }
+
+    memcpy(buf, src, n + 1);
+
+    return 0;
+}
+
+// hand a result of a *_r getter over to the char ** API
+static int sdwi_strdup_result(int rc, const char *buf, char **ret) {
+    if (rc < 0)
+        return rc;
+
+    *ret = strdup(buf);
+    if (NULL == *ret) {
+        LOG_ERROR("strdup() failed\n");
+        return SDW_EINVAL;
+    }
 
     return rc;
 }
 
+static inline bool sdwi_isalpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline bool sdwi_isdigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline int sdwi_unhex(char c) {
+    if (sdwi_isdigit(c))
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// same escaping as sd_bus_path_encode() but without allocation:
+// everything except [a-zA-Z0-9] becomes _xx, a leading digit as well
+static int sdwi_label_escape(const char *label, char *buf, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *f;
+    size_t n = 0;
+
+    // special case for the empty string
+    if ('\0' == *label)
+        return sdwi_strlcpy(buf, len, "_");
+
+    for (f = label; '\0' != *f; f++) {
+        if (n + 3 >= len) {
+            if (len > 0)
+                buf[0] = '\0';
+            return SDW_ERANGE;
+        }
+
+        if (sdwi_isalpha(*f) || (f > label && sdwi_isdigit(*f))) {
+            buf[n++] = *f;
+        } else {
+            buf[n++] = '_';
+            buf[n++] = hex[(unsigned char) *f >> 4];
+            buf[n++] = hex[(unsigned char) *f & 0xf];
+        }
+    }
+
+    buf[n] = '\0';
+
+    return 0;
+}
+
+// reverse of sdwi_label_escape(), see sd_bus_path_decode()
+static int sdwi_label_unescape(const char *label, char *buf, size_t len) {
+    size_t i, n = 0, l = strlen(label);
+
+    if (1 == l && '_' == label[0])
+        return sdwi_strlcpy(buf, len, "");
+
+    for (i = 0; i < l; i++) {
+        int a, b;
+
+        if (n + 1 >= len) {
+            if (len > 0)
+                buf[0] = '\0';
+            return SDW_ERANGE;
+        }
+
+        if ('_' == label[i] && i + 2 < l &&
+            (a = sdwi_unhex(label[i + 1])) >= 0 &&
+            (b = sdwi_unhex(label[i + 2])) >= 0) {
+            buf[n++] = (char) ((a << 4) | b);
+            i += 2;
+        } else {
+            buf[n++] = label[i];
+        }
+    }
+
+    buf[n] = '\0';
+
+    return 0;
+}
+
+static int sdwi_unit_path(const char *unit_name_encoded,
+                          char *buf, size_t len) {
+    int n = snprintf(buf, len, "%s%s", sdbus_unit_path, unit_name_encoded);
+
+    if (n < 0 || (size_t) n >= len) {
+        LOG_ERROR("unit path of '%s' exceeds %zu bytes\n",
+                  unit_name_encoded, len);
+        return SDW_EINVAL;
+    }
+
+    return 0;
+}
+
+static int sdwi_encode(unit_t *unit) {
+    int rc;
+
+    rc = sdwi_label_escape(unit->name, unit->encoded, sizeof(unit->encoded));
+    if (0 != rc) {
+        LOG_ERROR("failed to encode '%s'\n", unit->name);
+        return SDW_EINVAL;
+    }
+
+    LOG_DEBUG("encoded '%s' to '%s'\n", unit->name, unit->encoded);
+
+    return 0;
+}
+
 static int sdwi_decode(unit_t *unit) {
     char *buf = NULL;
     char *path = NULL;
@@ -811,731 +2677,3128 @@ static int sdwi_notify(int flag, const char *msg) {
     return 0;
 }
 
-static int sdwi_set_unit_name(unit_t *unit, const char *unit_name) {
+static uint64_t sdwi_now_usec(void) {
+    struct timespec ts;
 
-    if (NULL == unit_name) {
-        LOG_ERROR("invalid unit name 'NULL'\n");
-        return SDW_EINVAL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// start a thread of the library, tid may be NULL if detached. The thread
+// must not receive signals meant for the application, it starts with all
+// of them blocked. Returns the rc of pthread_create()
+static int sdwi_thread_start(pthread_t *tid, void *(*fn)(void *), void *arg,
+                             bool detached) {
+    pthread_attr_t attr;
+    pthread_t t;
+    sigset_t all, old;
+    int rc;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_init(&attr);
+    if (detached)
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rc = pthread_create(NULL != tid ? tid : &t, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (0 != rc)
+        LOG_ERROR("pthread_create() failed: %s\n", strerror(rc));
+
+    return rc;
+}
+
+static void sdwi_op_begin(op_t *op, int type, const char *unit,
+                          const char *path, const char *member) {
+    sdw_trace_hook_t begin = __atomic_load_n(&trace_hooks.begin,
+                                             __ATOMIC_ACQUIRE);
+
+    memset(&op->ev, 0, sizeof(op->ev));
+    op->ev.op = type;
+    op->ev.unit = unit;
+    op->ev.path = path;
+    op->ev.member = member;
+
+    SDWI_PROBE_BEGIN(&op->ev);
+
+    if (NULL != begin)
+        begin(&op->ev, __atomic_load_n(&trace_hooks.userdata,
+                                       __ATOMIC_RELAXED));
+
+    // the begin hook is not part of the latency
+    op->ts_begin = sdwi_now_usec();
+}
+
+// report the operation to the probe and the end hook and account it in
+// op_stats, rc < 0 counts as error; the counters are independent
+// relaxed atomics, no lock on the call path
+static void sdwi_op_end(op_t *op, int rc) {
+    sdw_op_stats_t *st = &op_stats[op->ev.op];
+    sdw_trace_hook_t end = __atomic_load_n(&trace_hooks.end,
+                                           __ATOMIC_ACQUIRE);
+    uint64_t usec = sdwi_now_usec() - op->ts_begin;
+    uint64_t max;
+    unsigned bucket;
+
+    op->ev.duration_usec = usec;
+    op->ev.rc = rc;
+
+    SDWI_PROBE_END(&op->ev);
+
+    if (NULL != end)
+        end(&op->ev, __atomic_load_n(&trace_hooks.userdata,
+                                     __ATOMIC_RELAXED));
+
+    if (__atomic_load_n(&journal_sink.flags, __ATOMIC_RELAXED) &
+        SDW_JOURNAL_OPS)
+        sdwi_journal_op(&op->ev);
+
+    // floor(log2(usec)), 0 and 1 usec go to bucket 0
+    bucket = 63 - __builtin_clzll(usec | 1);
+    if (bucket >= SDW_STATS_BUCKETS)
+        bucket = SDW_STATS_BUCKETS - 1;
+
+    __atomic_fetch_add(&st->calls, 1, __ATOMIC_RELAXED);
+    if (rc < 0)
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->total_usec, usec, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->hist[bucket], 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&st->max_usec, __ATOMIC_RELAXED);
+    while (usec > max &&
+           !__atomic_compare_exchange_n(&st->max_usec, &max, usec, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// calculate the earliest time for the next STATUS= message
+// return true if that time has already passed
+static bool sdwi_status_due(struct timespec *due) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    due->tv_sec = status_pub.ts_sent.tv_sec + status_pub.interval_ms / 1000;
+    due->tv_nsec = status_pub.ts_sent.tv_nsec +
+        (long) (status_pub.interval_ms % 1000) * 1000000L;
+    if (due->tv_nsec >= 1000000000L) {
+        due->tv_sec++;
+        due->tv_nsec -= 1000000000L;
     }
-    // just check the length of the unit name
 
-    if (strnlen(unit_name, MAX_UNIT_NAME_LEN + 2) >= MAX_UNIT_NAME_LEN) {
-        LOG_ERROR("invalid unit name '%s'\n", unit_name);
+    return now.tv_sec > due->tv_sec ||
+        (now.tv_sec == due->tv_sec && now.tv_nsec >= due->tv_nsec);
+}
+
+// send the pending status, status_pub.lock must be held
+static int sdwi_status_send(void) {
+    char msg[MAX_STATUS_LEN + sizeof("STATUS=")];
+    int rc;
+
+    snprintf(msg, sizeof(msg), "STATUS=%s", status_pub.next);
+
+    rc = sdwi_notify(0, msg);
+    if (0 == rc)
+        memcpy(status_pub.last, status_pub.next, sizeof(status_pub.last));
+
+    // a failed send is not retried, the next update gets a new chance
+    status_pub.pending = false;
+    clock_gettime(CLOCK_MONOTONIC, &status_pub.ts_sent);
+
+    return rc;
+}
+
+// flusher thread, sends the latest coalesced value as soon as the
+// rate limit allows it
+static void *sdwi_status_thread(void *arg) {
+    struct timespec due;
+
+    (void) arg;
+
+    pthread_mutex_lock(&status_pub.lock);
+
+    for (;;) {
+        while (!status_pub.pending)
+            pthread_cond_wait(&status_pub.cond, &status_pub.lock);
+
+        if (!sdwi_status_due(&due)) {
+            // updates published while sleeping overwrite next[]
+            pthread_mutex_unlock(&status_pub.lock);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+            pthread_mutex_lock(&status_pub.lock);
+            continue;
+        }
+
+        sdwi_status_send();
+    }
+
+    return NULL;
+}
+
+// start the flusher thread, status_pub.lock must be held
+static int sdwi_status_start_thread(void) {
+    if (status_pub.thread_started)
+        return 0;
+
+    if (sdwi_thread_start(NULL, sdwi_status_thread, NULL, true) != 0)
         return SDW_EINVAL;
+
+    status_pub.thread_started = true;
+
+    return 0;
+}
+
+// hand a record to the user callback or write it to stdout/stderr
+static void sdwi_log_write(int level, const char *msg) {
+    sdw_log_fn_t fn = __atomic_load_n(&log_backend.fn, __ATOMIC_ACQUIRE);
+
+    if (NULL != fn) {
+        fn(level, msg, __atomic_load_n(&log_backend.userdata,
+                                       __ATOMIC_RELAXED));
+        return;
+    }
+
+    if (__atomic_load_n(&journal_sink.flags, __ATOMIC_RELAXED) &
+        SDW_JOURNAL_LOG) {
+        sdwi_journal_log(level, msg);
+        return;
+    }
+
+    fputs(msg, SDW_LOG_ERROR == level ? stderr : stdout);
+}
+
+static void sdwi_log(int level, const char *fmt, ...) {
+    char msg[LOG_MSG_LEN];
+    log_ring_t *ring;
+    unsigned head, tail;
+    va_list ap;
+
+    va_start(ap, fmt);
+
+    if (!__atomic_load_n(&log_backend.async, __ATOMIC_RELAXED) ||
+        NULL == (ring = sdwi_log_ring())) {
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        sdwi_log_write(level, msg);
+        return;
+    }
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= LOG_RING_SIZE) {
+        // never block the caller, the drain reports the loss
+        __atomic_fetch_add(&log_backend.dropped, 1, __ATOMIC_RELAXED);
+    } else {
+        ring->rec[head & (LOG_RING_SIZE - 1)].level = level;
+        vsnprintf(ring->rec[head & (LOG_RING_SIZE - 1)].msg, LOG_MSG_LEN,
+                  fmt, ap);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
     }
 
-    strncpy(unit->name, unit_name, sizeof(unit->name) - 1);
+    va_end(ap);
+}
+
+// thread exit, the ring stays in the list and is reused by a new thread
+static void sdwi_log_ring_release(void *ring) {
+    __atomic_store_n(&((log_ring_t *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void sdwi_log_ring_key(void) {
+    pthread_key_create(&log_ring_key, sdwi_log_ring_release);
+}
+
+// ring of the calling thread, NULL if none can be allocated
+static log_ring_t *sdwi_log_ring(void) {
+    log_ring_t *ring;
+    int unused = 0;
+
+    if (NULL != log_ring)
+        return log_ring;
+
+    pthread_once(&log_ring_once, sdwi_log_ring_key);
+
+    // reuse the ring of a finished thread, pending records stay in order
+    ring = __atomic_load_n(&log_backend.rings, __ATOMIC_ACQUIRE);
+    for (; NULL != ring; ring = ring->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (NULL == ring) {
+        ring = (log_ring_t *) calloc(1, sizeof(log_ring_t));
+        if (NULL == ring)
+            return NULL;
+
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&log_backend.rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_backend.rings, &ring->next,
+                                            ring, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(log_ring_key, ring);
+    log_ring = ring;
+
+    return ring;
+}
+
+// write all pending records, log_backend.lock must be held
+static void sdwi_log_drain(void) {
+    log_ring_t *ring;
+    uint64_t dropped;
+    unsigned head, tail;
+    char msg[64];
+
+    ring = __atomic_load_n(&log_backend.rings, __ATOMIC_ACQUIRE);
+    for (; NULL != ring; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        for (tail = ring->tail; tail != head; tail++)
+            sdwi_log_write(ring->rec[tail & (LOG_RING_SIZE - 1)].level,
+                           ring->rec[tail & (LOG_RING_SIZE - 1)].msg);
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    dropped = __atomic_exchange_n(&log_backend.dropped, 0, __ATOMIC_RELAXED);
+    if (0 != dropped) {
+        snprintf(msg, sizeof(msg), "sdwi_log_drain: %" PRIu64
+                 " records dropped\n", dropped);
+        sdwi_log_write(SDW_LOG_ERROR, msg);
+    }
+}
+
+static void *sdwi_log_thread(void *arg) {
+    struct timespec ts = { 0, LOG_DRAIN_MS * 1000000L };
+
+    (void) arg;
+
+    pthread_mutex_lock(&log_backend.lock);
+
+    while (!log_backend.stop) {
+        sdwi_log_drain();
+
+        pthread_mutex_unlock(&log_backend.lock);
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&log_backend.lock);
+    }
+
+    sdwi_log_drain();
+
+    pthread_mutex_unlock(&log_backend.lock);
+
+    return NULL;
+}
+
+// record the failed call without formatting it, D-Bus error names and
+// unit names are copied, the message of the error is dropped
+static void sdwi_error_call(const char *func, const op_t *op,
+                            const sd_bus_error *error, int rc,
+                            uint32_t pid) {
+    const char *unit = NULL != op->ev.unit ? op->ev.unit : op->ev.path;
+
+    last_error.pending = true;
+    last_error.func = func;
+    last_error.op = op->ev.op;
+    last_error.errnum = -rc;
+    last_error.pid = pid;
+    last_error.member = op->ev.member;
+
+    if (NULL == error->name ||
+        0 != sdwi_strlcpy(last_error.bus_error, sizeof(last_error.bus_error),
+                          error->name))
+        last_error.bus_error[0] = '\0';
+
+    if (NULL == unit ||
+        0 != sdwi_strlcpy(last_error.unit, sizeof(last_error.unit), unit))
+        last_error.unit[0] = '\0';
+
+    if (__atomic_load_n(&log_errors, __ATOMIC_RELAXED)) {
+        sdwi_error_format();
+        sdwi_log(SDW_LOG_ERROR, "%s", last_error_msg);
+    }
+}
+
+// format last_error into last_error_msg
+static void sdwi_error_format(void) {
+    char unit[MAX_UNIT_NAME_LEN];
+    const char *u = last_error.unit;
+    size_t n = sizeof(sdbus_unit_path) - 1;
+    char pid[16];
+    int len;
+
+    last_error.pending = false;
+
+    // property reads record the object path, show the unit name
+    if (strncmp(u, sdbus_unit_path, n) == 0 &&
+        0 == sdwi_label_unescape(u + n, unit, sizeof(unit)))
+        u = unit;
+
+    if (0 != last_error.pid)
+        snprintf(pid, sizeof(pid), " '%" PRIu32 "'", last_error.pid);
+
+    // long D-Bus error names may be cut, the message stays terminated
+    len = snprintf(last_error_msg, sizeof(last_error_msg),
+                   "%s: %s%s%s%s%s%s%s - failed: %s%s%s%s\n",
+                   last_error.func, sdw_op_name(last_error.op),
+                   NULL != last_error.member ? " " : "",
+                   NULL != last_error.member ? last_error.member : "",
+                   '\0' != u[0] ? " '" : "", u, '\0' != u[0] ? "'" : "",
+                   0 != last_error.pid ? pid : "", last_error.bus_error,
+                   '\0' != last_error.bus_error[0] ? " (" : "",
+                   strerror(last_error.errnum),
+                   '\0' != last_error.bus_error[0] ? ")" : "");
+    if (len >= (int) sizeof(last_error_msg))
+        last_error_msg[sizeof(last_error_msg) - 2] = '\n';
+}
+
+// claim a queue slot, NULL if rate limited or full,
+// journal_sink.lock must be held
+static journal_entry_t *sdwi_journal_entry(int priority) {
+    journal_entry_t *entry;
+    uint64_t now = sdwi_now_usec();
+
+    if (now - journal_sink.ts_window >= JOURNAL_INTERVAL_MS * 1000ULL) {
+        journal_sink.ts_window = now;
+        journal_sink.n_window = 0;
+    }
+
+    if (NULL == journal_sink.queue ||
+        journal_sink.n_window >= JOURNAL_BURST ||
+        journal_sink.n_queued >= JOURNAL_QUEUE_LEN) {
+        journal_sink.suppressed++;
+        return NULL;
+    }
+
+    journal_sink.n_window++;
+    entry = &journal_sink.queue[journal_sink.n_queued++];
+    entry->unit[0] = '\0';
+    entry->job[0] = '\0';
+    entry->msg[0] = '\0';
+    entry->priority = priority;
+    entry->op = -1;
+
+    // wake the journal thread early if the batch fills up
+    if (journal_sink.n_queued == JOURNAL_QUEUE_LEN / 2)
+        pthread_cond_signal(&journal_sink.cond);
+
+    return entry;
+}
+
+static void sdwi_journal_log(int level, const char *msg) {
+    static const int priority[] = {
+        [SDW_LOG_ERROR] = 3, [SDW_LOG_INFO] = 6, [SDW_LOG_DEBUG] = 7
+    };
+    journal_entry_t *entry;
+
+    if (level < SDW_LOG_ERROR || level > SDW_LOG_DEBUG)
+        level = SDW_LOG_DEBUG;
+
+    pthread_mutex_lock(&journal_sink.lock);
+
+    entry = sdwi_journal_entry(priority[level]);
+    if (NULL != entry)
+        sdwi_strlcpy(entry->msg, sizeof(entry->msg), msg);
+
+    pthread_mutex_unlock(&journal_sink.lock);
+}
+
+static void sdwi_journal_op(const sdw_trace_event_t *ev) {
+    journal_entry_t *entry;
+    size_t n = sizeof(sdbus_unit_path) - 1;
+
+    pthread_mutex_lock(&journal_sink.lock);
+
+    entry = sdwi_journal_entry(ev->rc < 0 ? 3 : 6);
+    if (NULL == entry)
+        goto cleanup;
+
+    entry->op = ev->op;
+    entry->rc = ev->rc;
+    entry->duration_usec = ev->duration_usec;
+
+    if (NULL != ev->unit)
+        sdwi_strlcpy(entry->unit, sizeof(entry->unit), ev->unit);
+    else if (NULL != ev->path && strncmp(ev->path, sdbus_unit_path, n) == 0)
+        sdwi_label_unescape(ev->path + n, entry->unit, sizeof(entry->unit));
+
+    if (NULL != ev->job)
+        sdwi_strlcpy(entry->job, sizeof(entry->job), ev->job);
+    else if (SDW_OP_JOB_WAIT == ev->op && NULL != ev->path)
+        sdwi_strlcpy(entry->job, sizeof(entry->job), ev->path);
+
+    // a long unit name is cut here, UNIT= has all of it
+    snprintf(entry->msg, sizeof(entry->msg), "%s%s%.128s%s%s %s after %"
+             PRIu64 "us", sdw_op_name(ev->op), entry->unit[0] ? " " : "",
+             entry->unit, NULL != ev->member ? " " : "",
+             NULL != ev->member ? ev->member : "",
+             ev->rc < 0 ? "failed" : "done", ev->duration_usec);
+
+cleanup:
+    pthread_mutex_unlock(&journal_sink.lock);
+}
+
+static void sdwi_journal_send(const journal_entry_t *entry) {
+    char field[7][JOURNAL_FIELD_LEN];
+    struct iovec iov[7];
+    int n = 0;
+    size_t len;
+
+    // MESSAGE= without the trailing newline of the log records
+    len = strnlen(entry->msg, sizeof(entry->msg));
+    if (len > 0 && '\n' == entry->msg[len - 1])
+        len--;
+    snprintf(field[n++], JOURNAL_FIELD_LEN, "MESSAGE=%.*s", (int) len,
+             entry->msg);
+    snprintf(field[n++], JOURNAL_FIELD_LEN, "PRIORITY=%d", entry->priority);
+
+    if (entry->op >= 0) {
+        snprintf(field[n++], JOURNAL_FIELD_LEN, "OPERATION=%s",
+                 sdw_op_name(entry->op));
+        snprintf(field[n++], JOURNAL_FIELD_LEN, "DURATION_USEC=%" PRIu64,
+                 entry->duration_usec);
+        snprintf(field[n++], JOURNAL_FIELD_LEN, "SDW_RC=%d", entry->rc);
+    }
+
+    // the journal rejects empty fields
+    if ('\0' != entry->unit[0])
+        snprintf(field[n++], JOURNAL_FIELD_LEN, "UNIT=%s", entry->unit);
+    if ('\0' != entry->job[0])
+        snprintf(field[n++], JOURNAL_FIELD_LEN, "JOB=%s", entry->job);
+
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = field[i];
+        iov[i].iov_len = strnlen(field[i], JOURNAL_FIELD_LEN);
+    }
+
+    FN_SD_JOURNAL_SENDV(iov, n);
+}
+
+// send the queued entries every JOURNAL_FLUSH_MS or when half full,
+// the last ones once stopped
+static void *sdwi_journal_thread(void *arg) {
+    journal_entry_t *batch;
+    journal_entry_t note;
+    struct timespec ts;
+    uint64_t suppressed;
+    unsigned i, n;
+    bool stop;
+
+    (void) arg;
+
+    pthread_mutex_lock(&journal_sink.lock);
+
+    for (;;) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += JOURNAL_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (!journal_sink.stop)
+            pthread_cond_timedwait(&journal_sink.cond, &journal_sink.lock,
+                                   &ts);
+
+        // swap the buffers, the callers continue on the empty one,
+        // sdw_journal_flush() waits until this batch is sent
+        batch = journal_sink.queue;
+        journal_sink.queue = journal_sink.batch;
+        journal_sink.batch = batch;
+        n = journal_sink.n_queued;
+        journal_sink.n_queued = 0;
+        suppressed = journal_sink.suppressed;
+        journal_sink.suppressed = 0;
+        journal_sink.sending = true;
+        stop = journal_sink.stop;
+
+        pthread_mutex_unlock(&journal_sink.lock);
+
+        for (i = 0; i < n; i++)
+            sdwi_journal_send(&batch[i]);
+
+        if (0 != suppressed) {
+            memset(&note, 0, sizeof(note));
+            note.priority = 4;
+            note.op = -1;
+            snprintf(note.msg, sizeof(note.msg),
+                     "%" PRIu64 " entries suppressed by the rate limit",
+                     suppressed);
+            sdwi_journal_send(&note);
+        }
+
+        pthread_mutex_lock(&journal_sink.lock);
+        journal_sink.sending = false;
+        pthread_cond_broadcast(&journal_sink.sent);
+
+        if (stop)
+            break;
+    }
+
+    pthread_mutex_unlock(&journal_sink.lock);
+
+    return NULL;
+}
+
+static int sdwi_set_unit_name(unit_t *unit, const char *unit_name) {
+
+    if (NULL == unit_name) {
+        LOG_ERROR("invalid unit name 'NULL'\n");
+        return SDW_EINVAL;
+    }
+    // just check the length of the unit name
+
+    if (strnlen(unit_name, MAX_UNIT_NAME_LEN + 2) >= MAX_UNIT_NAME_LEN) {
+        LOG_ERROR("invalid unit name '%s'\n", unit_name);
+        return SDW_EINVAL;
+    }
+
+    strncpy(unit->name, unit_name, sizeof(unit->name) - 1);
+
+    return 0;
+
+}
+
+// the match, the call and the wait of a job use one connection: a
+// transport switch or a closed peer makes sdwi_bus() open a new one,
+// which would never see JobRemoved of the job
+static int sdwi_job_prepare(job_info_t *job, const char *unit_name) {
+    sd_bus *b;
+    int rc = 0;
+
+    sdwi_strlcpy(job->unit, sizeof(job->unit), unit_name);
+    job->status = JOB_UNKNOWN;
+    job->ts_end = time(NULL) + job->wait_sec;
+    job->bus = NULL;
+    job->slot = NULL;
+    job->path = NULL;
+    job->result = SDW_JOB_RESULT_UNKNOWN;
+
+    b = sdwi_bus();
+    if (NULL == b)
+        return SDW_EINIT;
+    job->bus = FN_SD_BUS_REF(b);
+
+    rc = FN_SD_BUS_ADD_MATCH(job->bus, &job->slot, sdbus_match,
+                             sdwi_msg_handler, (void *) job);
+
+    if (rc < 0) {
+        LOG_ERROR("sd_bus_add_match(,,%s,,) failed, (rc=%d,%s)\n", sdbus_match,
+                  rc, strerror(-rc));
+        return SDW_EINVAL;
+    }
+
+    LOG_INFO("sd_bus_add_match(,,%s,,)  (rc=%d)\n", sdbus_match, rc);
+
+    return 0;
+}
+
+static int sdwi_job_wait(job_info_t *job) {
+    sd_bus *b = job->bus;
+    op_t op;
+    int rc = 0;
+
+    LOG_INFO("waiting %us for job %s to finish\n", job->wait_sec, job->path);
+
+    sdwi_op_begin(&op, SDW_OP_JOB_WAIT, job->unit, job->path, NULL);
+
+    while (JOB_UNKNOWN == job->status) {
+        time_t ts_now = time(NULL);
+        uint64_t wait_usec;
+
+        if (FN_SD_BUS_IS_OPEN(b) <= 0) {
+            LOG_ERROR("connection closed while waiting for job %s\n",
+                      job->path);
+            rc = SDW_EINIT;
+            goto cleanup;
+        }
+
+        if (job->ts_end > ts_now) {
+            // usec waittime for sd_bus_wait
+            wait_usec = (uint64_t) 1000 *1000 * (job->ts_end - ts_now);
+        } else {
+            // expired without finished job
+            LOG_INFO("wait time %u expired for job %s\n", job->wait_sec,
+                     job->path);
+            rc = SDW_ETIMEOUT;
+            goto cleanup;
+        }
+
+        // wait for I/O on sdbus
+        rc = FN_SD_BUS_WAIT(b, wait_usec);
+        if (rc < 0) {
+            LOG_ERROR("sd_bus_wait failed %s\n", strerror(-rc));
+            rc = SDW_EINVAL;
+            goto cleanup;
+        }
+        // call the sdbus lib for handover to the callback
+        rc = FN_SD_BUS_PROCESS(b, NULL);
+        if (rc < 0) {
+            LOG_ERROR("sd_bus_process failed %s\n", strerror(-rc));
+            rc = SDW_EINVAL;
+            goto cleanup;
+        }
+    }
+
+    rc = (JOB_DONE == job->status) ? 0 : SDW_EINVAL;
+
+cleanup:
+    sdwi_op_end(&op, rc);
+
+    return rc;
+}
+
+static void sdwi_job_remove(job_info_t *job) {
+    if (NULL != job->path)
+        free(job->path);
+
+    if (NULL != job->slot)
+        FN_SD_BUS_SLOT_UNREF(job->slot);
+
+    if (NULL != job->bus)
+        FN_SD_BUS_UNREF(job->bus);
+}
+
+static int sdwi_msg_handler(sd_bus_message *msg,
+                                void *userdata, sd_bus_error *error) {
+    const char *path, *unit, *result;
+    uint32_t id;
+    int rc;
+    job_info_t *job = (job_info_t *) userdata;
+
+    if (NULL == job) {
+        LOG_ERROR("invalid job (NULL)\n");
+        return 0;
+    }
+
+    if (NULL == job->path) {
+        LOG_ERROR("invalid job->path (NULL)\n");
+        return 0;
+    }
+
+    rc = FN_SD_BUS_MESSAGE_READ(msg, "uoss", &id, &path, &unit, &result);
+    if (rc < 0) {
+        LOG_ERROR("%s\n", error->message);
+        return 0;
+    }
+
+    LOG_INFO("id: %u, path: '%s', unit: '%s', result: '%s'\n", id, path, unit,
+             result);
+
+    // the job.path must be checked because we don't want to process signals from other jobs
+
+    if (strcmp(job->path, path) != 0) {
+        LOG_INFO("'%s' ignore signal for %u result: '%s'\n", job->path, id,
+                 result);
+        return 0;
+    }
+
+    job->result = job_result_hash_t::lookup(result, SDW_JOB_RESULT_UNKNOWN);
+
+    // like check_wait_response of systemctl 'done' and 'skipped' are
+    // successful, any other result maps to JOB_FAILED
+    switch (job->result) {
+        case SDW_JOB_RESULT_DONE:
+        case SDW_JOB_RESULT_SKIPPED:
+            {
+                LOG_INFO("job '%s' finished with '%s'\n", path, result);
+                job->status = JOB_DONE;
+                break;
+            }
+        default:
+            {
+                LOG_ERROR("job '%s' canceled with '%s'\n", path, result);
+                job->status = JOB_FAILED;
+                break;
+            }
+    }
+
+    return 0;
+}
+
+static int sdwi_get_unitfilestate(const char *unit_name,
+                                  char *buf, size_t len) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *msg = NULL;
+    const char *response = NULL;
+    int rc = 0;
+    const char *cmd = "GetUnitFileState";
+    op_t op;
+
+    LOG_INFO("'%s' '%s' '%s' '%s' '%s'\n",
+             sdbus_service_contact, sdbus_object_path,
+             sdbus_interface_mgr, cmd, unit_name);
+
+    sdwi_op_begin(&op, SDW_OP_GET_FILE_STATE, unit_name, NULL, NULL);
+    rc = FN_SD_BUS_CALL_METHOD(sdwi_bus(), sdbus_service_contact, sdbus_object_path,
+                               sdbus_interface_mgr, cmd, &error, &msg,
+                               "s", unit_name);
+    sdwi_op_end(&op, rc);
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
+        goto cleanup;
+    }
+
+    rc = FN_SD_BUS_MESSAGE_READ(msg, "s", &response);
+    if (rc < 0) {
+        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
+        goto cleanup;
+    }
+
+    LOG_INFO("unit file state: %s.\n", response);
+
+    // the message owns response
+    rc = sdwi_strlcpy(buf, len, response);
+    if (0 != rc) {
+        LOG_ERROR("unit file state '%s' exceeds %zu bytes\n", response, len);
+        goto cleanup;
+    }
+
+    if (strcmp(response, "enabled") == 0)
+        rc = SDW_UNIT_FILE_STAT_ENABLED;
+
+    else if (strcmp(response, "disabled") == 0)
+        rc = SDW_UNIT_FILE_STAT_DISABLED;
+
+cleanup:
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
+
+    if (rc >= 0)
+        return rc;
+
+    if (SDW_ERANGE == rc)
+        return rc;
+
+    return SDW_EINVAL;
+}
+
+static int sdwi_get_activestate(const unit_t *unit,
+                                char *buf, size_t len) {
+    char state[MAX_RESPONSE_LEN];
+    strbuf_t response = { state, sizeof(state) };
+    int rc;
+
+    rc = sdwi_read_unit_property<prop_active_state>(unit, &response);
+    if (0 != rc)
+        return rc;
+
+    rc = sdwi_strlcpy(buf, len, state);
+    if (0 != rc)
+        return rc;
+
+    return active_state_hash_t::lookup(state, SDW_UNIT_ACTIVE_STAT_UNKNOWN);
+}
+
+static int sdwi_get_substate(const unit_t *unit,
+                             char *buf, size_t len) {
+    char state[MAX_RESPONSE_LEN];
+    strbuf_t response = { state, sizeof(state) };
+    int rc;
+
+    rc = sdwi_read_unit_property<prop_sub_state>(unit, &response);
+    if (0 != rc)
+        return rc;
+
+    rc = sdwi_strlcpy(buf, len, state);
+    if (0 != rc)
+        return rc;
+
+    return sub_state_hash_t::lookup(state, SDW_UNIT_SUB_STAT_UNKNOWN);
+}
+
+static int sdwi_get_loadstate(const unit_t *unit,
+                              char *buf, size_t len) {
+    char state[MAX_RESPONSE_LEN];
+    strbuf_t response = { state, sizeof(state) };
+    int rc;
+
+    rc = sdwi_read_unit_property<prop_load_state>(unit, &response);
+    if (0 != rc)
+        return rc;
+
+    rc = sdwi_strlcpy(buf, len, state);
+    if (0 != rc)
+        return rc;
+
+    return load_state_hash_t::lookup(state, SDW_UNIT_LOAD_STAT_UNKNOWN);
+}
+
+/* external functions */
+
+int sdw_start(const char *unit_name, unsigned wait_sec) {
+    int rc;
+    job_info_t job;
+    char *response = NULL;
+
+    job.cmd = SDBUS_START_UNIT;
+    job.wait_sec = wait_sec;
+
+    // async call
+    if (0 == wait_sec)
+        return sdwi_sdbus_cmd(sdwi_bus(), unit_name, NULL, job.cmd);
+
+    // sync call:
+    // - register for message on sdbus
+    // - start the unit
+    // - wait for final job status
+    rc = sdwi_job_prepare(&job, unit_name);
+    if (rc != 0)
+        goto cleanup;
+
+    rc = sdwi_sdbus_cmd(job.bus, unit_name, &response, job.cmd);
+    job.path = response;
+
+    if (rc != 0)
+        goto cleanup;
+
+    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+
+    rc = sdwi_job_wait(&job);
+
+cleanup:
+    sdwi_job_remove(&job);
+
+    return rc;
+}
+
+int sdw_restart(const char *unit_name, unsigned wait_sec) {
+    int rc;
+    job_info_t job;
+    char *response = NULL;
+
+    job.cmd = SDBUS_RESTART_UNIT;
+    job.wait_sec = wait_sec;
+
+    // async call
+    if (0 == wait_sec)
+        return sdwi_sdbus_cmd(sdwi_bus(), unit_name, NULL, job.cmd);
+
+    // sync call:
+    // - register for message on sdbus
+    // - restart the unit
+    // - wait for final job status
+    rc = sdwi_job_prepare(&job, unit_name);
+    if (rc != 0)
+        goto cleanup;
+
+    rc = sdwi_sdbus_cmd(job.bus, unit_name, &response, job.cmd);
+    job.path = response;
+
+    if (rc != 0)
+        goto cleanup;
+
+    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+
+    rc = sdwi_job_wait(&job);
+
+cleanup:
+    sdwi_job_remove(&job);
+
+    return rc;
+}
+
+int sdw_stop(const char *unit_name, unsigned wait_sec) {
+    int rc;
+    job_info_t job;
+    char *response = NULL;
+
+    job.cmd = SDBUS_STOP_UNIT;
+    job.wait_sec = wait_sec;
+
+    // async call
+    if (0 == wait_sec)
+        return sdwi_sdbus_cmd(sdwi_bus(), unit_name, NULL, job.cmd);
+
+    // sync call:
+    // - register for message on sdbus
+    // - stop the unit
+    // - wait for final job status
+    rc = sdwi_job_prepare(&job, unit_name);
+    if (rc != 0)
+        goto cleanup;
+
+    rc = sdwi_sdbus_cmd(job.bus, unit_name, &response, job.cmd);
+    job.path = response;
+
+    if (rc != 0)
+        goto cleanup;
+
+    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+
+    rc = sdwi_job_wait(&job);
+
+cleanup:
+    sdwi_job_remove(&job);
+
+    return rc;
+}
+
+int sdw_get_version_r(char *buf, size_t len) {
+    strbuf_t response = { buf, len };
+
+    if (NULL == buf)
+        return SDW_EINVAL;
+
+    return sdwi_read_property<prop_version>(NULL, sdbus_object_path, &response);
+}
+
+int sdw_get_version(char **ret_version) {
+    char version[MAX_RESPONSE_LEN];
+
+    if (NULL == ret_version)
+        return SDW_EINVAL;
+
+    *ret_version = NULL;
+
+    return sdwi_strdup_result(sdw_get_version_r(version, sizeof(version)),
+                              version, ret_version);
+}
+
+int sdw_get_unitfilestate_r(const char *unit_name, char *buf, size_t len) {
+    return sdwi_get_unitfilestate(unit_name, buf, len);
+}
+
+int sdw_get_unitfilestate(const char *unit_name, char **ret_state) {
+    char state[MAX_RESPONSE_LEN];
+    int rc;
+
+    if (NULL == ret_state)
+        return sdwi_get_unitfilestate(unit_name, NULL, 0);
+
+    *ret_state = NULL;
+
+    rc = sdwi_get_unitfilestate(unit_name, state, sizeof(state));
+
+    return sdwi_strdup_result(rc, state, ret_state);
+}
+
+int sdw_check_pid(const char *unit_name, unsigned pid) {
+    unit_t unit;
+    char name[MAX_UNIT_NAME_LEN];
+    int rc;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    if (0 == pid)
+        pid = (unsigned) getpid();
+
+    rc = sdwi_get_unit_by_pid(pid, name, sizeof(name));
+    if (0 != rc)
+        return SDW_EINVAL;
+
+    if (strcmp(name, unit.name) != 0) {
+        LOG_INFO("PID '%u' belongs to unit '%s', not '%s'\n", pid, name,
+                 unit.name);
+        return SDW_EINVAL;
+    }
+
+    LOG_INFO("unit '%s' found for PID '%u'\n", unit_name, pid);
+
+    return 0;
+}
+
+int sdw_check_controlpid(const char *unit_name, unsigned pid) {
+    uint32_t ctrl_pid = ~0U;
+    int rc;
+
+    rc = sdwi_get_unit_property<prop_control_pid>(unit_name, &ctrl_pid);
+    if (rc != 0)
+        return rc;
+
+    if (ctrl_pid != pid) {
+        LOG_INFO("ControlPID %u != PID %u\n", ctrl_pid, pid);
+        return SDW_EINVAL;
+    }
+
+    LOG_INFO("ControlPID %u == PID %u\n", ctrl_pid, pid);
+    return 0;
+}
+
+int sdw_get_mainpid(const char *unit_name, unsigned *pid) {
+    uint32_t value = 0;
+    int rc;
+
+    if (NULL == pid)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_main_pid>(unit_name, &value);
+    *pid = value;
+
+    return rc;
+}
+
+int sdw_get_mainpid_fd(const char *unit_name, unsigned *pid, int *pidfd) {
+    uint32_t before, after;
+    bool exited = false;
+    int fd, rc;
+
+    if (NULL == pidfd)
+        return SDW_EINVAL;
+
+    *pidfd = -1;
+    if (NULL != pid)
+        *pid = 0;
+
+    // the manager reaps the main process before it changes MainPID, its
+    // PID cannot be reused while MainPID still names it
+    for (int attempt = 0; attempt < PIDFD_ATTEMPTS; attempt++) {
+        before = 0;
+        rc = sdwi_get_unit_property<prop_main_pid>(unit_name, &before);
+        if (0 != rc)
+            return rc;
+
+        if (0 == before) {
+            LOG_INFO("unit '%s' has no main process\n", unit_name);
+            return SDW_EINVAL;
+        }
+
+        fd = (int) syscall(SYS_pidfd_open, (pid_t) before, 0);
+        if (fd < 0) {
+            exited = ESRCH == errno;
+            if (exited)
+                continue;       // MainPID not yet updated
+            LOG_ERROR("pidfd_open(%u) failed: %s\n", before, strerror(errno));
+            return SDW_EINVAL;
+        }
+
+        after = 0;
+        rc = sdwi_get_unit_property<prop_main_pid>(unit_name, &after);
+        if (0 == rc && after == before) {
+            LOG_INFO("pidfd %d of MainPID %u of '%s'\n", fd, before,
+                     unit_name);
+            *pidfd = fd;
+            if (NULL != pid)
+                *pid = before;
+            return 0;
+        }
+
+        close(fd);
+        if (0 != rc)
+            return rc;
+    }
+
+    LOG_INFO("main process of '%s' %s while opening its pidfd\n", unit_name,
+             exited ? "exited" : "changed");
+
+    return SDW_EINVAL;
+}
+
+int sdw_get_controlpid(const char *unit_name, unsigned *pid) {
+    uint32_t value = 0;
+    int rc;
+
+    if (NULL == pid)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_control_pid>(unit_name, &value);
+    *pid = value;
+
+    return rc;
+}
+
+int sdw_get_nrestarts(const char *unit_name, unsigned *count) {
+    uint32_t value = 0;
+    int rc;
+
+    if (NULL == count)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_n_restarts>(unit_name, &value);
+    *count = value;
+
+    return rc;
+}
+
+int sdw_get_exec_main_status(const char *unit_name, int *status) {
+    int32_t value = 0;
+    int rc;
+
+    if (NULL == status)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_exec_main_status>(unit_name, &value);
+    *status = value;
+
+    return rc;
+}
+
+int sdw_get_memory_current(const char *unit_name, uint64_t *bytes) {
+    if (NULL == bytes)
+        return SDW_EINVAL;
+
+    *bytes = 0;
+
+    return sdwi_get_unit_property<prop_memory_current>(unit_name, bytes);
+}
+
+int sdw_get_unit_resources(const char *unit_name, sdw_unit_resources_t *res) {
+    char cgroup[MAX_UNIT_PATH_LEN];
+    res_unit_t *u, tmp;
+    unit_t unit;
+    bool known;
+    int rc;
+
+    if (NULL == res)
+        return SDW_EINVAL;
+
+    memset(res, 0, sizeof(*res));
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    pthread_once(&cgroup_root_once, sdwi_cgroup_root_init);
+    if (NULL == cgroup_root) {
+        LOG_ERROR("no cgroup v2 hierarchy mounted\n");
+        return SDW_EINVAL;
+    }
+
+    pthread_mutex_lock(&res_cache.lock);
+    u = sdwi_res_find(unit.name, false);
+    known = NULL != u && '\0' != u->cgroup[0];
+    pthread_mutex_unlock(&res_cache.lock);
+
+    // one round trip until the cgroup is gone, not under the lock
+    if (!known) {
+        rc = sdwi_get_control_group(unit_name, cgroup, sizeof(cgroup));
+        if (0 != rc)
+            return rc;
+    }
+
+    pthread_mutex_lock(&res_cache.lock);
+    u = sdwi_res_find(unit.name, true);
+    if (NULL == u) {
+        // out of memory, the files are opened for this call only
+        memset(&tmp, 0, sizeof(tmp));
+        sdwi_strlcpy(tmp.name, sizeof(tmp.name), unit.name);
+        for (int i = 0; i < RES_FILES; i++)
+            tmp.fd[i] = -1;
+        u = &tmp;
+    }
+
+    if (!known && strcmp(u->cgroup, cgroup) != 0) {
+        sdwi_res_close(u);
+        sdwi_strlcpy(u->cgroup, sizeof(u->cgroup), cgroup);
+    }
+
+    if ('\0' == u->cgroup[0]) {
+        rc = SDW_EINVAL;        // dropped by another thread meanwhile
+    } else {
+        rc = sdwi_res_read(u, res);
+        if (0 == rc)
+            LOG_INFO("resources of '%s' read from '%s'\n", unit.name,
+                     u->cgroup);
+    }
+
+    // the cgroup is gone, the manager is asked again next time
+    if (&tmp == u)
+        sdwi_res_close(u);
+    else if (0 != rc)
+        sdwi_res_drop(u);
+    pthread_mutex_unlock(&res_cache.lock);
+
+    return rc;
+}
+
+int sdw_get_unit_pids(const char *unit_name, unsigned **ret_pids) {
+    char cgroup[MAX_UNIT_PATH_LEN], path[MAX_UNIT_PATH_LEN + 32];
+    pid_list_t list = { NULL, 0, 0 };
+    bool cached = false;
+    unit_t unit;
+    int mode, dir, rc;
+
+    if (NULL == ret_pids)
+        return SDW_EINVAL;
+
+    *ret_pids = NULL;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    pthread_once(&cgroup_root_once, sdwi_cgroup_root_init);
+    mode = sdwi_pid_lookup_mode();
+
+    rc = SDW_EINVAL;
+    if (SDW_PID_LOOKUP_BUS != mode && NULL != cgroup_root) {
+        // a remembered cgroup is gone after a restart, ask once more
+        for (int attempt = 0; attempt < 2 && 0 != rc; attempt++) {
+            rc = sdwi_unit_cgroup(unit.name, cgroup, sizeof(cgroup),
+                                  attempt > 0, &cached);
+            if (0 != rc)
+                return rc;
+
+            snprintf(path, sizeof(path), "%s%s", cgroup_root, cgroup);
+            dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir < 0) {
+                LOG_INFO("open '%s' failed: %s\n", path, strerror(errno));
+                rc = SDW_EINVAL;
+            } else {
+                list.n = 0;
+                rc = sdwi_cgroup_pids(dir, 0, &list);
+            }
+
+            if (-ENOMEM == rc || !cached)
+                break;
+        }
+
+        if (0 == rc)
+            LOG_INFO("%zu processes of '%s' read from '%s'\n", list.n,
+                     unit.name, path);
+    }
+
+    if (0 != rc && -ENOMEM != rc && SDW_PID_LOOKUP_CGROUP != mode) {
+        list.n = 0;
+        rc = sdwi_bus_unit_pids(unit.name, &list);
+    }
+
+    if (0 != rc) {
+        free(list.pids);
+        return SDW_EINIT == rc ? rc : SDW_EINVAL;
+    }
+
+    if (0 == list.n) {
+        free(list.pids);
+        list.pids = NULL;
+    }
+    *ret_pids = list.pids;
+
+    return (int) list.n;
+}
+
+int sdw_get_active_enter_timestamp(const char *unit_name, uint64_t *usec) {
+    if (NULL == usec)
+        return SDW_EINVAL;
+
+    *usec = 0;
+
+    return sdwi_get_unit_property<prop_active_enter_timestamp>(unit_name,
+                                                               usec);
+}
+
+int sdw_get_need_daemon_reload(const char *unit_name, int *need) {
+    bool value = false;
+    int rc;
+
+    if (NULL == need)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_need_daemon_reload>(unit_name, &value);
+    *need = value ? 1 : 0;
+
+    return rc;
+}
+
+int sdw_get_unit_job(const char *unit_name, unsigned *job_id) {
+    job_ref_t job = { 0, { NULL, 0 } };
+    int rc;
+
+    if (NULL == job_id)
+        return SDW_EINVAL;
+
+    rc = sdwi_get_unit_property<prop_job>(unit_name, &job);
+    *job_id = job.id;
+
+    return rc;
+}
+
+int sdw_notify_ready(void) {
+
+    return sdwi_notify(0, "READY=1");
+}
+
+int sdw_notify_stopping(void) {
+
+    return sdwi_notify(0, "STOPPING=1");
+}
+
+int sdw_notify_mainpid(unsigned pid) {
+    char *msg = NULL;
+    int rc;
+
+    rc = asprintf(&msg, "MAINPID=%u", pid);
+    if (-1 == rc || NULL == msg)
+        return SDW_EINVAL;
+
+    rc = sdwi_notify(0, msg);
+
+    free(msg);
+    return rc;
+}
+
+int sdw_status_publish(const char *status) {
+    struct timespec due;
+    int rc = 0;
+
+    if (NULL == status || NULL != strchr(status, '\n') ||
+        strnlen(status, MAX_STATUS_LEN) >= MAX_STATUS_LEN) {
+        LOG_ERROR("invalid status\n");
+        return SDW_EINVAL;
+    }
+
+    // a coalesced update could not report a missing socket
+    if (NULL == getenv("NOTIFY_SOCKET")) {
+        LOG_ERROR("message could not be sent, NOTIFY_SOCKET not set\n");
+        return SDW_ENOTIFYSOCK;
+    }
+
+    pthread_mutex_lock(&status_pub.lock);
+
+    // skip values the service manager has already seen,
+    // a pending update that reverted to that value is dropped
+    if (strcmp(status, status_pub.last) == 0) {
+        status_pub.pending = false;
+        goto unlock;
+    }
+
+    strcpy(status_pub.next, status);
+    status_pub.pending = true;
+
+    if (sdwi_status_due(&due)) {
+        rc = sdwi_status_send();
+        goto unlock;
+    }
+
+    // rate limit reached, the flusher thread sends the latest value
+    rc = sdwi_status_start_thread();
+    if (0 != rc) {
+        rc = sdwi_status_send();
+        goto unlock;
+    }
+
+    LOG_DEBUG("coalesced status '%s'\n", status);
+    pthread_cond_signal(&status_pub.cond);
+
+unlock:
+    pthread_mutex_unlock(&status_pub.lock);
+
+    return rc;
+}
+
+int sdw_status_flush(void) {
+    int rc = 0;
+
+    pthread_mutex_lock(&status_pub.lock);
+
+    if (status_pub.pending)
+        rc = sdwi_status_send();
+
+    pthread_mutex_unlock(&status_pub.lock);
+
+    return rc;
+}
+
+void sdw_status_set_interval(unsigned interval_ms) {
+    pthread_mutex_lock(&status_pub.lock);
+    status_pub.interval_ms = interval_ms;
+    pthread_mutex_unlock(&status_pub.lock);
+}
+
+const char *sdw_get_error_message(void) {
+    if (last_error.pending)
+        sdwi_error_format();
+
+    return last_error_msg;
+}
+
+void sdw_log_set_errors(int enable) {
+    __atomic_store_n(&log_errors, 0 != enable, __ATOMIC_RELAXED);
+}
+
+int sdw_set_pid_lookup(int mode) {
+    if (SDW_PID_LOOKUP_AUTO != mode && SDW_PID_LOOKUP_BUS != mode &&
+        SDW_PID_LOOKUP_CGROUP != mode)
+        return SDW_EINVAL;
+
+    __atomic_store_n(&pid_lookup, mode, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int sdw_get_stats(sdw_stats_t *stats) {
+    const uint64_t *src = (const uint64_t *) op_stats;
+    uint64_t *dst;
+    size_t i;
+
+    if (NULL == stats)
+        return SDW_EINVAL;
+
+    static_assert(sizeof(*stats) == sizeof(op_stats), "stats layout");
+
+    // sdw_op_stats_t consists of uint64_t only
+    dst = (uint64_t *) stats;
+    for (i = 0; i < STATS_WORDS; i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void sdw_reset_stats(void) {
+    uint64_t *p = (uint64_t *) op_stats;
+    size_t i;
+
+    for (i = 0; i < STATS_WORDS; i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+void sdw_set_trace_hooks(sdw_trace_hook_t begin, sdw_trace_hook_t end,
+                         void *userdata) {
+    __atomic_store_n(&trace_hooks.userdata, userdata, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_hooks.begin, begin, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_hooks.end, end, __ATOMIC_RELEASE);
+}
+
+const char *sdw_op_name(int op) {
+    static const char *names[SDW_OP_COUNT] = {
+        [SDW_OP_GET_PROPERTY] = "GetProperty",
+        [SDW_OP_START_UNIT] = "StartUnit",
+        [SDW_OP_STOP_UNIT] = "StopUnit",
+        [SDW_OP_RESTART_UNIT] = "RestartUnit",
+        [SDW_OP_GET_UNIT_BY_PID] = "GetUnitByPID",
+        [SDW_OP_GET_FILE_STATE] = "GetUnitFileState",
+        [SDW_OP_ENABLE] = "EnableUnitFiles",
+        [SDW_OP_DISABLE] = "DisableUnitFiles",
+        [SDW_OP_RELOAD] = "Reload",
+        [SDW_OP_JOB_WAIT] = "JobWait",
+        [SDW_OP_SUBSCRIBE] = "Subscribe",
+        [SDW_OP_LIST_UNITS] = "ListUnitsByPatterns",
+        [SDW_OP_GET_PROCESSES] = "GetUnitProcesses"
+    };
+
+    if (op < 0 || op >= SDW_OP_COUNT)
+        return NULL;
+
+    return names[op];
+}
+
+// call initialization without trace
+// in non systemd setups we want to suppress errors/warnings
+int sdw_is_supported(void) {
+    lib_stat_t state = __atomic_load_n(&lib_stat, __ATOMIC_ACQUIRE);
+
+    if (LOADED == state)
+        return 0;
+
+    if (INVALID_VERSION == state)
+        return SDW_EVERSION;
+
+    return SDW_EINIT;
+}
+
+int sdw_set_transport(const sdw_transport_t *t) {
+    sdw_transport_t old;
+
+    if (!loaded)
+        return SDW_EINIT;
+
+    // the other threads drop their connection on their next call
+    pthread_mutex_lock(&transport_lock);
+    old = transport;
+    if (NULL != t)
+        transport = *t;
+    else
+        memset(&transport, 0, sizeof(transport));
+    __atomic_store_n(&transport_gen, transport_gen + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&transport_lock);
+
+    if (NULL != bus) {
+        FN_SD_BUS_UNREF(bus);
+        bus = NULL;
+        pthread_setspecific(bus_key, NULL);
+    }
+
+    if (NULL != old.close)
+        old.close(old.userdata);
+
+    LOG_INFO("transport %s\n", NULL != t && NULL != t->name ?
+             t->name : "system");
+
+    return sdwi_connect();
+}
+
+int sdw_encode(const char *unit_name, char **ret_encoded) {
+    unit_t unit;
+    int rc;
+
+    if (NULL == ret_encoded)
+        return SDW_EINVAL;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    rc = sdwi_encode(&unit);
+    if (rc == 0)
+        *ret_encoded = strdup(unit.encoded);
+
+    return rc;
+}
+
+int sdw_decode(const char *unit_name, char **ret_decoded) {
+
+    unit_t unit;
+    int rc;
+
+    if (NULL == unit_name || NULL == ret_decoded)
+        return SDW_EINVAL;
+
+    if (strlen(unit_name) >= MAX_UNIT_NAME_LEN) {
+        LOG_ERROR("invalid unit name '%s'\n", unit_name);
+        return SDW_EINVAL;
+    }
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    sdwi_strlcpy(unit.encoded, sizeof(unit.encoded), unit.name);
+
+    rc = sdwi_decode(&unit);
+    if (0 == rc)
+        *ret_decoded = strndup(unit.name, sizeof(unit.name));
+
+    return rc;
+}
+
+int sdw_get_unit_by_pid_r(unsigned pid, char *buf, size_t len) {
+    if (NULL == buf)
+        return SDW_EINVAL;
+
+    return sdwi_get_unit_by_pid(pid, buf, len);
+}
+
+int sdw_get_unit_by_pid(unsigned pid, char **unit_name) {
+    char name[MAX_UNIT_NAME_LEN];
+
+    if (NULL == unit_name)
+        return SDW_EINVAL;
+
+    *unit_name = NULL;
+
+    return sdwi_strdup_result(sdwi_get_unit_by_pid(pid, name, sizeof(name)),
+                              name, unit_name);
+}
+
+// takes chunks of PIDs until none are left: cgroupfs, then the units the
+// manager told for the same process before, the rest is marked for it
+static void *sdwi_pid_batch_worker(void *arg) {
+    pid_batch_t *b = (pid_batch_t *) arg;
+    size_t i, end;
+
+    while ((i = __atomic_fetch_add(&b->next, PID_BATCH_CHUNK,
+                                   __ATOMIC_RELAXED)) < b->n) {
+        end = i + PID_BATCH_CHUNK < b->n ? i + PID_BATCH_CHUNK : b->n;
+
+        for (; i < end; i++) {
+            if (SDW_PID_LOOKUP_BUS != b->mode &&
+                sdwi_cgroup_unit_by_pid(b->pids[i], b->units[i],
+                                        MAX_UNIT_NAME_LEN) == 0)
+                continue;
+
+            b->units[i][0] = '\0';
+            if (SDW_PID_LOOKUP_CGROUP == b->mode)
+                continue;
+
+            b->start[i] = sdwi_pid_starttime(b->pids[i]);
+            if (!sdwi_pid_cache_get(b->pids[i], b->start[i], b->gen, b->now,
+                                    b->units[i]))
+                b->ask_bus[i] = true;
+        }
+    }
+
+    return NULL;
+}
+
+int sdw_get_units_by_pids(const unsigned *pids, size_t n, char ***ret_units) {
+    pthread_t threads[PID_BATCH_THREADS];
+    unsigned n_threads = 0, want;
+    pid_batch_t b;
+    char **units = NULL, *names;
+    bool no_unit;
+    long cpus;
+    size_t i;
+    int found = 0, rc;
+
+    if (NULL == ret_units || (NULL == pids && n > 0))
+        return SDW_EINVAL;
+
+    *ret_units = NULL;
+
+    // the count is returned as int, the array must not overflow size_t
+    if (n > INT_MAX ||
+        n > (SIZE_MAX - 1) / (sizeof(char *) + MAX_UNIT_NAME_LEN)) {
+        LOG_ERROR("too many PIDs %zu\n", n);
+        return SDW_EINVAL;
+    }
+
+    // the array and a slot per PID in one allocation, one free()
+    units = (char **) malloc(n * (sizeof(char *) + MAX_UNIT_NAME_LEN) + 1);
+    memset(&b, 0, sizeof(b));
+    b.start = (uint64_t *) calloc(n + 1, sizeof(uint64_t));
+    b.ask_bus = (bool *) calloc(n + 1, sizeof(bool));
+    if (NULL == units || NULL == b.start || NULL == b.ask_bus) {
+        LOG_ERROR("no memory for %zu PIDs\n", n);
+        free(units);
+        units = NULL;
+        found = SDW_EINVAL;
+        goto cleanup;
+    }
+
+    names = (char *) &units[n];
+    for (i = 0; i < n; i++)
+        units[i] = names + i * MAX_UNIT_NAME_LEN;
+
+    pthread_once(&pid_cache_once, sdwi_pid_cache_init);
+
+    b.pids = pids;
+    b.units = units;
+    b.n = n;
+    b.mode = sdwi_pid_lookup_mode();
+    b.gen = __atomic_load_n(&transport_gen, __ATOMIC_ACQUIRE);
+    b.now = sdwi_now_usec();
+
+    // the /proc reads in parallel, the calling thread is one of the workers
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    want = (unsigned) ((n + PID_BATCH_CHUNK - 1) / PID_BATCH_CHUNK);
+    if (cpus > 0 && want > (unsigned long) cpus)
+        want = (unsigned) cpus;
+    if (want > PID_BATCH_THREADS)
+        want = PID_BATCH_THREADS;
+
+    while (n_threads + 1 < want &&
+           sdwi_thread_start(&threads[n_threads], sdwi_pid_batch_worker, &b,
+                             false) == 0)
+        n_threads++;
+
+    sdwi_pid_batch_worker(&b);
+
+    for (unsigned t = 0; t < n_threads; t++)
+        pthread_join(threads[t], NULL);
+
+    // the rest on the connection of the calling thread, cached only if
+    // the PID was not reused during the call. Only a PID without unit
+    // is left empty, any other failure fails the whole call
+    for (i = 0; i < n; i++) {
+        if (!b.ask_bus[i])
+            continue;
+
+        if (NULL == sdwi_bus()) {
+            found = SDW_EINIT;
+            goto failed;
+        }
+
+        no_unit = false;
+        rc = sdwi_bus_unit_by_pid(pids[i], units[i], MAX_UNIT_NAME_LEN,
+                                  &no_unit);
+        if (0 != rc && !no_unit) {
+            found = rc;
+            goto failed;
+        }
+
+        if (0 != rc)
+            units[i][0] = '\0';
+        else if (0 != b.start[i] && sdwi_pid_starttime(pids[i]) == b.start[i])
+            sdwi_pid_cache_put(pids[i], b.start[i], b.gen, b.now, units[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        if ('\0' == units[i][0])
+            units[i] = NULL;
+        else
+            found++;
+    }
+
+    LOG_INFO("units of %d of %zu PIDs found, %u threads\n", found, n,
+             n_threads + 1);
+
+    *ret_units = units;
+    goto cleanup;
+
+failed:
+    LOG_ERROR("unit of PID %u not found (rc=%d)\n", pids[i], found);
+    free(units);
+
+cleanup:
+    free(b.start);
+    free(b.ask_bus);
+
+    return found;
+}
+
+int sdw_get_activestate_r(const char *unit_name, char *buf, size_t len) {
+    unit_t unit;
+    int rc;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    rc = sdwi_encode(&unit);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_get_activestate(&unit, buf, len);
+}
+
+int sdw_get_activestate(const char *unit_name, char **ret_state) {
+    char state[MAX_RESPONSE_LEN];
+
+    if (NULL == ret_state)
+        return sdw_get_activestate_r(unit_name, NULL, 0);
+
+    *ret_state = NULL;
+
+    return sdwi_strdup_result(sdw_get_activestate_r(unit_name, state,
+                                                    sizeof(state)),
+                              state, ret_state);
+}
+
+int sdw_get_substate_r(const char *unit_name, char *buf, size_t len) {
+    unit_t unit;
+    int rc;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    rc = sdwi_encode(&unit);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_get_substate(&unit, buf, len);
+}
+
+int sdw_get_substate(const char *unit_name, char **ret_state) {
+    char state[MAX_RESPONSE_LEN];
+
+    if (NULL == ret_state)
+        return sdw_get_substate_r(unit_name, NULL, 0);
+
+    *ret_state = NULL;
+
+    return sdwi_strdup_result(sdw_get_substate_r(unit_name, state,
+                                                 sizeof(state)),
+                              state, ret_state);
+}
+
+int sdw_get_loadstate_r(const char *unit_name, char *buf, size_t len) {
+    unit_t unit;
+    int rc;
+
+    rc = sdwi_set_unit_name(&unit, unit_name);
+    if (rc != 0)
+        return rc;
+
+    rc = sdwi_encode(&unit);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_get_loadstate(&unit, buf, len);
+}
+
+int sdw_get_loadstate(const char *unit_name, char **ret_state) {
+    char state[MAX_RESPONSE_LEN];
+
+    if (NULL == ret_state)
+        return sdw_get_loadstate_r(unit_name, NULL, 0);
+
+    *ret_state = NULL;
+
+    return sdwi_strdup_result(sdw_get_loadstate_r(unit_name, state,
+                                                  sizeof(state)),
+                              state, ret_state);
+}
+
+int sdw_parse_activestate(const char *state) {
+    return active_state_hash_t::lookup(state, SDW_UNIT_ACTIVE_STAT_UNKNOWN);
+}
+
+int sdw_parse_substate(const char *state) {
+    return sub_state_hash_t::lookup(state, SDW_UNIT_SUB_STAT_UNKNOWN);
+}
+
+int sdw_parse_loadstate(const char *state) {
+    return load_state_hash_t::lookup(state, SDW_UNIT_LOAD_STAT_UNKNOWN);
+}
+
+int sdw_parse_job_result(const char *result) {
+    return job_result_hash_t::lookup(result, SDW_JOB_RESULT_UNKNOWN);
+}
+
+const char *sdw_state_name(int state) {
+    static const struct {
+        const state_name_t *names;
+        size_t n;
+    } tables[] = {
+        {active_states, sizeof(active_states) / sizeof(active_states[0])},
+        {sub_states, sizeof(sub_states) / sizeof(sub_states[0])},
+        {load_states, sizeof(load_states) / sizeof(load_states[0])},
+        {job_results, sizeof(job_results) / sizeof(job_results[0])}
+    };
+    size_t t, i;
+
+    // the state values of all tables are disjoint
+    for (t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+        for (i = 0; i < tables[t].n; i++) {
+            if (tables[t].names[i].state == state)
+                return tables[t].names[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+int sdw_enable(const char *unit_name) {
+    int rc;
+    rc = sdwi_enable(unit_name, false, true);
+
+    if (rc != 0)
+        return rc;
+
+    return sdwi_reload_changed();
+}
+
+int sdw_disable(const char *unit_name) {
+    int rc;
+    rc = sdwi_disable(unit_name, false);
+
+    if (rc != 0)
+        return rc;
+
+    return sdwi_reload_changed();
+}
+
+int sdw_reload(void) {
+    return sdwi_reload(false);
+}
+
+int sdw_enable_units(const char *const *unit_names) {
+    int rc;
+
+    rc = sdwi_unit_files(true, unit_names, false, true);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_reload_changed();
+}
+
+int sdw_disable_units(const char *const *unit_names) {
+    int rc;
+
+    rc = sdwi_unit_files(false, unit_names, false, false);
+    if (rc != 0)
+        return rc;
+
+    return sdwi_reload_changed();
+}
+
+int sdw_set_reload_policy(int policy, unsigned window_ms) {
+    if (SDW_RELOAD_IMMEDIATE != policy && SDW_RELOAD_NONE != policy &&
+        SDW_RELOAD_DEFERRED != policy)
+        return SDW_EINVAL;
+
+    // changes deferred before stay pending for the reload thread
+    pthread_mutex_lock(&reload.lock);
+    reload.policy = policy;
+    reload.window_ms = window_ms;
+    pthread_mutex_unlock(&reload.lock);
+
+    return 0;
+}
+
+int sdw_reload_flush(void) {
+    uint64_t target;
+    bool failed;
 
-    return 0;
+    pthread_mutex_lock(&reload.lock);
+    target = reload.seq;
+    pthread_mutex_unlock(&reload.lock);
+
+    // run the pending reload here rather than wake the thread
+    sdwi_reload(true);
+
+    pthread_mutex_lock(&reload.lock);
+    while (reload.done < target)
+        pthread_cond_wait(&reload.done_cond, &reload.lock);
+    failed = reload.failed;
+    reload.failed = false;
+    pthread_mutex_unlock(&reload.lock);
 
+    return failed ? SDW_EINVAL : 0;
 }
 
-static int sdwi_job_prepare(job_info_t *job) {
-    int rc = 0;
+int sdw_list_units(const char *const *patterns, char ***ret_units) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *call = NULL, *msg = NULL;
+    const char *name, *skip, **names = NULL, **grown;
+    size_t i, n = 0, max = 0, bytes = 0;
+    char **units, *p;
+    uint32_t id;
+    op_t op;
+    int rc;
 
-    job->status = JOB_UNKNOWN;
-    job->ts_end = time(NULL) + job->wait_sec;
-    job->slot = NULL;
-    job->path = NULL;
-    job->result = NULL;
+    if (NULL == patterns || NULL == ret_units)
+        return SDW_EINVAL;
+
+    *ret_units = NULL;
 
-    rc = FN_SD_BUS_ADD_MATCH(bus, &job->slot, sdbus_match, sdwi_msg_handler,
-                             (void *) job);
+    if (NULL == sdwi_bus())
+        return SDW_EINIT;
+
+    LOG_DEBUG("'%s' '%s' '%s' '%s'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, "ListUnitsByPatterns");
+
+    sdwi_op_begin(&op, SDW_OP_LIST_UNITS, NULL, NULL, NULL);
+    rc = FN_SD_BUS_MESSAGE_NEW_METHOD_CALL(sdwi_bus(), &call,
+                                           sdbus_service_contact,
+                                           sdbus_object_path,
+                                           sdbus_interface_mgr,
+                                           "ListUnitsByPatterns");
+    if (rc >= 0)
+        rc = FN_SD_BUS_MESSAGE_APPEND_STRV(call, NULL);     // any state
+    if (rc >= 0)
+        rc = FN_SD_BUS_MESSAGE_APPEND_STRV(call, (char **) patterns);
+    if (rc >= 0)
+        rc = FN_SD_BUS_CALL(sdwi_bus(), call, 0, &error, &msg);
+    sdwi_op_end(&op, rc);
 
     if (rc < 0) {
-        LOG_ERROR("sd_bus_add_match(,,%s,,) failed, (rc=%d,%s)\n", sdbus_match,
-                  rc, strerror(-rc));
-        return SDW_EINVAL;
+        LOG_CALL_ERROR(&op, &error, rc);
+        goto cleanup;
     }
 
-    LOG_INFO("sd_bus_add_match(,,%s,,)  (rc=%d)\n", sdbus_match, rc);
+    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "(ssssssouso)");
+    if (rc < 0)
+        goto invalid;
+
+    // the names are owned by msg until they are copied below
+    while ((rc = FN_SD_BUS_MESSAGE_READ(msg, "(ssssssouso)", &name, &skip,
+                                        &skip, &skip, &skip, &skip, &skip,
+                                        &id, &skip, &skip)) > 0) {
+        if (n == max) {
+            max = 0 == max ? 64 : 2 * max;
+            grown = (const char **) realloc(names, max * sizeof(char *));
+            if (NULL == grown) {
+                rc = -ENOMEM;
+                goto invalid;
+            }
+            names = grown;
+        }
+        names[n++] = name;
+        bytes += strlen(name) + 1;
+    }
+    if (rc < 0)
+        goto invalid;
+
+    // the array and the names in one allocation, one free() for the caller
+    units = (char **) malloc((n + 1) * sizeof(char *) + bytes);
+    if (NULL == units) {
+        rc = -ENOMEM;
+        goto invalid;
+    }
 
-    return 0;
-}
+    p = (char *) &units[n + 1];
+    for (i = 0; i < n; i++) {
+        units[i] = p;
+        p = stpcpy(p, names[i]) + 1;
+    }
+    units[n] = NULL;
 
-static int sdwi_job_wait(job_info_t *job) {
-    int rc = 0;
+    LOG_INFO("ListUnitsByPatterns: %zu units\n", n);
 
-    LOG_INFO("waiting %us for job %s to finish\n", job->wait_sec, job->path);
+    *ret_units = units;
+    rc = (int) n;
+    goto cleanup;
 
-    while (JOB_UNKNOWN == job->status) {
-        time_t ts_now = time(NULL);
-        uint64_t wait_usec;
+invalid:
+    LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
 
-        if (job->ts_end > ts_now) {
-            // usec waittime for sd_bus_wait
-            wait_usec = (uint64_t) 1000 *1000 * (job->ts_end - ts_now);
-        } else {
-            // expired without finished job
-            LOG_INFO("wait time %u expired for job %s\n", job->wait_sec,
-                     job->path);
-            return SDW_ETIMEOUT;
-        }
+cleanup:
+    free(names);
+    FN_SD_BUS_ERROR_FREE(&error);
+    FN_SD_BUS_MESSAGE_UNREF(call);
+    FN_SD_BUS_MESSAGE_UNREF(msg);
 
-        // wait for I/O on sdbus
-        rc = FN_SD_BUS_WAIT(bus, wait_usec);
-        if (rc < 0) {
-            LOG_ERROR("sd_bus_wait failed %s\n", strerror(rc));
-            return SDW_EINVAL;
-        }
-        // call the sdbus lib for handover to the callback
-        rc = FN_SD_BUS_PROCESS(bus, NULL);
-        if (rc < 0) {
-            LOG_ERROR("sd_bus_process failed %s\n", strerror(rc));
-            return SDW_EINVAL;
-        }
+    if (rc < 0)
+        return SDW_EINVAL;
+
+    return rc;
+}
+
+// the entry of name, added and the least recently changed unit evicted
+// if there are WATCH_MAX_UNITS, NULL if out of memory
+static watch_unit_t *sdwi_watch_unit(sdw_watch_t *watch, const char *name) {
+    watch_unit_t **head, **pu, **lru = NULL, *u;
+
+    head = &watch->buckets[sdwi_fnv1a(name, 2166136261u) % WATCH_BUCKETS];
+    for (u = *head; NULL != u; u = u->next)
+        if (strcmp(u->name, name) == 0)
+            return u;
+
+    if (watch->n_units >= WATCH_MAX_UNITS) {
+        for (unsigned i = 0; i < WATCH_BUCKETS; i++)
+            for (pu = &watch->buckets[i]; NULL != *pu; pu = &(*pu)->next)
+                if (NULL == lru || (*pu)->used < (*lru)->used)
+                    lru = pu;
+
+        u = *lru;
+        *lru = u->next;
+        LOG_DEBUG("'%s' evicted for '%s'\n", u->name, name);
+        free(u);
+        watch->n_units--;
     }
 
-    if (JOB_DONE == job->status)
-        return 0;
+    u = (watch_unit_t *) calloc(1, sizeof(*u));
+    if (NULL == u)
+        return NULL;
 
-    return SDW_EINVAL;
+    sdwi_strlcpy(u->name, sizeof(u->name), name);
+    u->next = *head;
+    *head = u;
+    watch->n_units++;
+
+    return u;
 }
 
-static void sdwi_job_remove(job_info_t *job) {
-    if (NULL != job->path)
-        free(job->path);
-    if (NULL != job->result)
-        free(job->result);
+// clear the SDW_CHANGE_* bits of change whose value the unit had already
+// and remember the new values, invalidated values are unknown afterwards
+static void sdwi_watch_diff(sdw_watch_t *watch, const char *name,
+                            sdw_unit_change_t *change, int invalidated) {
+    watch_unit_t *u;
+    int same = 0;
+
+    u = sdwi_watch_unit(watch, name);
+    if (NULL == u)
+        return;                 // reported as sent
+
+    u->used = watch->signals;
+
+    if (change->changed & SDW_CHANGE_ACTIVE_STATE) {
+        if ((u->known & SDW_CHANGE_ACTIVE_STATE) &&
+            strcmp(u->active_state, change->active_state) == 0)
+            same |= SDW_CHANGE_ACTIVE_STATE;
+        else if (sdwi_strlcpy(u->active_state, sizeof(u->active_state),
+                              change->active_state) == 0)
+            u->known |= SDW_CHANGE_ACTIVE_STATE;
+        else
+            u->known &= ~SDW_CHANGE_ACTIVE_STATE;
+    }
 
-    if (NULL != job->slot)
-        FN_SD_BUS_SLOT_UNREF(job->slot);
+    if (change->changed & SDW_CHANGE_SUB_STATE) {
+        if ((u->known & SDW_CHANGE_SUB_STATE) &&
+            strcmp(u->sub_state, change->sub_state) == 0)
+            same |= SDW_CHANGE_SUB_STATE;
+        else if (sdwi_strlcpy(u->sub_state, sizeof(u->sub_state),
+                              change->sub_state) == 0)
+            u->known |= SDW_CHANGE_SUB_STATE;
+        else
+            u->known &= ~SDW_CHANGE_SUB_STATE;
+    }
+
+    if (change->changed & SDW_CHANGE_MAIN_PID) {
+        if ((u->known & SDW_CHANGE_MAIN_PID) &&
+            u->main_pid == change->main_pid)
+            same |= SDW_CHANGE_MAIN_PID;
+        u->main_pid = change->main_pid;
+        u->known |= SDW_CHANGE_MAIN_PID;
+    }
+
+    u->known &= ~invalidated;
+    change->changed &= ~same;
 }
 
-static int sdwi_msg_handler(sd_bus_message *msg,
-                                void *userdata, sd_bus_error *error) {
-    const char *path, *unit, *result;
-    uint32_t id;
+// PropertiesChanged of a unit, body sa{sv}as
+static int sdwi_watch_handler(sd_bus_message *msg,
+                              void *userdata, sd_bus_error *error) {
+    sdw_watch_t *watch = (sdw_watch_t *) userdata;
+    sdw_unit_change_t change;
+    char name[MAX_UNIT_NAME_LEN];
+    const char *path, *iface, *prop;
+    int invalidated = 0;
+    bool match;
     int rc;
-    job_info_t *job = (job_info_t *) userdata;
 
-    if (NULL == job) {
-        LOG_ERROR("invalid job (NULL)\n");
+    (void) error;
+
+    path = FN_SD_BUS_MESSAGE_GET_PATH(msg);
+    if (NULL == path ||
+        strncmp(path, sdbus_unit_path, sizeof(sdbus_unit_path) - 1) != 0)
         return 0;
-    }
 
-    if (NULL == job->path) {
-        LOG_ERROR("invalid job->path (NULL)\n");
+    if (sdwi_label_unescape(path + sizeof(sdbus_unit_path) - 1,
+                            name, sizeof(name)) != 0) {
+        LOG_INFO("PropertiesChanged of '%s' dropped, invalid unit name\n",
+                 path);
         return 0;
     }
 
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "uoss", &id, &path, &unit, &result);
-    if (rc < 0) {
-        LOG_ERROR("%s\n", error->message);
+    match = NULL == watch->patterns;
+    for (char **p = watch->patterns; !match && NULL != *p; p++)
+        match = fnmatch(*p, name, 0) == 0;
+
+    if (!match)
         return 0;
-    }
 
-    LOG_INFO("id: %u, path: '%s', unit: '%s', result: '%s'\n", id, path, unit,
-             result);
+    memset(&change, 0, sizeof(change));
+    change.unit_name = name;
+
+    rc = FN_SD_BUS_MESSAGE_READ(msg, "s", &iface);
+    if (rc < 0)
+        goto invalid;
+
+    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "{sv}");
+    if (rc < 0)
+        goto invalid;
+
+    while ((rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'e', "sv")) > 0) {
+        rc = FN_SD_BUS_MESSAGE_READ(msg, "s", &prop);
+        if (rc < 0)
+            goto invalid;
+
+        if (strcmp(prop, "ActiveState") == 0) {
+            rc = FN_SD_BUS_MESSAGE_READ(msg, "v", "s", &change.active_state);
+            change.changed |= SDW_CHANGE_ACTIVE_STATE;
+        } else if (strcmp(prop, "SubState") == 0) {
+            rc = FN_SD_BUS_MESSAGE_READ(msg, "v", "s", &change.sub_state);
+            change.changed |= SDW_CHANGE_SUB_STATE;
+        } else if (strcmp(prop, "MainPID") == 0) {
+            rc = FN_SD_BUS_MESSAGE_READ(msg, "v", "u", &change.main_pid);
+            change.changed |= SDW_CHANGE_MAIN_PID;
+        } else {
+            rc = FN_SD_BUS_MESSAGE_SKIP(msg, "v");
+        }
+        if (rc < 0)
+            goto invalid;
 
-    // the job.path must be checked because we don't want to process signals from other jobs
+        rc = FN_SD_BUS_MESSAGE_EXIT_CONTAINER(msg);
+        if (rc < 0)
+            goto invalid;
+    }
+    if (rc < 0)
+        goto invalid;
 
-    if (strcmp(job->path, path) != 0) {
-        LOG_INFO("'%s' ignore signal for %u result: '%s'\n", job->path, id,
-                 result);
+    rc = FN_SD_BUS_MESSAGE_EXIT_CONTAINER(msg);
+    if (rc < 0)
+        goto invalid;
+
+    // properties which changed without their value in the signal
+    rc = FN_SD_BUS_MESSAGE_ENTER_CONTAINER(msg, 'a', "s");
+    if (rc < 0)
+        goto invalid;
+
+    while ((rc = FN_SD_BUS_MESSAGE_READ(msg, "s", &prop)) > 0)
+        if (strcmp(prop, "ActiveState") == 0)
+            invalidated |= SDW_CHANGE_ACTIVE_STATE;
+        else if (strcmp(prop, "SubState") == 0)
+            invalidated |= SDW_CHANGE_SUB_STATE;
+        else if (strcmp(prop, "MainPID") == 0)
+            invalidated |= SDW_CHANGE_MAIN_PID;
+    if (rc < 0)
+        goto invalid;
+
+    if (0 != invalidated)
+        change.changed |= SDW_CHANGE_INVALIDATED;
+
+    if (0 == change.changed)
         return 0;
-    }
 
-    job->result = strdup(result);
+    // the manager also sends values which did not change
+    watch->signals++;
+    sdwi_watch_diff(watch, name, &change, invalidated);
+    if (0 == change.changed)
+        return 0;
 
-    if (strcmp(result, "done") == 0) {
-        LOG_INFO("job '%s' finished\n", path);
-        job->status = JOB_DONE;
-    } else {
-        // map possible errors to JOB_FAILED
-        // for further details see bus_wait_for_jobs and check_wait_response
-        if (
-            // TODO, check correctnes of #if_0
-#if 0
-               // known 'failed' results
-               (strcmp(result, "canceled") == 0) ||
-               (strcmp(result, "timeout") == 0) ||
-               (strcmp(result, "dependency") == 0) ||
-               (strcmp(result, "invalid") == 0) ||
-               (strcmp(result, "assert") == 0) ||
-               (strcmp(result, "unsupported") == 0) ||
-               (strcmp(result, "collected") == 0) ||
-               (strcmp(result, "once") == 0) ||
-#endif
-               // cover any 'failed' results
-               // 'done' was already checked
-               strcmp(result, "skipped") != 0) {
+    LOG_DEBUG("'%s' changed %d on %s\n", name, change.changed, iface);
 
-            LOG_ERROR("job '%s' canceled with '%s'\n", path, result);
-            job->status = JOB_FAILED;
-        }
-    }
+    change.ts_usec = sdwi_now_usec();
+    watch->reported++;
+    watch->fn(&change, watch->userdata);
+
+    return 0;
 
+invalid:
+    LOG_ERROR("invalid PropertiesChanged of '%s' (rc=%d,%s)\n", name, rc,
+              strerror(-rc));
     return 0;
 }
 
-static int sdwi_get_unitfilestate(const char *unit_name, char **ret_state) {
+int sdw_watch_new(const char *const *patterns, sdw_unit_change_fn_t fn,
+                  void *userdata, sdw_watch_t **ret_watch) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message *msg = NULL;
-    char *response = NULL;
-    int rc = 0;
-    const char *cmd = "GetUnitFileState";
+    sdw_watch_t *watch = NULL;
+    size_t i, n = 0;
+    op_t op;
+    int rc;
 
-    LOG_INFO("'%s' '%s' '%s' '%s' '%s'\n",
-             sdbus_service_contact, sdbus_object_path,
-             sdbus_interface_mgr, cmd, unit_name);
+    if (NULL == fn || NULL == ret_watch)
+        return SDW_EINVAL;
 
-    rc = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                               sdbus_interface_mgr, cmd, &error, &msg,
-                               "s", unit_name);
-    if (rc < 0) {
-        LOG_ERROR("%s '%s' - failed: %s\n", cmd, unit_name, error.message);
-        goto cleanup;
+    *ret_watch = NULL;
+
+    if (NULL == sdwi_bus())
+        return SDW_EINIT;
+
+    watch = (sdw_watch_t *) calloc(1, sizeof(*watch));
+    if (NULL == watch)
+        return SDW_EINVAL;
+
+    watch->owner = pthread_self();
+    watch->fn = fn;
+    watch->userdata = userdata;
+
+    if (NULL != patterns) {
+        while (NULL != patterns[n])
+            n++;
+
+        watch->patterns = (char **) calloc(n + 1, sizeof(char *));
+        if (NULL == watch->patterns) {
+            rc = SDW_EINVAL;
+            goto cleanup;
+        }
+
+        for (i = 0; i < n; i++) {
+            watch->patterns[i] = strdup(patterns[i]);
+            if (NULL == watch->patterns[i]) {
+                rc = SDW_EINVAL;
+                goto cleanup;
+            }
+        }
     }
 
-    rc = FN_SD_BUS_MESSAGE_READ(msg, "s", &response);
+    // match before Subscribe, no change in between gets lost
+    rc = FN_SD_BUS_ADD_MATCH(sdwi_bus(), &watch->slot, sdbus_match_changed,
+                             sdwi_watch_handler, (void *) watch);
     if (rc < 0) {
-        LOG_ERROR("failed to parse response message: %s\n", strerror(-rc));
+        LOG_ERROR("sd_bus_add_match(,,%s,,) failed, (rc=%d,%s)\n",
+                  sdbus_match_changed, rc, strerror(-rc));
+        rc = SDW_EINVAL;
         goto cleanup;
     }
 
-    LOG_INFO("unit file state: %s.\n", response);
+    LOG_DEBUG("'%s' '%s' '%s' '%s'\n",
+              sdbus_service_contact, sdbus_object_path,
+              sdbus_interface_mgr, "Subscribe");
+
+    // the manager sends the unit signals only to subscribed clients,
+    // the subscription ends with the connection
+    sdwi_op_begin(&op, SDW_OP_SUBSCRIBE, NULL, NULL, NULL);
+    rc = FN_SD_BUS_CALL_METHOD(sdwi_bus(), sdbus_service_contact, sdbus_object_path,
+                               sdbus_interface_mgr, "Subscribe", &error, &msg, "");
+    if (rc < 0 && NULL != error.name &&
+        strcmp(error.name, sdbus_error_subscribed) == 0)
+        rc = 0;                 // by an earlier watch of the thread
+    sdwi_op_end(&op, rc);
 
-    if (0 <= rc) {
-        if (ret_state != NULL) {
-            if (strlen(response) <= MAX_RESPONSE_LEN) {
-                *ret_state = strdup(response);
-            }
-        }
+    if (rc < 0) {
+        LOG_CALL_ERROR(&op, &error, rc);
+        rc = SDW_EINVAL;
+        goto cleanup;
+    }
 
-        if (strcmp(response, "enabled") == 0)
-            rc = SDW_UNIT_FILE_STAT_ENABLED;
+    LOG_INFO("watching %zu unit patterns\n", n);
 
-        else if (strcmp(response, "disabled") == 0)
-            rc = SDW_UNIT_FILE_STAT_DISABLED;
-    }
+    watch->bus = FN_SD_BUS_REF(sdwi_bus());
+    *ret_watch = watch;
+    watch = NULL;
+    rc = 0;
 
 cleanup:
     FN_SD_BUS_ERROR_FREE(&error);
     FN_SD_BUS_MESSAGE_UNREF(msg);
+    sdw_watch_free(watch);
 
-    if (rc >= 0)
-        return rc;
+    return rc;
+}
 
-    return SDW_EINVAL;
+int sdw_watch_get_fd(const sdw_watch_t *watch) {
+    int fd;
+
+    if (NULL == watch)
+        return SDW_EINVAL;
+
+    fd = FN_SD_BUS_GET_FD(watch->bus);
+    if (fd < 0)
+        return SDW_EINVAL;
+
+    return fd;
 }
 
-static int sdwi_get_activestate(const char *unit_name_encoded, char **ret_state) {
-    response_t response;
+int sdw_watch_process(sdw_watch_t *watch, int timeout_ms) {
+    bool waited = false;
     int rc;
 
-    response.s = NULL;
+    if (NULL == watch || !pthread_equal(watch->owner, pthread_self()))
+        return SDW_EINVAL;
 
-    rc = sdwi_get_unit_property(unit_name_encoded,
-                                sdbus_service_contact, sdbus_interface_unit,
-                                "ActiveState", "s", &response);
+    // replaced by sdw_set_transport() or closed by the peer
+    if (watch->bus != bus ||
+        bus_gen != __atomic_load_n(&transport_gen, __ATOMIC_ACQUIRE) ||
+        FN_SD_BUS_IS_OPEN(watch->bus) <= 0)
+        return SDW_EINIT;
 
-    if (0 == rc) {
-        if (NULL != ret_state &&
-            NULL != response.s && strlen(response.s) <= MAX_RESPONSE_LEN) {
+    watch->reported = 0;
 
-            *ret_state = strdup(response.s);
+    for (;;) {
+        rc = FN_SD_BUS_PROCESS(watch->bus, NULL);
+        if (rc < 0) {
+            LOG_ERROR("sd_bus_process failed %s\n", strerror(-rc));
+            return SDW_EINIT;
         }
 
-        rc = SDW_UNIT_ACTIVE_STAT_UNKNOWN;
+        if (rc > 0)
+            continue;
 
-        if (NULL != response.s) {
+        if (watch->reported > 0 || waited || 0 == timeout_ms)
+            break;
+
+        rc = FN_SD_BUS_WAIT(watch->bus, timeout_ms < 0 ? UINT64_MAX :
+                            (uint64_t) timeout_ms * 1000);
+        if (rc < 0 && -EINTR != rc) {
+            LOG_ERROR("sd_bus_wait failed %s\n", strerror(-rc));
+            return SDW_EINIT;
+        }
+        waited = true;
+    }
 
-            if (strcmp("activating", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_ACTIVATING;
+    return watch->reported;
+}
 
-            if (strcmp("active", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_ACTIVE;
+void sdw_watch_free(sdw_watch_t *watch) {
+    if (NULL == watch)
+        return;
 
-            else if (strcmp("reloading", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_RELOADING;
+    if (NULL != watch->slot)
+        FN_SD_BUS_SLOT_UNREF(watch->slot);
 
-            else if (strcmp("deactivating", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_DEACTIVATING;
+    if (NULL != watch->bus)
+        FN_SD_BUS_UNREF(watch->bus);
 
-            else if (strcmp("inactive", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_INACTIVE;
+    for (char **p = watch->patterns; NULL != p && NULL != *p; p++)
+        free(*p);
+    free(watch->patterns);
 
-            else if (strcmp("failed", response.s) == 0)
-                rc = SDW_UNIT_ACTIVE_STAT_FAILED;
+    for (unsigned i = 0; i < WATCH_BUCKETS; i++) {
+        for (watch_unit_t *u = watch->buckets[i], *next; NULL != u; u = next) {
+            next = u->next;
+            free(u);
         }
     }
+    free(watch);
+}
 
-    if (NULL != response.s)
-        free((void *) response.s);
+static const struct {
+    int type;
+    const char *file;
+} pressure_files[] = {
+    { SDW_PRESSURE_MEMORY, "memory.pressure" },
+    { SDW_PRESSURE_CPU, "cpu.pressure" },
+    { SDW_PRESSURE_IO, "io.pressure" },
+    { SDW_PRESSURE_OOM, "memory.events" },
+};
+
+// "some avg10=1.23 avg60=... total=<usec>" and the same for full
+static void sdwi_pressure_parse(const char *data, sdw_pressure_event_t *ev) {
+    unsigned whole, hundredths;
+    uint64_t total;
+    char kind[8];
+
+    const char *line = data;
+
+    while (NULL != line && '\0' != *line) {
+        if (sscanf(line, "%7s avg10=%u.%u %*s %*s total=%" SCNu64, kind,
+                   &whole, &hundredths, &total) == 4) {
+            if (strcmp(kind, "some") == 0) {
+                ev->some_avg10 = whole * 100 + hundredths;
+                ev->some_total_usec = total;
+            } else if (strcmp(kind, "full") == 0) {
+                ev->full_avg10 = whole * 100 + hundredths;
+                ev->full_total_usec = total;
+            }
+        }
 
-    return rc;
+        line = strchr(line, '\n');
+        if (NULL != line)
+            line++;
+    }
 }
 
-// dead/start/running/stop-sigterm
-static int sdwi_get_substate(const char *unit_name_encoded, char **ret_state) {
-    response_t response;
-    int rc;
+// the oom and oom_kill counters of memory.events
+static void sdwi_pressure_events(const char *data, uint64_t *oom,
+                                 uint64_t *oom_kill) {
+    const char *line = data;
 
-    response.s = NULL;
+    while (NULL != line && '\0' != *line) {
+        if (strncmp(line, "oom ", 4) == 0)
+            *oom = strtoull(line + 4, NULL, 10);
+        else if (strncmp(line, "oom_kill ", 9) == 0)
+            *oom_kill = strtoull(line + 9, NULL, 10);
 
-    rc = sdwi_get_unit_property(unit_name_encoded, sdbus_service_contact,
-                                sdbus_interface_unit, "SubState", "s", &response);
-    if (0 == rc) {
-        if (NULL != ret_state &&
-            NULL != response.s && strlen(response.s) <= MAX_RESPONSE_LEN) {
-            *ret_state = strdup(response.s);
-        }
+        line = strchr(line, '\n');
+        if (NULL != line)
+            line++;
+    }
+}
+
+// reads the file of src after epoll reported it, 1 if fn was called
+static int sdwi_pressure_report(sdw_pressure_t *pressure,
+                                pressure_src_t *src, uint32_t events) {
+    sdw_pressure_event_t ev;
+    char buf[512];
+    uint64_t oom, oom_kill;
+    ssize_t n;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.unit_name = src->unit;
+    ev.ts_usec = sdwi_now_usec();
+
+    // a removed cgroup reads ENODEV, its PSI triggers poll EPOLLERR,
+    // memory.events also does so for each change until it is read
+    n = SDW_PRESSURE_OOM != src->type && (events & EPOLLERR) ? -1 :
+        pread(src->fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0) {
+        LOG_INFO("cgroup of '%s' removed\n", src->unit);
+        close(src->fd);
+        src->fd = -1;
+        ev.type = SDW_PRESSURE_REMOVED | src->type;
+        pressure->fn(&ev, pressure->userdata);
+        return 1;
+    }
+    buf[n] = '\0';
 
-        rc = SDW_UNIT_SUB_STAT_UNKNOWN;
+    if (SDW_PRESSURE_OOM != src->type) {
+        ev.type = src->type;
+        sdwi_pressure_parse(buf, &ev);
+        pressure->fn(&ev, pressure->userdata);
+        return 1;
+    }
 
-        if (NULL != response.s) {
+    // memory.events changes with every memory.high or .max event too
+    oom = src->oom;
+    oom_kill = src->oom_kill;
+    sdwi_pressure_events(buf, &oom, &oom_kill);
+    if (oom == src->oom && oom_kill == src->oom_kill)
+        return 0;
 
-            if (strcmp("start", response.s) == 0)
-                rc = SDW_UNIT_SUB_STAT_START;
+    src->oom = oom;
+    src->oom_kill = oom_kill;
+    ev.type = SDW_PRESSURE_OOM;
+    ev.oom = oom;
+    ev.oom_kill = oom_kill;
+    pressure->fn(&ev, pressure->userdata);
 
-            else if (strcmp("running", response.s) == 0)
-                rc = SDW_UNIT_SUB_STAT_RUNNING;
+    return 1;
+}
 
-            else if (strcmp("stop-sigterm", response.s) == 0)
-                rc = SDW_UNIT_SUB_STAT_STOP_SIGTERM;
+int sdw_pressure_new(sdw_pressure_fn_t fn, void *userdata,
+                     sdw_pressure_t **ret_pressure) {
+    sdw_pressure_t *pressure;
 
-            else if (strcmp("dead", response.s) == 0)
-                rc = SDW_UNIT_SUB_STAT_DEAD;
-        }
+    if (NULL == fn || NULL == ret_pressure)
+        return SDW_EINVAL;
+
+    *ret_pressure = NULL;
+
+    pthread_once(&cgroup_root_once, sdwi_cgroup_root_init);
+    if (NULL == cgroup_root) {
+        LOG_ERROR("no cgroup v2 hierarchy mounted\n");
+        return SDW_EINVAL;
     }
 
-    if (NULL != response.s)
-        free(response.s);
+    pressure = (sdw_pressure_t *) calloc(1, sizeof(*pressure));
+    if (NULL == pressure)
+        return SDW_EINVAL;
 
-    return rc;
-}
+    pressure->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pressure->epfd < 0) {
+        LOG_ERROR("epoll_create1() failed: %s\n", strerror(errno));
+        free(pressure);
+        return SDW_EINVAL;
+    }
 
-/* external functions */
+    pressure->fn = fn;
+    pressure->userdata = userdata;
+    *ret_pressure = pressure;
 
-int sdw_start(const char *unit_name, unsigned wait_sec) {
-    int rc;
-    job_info_t job;
-    char *response = NULL;
+    return 0;
+}
 
-    job.cmd = SDBUS_START_UNIT;
-    job.wait_sec = wait_sec;
+int sdw_pressure_add(sdw_pressure_t *pressure, const char *unit_name,
+                     int types, unsigned stall_usec, unsigned window_usec) {
+    char cgroup[MAX_UNIT_PATH_LEN], path[MAX_UNIT_PATH_LEN + 32];
+    char trigger[64], buf[512];
+    struct epoll_event event;
+    pressure_src_t *src, *grown;
+    unsigned first;
+    unit_t unit;
+    ssize_t n;
+    int dir = -1, rc;
 
-    // async call
-    if (0 == wait_sec)
-        return sdwi_sdbus_cmd(unit_name, NULL, job.cmd);
+    if (NULL == pressure || 0 == types ||
+        0 != (types & ~(SDW_PRESSURE_MEMORY | SDW_PRESSURE_CPU |
+                        SDW_PRESSURE_IO | SDW_PRESSURE_OOM)))
+        return SDW_EINVAL;
 
-    // sync call:
-    // - register for message on sdbus
-    // - start the unit
-    // - wait for final job status
-    rc = sdwi_job_prepare(&job);
+    rc = sdwi_set_unit_name(&unit, unit_name);
     if (rc != 0)
-        goto cleanup;
+        return rc;
 
-    rc = sdwi_sdbus_cmd(unit_name, &response, job.cmd);
-    job.path = response;
+    rc = sdwi_get_control_group(unit.name, cgroup, sizeof(cgroup));
+    if (0 != rc)
+        return rc;
 
-    if (rc != 0)
-        goto cleanup;
+    snprintf(path, sizeof(path), "%s%s", cgroup_root, cgroup);
+    dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+        LOG_ERROR("open '%s' failed: %s\n", path, strerror(errno));
+        return SDW_EINVAL;
+    }
 
-    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+    // the kernel expects the trigger with its terminating NUL
+    snprintf(trigger, sizeof(trigger), "some %u %u", stall_usec,
+             window_usec);
 
-    rc = sdwi_job_wait(&job);
+    first = pressure->n_src;
+    rc = 0;
 
-cleanup:
-    sdwi_job_remove(&job);
+    for (const auto &f : pressure_files) {
+        if (0 == (types & f.type))
+            continue;
+
+        if (pressure->n_src == pressure->max_src) {
+            pressure->max_src = 0 == pressure->max_src ? 8 :
+                                2 * pressure->max_src;
+            grown = (pressure_src_t *) realloc(pressure->src,
+                        pressure->max_src * sizeof(*grown));
+            if (NULL == grown) {
+                rc = SDW_EINVAL;
+                break;
+            }
+            pressure->src = grown;
+        }
 
-    return rc;
-}
+        src = &pressure->src[pressure->n_src];
+        memset(src, 0, sizeof(*src));
+        sdwi_strlcpy(src->unit, sizeof(src->unit), unit.name);
+        src->type = f.type;
+        src->fd = openat(dir, f.file, SDW_PRESSURE_OOM == f.type ?
+                         O_RDONLY | O_CLOEXEC :
+                         O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (src->fd < 0) {
+            LOG_ERROR("open '%s/%s' failed: %s\n", path, f.file,
+                      strerror(errno));
+            rc = SDW_EINVAL;
+            break;
+        }
+        pressure->n_src++;
+
+        // only increases after this read are reported
+        if (SDW_PRESSURE_OOM == f.type) {
+            n = pread(src->fd, buf, sizeof(buf) - 1, 0);
+            if (n >= 0) {
+                buf[n] = '\0';
+                sdwi_pressure_events(buf, &src->oom, &src->oom_kill);
+            }
+        } else if (write(src->fd, trigger, strlen(trigger) + 1) < 0) {
+            LOG_ERROR("trigger '%s' on '%s/%s' failed: %s\n", trigger,
+                      path, f.file, strerror(errno));
+            rc = SDW_EINVAL;
+            break;
+        }
 
-int sdw_restart(const char *unit_name, unsigned wait_sec) {
-    int rc;
-    job_info_t job;
-    char *response = NULL;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLPRI;
+        event.data.u32 = pressure->n_src - 1;
+        if (epoll_ctl(pressure->epfd, EPOLL_CTL_ADD, src->fd, &event) < 0) {
+            LOG_ERROR("epoll_ctl() failed: %s\n", strerror(errno));
+            rc = SDW_EINVAL;
+            break;
+        }
+    }
 
-    job.cmd = SDBUS_RESTART_UNIT;
-    job.wait_sec = wait_sec;
+    close(dir);
 
-    // async call
-    if (0 == wait_sec)
-        return sdwi_sdbus_cmd(unit_name, NULL, job.cmd);
+    if (0 != rc) {
+        // all or none of the files of the unit
+        while (pressure->n_src > first)
+            close(pressure->src[--pressure->n_src].fd);
+        return rc;
+    }
 
-    // sync call:
-    // - register for message on sdbus
-    // - restart the unit
-    // - wait for final job status
-    rc = sdwi_job_prepare(&job);
-    if (rc != 0)
-        goto cleanup;
+    LOG_INFO("pressure of '%s' watched in '%s'\n", unit.name, path);
+
+    return 0;
+}
+
+int sdw_pressure_get_fd(const sdw_pressure_t *pressure) {
+    if (NULL == pressure)
+        return SDW_EINVAL;
+
+    return pressure->epfd;
+}
 
-    rc = sdwi_sdbus_cmd(unit_name, &response, job.cmd);
-    job.path = response;
+int sdw_pressure_process(sdw_pressure_t *pressure, int timeout_ms) {
+    struct epoll_event events[PRESSURE_EVENTS];
+    pressure_src_t *src;
+    int n, reported = 0;
 
-    if (rc != 0)
-        goto cleanup;
+    if (NULL == pressure)
+        return SDW_EINVAL;
 
-    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+    n = epoll_wait(pressure->epfd, events, PRESSURE_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (EINTR == errno)
+            return 0;
+        LOG_ERROR("epoll_wait() failed: %s\n", strerror(errno));
+        return SDW_EINVAL;
+    }
 
-    rc = sdwi_job_wait(&job);
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u32 >= pressure->n_src)
+            continue;
 
-cleanup:
-    sdwi_job_remove(&job);
+        src = &pressure->src[events[i].data.u32];
+        if (src->fd >= 0)
+            reported += sdwi_pressure_report(pressure, src,
+                                             events[i].events);
+    }
 
-    return rc;
+    return reported;
 }
 
-int sdw_stop(const char *unit_name, unsigned wait_sec) {
-    int rc;
-    job_info_t job;
-    char *response = NULL;
+void sdw_pressure_free(sdw_pressure_t *pressure) {
+    if (NULL == pressure)
+        return;
 
-    job.cmd = SDBUS_STOP_UNIT;
-    job.wait_sec = wait_sec;
+    for (unsigned i = 0; i < pressure->n_src; i++)
+        if (pressure->src[i].fd >= 0)
+            close(pressure->src[i].fd);
 
-    // async call
-    if (0 == wait_sec)
-        return sdwi_sdbus_cmd(unit_name, NULL, job.cmd);
+    close(pressure->epfd);
+    free(pressure->src);
+    free(pressure);
+}
 
-    // sync call:
-    // - register for message on sdbus
-    // - stop the unit
-    // - wait for final job status
-    rc = sdwi_job_prepare(&job);
-    if (rc != 0)
-        goto cleanup;
+void sdw_set_tracelevel(int trace_level) {
+    if (trace_level < 0 || trace_level > 2)
+        return;
 
-    rc = sdwi_sdbus_cmd(unit_name, &response, job.cmd);
-    job.path = response;
+    // levels above SDW_LOG_LEVEL_MAX are not compiled in
+    if (trace_level > SDW_LOG_LEVEL_MAX)
+        trace_level = SDW_LOG_LEVEL_MAX;
 
-    if (rc != 0)
-        goto cleanup;
+    __atomic_store_n(&trc_level, trace_level, __ATOMIC_RELAXED);
+}
 
-    LOG_INFO("waiting %us for job %s to finish\n", wait_sec, job.path);
+void sdw_log_set_callback(sdw_log_fn_t fn, void *userdata) {
+    __atomic_store_n(&log_backend.userdata, userdata, __ATOMIC_RELAXED);
+    __atomic_store_n(&log_backend.fn, fn, __ATOMIC_RELEASE);
+}
 
-    rc = sdwi_job_wait(&job);
+int sdw_log_set_async(int enable) {
+    pthread_mutex_lock(&log_backend.lock);
 
-cleanup:
-    sdwi_job_remove(&job);
+    if (enable && !log_backend.thread_started) {
+        log_backend.stop = false;
+        if (sdwi_thread_start(&log_backend.thread, sdwi_log_thread, NULL,
+                              false) != 0) {
+            pthread_mutex_unlock(&log_backend.lock);
+            return SDW_EINVAL;
+        }
 
-    return rc;
-}
+        log_backend.thread_started = true;
+        __atomic_store_n(&log_backend.async, true, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&log_backend.lock);
+        return 0;
+    }
 
-int sdw_get_version(char **ret_version) {
-    response_t response;
-    int rc;
+    if (!enable && log_backend.thread_started) {
+        // a record racing with the switch stays in its ring until the
+        // next sdw_log_flush()
+        __atomic_store_n(&log_backend.async, false, __ATOMIC_RELAXED);
+        log_backend.stop = true;
+        pthread_mutex_unlock(&log_backend.lock);
 
-    response.s = NULL;
+        pthread_join(log_backend.thread, NULL);
 
-    if (NULL == ret_version)
-        return SDW_EINVAL;
+        pthread_mutex_lock(&log_backend.lock);
+        log_backend.thread_started = false;
+        sdwi_log_drain();
+    }
+
+    pthread_mutex_unlock(&log_backend.lock);
+
+    return 0;
+}
+
+int sdw_journal_enable(int flags) {
+    journal_entry_t *batch;
+    unsigned i;
+
+    pthread_mutex_lock(&journal_sink.lock);
+
+    if (0 != flags && !journal_sink.thread_started) {
+        // kept from an earlier call if only pthread_create() failed
+        if (NULL == journal_sink.queue)
+            journal_sink.queue = (journal_entry_t *)
+                calloc(JOURNAL_QUEUE_LEN, sizeof(journal_entry_t));
+        if (NULL == journal_sink.batch)
+            journal_sink.batch = (journal_entry_t *)
+                calloc(JOURNAL_QUEUE_LEN, sizeof(journal_entry_t));
+        if (NULL == journal_sink.queue || NULL == journal_sink.batch) {
+            free(journal_sink.queue);
+            free(journal_sink.batch);
+            journal_sink.queue = journal_sink.batch = NULL;
+            pthread_mutex_unlock(&journal_sink.lock);
+            return SDW_EINVAL;
+        }
 
-    rc = sdwi_get_property(sdbus_object_path, sdbus_service_contact,
-                           sdbus_interface_mgr, "Version", "s", &response);
+        journal_sink.stop = false;
+        if (sdwi_thread_start(&journal_sink.thread, sdwi_journal_thread, NULL,
+                              false) != 0) {
+            // the buffers stay allocated, the next call retries
+            pthread_mutex_unlock(&journal_sink.lock);
+            return SDW_EINVAL;
+        }
 
-    if (0 == rc &&
-        NULL != response.s &&
-        strnlen(response.s, MAX_RESPONSE_LEN) < (MAX_RESPONSE_LEN - 1)) {
-        *ret_version = strdup(response.s);
+        journal_sink.thread_started = true;
     }
 
-    if (NULL != response.s)
-        free(response.s);
+    __atomic_store_n(&journal_sink.flags, flags, __ATOMIC_RELAXED);
+
+    if (0 == flags && journal_sink.thread_started) {
+        // the thread sends what is queued before it exits
+        journal_sink.stop = true;
+        pthread_cond_signal(&journal_sink.cond);
+        pthread_mutex_unlock(&journal_sink.lock);
+
+        pthread_join(journal_sink.thread, NULL);
+
+        // entries racing with the switch are sent here
+        pthread_mutex_lock(&journal_sink.lock);
+        journal_sink.thread_started = false;
+        batch = journal_sink.queue;
+        for (i = 0; i < journal_sink.n_queued; i++)
+            sdwi_journal_send(&batch[i]);
+        journal_sink.n_queued = 0;
+        free(journal_sink.queue);
+        free(journal_sink.batch);
+        journal_sink.queue = journal_sink.batch = NULL;
+    }
 
-    return rc;
-}
+    pthread_mutex_unlock(&journal_sink.lock);
 
-int sdw_get_unitfilestate(const char *unit_name, char **ret_state) {
-    return sdwi_get_unitfilestate(unit_name, ret_state);
+    return 0;
 }
 
-int sdw_check_pid(const char *unit_name, unsigned pid) {
-    unit_t unit;
-    char *response = NULL;
-    int rc;
-
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
+void sdw_journal_flush(void) {
+    journal_entry_t *batch;
+    unsigned i;
 
-    rc = sdwi_encode(&unit);
-    if (rc != 0)
-        return rc;
+    // the entries the journal thread took go out first
+    pthread_mutex_lock(&journal_sink.lock);
 
-    if (0 == pid)
-        pid = (unsigned) getpid();
+    while (journal_sink.sending)
+        pthread_cond_wait(&journal_sink.sent, &journal_sink.lock);
 
-    rc = sdwi_get_unit_by_pid(pid, &response);
-    if (0 != rc || NULL == response) {
-        rc = SDW_EINVAL;
-        goto cleanup;
-    }
+    batch = journal_sink.queue;
+    for (i = 0; NULL != batch && i < journal_sink.n_queued; i++)
+        sdwi_journal_send(&batch[i]);
+    journal_sink.n_queued = 0;
 
-    if (NULL != strstr(response, unit.encoded)) {
-        LOG_INFO("unit '%s' found for PID '%u'\n", unit_name, pid);
-    } else {
-        LOG_INFO("no unit found for PID '%u'\n", pid);
-        rc = SDW_EINVAL;
-    }
+    pthread_mutex_unlock(&journal_sink.lock);
+}
 
-cleanup:
+void sdw_log_flush(void) {
+    pthread_mutex_lock(&log_backend.lock);
+    sdwi_log_drain();
+    pthread_mutex_unlock(&log_backend.lock);
+}
 
-    if (NULL != response)
-        free(response);
+/* C++ interface, see sdw.hpp */
 
-    return rc;
+static sdw::Error sdwi_error(int rc) {
+    return sdw::Error(rc, sdw_get_error_message());
 }
 
-int sdw_check_controlpid(const char *unit_name, unsigned pid) {
-    unit_t unit;
-    unsigned ctrl_pid = ~0U;
-    response_t response;
+template <class P>
+static sdw::Result<typename P::type> sdwi_value(const char *unit_name,
+                                                const char *path) {
+    typename P::type value = { };
     int rc;
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
+    rc = sdwi_read_property<P>(unit_name, path, &value);
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    rc = sdwi_encode(&unit);
-    if (rc != 0)
-        return rc;
+    return value;
+}
 
-    response.u = 0;
+template <class P, class H>
+static sdw::Result<sdw::State> sdwi_state(const char *unit_name,
+                                          const char *path, int unknown) {
+    sd_bus_message *msg = NULL;
+    const char *name = NULL;
+    int rc;
 
-    rc = sdwi_get_unit_property(unit.encoded, sdbus_service_contact,
-                                sdbus_interface_srv, "ControlPID",
-                                "u", &response);
-    if (rc != 0)
-        return rc;
+    rc = sdwi_read_property<P>(unit_name, path, &name, &msg);
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    ctrl_pid = response.u;
+    return sdw::State(H::lookup(name, unknown),
+                      sdw::Borrowed(sdw::Message(msg), name));
+}
 
-    if (ctrl_pid != pid) {
-        LOG_INFO("ControlPID %u != PID %u\n", ctrl_pid, pid);
-        return SDW_EINVAL;
+namespace sdw {
+
+struct Job::state_t {
+    job_info_t info;
+};
+
+Message &Message::operator=(Message &&other) noexcept {
+    if (this != &other) {
+        if (nullptr != msg_)
+            FN_SD_BUS_MESSAGE_UNREF(msg_);
+        msg_ = std::exchange(other.msg_, nullptr);
     }
 
-    LOG_INFO("ControlPID %u == PID %u\n", ctrl_pid, pid);
-    return 0;
+    return *this;
 }
 
-int sdw_get_mainpid(const char *unit_name, unsigned *pid) {
-    unit_t unit;
-    response_t response;
-    int rc;
+Message::~Message() {
+    if (nullptr != msg_)
+        FN_SD_BUS_MESSAGE_UNREF(msg_);
+}
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
+Job &Job::operator=(Job &&other) noexcept {
+    if (this != &other) {
+        this->~Job();
+        state_ = std::exchange(other.state_, nullptr);
+    }
 
-    rc = sdwi_encode(&unit);
-    if (rc != 0)
-        return rc;
+    return *this;
+}
 
-    response.u = 0;
+Job::~Job() {
+    if (nullptr == state_)
+        return;
 
-    if (NULL == pid)
-        return SDW_EINVAL;
+    sdwi_job_remove(&state_->info);
+    delete state_;
+    state_ = nullptr;
+}
 
-    rc = sdwi_get_srv_property(unit.encoded, "MainPID", "u", &response);
-    *pid = response.u;
+std::string_view Job::path() const noexcept {
+    if (nullptr == state_ || nullptr == state_->info.path)
+        return std::string_view();
 
-    return rc;
+    return state_->info.path;
 }
 
-int sdw_get_controlpid(const char *unit_name, unsigned *pid) {
-    response_t response;
+Result<Job> Job::queue(const char *unit_name, int cmd) {
+    state_t *state = new(std::nothrow) state_t();
+    char *path = NULL;
     int rc;
 
-    response.u = 0;
+    if (nullptr == state)
+        return Error(SDW_EINVAL, "out of memory");
 
-    if (NULL == pid)
-        return SDW_EINVAL;
+    state->info.cmd = (sdbus_cmd_t) cmd;
+    state->info.wait_sec = 0;
 
-    rc = sdwi_get_unit_property(unit_name, sdbus_service_contact,
-                                sdbus_interface_srv, "ControlPID",
-                                "u", &response);
-    *pid = response.u;
+    // JobRemoved must be matched before the job is queued
+    rc = sdwi_job_prepare(&state->info, unit_name);
+    if (0 == rc) {
+        rc = sdwi_sdbus_cmd(state->info.bus, unit_name, &path,
+                            state->info.cmd);
+        state->info.path = path;
+    }
 
-    return rc;
-}
+    // releases the match on error
+    Job job(state);
 
-int sdw_notify_ready(void) {
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    return sdwi_notify(0, "READY=1");
+    return job;
 }
 
-int sdw_notify_stopping(void) {
+Result<int> Job::wait(std::chrono::seconds timeout) {
+    job_info_t *info;
+    int rc;
 
-    return sdwi_notify(0, "STOPPING=1");
-}
+    if (nullptr == state_)
+        return Error(SDW_EINVAL, "invalid job");
 
-int sdw_notify_mainpid(unsigned pid) {
-    char *msg = NULL;
-    int rc;
+    info = &state_->info;
+    info->wait_sec = (unsigned) timeout.count();
+    info->ts_end = time(NULL) + timeout.count();
 
-    rc = asprintf(&msg, "MAINPID=%u", pid);
-    if (-1 == rc || NULL == msg)
-        return SDW_EINVAL;
+    rc = sdwi_job_wait(info);
+    if (SDW_ETIMEOUT == rc)
+        return Error(rc, "job is still queued");
 
-    rc = sdwi_notify(0, msg);
+    if (JOB_UNKNOWN == info->status)
+        return sdwi_error(rc);
 
-    free(msg);
-    return rc;
+    return info->result;
 }
 
-const char *sdw_get_error_message(void) {
-    return last_error_msg;
+Result<State> Unit::active_state() const {
+    return sdwi_state<prop_active_state, active_state_hash_t>
+        (name_.c_str(), path_.c_str(), SDW_UNIT_ACTIVE_STAT_UNKNOWN);
 }
 
-// call initialization without trace
-// in non systemd setups we want to suppress errors/warnings
-int sdw_is_supported(void) {
-    if (LOADED == lib_stat)
-        return 0;
-
-    if (INVALID_VERSION == lib_stat)
-        return SDW_EVERSION;
+Result<State> Unit::sub_state() const {
+    return sdwi_state<prop_sub_state, sub_state_hash_t>
+        (name_.c_str(), path_.c_str(), SDW_UNIT_SUB_STAT_UNKNOWN);
+}
 
-    return SDW_EINIT;
+Result<State> Unit::load_state() const {
+    return sdwi_state<prop_load_state, load_state_hash_t>
+        (name_.c_str(), path_.c_str(), SDW_UNIT_LOAD_STAT_UNKNOWN);
 }
 
-int sdw_encode(const char *unit_name, char **ret_encoded) {
-    unit_t unit;
+Result<int> Unit::unit_file_state() const {
     int rc;
 
-    if (NULL == ret_encoded)
-        return SDW_EINVAL;
+    rc = sdwi_get_unitfilestate(name_.c_str(), NULL, 0);
+    if (rc < 0)
+        return sdwi_error(rc);
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
+    return rc;
+}
 
-    rc = sdwi_encode(&unit);
-    if (rc == 0)
-        *ret_encoded = strdup(unit.encoded);
+Result<uint32_t> Unit::main_pid() const {
+    return sdwi_value<prop_main_pid>(name_.c_str(), path_.c_str());
+}
 
-    return rc;
+Result<uint32_t> Unit::control_pid() const {
+    return sdwi_value<prop_control_pid>(name_.c_str(), path_.c_str());
 }
 
-int sdw_decode(const char *unit_name, char **ret_decoded) {
+Result<uint32_t> Unit::nrestarts() const {
+    return sdwi_value<prop_n_restarts>(name_.c_str(), path_.c_str());
+}
 
-    unit_t unit;
-    int rc;
+Result<int32_t> Unit::exec_main_status() const {
+    return sdwi_value<prop_exec_main_status>(name_.c_str(), path_.c_str());
+}
 
-    if (NULL == unit_name || NULL == ret_decoded)
-        return SDW_EINVAL;
+Result<uint64_t> Unit::memory_current() const {
+    return sdwi_value<prop_memory_current>(name_.c_str(), path_.c_str());
+}
 
-    if (strlen(unit_name) >= MAX_UNIT_NAME_LEN) {
-        LOG_ERROR("invalid unit name '%s'\n", unit_name);
-        return SDW_EINVAL;
-    }
+Result<uint64_t> Unit::active_enter_timestamp() const {
+    return sdwi_value<prop_active_enter_timestamp>(name_.c_str(),
+                                                   path_.c_str());
+}
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
+Result<bool> Unit::need_daemon_reload() const {
+    return sdwi_value<prop_need_daemon_reload>(name_.c_str(), path_.c_str());
+}
 
-    strncpy(unit.encoded, unit.name, sizeof(unit.name));
+Result<Job> Unit::start() const {
+    return Job::queue(name_.c_str(), SDBUS_START_UNIT);
+}
 
-    rc = sdwi_decode(&unit);
-    if (0 == rc)
-        *ret_decoded = strndup(unit.name, sizeof(unit.name));
+Result<Job> Unit::stop() const {
+    return Job::queue(name_.c_str(), SDBUS_STOP_UNIT);
+}
 
-    return rc;
+Result<Job> Unit::restart() const {
+    return Job::queue(name_.c_str(), SDBUS_RESTART_UNIT);
 }
 
-int sdw_get_unit_by_pid(unsigned pid, char **unit_name) {
-    char *response = NULL;
+Error Unit::enable(bool runtime, bool force) const {
     int rc;
 
-    rc = sdwi_get_unit_by_pid(pid, &response);
-    if (0 == rc) {
-        LOG_INFO("unit '%s' found for PID '%u'\n", response, pid);
-        if (strlen(response) <= MAX_RESPONSE_LEN) {
-            *unit_name = strdup(response);
-        }
-    }
-
-    if (NULL != response)
-        free(response);
+    rc = sdwi_enable(name_.c_str(), runtime, force);
 
-    return rc;
+    return 0 == rc ? Error() : sdwi_error(rc);
 }
 
-int sdw_get_activestate(const char *unit_name, char **ret_state) {
-    unit_t unit;
+Error Unit::disable(bool runtime) const {
     int rc;
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
-
-    rc = sdwi_encode(&unit);
-    if (rc != 0)
-        return rc;
+    rc = sdwi_disable(name_.c_str(), runtime);
 
-    return sdwi_get_activestate(unit.encoded, ret_state);
+    return 0 == rc ? Error() : sdwi_error(rc);
 }
 
-int sdw_get_substate(const char *unit_name, char **ret_state) {
-    unit_t unit;
+Result<Bus> Bus::system() {
     int rc;
 
-    rc = sdwi_set_unit_name(&unit, unit_name);
-    if (rc != 0)
-        return rc;
-
-    rc = sdwi_encode(&unit);
-    if (rc != 0)
-        return rc;
+    rc = sdw_is_supported();
+    if (0 != rc)
+        return Error(rc, "libsdw is not usable");
 
-    return sdwi_get_substate(unit.encoded, ret_state);
+    return Bus();
 }
 
-int sdw_enable(const char *unit_name) {
+Result<Borrowed> Bus::version() const {
+    sd_bus_message *msg = NULL;
+    const char *version = NULL;
     int rc;
-    rc = sdwi_enable(unit_name, false, true);
 
-    if (rc != 0)
-        return rc;
+    rc = sdwi_read_property<prop_version>(NULL, sdbus_object_path, &version,
+                                          &msg);
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    return sdw_reload();
+    return Borrowed(Message(msg), version);
 }
 
-int sdw_disable(const char *unit_name) {
+Error Bus::reload() const {
     int rc;
-    rc = sdwi_disable(unit_name, false);
 
-    if (rc != 0)
-        return rc;
+    rc = sdw_reload();
 
-    return sdw_reload();
+    return 0 == rc ? Error() : sdwi_error(rc);
 }
 
-int sdw_reload(void) {
-    int rc = 0;
+Result<Unit> Bus::unit(std::string_view name) const {
+    Unit u;
+    unit_t unit;
+    char path[MAX_UNIT_PATH_LEN];
+    int rc;
 
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg = NULL;
+    // sdwi_set_unit_name() needs the terminating NUL
+    if (!u.name_.assign(name))
+        return Error(SDW_EINVAL, "unit name too long");
 
-    LOG_DEBUG("'%s' '%s' '%s' '%s'\n",
-              sdbus_service_contact, sdbus_object_path,
-              sdbus_interface_mgr, "Reload");
+    rc = sdwi_set_unit_name(&unit, u.name_.c_str());
+    if (0 == rc)
+        rc = sdwi_encode(&unit);
+    if (0 == rc)
+        rc = sdwi_unit_path(unit.encoded, path, sizeof(path));
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    rc = FN_SD_BUS_CALL_METHOD(bus, sdbus_service_contact, sdbus_object_path,
-                               sdbus_interface_mgr, "Reload", &error, &msg, "");
+    u.path_.assign(path);
 
-    if (rc < 0) {
-        LOG_ERROR("failed to issue method call: %s\n", error.message);
-        goto cleanup;
-    }
+    return u;
+}
 
-cleanup:
-    FN_SD_BUS_ERROR_FREE(&error);
-    FN_SD_BUS_MESSAGE_UNREF(msg);
+Result<Unit> Bus::unit_by_pid(uint32_t pid) const {
+    char name[MAX_UNIT_NAME_LEN];
+    int rc;
 
-    if (rc >= 0)
-        return 0;
+    rc = sdwi_get_unit_by_pid(pid, name, sizeof(name));
+    if (0 != rc)
+        return sdwi_error(rc);
 
-    return SDW_EINVAL;
+    return unit(name);
 }
 
-void sdw_set_tracelevel(int trace_level) {
-    if (trace_level >= 0 && trace_level <= 2)
-        trc_level = trace_level;
-}
+}                               // namespace sdw
@@ -22,9 +22,17 @@
  *
  *  @brief   wrapper for systemd communication
  *
+ *  The functions can be called from any thread. Each thread talks to
+ *  the manager over its own bus connection, opened on its first call
+ *  and released when the thread exits, so a job is waited for on the
+ *  thread that queued it. sdw_get_error_message() reports the last
+ *  error of the calling thread.
+ *
  *                                                                    */
 /*--------------------------------------------------------------------*/
 
+#include <stddef.h>
+#include <stdint.h>
 
 enum {
     SDW_EINIT       = -1,                           /**< systemdlib initialization failed   */
@@ -32,6 +40,7 @@ enum {
     SDW_EINVAL      = -3,                           /**< invalid value                      */
     SDW_ENOTIFYSOCK = -4,                           /**< sd_notify socket not available     */
     SDW_ETIMEOUT    = -5,                           /**< timeout of synchronous call        */
+    SDW_ERANGE      = -6,                           /**< result exceeds the caller's buffer */
 
     SDW_UNIT_FILE_STAT_ENABLED              = 11,   /**< Unit FileState is enabled          */
     SDW_UNIT_FILE_STAT_DISABLED             = 12,   /**< Unit FileState is disabled         */
@@ -43,15 +52,292 @@ enum {
     SDW_UNIT_ACTIVE_STAT_DEACTIVATING       = 24,   /**< Unit ActiveState is deactivating   */
     SDW_UNIT_ACTIVE_STAT_INACTIVE           = 25,   /**< Unit ActiveState is inactive       */
     SDW_UNIT_ACTIVE_STAT_FAILED             = 26,   /**< Unit ActiveState is failed         */
+    SDW_UNIT_ACTIVE_STAT_MAINTENANCE        = 27,   /**< Unit ActiveState is maintenance    */
+    SDW_UNIT_ACTIVE_STAT_REFRESHING         = 28,   /**< Unit ActiveState is refreshing     */
 
     SDW_UNIT_SUB_STAT_UNKNOWN               = 30,   /**< Unit SubState is unknown           */
     SDW_UNIT_SUB_STAT_START                 = 31,   /**< Unit SubState is start             */
     SDW_UNIT_SUB_STAT_RUNNING               = 32,   /**< Unit SubState is running           */
     SDW_UNIT_SUB_STAT_STOP_SIGTERM          = 33,   /**< Unit SubState is stop-sigterm      */
     SDW_UNIT_SUB_STAT_DEAD                  = 34,   /**< Unit SubState is dead              */
-    SDW_UNIT_SUB_STAT_FAILED                = 35    /**< Unit SubState is failed            */
+    SDW_UNIT_SUB_STAT_FAILED                = 35,   /**< Unit SubState is failed            */
+
+    SDW_UNIT_LOAD_STAT_UNKNOWN              = 40,   /**< Unit LoadState is unknown          */
+    SDW_UNIT_LOAD_STAT_STUB                 = 41,   /**< Unit LoadState is stub             */
+    SDW_UNIT_LOAD_STAT_LOADED               = 42,   /**< Unit LoadState is loaded           */
+    SDW_UNIT_LOAD_STAT_NOT_FOUND            = 43,   /**< Unit LoadState is not-found        */
+    SDW_UNIT_LOAD_STAT_BAD_SETTING          = 44,   /**< Unit LoadState is bad-setting      */
+    SDW_UNIT_LOAD_STAT_ERROR                = 45,   /**< Unit LoadState is error            */
+    SDW_UNIT_LOAD_STAT_MERGED               = 46,   /**< Unit LoadState is merged           */
+    SDW_UNIT_LOAD_STAT_MASKED               = 47,   /**< Unit LoadState is masked           */
+
+    SDW_JOB_RESULT_UNKNOWN                  = 50,   /**< Job result is unknown              */
+    SDW_JOB_RESULT_DONE                     = 51,   /**< Job result is done                 */
+    SDW_JOB_RESULT_CANCELED                 = 52,   /**< Job result is canceled             */
+    SDW_JOB_RESULT_TIMEOUT                  = 53,   /**< Job result is timeout              */
+    SDW_JOB_RESULT_FAILED                   = 54,   /**< Job result is failed               */
+    SDW_JOB_RESULT_DEPENDENCY               = 55,   /**< Job result is dependency           */
+    SDW_JOB_RESULT_SKIPPED                  = 56,   /**< Job result is skipped              */
+    SDW_JOB_RESULT_INVALID                  = 57,   /**< Job result is invalid              */
+    SDW_JOB_RESULT_ASSERT                   = 58,   /**< Job result is assert               */
+    SDW_JOB_RESULT_UNSUPPORTED              = 59,   /**< Job result is unsupported          */
+    SDW_JOB_RESULT_COLLECTED                = 60,   /**< Job result is collected            */
+    SDW_JOB_RESULT_ONCE                     = 61,   /**< Job result is once                 */
+    SDW_JOB_RESULT_FROZEN                   = 62,   /**< Job result is frozen               */
+    SDW_JOB_RESULT_CONCURRENCY              = 63,   /**< Job result is concurrency          */
+
+    /* further SubStates of all unit types, see systemd.unit(5) */
+    SDW_UNIT_SUB_STAT_CONDITION             = 100,  /**< Unit SubState is condition         */
+    SDW_UNIT_SUB_STAT_START_PRE             = 101,  /**< Unit SubState is start-pre         */
+    SDW_UNIT_SUB_STAT_START_POST            = 102,  /**< Unit SubState is start-post        */
+    SDW_UNIT_SUB_STAT_EXITED                = 103,  /**< Unit SubState is exited            */
+    SDW_UNIT_SUB_STAT_RELOAD                = 104,  /**< Unit SubState is reload            */
+    SDW_UNIT_SUB_STAT_RELOAD_SIGNAL         = 105,  /**< Unit SubState is reload-signal     */
+    SDW_UNIT_SUB_STAT_RELOAD_NOTIFY         = 106,  /**< Unit SubState is reload-notify     */
+    SDW_UNIT_SUB_STAT_STOP                  = 107,  /**< Unit SubState is stop              */
+    SDW_UNIT_SUB_STAT_STOP_WATCHDOG         = 108,  /**< Unit SubState is stop-watchdog     */
+    SDW_UNIT_SUB_STAT_STOP_SIGKILL          = 109,  /**< Unit SubState is stop-sigkill      */
+    SDW_UNIT_SUB_STAT_STOP_POST             = 110,  /**< Unit SubState is stop-post         */
+    SDW_UNIT_SUB_STAT_FINAL_WATCHDOG        = 111,  /**< Unit SubState is final-watchdog    */
+    SDW_UNIT_SUB_STAT_FINAL_SIGTERM         = 112,  /**< Unit SubState is final-sigterm     */
+    SDW_UNIT_SUB_STAT_FINAL_SIGKILL         = 113,  /**< Unit SubState is final-sigkill     */
+    SDW_UNIT_SUB_STAT_DEAD_BEFORE_AUTO_RESTART = 114, /**< Unit SubState is dead-before-auto-restart */
+    SDW_UNIT_SUB_STAT_FAILED_BEFORE_AUTO_RESTART = 115, /**< Unit SubState is failed-before-auto-restart */
+    SDW_UNIT_SUB_STAT_DEAD_RESOURCES_PINNED = 116, /**< Unit SubState is dead-resources-pinned */
+    SDW_UNIT_SUB_STAT_AUTO_RESTART          = 117,  /**< Unit SubState is auto-restart      */
+    SDW_UNIT_SUB_STAT_AUTO_RESTART_QUEUED   = 118,  /**< Unit SubState is auto-restart-queued */
+    SDW_UNIT_SUB_STAT_CLEANING              = 119,  /**< Unit SubState is cleaning          */
+    SDW_UNIT_SUB_STAT_START_CHOWN           = 120,  /**< Unit SubState is start-chown       */
+    SDW_UNIT_SUB_STAT_LISTENING             = 121,  /**< Unit SubState is listening         */
+    SDW_UNIT_SUB_STAT_STOP_PRE              = 122,  /**< Unit SubState is stop-pre          */
+    SDW_UNIT_SUB_STAT_STOP_PRE_SIGTERM      = 123,  /**< Unit SubState is stop-pre-sigterm  */
+    SDW_UNIT_SUB_STAT_STOP_PRE_SIGKILL      = 124,  /**< Unit SubState is stop-pre-sigkill  */
+    SDW_UNIT_SUB_STAT_MOUNTING              = 125,  /**< Unit SubState is mounting          */
+    SDW_UNIT_SUB_STAT_MOUNTING_DONE         = 126,  /**< Unit SubState is mounting-done     */
+    SDW_UNIT_SUB_STAT_MOUNTED               = 127,  /**< Unit SubState is mounted           */
+    SDW_UNIT_SUB_STAT_REMOUNTING            = 128,  /**< Unit SubState is remounting        */
+    SDW_UNIT_SUB_STAT_UNMOUNTING            = 129,  /**< Unit SubState is unmounting        */
+    SDW_UNIT_SUB_STAT_REMOUNTING_SIGTERM    = 130,  /**< Unit SubState is remounting-sigterm*/
+    SDW_UNIT_SUB_STAT_REMOUNTING_SIGKILL    = 131,  /**< Unit SubState is remounting-sigkill*/
+    SDW_UNIT_SUB_STAT_UNMOUNTING_SIGTERM    = 132,  /**< Unit SubState is unmounting-sigterm*/
+    SDW_UNIT_SUB_STAT_UNMOUNTING_SIGKILL    = 133,  /**< Unit SubState is unmounting-sigkill*/
+    SDW_UNIT_SUB_STAT_ACTIVATING            = 134,  /**< Unit SubState is activating        */
+    SDW_UNIT_SUB_STAT_ACTIVATING_DONE       = 135,  /**< Unit SubState is activating-done   */
+    SDW_UNIT_SUB_STAT_ACTIVE                = 136,  /**< Unit SubState is active            */
+    SDW_UNIT_SUB_STAT_DEACTIVATING          = 137,  /**< Unit SubState is deactivating      */
+    SDW_UNIT_SUB_STAT_DEACTIVATING_SIGTERM = 138, /**< Unit SubState is deactivating-sigterm */
+    SDW_UNIT_SUB_STAT_DEACTIVATING_SIGKILL = 139, /**< Unit SubState is deactivating-sigkill */
+    SDW_UNIT_SUB_STAT_WAITING               = 140,  /**< Unit SubState is waiting           */
+    SDW_UNIT_SUB_STAT_ELAPSED               = 141,  /**< Unit SubState is elapsed           */
+    SDW_UNIT_SUB_STAT_TENTATIVE             = 142,  /**< Unit SubState is tentative         */
+    SDW_UNIT_SUB_STAT_PLUGGED               = 143,  /**< Unit SubState is plugged           */
+    SDW_UNIT_SUB_STAT_ABANDONED             = 144   /**< Unit SubState is abandoned         */
+};
+
+// D-Bus operations measured by sdw_get_stats()
+enum {
+    SDW_OP_GET_PROPERTY     = 0,                    /**< property read                      */
+    SDW_OP_START_UNIT       = 1,                    /**< StartUnit call                     */
+    SDW_OP_STOP_UNIT        = 2,                    /**< StopUnit call                      */
+    SDW_OP_RESTART_UNIT     = 3,                    /**< RestartUnit call                   */
+    SDW_OP_GET_UNIT_BY_PID  = 4,                    /**< GetUnitByPID call                  */
+    SDW_OP_GET_FILE_STATE   = 5,                    /**< GetUnitFileState call              */
+    SDW_OP_ENABLE           = 6,                    /**< EnableUnitFiles call               */
+    SDW_OP_DISABLE          = 7,                    /**< DisableUnitFiles call              */
+    SDW_OP_RELOAD           = 8,                    /**< Reload call                        */
+    SDW_OP_JOB_WAIT         = 9,                    /**< wait for JobRemoved                */
+    SDW_OP_SUBSCRIBE        = 10,                   /**< Subscribe call                     */
+    SDW_OP_LIST_UNITS       = 11,                   /**< ListUnitsByPatterns call           */
+    SDW_OP_GET_PROCESSES    = 12,                   /**< GetUnitProcesses call              */
+    SDW_OP_COUNT            = 13
+};
+
+#define SDW_STATS_BUCKETS 32
+
+/** size of the error message buffer, see sdw_get_error_message() */
+#define SDW_MAX_ERROR_LEN 1024
+
+/** latency statistics of one SDW_OP_* */
+typedef struct {
+    uint64_t calls;             /**< finished operations                */
+    uint64_t errors;            /**< operations that failed             */
+    uint64_t total_usec;        /**< sum of all latencies               */
+    uint64_t max_usec;          /**< highest latency                    */
+    /** hist[i] counts latencies in [2^i, 2^(i+1)) usec, hist[0] also
+     *  counts 0 usec, the last bucket everything above */
+    uint64_t hist[SDW_STATS_BUCKETS];
+} sdw_op_stats_t;
+
+typedef struct {
+    sdw_op_stats_t op[SDW_OP_COUNT];    /**< indexed by SDW_OP_*    */
+} sdw_stats_t;
+
+/** D-Bus operation passed to the trace hooks, the strings are only valid
+ *  during the hook call */
+typedef struct {
+    int op;                     /**< SDW_OP_*                           */
+    const char *unit;           /**< unit name, NULL if not known       */
+    const char *path;           /**< object path, the unit for property
+                                     reads, the job for job waits       */
+    const char *member;         /**< property name of property reads    */
+    const char *job;            /**< job queued by Start/Stop/RestartUnit,
+                                     end hook only                      */
+    uint64_t duration_usec;     /**< end hook only                      */
+    int rc;                     /**< < 0 if failed, end hook only       */
+    void *span;                 /**< free for the hooks, e.g. set by the
+                                     begin hook and read by the end hook */
+} sdw_trace_event_t;
+
+typedef void (*sdw_trace_hook_t)(sdw_trace_event_t *event, void *userdata);
+
+// trace levels of sdw_set_tracelevel() and the log records
+enum {
+    SDW_LOG_ERROR           = 0,                    /**< errors, see sdw_log_set_errors()   */
+    SDW_LOG_INFO            = 1,                    /**< results of the D-Bus calls         */
+    SDW_LOG_DEBUG           = 2                     /**< the D-Bus calls                    */
+};
+
+/** receives one formatted log record, msg ends with a newline */
+typedef void (*sdw_log_fn_t)(int level, const char *msg, void *userdata);
+
+// flags of sdw_journal_enable()
+enum {
+    SDW_JOURNAL_OFF         = 0,                    /**< nothing sent to the journal        */
+    SDW_JOURNAL_OPS         = 1,                    /**< one entry per D-Bus operation      */
+    SDW_JOURNAL_LOG         = 2                     /**< the log records                    */
+};
+
+// modes of sdw_set_pid_lookup()
+enum {
+    SDW_PID_LOOKUP_AUTO     = 0,                    /**< cgroupfs first, then the manager   */
+    SDW_PID_LOOKUP_BUS      = 1,                    /**< always ask the manager             */
+    SDW_PID_LOOKUP_CGROUP   = 2                     /**< only /proc/<pid>/cgroup            */
+};
+
+// policies of sdw_set_reload_policy()
+enum {
+    SDW_RELOAD_IMMEDIATE    = 0,                    /**< Reload after every enable, disable */
+    SDW_RELOAD_NONE         = 1,                    /**< the caller runs sdw_reload()       */
+    SDW_RELOAD_DEFERRED     = 2                     /**< one Reload per window of changes   */
+};
+
+// fields set in sdw_unit_change_t
+enum {
+    SDW_CHANGE_ACTIVE_STATE = 1,                    /**< active_state                       */
+    SDW_CHANGE_SUB_STATE    = 2,                    /**< sub_state                          */
+    SDW_CHANGE_MAIN_PID     = 4,                    /**< main_pid                           */
+    SDW_CHANGE_INVALIDATED  = 8                     /**< one of them changed, value not sent */
+};
+
+/** change of a unit passed to the watch callback, the strings are only
+ *  valid during the callback */
+typedef struct {
+    const char *unit_name;
+    int changed;                /**< SDW_CHANGE_* of the set fields     */
+    const char *active_state;   /**< e.g. "active"                      */
+    const char *sub_state;      /**< e.g. "running"                     */
+    uint32_t main_pid;          /**< 0 if the unit has no main process  */
+    uint64_t ts_usec;           /**< CLOCK_MONOTONIC when it was read   */
+} sdw_unit_change_t;
+
+// cgroup files read into sdw_unit_resources_t
+enum {
+    SDW_RES_MEMORY          = 1,                    /**< memory.current and memory.stat     */
+    SDW_RES_CPU             = 2,                    /**< cpu.stat                           */
+    SDW_RES_IO              = 4,                    /**< io.stat                            */
+    SDW_RES_PIDS            = 8                     /**< pids.current                       */
+};
+
+/** resource usage of a unit from its cgroup v2 directory, the fields of
+ *  a file not set in valid are 0 */
+typedef struct {
+    int valid;                  /**< SDW_RES_* of the files read        */
+    uint64_t memory_current;    /**< bytes, memory.current              */
+    uint64_t memory_anon;       /**< bytes, memory.stat                 */
+    uint64_t memory_file;
+    uint64_t memory_kernel_stack;
+    uint64_t memory_slab;
+    uint64_t memory_sock;
+    uint64_t memory_shmem;
+    uint64_t memory_pgfault;    /**< count                              */
+    uint64_t memory_pgmajfault;
+    uint64_t cpu_usage_usec;    /**< cpu.stat                           */
+    uint64_t cpu_user_usec;
+    uint64_t cpu_system_usec;
+    uint64_t cpu_nr_periods;    /**< only with the cpu controller       */
+    uint64_t cpu_nr_throttled;
+    uint64_t cpu_throttled_usec;
+    uint64_t io_rbytes;         /**< io.stat, sum of all devices        */
+    uint64_t io_wbytes;
+    uint64_t io_rios;
+    uint64_t io_wios;
+    uint64_t pids_current;      /**< pids.current                       */
+} sdw_unit_resources_t;
+
+typedef void (*sdw_unit_change_fn_t)(const sdw_unit_change_t *change,
+                                     void *userdata);
+
+/** unit state changes of one thread's connection, see sdw_watch_new() */
+typedef struct sdw_watch sdw_watch_t;
+
+// sources of sdw_pressure_add() and events of sdw_pressure_event_t
+enum {
+    SDW_PRESSURE_MEMORY     = 1,                    /**< memory.pressure trigger            */
+    SDW_PRESSURE_CPU        = 2,                    /**< cpu.pressure trigger               */
+    SDW_PRESSURE_IO         = 4,                    /**< io.pressure trigger                */
+    SDW_PRESSURE_OOM        = 8,                    /**< oom or oom_kill of memory.events   */
+    SDW_PRESSURE_REMOVED    = 16                    /**< cgroup removed, add the unit again */
 };
 
+/** event passed to the pressure callback, unit_name is only valid
+ *  during the callback */
+typedef struct {
+    const char *unit_name;
+    int type;                   /**< one SDW_PRESSURE_*, REMOVED with the type of the file */
+    unsigned some_avg10;        /**< pressure only, percent * 100       */
+    unsigned full_avg10;
+    uint64_t some_total_usec;
+    uint64_t full_total_usec;
+    uint64_t oom;               /**< OOM only, counters of memory.events */
+    uint64_t oom_kill;
+    uint64_t ts_usec;           /**< CLOCK_MONOTONIC when it was read   */
+} sdw_pressure_event_t;
+
+typedef void (*sdw_pressure_fn_t)(const sdw_pressure_event_t *event,
+                                  void *userdata);
+
+/** PSI triggers and OOM events of units, see sdw_pressure_new() */
+typedef struct sdw_pressure sdw_pressure_t;
+
+struct sd_bus;
+
+/** connection to a systemd manager, see sdw_set_transport() */
+typedef struct {
+    const char *name;
+    int (*open)(struct sd_bus **ret_bus, void *userdata);  /**< 0 or -errno  */
+    void (*close)(void *userdata);      /**< after the bus is released, may be NULL */
+    void *userdata;
+    int one_connection;                 /**< open() serves one connection only */
+} sdw_transport_t;
+
+/** simulated manager, see sdw_sim_transport() */
+typedef struct {
+    unsigned units;             /**< serves fake-0.service .. fake-<units-1>.service */
+    unsigned latency_usec;      /**< added to every call, calls are serialized */
+    unsigned job_usec;          /**< from a queued job to its JobRemoved */
+    unsigned error_permille;    /**< calls failing with error_name */
+    const char *error_name;     /**< NULL for org.freedesktop.DBus.Error.Failed */
+    unsigned storm;             /**< unrelated JobRemoved signals per job */
+    unsigned seed;              /**< of the error injection */
+} sdw_sim_config_t;
+
+/** replay of a capture, see sdw_replay_transport() */
+typedef struct {
+    const char *file;           /**< written by sdw_capture_transport() */
+    unsigned latency_percent;   /**< of the recorded latencies, 100 as recorded, 0 none */
+    int loop;                   /**< start over once all recorded calls were served */
+} sdw_replay_config_t;
+
 
 /*--------------------------------------------------------------------*/
 /* sdw_check_pid ()                                                   */
@@ -59,6 +345,8 @@ enum {
 /** Check if the PID of the calling process is started from systemd
  *  and it's own unit name matches unit_name
  *
+ * The unit is looked up as by sdw_get_unit_by_pid().
+ *
  * @param  unit_name       unit_name of service
  * @param  pid             optional PID,
  *                         the default value '0' will be replaced by
@@ -115,6 +403,244 @@ int sdw_get_mainpid(const char *unit_name,
                     unsigned *pid);
 
 
+/*--------------------------------------------------------------------*/
+/* sdw_get_mainpid_fd ()                                              */
+/*                                                                    */
+/** Open a pidfd of the main process of the service 'unit_name'
+ *
+ * The pidfd refers to the process found by sdw_get_mainpid() even if
+ * its PID is reused later. It polls readable once the process exited,
+ * see poll(2), and takes signals with pidfd_send_signal(2). MainPID is
+ * asked again after pidfd_open(2), the process cannot have exited and
+ * its PID been reused meanwhile while the manager did not change it.
+ *
+ * @param  unit_name       unit_name of service
+ * @param  pid             pid as out parameter, may be NULL
+ * @param  pidfd           pidfd as out parameter, -1 on failure
+ *
+ * @retval pid             pid of the main process
+ * @retval pidfd           caller must close() it
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter, unit not found, no main
+ *                          process or pidfd_open(2) not supported
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_mainpid_fd(const char *unit_name,
+                       unsigned *pid,
+                       int *pidfd);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_controlpid ()                                              */
+/*                                                                    */
+/** Get the ControlPID for the service 'unit_name'
+ *
+ * @param  unit_name       unit_name of service
+ * @param  pid             pid as out parameter
+ *
+ * @retval pid             pid of the running control process, 0 if none
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_controlpid(const char *unit_name,
+                       unsigned *pid);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_nrestarts ()                                               */
+/*                                                                    */
+/** Get the number of automatic restarts of the service
+ *
+ * @param  unit_name       unit_name of service
+ * @param  count           restart count as out parameter
+ *
+ * @retval count           NRestarts of the service
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_nrestarts(const char *unit_name,
+                      unsigned *count);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_exec_main_status ()                                        */
+/*                                                                    */
+/** Get the exit status of the last main process of the service
+ *
+ * @param  unit_name       unit_name of service
+ * @param  status          exit status as out parameter
+ *
+ * @retval status          ExecMainStatus of the service
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_exec_main_status(const char *unit_name,
+                             int *status);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_memory_current ()                                          */
+/*                                                                    */
+/** Get the current memory usage of the service
+ *
+ * The value is UINT64_MAX if memory accounting is off for the unit.
+ *
+ * @param  unit_name       unit_name of service
+ * @param  bytes           memory usage as out parameter
+ *
+ * @retval bytes           MemoryCurrent of the service in bytes
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_memory_current(const char *unit_name,
+                           uint64_t *bytes);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_unit_resources ()                                          */
+/*                                                                    */
+/** Read the resource usage of a unit from its cgroup
+ *
+ * Reads memory.current, memory.stat, cpu.stat, io.stat and pids.current
+ * of the cgroup v2 directory of the unit instead of asking the manager
+ * per value, for services, scopes, slices, sockets, mounts and swaps.
+ * The ControlGroup is asked once, the files stay open and are read
+ * again with pread() on the next call until the cgroup is removed. The
+ * files of the least recently read unit are closed once 512 units are
+ * open. Files of controllers not enabled for the unit are left out of
+ * res->valid.
+ *
+ * @param  unit_name       unit_name of service, scope, slice, socket,
+ *                         mount or swap
+ * @param  res             resource usage as out parameter
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter, unit not found, not running
+ *                          or no cgroup v2 hierarchy mounted
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_unit_resources(const char *unit_name,
+                           sdw_unit_resources_t *res);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_unit_pids ()                                               */
+/*                                                                    */
+/** List the processes of a unit
+ *
+ * Reads cgroup.procs of the cgroup v2 directory of the unit and of
+ * the cgroups below it, the ControlGroup is remembered like by
+ * sdw_get_unit_resources(). Without cgroup v2 hierarchy, or with the
+ * manager selected by sdw_set_pid_lookup(), GetUnitProcesses is called
+ * instead, which makes the manager read the command line of every
+ * process.
+ *
+ * @param  unit_name       unit_name of service, scope, slice, socket,
+ *                         mount or swap
+ * @param  ret_pids        array of the PIDs, NULL if there are none
+ *
+ * @retval ret_pids        caller must release the array with free()
+ *
+ * @return
+ *     - #>= 0          number of processes
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter, unit not found or not running
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_unit_pids(const char *unit_name,
+                      unsigned **ret_pids);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_active_enter_timestamp ()                                  */
+/*                                                                    */
+/** Get the time the unit last entered the active state
+ *
+ * The timestamp is CLOCK_MONOTONIC, 0 if the unit was never active.
+ *
+ * @param  unit_name       unit_name of the unit
+ * @param  usec            timestamp as out parameter
+ *
+ * @retval usec            ActiveEnterTimestampMonotonic in usec
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_active_enter_timestamp(const char *unit_name,
+                                   uint64_t *usec);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_need_daemon_reload ()                                      */
+/*                                                                    */
+/** Check if the unit file changed since it was loaded
+ *
+ * @param  unit_name       unit_name of the unit
+ * @param  need            flag as out parameter
+ *
+ * @retval need            1 if sdw_reload() is due, else 0
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_need_daemon_reload(const char *unit_name,
+                               int *need);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_unit_job ()                                                */
+/*                                                                    */
+/** Get the id of the job pending for the unit
+ *
+ * @param  unit_name       unit_name of the unit
+ * @param  job_id          job id as out parameter
+ *
+ * @retval job_id          id of the pending job, 0 if none
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or unit not found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_unit_job(const char *unit_name,
+                     unsigned *job_id);
+
+
 /*--------------------------------------------------------------------*/
 /* sdw_start ()                                                       */
 /*                                                                    */
@@ -189,6 +715,8 @@ int sdw_restart(const char *unit_name,
 /* sdw_enable ()                                                      */
 /*                                                                    */
 /** Enable the service 'unit_name'
+ *
+ * The manager is reloaded as set by sdw_set_reload_policy().
  *
  * @param  unit_name        unit name of service
  *
@@ -206,6 +734,8 @@ int sdw_enable(const char *unit_name);
 /* sdw_disable ()                                                     */
 /*                                                                    */
 /** Disable the service 'unit_name'
+ *
+ * The manager is reloaded as set by sdw_set_reload_policy().
  *
  * @param  unit_name        unit name of service
  *
@@ -237,146 +767,582 @@ int sdw_reload(void);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_get_version ()                                                 */
+/* sdw_enable_units ()                                                */
 /*                                                                    */
-/** Read the systemd version
+/** Enable many services with one EnableUnitFiles call
  *
- * @param  ret_version      systemd version as out parameter
+ * The manager is reloaded once for all of them as set by
+ * sdw_set_reload_policy().
  *
- * @retval ret_version      caller must release the memory with free()
+ * @param  unit_names       NULL terminated list of unit names
  *
  * @return
- *     - #0             successful, systemd library initialized,
- *                      version info is available
+ *     - #0             successful, all services enabled
+ *     - #SDW_EINVAL    failed, no service enabled
  *     - #SDW_EINIT     sdbus library initialization failed
  *     - #SDW_EVERSION  invalid systemd version detected
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_get_version(char **ret_version);
+int sdw_enable_units(const char *const *unit_names);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_notify_ready ()                                                */
+/* sdw_disable_units ()                                               */
 /*                                                                    */
-/** Notify service manager that service startup is finished
- *  For details see man sd_notify, READY=1
+/** Disable many services with one DisableUnitFiles call
+ *
+ * The manager is reloaded once for all of them as set by
+ * sdw_set_reload_policy().
+ *
+ * @param  unit_names       NULL terminated list of unit names
  *
  * @return
- *     - #0             successful
+ *     - #0             successful, all services disabled
+ *     - #SDW_EINVAL    failed, no service disabled
  *     - #SDW_EINIT     sdbus library initialization failed
  *     - #SDW_EVERSION  invalid systemd version detected
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_notify_ready(void);
+int sdw_disable_units(const char *const *unit_names);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_notify_stopping ()                                             */
+/* sdw_set_reload_policy ()                                           */
 /*                                                                    */
-/** Notify service manager that service is stopping
- *  For details see man sd_notify, STOPPING=1
+/** Select when the enable and disable functions reload the manager
+ *
+ * A Reload makes PID 1 parse all unit files again and holds back
+ * every other job meanwhile. #SDW_RELOAD_IMMEDIATE, the default,
+ * reloads before each call returns. With #SDW_RELOAD_NONE the caller
+ * runs sdw_reload() after its changes. #SDW_RELOAD_DEFERRED returns
+ * at once and reloads on a thread of libsdw 'window_ms' after the
+ * first change not yet reloaded, all changes of all threads until
+ * then share that Reload. sdw_reload() covers the changes made
+ * before it, sdw_reload_flush() waits for them. A transport serving
+ * one connection, e.g. sdw_capture_transport(), leaves the thread of
+ * libsdw without one, #SDW_RELOAD_DEFERRED reloads immediately there.
+ *
+ * @param  policy          SDW_RELOAD_*
+ * @param  window_ms       delay of a deferred Reload
  *
  * @return
  *     - #0             successful
- *     - #SDW_EINIT     sdbus library initialization failed
- *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    unknown policy
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_notify_stopping(void);
+int sdw_set_reload_policy(int policy,
+                          unsigned window_ms);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_notify_mainpid ()                                              */
+/* sdw_reload_flush ()                                                */
 /*                                                                    */
-/** Update the mainpid of the service.
- *  For details see man sd_notify, MAINPID=%u
+/** Run a deferred Reload now and wait until it finished
  *
- * @param  pid              new mainpid of service
+ * Call it before the changes must be in effect, e.g. before starting
+ * a just enabled service, and before the process exits, a deferred
+ * Reload still pending then is lost.
  *
  * @return
- *     - #0             successful
- *     - #SDW_EINIT     sdbus library initialization failed
- *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #0             successful or nothing to reload
+ *     - #SDW_EINVAL    a deferred Reload since the last call failed
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_notify_mainpid(unsigned pid);
+int sdw_reload_flush(void);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_get_error_message ()                                           */
+/* sdw_list_units ()                                                  */
 /*                                                                    */
-/** Get last error message
+/** List the units the manager has loaded whose names match one of
+ *  the patterns, like systemctl list-units PATTERN...
  *
- * @return      pointer to last error message
- *              memory must not be released from the caller
+ * @param  patterns        NULL terminated list of unit name globs,
+ *                         see fnmatch(3)
+ * @param  ret_units       NULL terminated array of the unit names
+ *
+ * @retval ret_units       caller must release the array and the names
+ *                         with one free() of the array
+ *
+ * @return
+ *     - #>= 0          number of units found
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter or call failed
  *                                                                    */
 /*--------------------------------------------------------------------*/
-const char *sdw_get_error_message(void);
+int sdw_list_units(const char *const *patterns, char ***ret_units);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_is_supported ()                                                */
+/* sdw_watch_new ()                                                   */
 /*                                                                    */
-/** check systemd version for defined minimum version number
+/** Subscribe to the state changes of units
+ *
+ * Subscribes the connection of the calling thread to the signals of
+ * the manager and reports each change of ActiveState, SubState and
+ * MainPID of the matching units to fn, called by sdw_watch_process()
+ * and while a sdw_start(), sdw_stop() or sdw_restart() of the thread
+ * waits for its job. The watch belongs to the calling thread, the other
+ * libsdw calls of the thread may be made in between, e.g. to read the
+ * initial state after the watch was created. A field is reported as
+ * changed only if it differs from its last value in a signal, the
+ * first signal of a unit reports all fields it carries.
+ *
+ * @param  patterns        NULL terminated list of unit name globs,
+ *                         see fnmatch(3), NULL for all units
+ * @param  fn              called once per change
+ * @param  userdata        passed to fn
+ * @param  ret_watch       release with sdw_watch_free()
  *
  * @return
  *     - #0             successful
  *     - #SDW_EINIT     sdbus library initialization failed
- *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #SDW_EINVAL    invalid parameter or subscription failed
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_is_supported(void);
+int sdw_watch_new(const char *const *patterns, sdw_unit_change_fn_t fn,
+                  void *userdata, sdw_watch_t **ret_watch);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_encode ()                                                      */
+/* sdw_watch_get_fd ()                                                */
 /*                                                                    */
-/** Encode a unit name, for details see 'man sd_bus_path_encode'
+/** File descriptor of the watch for poll(2)
  *
- * @param  unit_name        unit name
- * @param  ret_encoded      pointer to the encoded unit name
+ * Readable when changes arrive. Other libsdw calls of the thread may
+ * have read them from the socket already, call sdw_watch_process()
+ * with timeout 0 before polling.
  *
- * @retval ret_encoded      caller must release the memory with free()
+ * @param  watch           from sdw_watch_new()
  *
  * @return
- *     - #0             successful
- *     - #SDW_EINVAL    failed
- *     - #SDW_EINIT     sdbus library initialization failed
- *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #>= 0          file descriptor
+ *     - #SDW_EINVAL    invalid watch
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_encode(const char *unit_name,
-               char **ret_encoded);
+int sdw_watch_get_fd(const sdw_watch_t *watch);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_decode ()                                                      */
+/* sdw_watch_process ()                                               */
 /*                                                                    */
-/** Decode a unit name, for details see 'man sd_bus_path_decode'
+/** Report the pending changes of the watch
  *
- * @param  unit_name        encoded unit name
- * @param  ret_decoded      pointer to the decoded unit name
+ * Calls fn of the watch for each change received so far. Waits up to
+ * timeout_ms for one if none is pending.
  *
- * @retval ret_decoded      caller must release the memory with free()
+ * @param  watch           from sdw_watch_new()
+ * @param  timeout_ms      0 does not wait, < 0 waits without limit
  *
  * @return
- *     - #0             successful
- *     - #SDW_EINVAL    failed
- *     - #SDW_EINIT     sdbus library initialization failed
- *     - #SDW_EVERSION  invalid systemd version detected
+ *     - #>= 0          number of reported changes
+ *     - #SDW_EINIT     connection lost or replaced, free the watch and
+ *                      create a new one, changes may have been missed
+ *     - #SDW_EINVAL    invalid watch or called from another thread
  *                                                                    */
 /*--------------------------------------------------------------------*/
-int sdw_decode(const char *unit_name,
-               char **ret_decoded);
+int sdw_watch_process(sdw_watch_t *watch, int timeout_ms);
 
 
 /*--------------------------------------------------------------------*/
-/* sdw_get_unit_by_pid ()                                             */
+/* sdw_watch_free ()                                                  */
 /*                                                                    */
-/** Lookup the unit name for a running process
- *
- * @param  pid              pid of the process
- * @param  ret_unit_name    pointer to the unit name of the process
+/** Stop a watch, must be called by the thread which created it
+ *
+ * @param  watch           from sdw_watch_new(), may be NULL
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_watch_free(sdw_watch_t *watch);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_pressure_new ()                                                */
+/*                                                                    */
+/** Create a watcher for the pressure stall information of units
+ *
+ * The units are added with sdw_pressure_add(), the events are reported
+ * to fn by sdw_pressure_process(). Unlike sdw_watch_new() it reads the
+ * cgroup v2 files of the units and needs no connection once the units
+ * are added. The watcher is used by one thread at a time.
+ *
+ * @param  fn              called once per event
+ * @param  userdata        passed to fn
+ * @param  ret_pressure    release with sdw_pressure_free()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    invalid parameter or no cgroup v2 hierarchy
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_pressure_new(sdw_pressure_fn_t fn, void *userdata,
+                     sdw_pressure_t **ret_pressure);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_pressure_add ()                                                */
+/*                                                                    */
+/** Watch the pressure of a service
+ *
+ * Registers a PSI trigger 'some <stall_usec> <window_usec>' on each
+ * selected pressure file of the cgroup of the service, an event is
+ * reported at most once per window while the tasks of the service were
+ * stalled for more than stall_usec in it. The kernel requires a window
+ * of 500 ms to 10 s, unprivileged callers a multiple of 2 s.
+ * SDW_PRESSURE_OOM reports each increase of the oom and oom_kill
+ * counters instead. The triggers are gone with the cgroup, e.g. after a
+ * restart, which is reported as SDW_PRESSURE_REMOVED.
+ *
+ * @param  pressure        from sdw_pressure_new()
+ * @param  unit_name       unit_name of service
+ * @param  types           SDW_PRESSURE_MEMORY, _CPU, _IO and _OOM
+ * @param  stall_usec      stall time per window that triggers
+ * @param  window_usec     window of the trigger
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter, unit not running or the
+ *                          kernel refused the trigger
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_pressure_add(sdw_pressure_t *pressure, const char *unit_name,
+                     int types, unsigned stall_usec, unsigned window_usec);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_pressure_get_fd ()                                             */
+/*                                                                    */
+/** File descriptor of the watcher for poll(2)
+ *
+ * An epoll instance, readable while events are pending.
+ *
+ * @param  pressure        from sdw_pressure_new()
+ *
+ * @return
+ *     - #>= 0          file descriptor
+ *     - #SDW_EINVAL    invalid watcher
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_pressure_get_fd(const sdw_pressure_t *pressure);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_pressure_process ()                                            */
+/*                                                                    */
+/** Report the pending events of the watcher
+ *
+ * Calls fn of the watcher for each event. Waits up to timeout_ms for
+ * one if none is pending.
+ *
+ * @param  pressure        from sdw_pressure_new()
+ * @param  timeout_ms      0 does not wait, < 0 waits without limit
+ *
+ * @return
+ *     - #>= 0          number of reported events
+ *     - #SDW_EINVAL    invalid watcher or epoll_wait() failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_pressure_process(sdw_pressure_t *pressure, int timeout_ms);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_pressure_free ()                                               */
+/*                                                                    */
+/** Remove the triggers and release the watcher
+ *
+ * @param  pressure        from sdw_pressure_new(), may be NULL
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_pressure_free(sdw_pressure_t *pressure);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_version ()                                                 */
+/*                                                                    */
+/** Read the systemd version
+ *
+ * @param  ret_version      systemd version as out parameter
+ *
+ * @retval ret_version      caller must release the memory with free()
+ *
+ * @return
+ *     - #0             successful, systemd library initialized,
+ *                      version info is available
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_version(char **ret_version);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_version_r ()                                               */
+/*                                                                    */
+/** Read the systemd version into a caller supplied buffer
+ *
+ * @param  buf              buffer for the systemd version
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_ERANGE    version exceeds len
+ *     - #SDW_EINVAL    failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_version_r(char *buf, size_t len);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_notify_ready ()                                                */
+/*                                                                    */
+/** Notify service manager that service startup is finished
+ *  For details see man sd_notify, READY=1
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_notify_ready(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_notify_stopping ()                                             */
+/*                                                                    */
+/** Notify service manager that service is stopping
+ *  For details see man sd_notify, STOPPING=1
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_notify_stopping(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_notify_mainpid ()                                              */
+/*                                                                    */
+/** Update the mainpid of the service.
+ *  For details see man sd_notify, MAINPID=%u
+ *
+ * @param  pid              new mainpid of service
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_notify_mainpid(unsigned pid);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_status_publish ()                                              */
+/*                                                                    */
+/** Publish a free-form status text to the service manager,
+ *  for details see man sd_notify, STATUS=...
+ *  Updates are rate limited, see sdw_status_set_interval().
+ *  A value equal to the last sent one is skipped, an update within
+ *  the interval is coalesced and only the latest value is sent
+ *  when the interval expired.
+ *
+ * @param  status           status text without newlines
+ *
+ * @return
+ *     - #0                 successful, sent or queued
+ *     - #SDW_EINVAL        invalid status or send failed
+ *     - #SDW_ENOTIFYSOCK   sd_notify socket not available
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_status_publish(const char *status);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_status_flush ()                                                */
+/*                                                                    */
+/** Send a coalesced status update immediately, e.g. before
+ *  sdw_notify_stopping()
+ *
+ * @return
+ *     - #0                 successful or nothing to send
+ *     - #SDW_EINVAL        send failed
+ *     - #SDW_ENOTIFYSOCK   sd_notify socket not available
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_status_flush(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_status_set_interval ()                                         */
+/*                                                                    */
+/** Set the minimum interval between two STATUS= messages
+ *
+ * @param  interval_ms      interval in ms, default 1000,
+ *                          0 sends every changed value immediately
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_status_set_interval(unsigned interval_ms);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_error_message ()                                           */
+/*                                                                    */
+/** Get last error message
+ *
+ * Failed D-Bus calls only record the operation, errno, D-Bus error
+ * name and unit, the text is formatted by the first call after the
+ * failure. The error and the buffer of #SDW_MAX_ERROR_LEN bytes are
+ * per thread.
+ *
+ * @return      pointer to last error message of the calling thread
+ *              memory must not be released from the caller
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+const char *sdw_get_error_message(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_log_set_errors ()                                              */
+/*                                                                    */
+/** Log errors in addition to keeping the last one
+ *
+ * Off by default, failures are then only available through
+ * sdw_get_error_message(). If enabled, each error is formatted when it
+ * happens and passed to the log output like the other records.
+ *
+ * @param  enable          1 logs errors, 0 keeps them quiet
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_log_set_errors(int enable);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_stats ()                                                   */
+/*                                                                    */
+/** Copy the call counters and latency histograms of all operations
+ *
+ * The counters are updated without locks, a copy taken while other
+ * threads call libsdw may be off by the calls in flight.
+ *
+ * @param  stats           statistics as out parameter
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    stats is NULL
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_stats(sdw_stats_t *stats);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_reset_stats ()                                                 */
+/*                                                                    */
+/** Set all call counters and latency histograms to 0
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_reset_stats(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_set_trace_hooks ()                                             */
+/*                                                                    */
+/** Register hooks called before and after every D-Bus operation
+ *
+ * The hooks run on the calling thread, they must not call libsdw. Set
+ * them before other threads use libsdw, a change is not synchronized
+ * with operations in flight.
+ *
+ * @param  begin           called before the operation, NULL for none
+ * @param  end             called after the operation, NULL for none
+ * @param  userdata        passed to both hooks
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_set_trace_hooks(sdw_trace_hook_t begin,
+                         sdw_trace_hook_t end,
+                         void *userdata);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_op_name ()                                                     */
+/*                                                                    */
+/** Name of the D-Bus operation SDW_OP_*, NULL for unknown values
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+const char *sdw_op_name(int op);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_is_supported ()                                                */
+/*                                                                    */
+/** check systemd version for defined minimum version number
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_is_supported(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_encode ()                                                      */
+/*                                                                    */
+/** Encode a unit name, for details see 'man sd_bus_path_encode'
+ *
+ * @param  unit_name        unit name
+ * @param  ret_encoded      pointer to the encoded unit name
+ *
+ * @retval ret_encoded      caller must release the memory with free()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    failed
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_encode(const char *unit_name,
+               char **ret_encoded);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_decode ()                                                      */
+/*                                                                    */
+/** Decode a unit name, for details see 'man sd_bus_path_decode'
+ *
+ * @param  unit_name        encoded unit name
+ * @param  ret_decoded      pointer to the decoded unit name
+ *
+ * @retval ret_decoded      caller must release the memory with free()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    failed
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_decode(const char *unit_name,
+               char **ret_decoded);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_unit_by_pid ()                                             */
+/*                                                                    */
+/** Lookup the unit name for a running process
+ *
+ * By default the unit is taken from the cgroup of the process in
+ * /proc/<pid>/cgroup, cgroup v2 or the systemd hierarchy of v1, and the
+ * manager is only asked (GetUnitByPID) if that names no unit, e.g. for
+ * processes outside of the own cgroup namespace. See
+ * sdw_set_pid_lookup().
+ *
+ * @param  pid              pid of the process
+ * @param  ret_unit_name    pointer to the unit name of the process
  *
  * @retval ret_unit_name    caller must release the memory with free()
  *
@@ -391,18 +1357,91 @@ int sdw_get_unit_by_pid(unsigned pid,
                         char **ret_unit_name);
 
 
+/*--------------------------------------------------------------------*/
+/* sdw_get_unit_by_pid_r ()                                           */
+/*                                                                    */
+/** Lookup the unit name for a running process without allocation
+ *
+ * @param  pid              pid of the process
+ * @param  buf              buffer for the unit name of the process
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #0             successful, unit found
+ *     - #SDW_ERANGE    unit name exceeds len
+ *     - #SDW_EINVAL    failed, no unit found
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_unit_by_pid_r(unsigned pid,
+                          char *buf, size_t len);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_units_by_pids ()                                           */
+/*                                                                    */
+/** Lookup the unit names of many processes at once
+ *
+ * Resolves like sdw_get_unit_by_pid(), the /proc files are read by up
+ * to 8 threads and what only the manager can tell is asked on the
+ * connection of the calling thread. The units the manager told are
+ * cached per PID and start time of the process, so a reused PID is
+ * asked again, for at most 30 seconds in case a process moved to
+ * another unit.
+ *
+ * @param  pids            PIDs to look up, 0 is the calling process
+ * @param  n               number of pids
+ * @param  ret_units       array of n unit names in the order of pids,
+ *                         NULL for a PID without unit
+ *
+ * @retval ret_units       caller must release the array and the names
+ *                         with one free() of the array
+ *
+ * @return
+ *     - #>= 0          number of PIDs whose unit was found
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EINVAL    invalid parameter, too many pids, out of memory
+ *                      or a GetUnitByPID call failed for another reason
+ *                      than a PID without unit
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_units_by_pids(const unsigned *pids, size_t n,
+                          char ***ret_units);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_set_pid_lookup ()                                              */
+/*                                                                    */
+/** Select where sdw_get_unit_by_pid() and sdw_check_pid() find the unit
+ *  and sdw_get_unit_pids() the processes
+ *
+ * With #SDW_PID_LOOKUP_AUTO, the default, cgroupfs is only read while the
+ * system bus is used, a transport set by sdw_set_transport() is always
+ * asked. #SDW_PID_LOOKUP_CGROUP never falls back to D-Bus and works
+ * without a connection, sdw_get_unit_pids() still asks the ControlGroup
+ * of a unit once.
+ *
+ * @param  mode            SDW_PID_LOOKUP_*
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    unknown mode
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_set_pid_lookup(int mode);
+
+
 /*--------------------------------------------------------------------*/
 /* sdw_get_activestate ()                                             */
 /*                                                                    */
 /** Read the property 'ActiveState' of a unit
  *
  * @param  unit_name        unit name
- * @param  ret_state        pointer to the unit active state
+ * @param  ret_state        pointer to the unit active state, optional
  *
  * @retval ret_state        caller must release the memory with free()
  *
  * @return
- *     - #0             successful
+ *     - #SDW_UNIT_ACTIVE_STAT_*   successful, the unit active state
  *     - #SDW_EINVAL    failed
  *     - #SDW_EINIT     sdbus library initialization failed
  *     - #SDW_EVERSION  invalid systemd version detected
@@ -412,18 +1451,38 @@ int sdw_get_activestate(const char *unit_name,
                         char **ret_state);
 
 
+/*--------------------------------------------------------------------*/
+/* sdw_get_activestate_r ()                                           */
+/*                                                                    */
+/** Read the property 'ActiveState' of a unit without allocation
+ *
+ * @param  unit_name        unit name
+ * @param  buf              buffer for the unit active state,
+ *                          NULL just returns the state
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #SDW_UNIT_ACTIVE_STAT_*   successful, the unit active state
+ *     - #SDW_ERANGE    active state exceeds len
+ *     - #SDW_EINVAL    failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_activestate_r(const char *unit_name,
+                          char *buf, size_t len);
+
+
 /*--------------------------------------------------------------------*/
 /* sdw_get_substate ()                                                */
 /*                                                                    */
 /** Read the property 'SubState' of a unit
  *
  * @param  unit_name        unit name
- * @param  ret_state        pointer to the unit sub state
+ * @param  ret_state        pointer to the unit sub state, optional
  *
  * @retval ret_state        caller must release the memory with free()
  *
  * @return
- *     - #0             successful
+ *     - #SDW_UNIT_SUB_STAT_*      successful, the unit sub state
  *     - #SDW_EINVAL    failed
  *     - #SDW_EINIT     sdbus library initialization failed
  *     - #SDW_EVERSION  invalid systemd version detected
@@ -433,13 +1492,112 @@ int sdw_get_substate(const char *unit_name,
                      char **ret_state);
 
 
+/*--------------------------------------------------------------------*/
+/* sdw_get_substate_r ()                                              */
+/*                                                                    */
+/** Read the property 'SubState' of a unit without allocation
+ *
+ * @param  unit_name        unit name
+ * @param  buf              buffer for the unit sub state,
+ *                          NULL just returns the state
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #SDW_UNIT_SUB_STAT_*      successful, the unit sub state
+ *     - #SDW_ERANGE    sub state exceeds len
+ *     - #SDW_EINVAL    failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_substate_r(const char *unit_name,
+                       char *buf, size_t len);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_loadstate ()                                               */
+/*                                                                    */
+/** Read the property 'LoadState' of a unit
+ *
+ * @param  unit_name        unit name
+ * @param  ret_state        pointer to the unit load state, optional
+ *
+ * @retval ret_state        caller must release the memory with free()
+ *
+ * @return
+ *     - #SDW_UNIT_LOAD_STAT_*     successful, the unit load state
+ *     - #SDW_EINVAL    failed
+ *     - #SDW_EINIT     sdbus library initialization failed
+ *     - #SDW_EVERSION  invalid systemd version detected
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_loadstate(const char *unit_name,
+                      char **ret_state);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_loadstate_r ()                                             */
+/*                                                                    */
+/** Read the property 'LoadState' of a unit without allocation
+ *
+ * @param  unit_name        unit name
+ * @param  buf              buffer for the unit load state,
+ *                          NULL just returns the state
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #SDW_UNIT_LOAD_STAT_*     successful, the unit load state
+ *     - #SDW_ERANGE    load state exceeds len
+ *     - #SDW_EINVAL    failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_loadstate_r(const char *unit_name,
+                        char *buf, size_t len);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_parse_activestate ()                                           */
+/* sdw_parse_substate ()                                              */
+/* sdw_parse_loadstate ()                                             */
+/* sdw_parse_job_result ()                                            */
+/*                                                                    */
+/** Map a state string of systemd to its enum value in O(1),
+ *  e.g. from a PropertiesChanged or JobRemoved signal
+ *
+ * @param  state            state string, e.g. "auto-restart"
+ *
+ * @return
+ *     - #SDW_UNIT_ACTIVE_STAT_*, #SDW_UNIT_SUB_STAT_*,
+ *       #SDW_UNIT_LOAD_STAT_* or #SDW_JOB_RESULT_*,
+ *       the *_UNKNOWN value for unknown strings or NULL
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_parse_activestate(const char *state);
+int sdw_parse_substate(const char *state);
+int sdw_parse_loadstate(const char *state);
+int sdw_parse_job_result(const char *result);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_state_name ()                                                  */
+/*                                                                    */
+/** Map a state enum value back to the state string of systemd
+ *
+ * @param  state            #SDW_UNIT_ACTIVE_STAT_*, #SDW_UNIT_SUB_STAT_*,
+ *                          #SDW_UNIT_LOAD_STAT_* or #SDW_JOB_RESULT_*
+ *
+ * @return      state string, NULL for unknown values
+ *              memory must not be released from the caller
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+const char *sdw_state_name(int state);
+
+
 /*--------------------------------------------------------------------*/
 /* sdw_get_unitfilestate ()                                           */
 /*                                                                    */
 /** Read the unit file state with 'GetUnitFileState'
  *
  * @param  unit_name        unit name of service
- * @param  ret_state        pointer to the unit file state
+ * @param  ret_state        pointer to the unit file state, optional
  *
  * @retval ret_state        caller must release the memory with free()
  *
@@ -455,14 +1613,227 @@ int sdw_get_substate(const char *unit_name,
 int sdw_get_unitfilestate(const char *unit_name,
                           char **ret_state);
 
+
+/*--------------------------------------------------------------------*/
+/* sdw_get_unitfilestate_r ()                                         */
+/*                                                                    */
+/** Read the unit file state without allocation
+ *
+ * @param  unit_name        unit name of service
+ * @param  buf              buffer for the unit file state,
+ *                          NULL just returns the state
+ * @param  len              size of buf
+ *
+ * @return
+ *     - #0           'GetUnitFileState' successful but unknown state
+ *     - #SDW_UNIT_FILE_STAT_ENABLED   unit is enabled
+ *     - #SDW_UNIT_FILE_STAT_DISABLED  unit is disabled
+ *     - #SDW_ERANGE    unit file state exceeds len
+ *     - #SDW_EINVAL    failed
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_get_unitfilestate_r(const char *unit_name,
+                            char *buf, size_t len);
+
 /*--------------------------------------------------------------------*/
 /* sdw_set_tracelevel ()                                              */
 /*                                                                    */
 /** Set internal tracelevel
  *
- * @param  level            traclevel (0-4)
+ * Levels above the SDW_LOG_LEVEL_MAX of the libsdw build are lowered
+ * to SDW_LOG_LEVEL_MAX.
+ *
+ * @param  level            SDW_LOG_ERROR, SDW_LOG_INFO or SDW_LOG_DEBUG
  *                                                                    */
 /*--------------------------------------------------------------------*/
 void sdw_set_tracelevel(int level);
 
+
+/*--------------------------------------------------------------------*/
+/* sdw_log_set_callback ()                                            */
+/*                                                                    */
+/** Pass the log records to fn instead of writing them to stdout/stderr
+ *
+ * fn is called on the logging thread, or by the log thread if
+ * sdw_log_set_async() is enabled. It must not call libsdw.
+ *
+ * @param  fn              record handler, NULL restores stdout/stderr
+ * @param  userdata        passed to fn
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_log_set_callback(sdw_log_fn_t fn,
+                          void *userdata);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_log_set_async ()                                               */
+/*                                                                    */
+/** Move the log output off the calling threads
+ *
+ * If enabled, the records are copied into a lock-free ring of the
+ * calling thread and written by a background thread every 20ms. A full
+ * ring drops records and reports the count instead of blocking.
+ *
+ * @param  enable          1 starts, 0 stops the log thread
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    log thread could not be started
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_log_set_async(int enable);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_log_flush ()                                                   */
+/*                                                                    */
+/** Write all pending log records now, e.g. before exit()
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_log_flush(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_journal_enable ()                                              */
+/*                                                                    */
+/** Send operations and log records to the systemd journal
+ *
+ * Entries carry the structured fields MESSAGE, PRIORITY, OPERATION,
+ * UNIT, JOB, DURATION_USEC and SDW_RC, e.g. for
+ *     journalctl OPERATION=StartUnit UNIT=foo.service
+ * They are queued and sent by a background thread every 100ms, at
+ * most 200 entries per second. Entries over the limit are dropped and
+ * reported by count.
+ *
+ * With SDW_JOURNAL_LOG the log records go to the journal instead of
+ * stdout/stderr, a callback of sdw_log_set_callback() still has
+ * precedence.
+ *
+ * @param  flags           SDW_JOURNAL_OPS | SDW_JOURNAL_LOG,
+ *                         SDW_JOURNAL_OFF sends the queued entries and
+ *                         stops the journal thread
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    journal thread could not be started
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_journal_enable(int flags);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_journal_flush ()                                               */
+/*                                                                    */
+/** Send all queued journal entries now, e.g. before exit()
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+void sdw_journal_flush(void);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_set_transport ()                                               */
+/*                                                                    */
+/** Replace the connection to the systemd manager
+ *
+ * libsdw releases the bus connection of the calling thread, opens the
+ * new one and checks the systemd version again. The other threads
+ * reconnect on their next call, open() may be called from several
+ * threads at once. The transport must stay valid until it is replaced,
+ * its close() is called then. Must not be called while other libsdw
+ * calls are running.
+ *
+ * @param  transport       NULL for the system bus (default)
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINIT     connection failed or library not loaded
+ *     - #SDW_EVERSION  systemd version not supported
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_set_transport(const sdw_transport_t *transport);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_sim_transport ()                                               */
+/*                                                                    */
+/** Create a transport to an in-process simulated systemd manager
+ *
+ * The manager needs neither root nor systemd nor a dbus-daemon. It
+ * answers the calls of libsdw for config->units units with the
+ * configured latency and error rate, finishes jobs after job_usec and
+ * can flood the callers with unrelated JobRemoved signals. Intended
+ * for scale and fault tests, e.g.
+ *     sdw_sim_config_t cfg = { .units = 10000, .latency_usec = 500 };
+ *     sdw_sim_transport(&cfg, &transport);
+ *     sdw_set_transport(&transport);
+ * Implemented in sdwsim.cpp, the program must link libsystemd.
+ *
+ * @param  config          simulated manager
+ * @param  ret_transport   filled for sdw_set_transport()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    invalid config or out of memory
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_sim_transport(const sdw_sim_config_t *config,
+                      sdw_transport_t *ret_transport);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_capture_transport ()                                           */
+/*                                                                    */
+/** Create a transport that records the D-Bus traffic of libsdw
+ *
+ * A proxy thread forwards every call of libsdw to the inner transport
+ * and the manager and unit PropertiesChanged signals back, and appends
+ * each request with its reply and latency and each signal with its
+ * arrival time to file.
+ * The proxy handles one call at a time. The file is flushed whenever
+ * the proxy is idle and closed with the transport. It serves a single
+ * connection, libsdw must be used from one thread and
+ * #SDW_RELOAD_DEFERRED reloads immediately, e.g.
+ *     sdw_capture_transport("/var/tmp/sdw.rec", NULL, &transport);
+ *     sdw_set_transport(&transport);
+ * Implemented in sdwrec.cpp, the program must link libsystemd.
+ *
+ * @param  file            created or truncated
+ * @param  inner           NULL for the system bus, otherwise closed
+ *                         with the capture transport
+ * @param  ret_transport   filled for sdw_set_transport()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    invalid parameter or file not writable
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_capture_transport(const char *file, const sdw_transport_t *inner,
+                          sdw_transport_t *ret_transport);
+
+
+/*--------------------------------------------------------------------*/
+/* sdw_replay_transport ()                                            */
+/*                                                                    */
+/** Create a transport serving a capture back to libsdw
+ *
+ * Each call is answered with the reply recorded for the first unserved
+ * call with the same path, member and arguments, after its recorded
+ * latency scaled by latency_percent. Signals recorded before that call
+ * are sent before the reply, the signals up to the next recorded call
+ * follow with their recorded delays. Calls not in the recording fail
+ * with org.freedesktop.DBus.Error.Failed. Serves a single connection
+ * like the capture.
+ * Implemented in sdwrec.cpp, the program must link libsystemd.
+ *
+ * @param  config          replay
+ * @param  ret_transport   filled for sdw_set_transport()
+ *
+ * @return
+ *     - #0             successful
+ *     - #SDW_EINVAL    invalid config or file not a capture
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+int sdw_replay_transport(const sdw_replay_config_t *config,
+                         sdw_transport_t *ret_transport);
+
 #endif
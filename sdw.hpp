@@ -0,0 +1,368 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _LIBSDW_HPP_
+#define _LIBSDW_HPP_
+
+/*--------------------------------------------------------------------*/
+/** @file    sdw.hpp
+ *
+ *  @brief   C++17 interface of libsdw
+ *
+ *  Handles are move-only and release their bus messages and slots in
+ *  the destructor. Failures are returned as sdw::Error values that
+ *  carry the SDW_E* code and the message, nothing is thrown and no
+ *  result needs free().
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+#include "sdw.h"
+
+struct sd_bus_message;
+
+namespace sdw {
+
+/*--------------------------------------------------------------------*/
+/* sdw::String                                                        */
+/*                                                                    */
+/** Fixed capacity string, results are kept inline without allocation
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+template <size_t N> class String {
+  public:
+    String() noexcept = default;
+
+    explicit String(std::string_view s) noexcept {
+        assign(s);
+    }
+
+    // truncates to N - 1 chars, returns false if s did not fit
+    bool assign(std::string_view s) noexcept {
+        bool fits = s.size() < N;
+
+        len_ = fits ? s.size() : N - 1;
+        s.copy(buf_, len_);
+        buf_[len_] = '\0';
+
+        return fits;
+    }
+
+    const char *c_str() const noexcept {
+        return buf_;
+    }
+
+    std::string_view view() const noexcept {
+        return std::string_view(buf_, len_);
+    }
+
+    operator std::string_view() const noexcept {
+        return view();
+    }
+
+  private:
+    char buf_[N] = "";
+    size_t len_ = 0;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Error                                                         */
+/*                                                                    */
+/** Error code SDW_E* and the message of the failed call
+ *
+ * A default constructed Error is no error, ok() is true then.
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Error {
+  public:
+    Error() noexcept = default;
+
+    Error(int code, std::string_view message) noexcept
+    :code_(code), message_(message) {
+    }
+
+    bool ok() const noexcept {
+        return 0 == code_;
+    }
+
+    int code() const noexcept {
+        return code_;
+    }
+
+    std::string_view message() const noexcept {
+        return message_.view();
+    }
+
+  private:
+    int code_ = 0;
+    String<SDW_MAX_ERROR_LEN> message_;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Result                                                        */
+/*                                                                    */
+/** Either a value or the Error of the failed call
+ *
+ * value() must only be used if ok() is true.
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+template <typename T> class Result {
+  public:
+    Result(T value) noexcept
+    :v_(std::in_place_index<0>, std::move(value)) {
+    }
+
+    Result(Error error) noexcept
+    :v_(std::in_place_index<1>, std::move(error)) {
+    }
+
+    bool ok() const noexcept {
+        return 0 == v_.index();
+    }
+
+    explicit operator bool() const noexcept {
+        return ok();
+    }
+
+    T &value() & noexcept {
+        return *std::get_if<0>(&v_);
+    }
+
+    const T &value() const & noexcept {
+        return *std::get_if<0>(&v_);
+    }
+
+    T &&value() && noexcept {
+        return std::move(*std::get_if<0>(&v_));
+    }
+
+    T *operator->() noexcept {
+        return std::get_if<0>(&v_);
+    }
+
+    const T *operator->() const noexcept {
+        return std::get_if<0>(&v_);
+    }
+
+    // Error() if ok()
+    Error error() const noexcept {
+        return ok() ? Error() : *std::get_if<1>(&v_);
+    }
+
+  private:
+    std::variant<T, Error> v_;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Message                                                       */
+/*                                                                    */
+/** Move-only owner of one sd_bus_message reference
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Message {
+  public:
+    Message() noexcept = default;
+    explicit Message(sd_bus_message *msg) noexcept
+    :msg_(msg) {
+    }
+
+    Message(Message &&other) noexcept
+    :msg_(std::exchange(other.msg_, nullptr)) {
+    }
+
+    Message &operator=(Message &&other) noexcept;
+    Message(const Message &) = delete;
+    Message &operator=(const Message &) = delete;
+    ~Message();
+
+    sd_bus_message *get() const noexcept {
+        return msg_;
+    }
+
+  private:
+    sd_bus_message *msg_ = nullptr;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Borrowed                                                      */
+/*                                                                    */
+/** String viewing into the reply it was read from
+ *
+ * The view stays valid as long as the Borrowed object lives, the
+ * string is never copied.
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Borrowed {
+  public:
+    Borrowed(Message msg, std::string_view view) noexcept
+    :msg_(std::move(msg)), view_(view) {
+    }
+
+    std::string_view view() const noexcept {
+        return view_;
+    }
+
+    operator std::string_view() const noexcept {
+        return view_;
+    }
+
+  private:
+    Message msg_;
+    std::string_view view_;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::State                                                         */
+/*                                                                    */
+/** Unit state as SDW_UNIT_*_STAT_* code and the name sent by systemd
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class State {
+  public:
+    State(int code, Borrowed name) noexcept
+    :code_(code), name_(std::move(name)) {
+    }
+
+    int code() const noexcept {
+        return code_;
+    }
+
+    std::string_view name() const noexcept {
+        return name_.view();
+    }
+
+  private:
+    int code_;
+    Borrowed name_;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Job                                                           */
+/*                                                                    */
+/** Move-only handle of a queued start/stop/restart job
+ *
+ * The JobRemoved match is registered before the job is queued and
+ * released with the handle. The match lives on the connection of the
+ * queueing thread, so wait() and the handle belong to that thread.
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Job {
+  public:
+    Job(Job &&other) noexcept
+    :state_(std::exchange(other.state_, nullptr)) {
+    }
+
+    Job &operator=(Job &&other) noexcept;
+    Job(const Job &) = delete;
+    Job &operator=(const Job &) = delete;
+    ~Job();
+
+    // object path of the job
+    std::string_view path() const noexcept;
+
+    // SDW_JOB_RESULT_* once the job is removed, SDW_ETIMEOUT if it
+    // is still queued after timeout
+    Result<int> wait(std::chrono::seconds timeout);
+
+  private:
+    friend class Unit;
+    struct state_t;
+
+    explicit Job(state_t *state) noexcept
+    :state_(state) {
+    }
+
+    static Result<Job> queue(const char *unit_name, int cmd);
+
+    state_t *state_;
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Unit                                                          */
+/*                                                                    */
+/** Systemd unit, the object path is encoded once at construction
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Unit {
+  public:
+    std::string_view name() const noexcept {
+        return name_.view();
+    }
+
+    Result<State> active_state() const;
+    Result<State> sub_state() const;
+    Result<State> load_state() const;
+
+    // SDW_UNIT_FILE_STAT_*, 0 for other states
+    Result<int> unit_file_state() const;
+
+    Result<uint32_t> main_pid() const;
+    Result<uint32_t> control_pid() const;
+    Result<uint32_t> nrestarts() const;
+    Result<int32_t> exec_main_status() const;
+    Result<uint64_t> memory_current() const;
+    Result<uint64_t> active_enter_timestamp() const;
+    Result<bool> need_daemon_reload() const;
+
+    Result<Job> start() const;
+    Result<Job> stop() const;
+    Result<Job> restart() const;
+
+    Error enable(bool runtime = false, bool force = true) const;
+    Error disable(bool runtime = false) const;
+
+  private:
+    friend class Bus;
+    Unit() noexcept = default;
+
+    String<256> name_;          // UNIT_NAME_MAX of systemd
+    String<832> path_;          // each char of the name may become _xx
+};
+
+/*--------------------------------------------------------------------*/
+/* sdw::Bus                                                           */
+/*                                                                    */
+/** Handle to the bus connection libsdw keeps per thread
+ *
+ * Holds no connection itself: every call goes over the connection of
+ * the calling thread, opened on first use and again after
+ * sdw_set_transport() or once the peer closed it, like the C calls.
+ *                                                                    */
+/*--------------------------------------------------------------------*/
+class Bus {
+  public:
+    // SDW_EINIT or SDW_EVERSION if the library is not usable
+    static Result<Bus> system();
+
+    Result<Borrowed> version() const;
+    Error reload() const;
+
+    Result<Unit> unit(std::string_view name) const;
+    Result<Unit> unit_by_pid(uint32_t pid) const;
+
+  private:
+    Bus() noexcept = default;
+};
+
+}                               // namespace sdw
+
+#endif
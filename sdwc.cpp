@@ -20,30 +20,156 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "sdw.h"
 
+#define MAX_OUT_LEN             512
+#define MAX_BATCH_ARGS          32
+#define MAX_BATCH_JOBS          64
+#define MAX_BATCH_PENDING       1024    // read ahead of the written results
+#define MAX_SERVE_CLIENTS       256
+#define MAX_SERVE_LINE          512     // request including the newline
+#define MAX_SERVE_OUT           8192    // replies a client has not read yet
+#define MAX_STATE_LEN           64
+#define SERVE_BUCKETS           1024    // of the unit cache
+#define SERVE_MAX_UNITS         8192    // cached, the least used is dropped
+#define SERVE_SOCKET_MODE       0600    // without -m
+#define MAX_WATCH_UNITS         64
+
 extern char *optarg;
+extern int optind;
 extern int opterr;
 
-struct {
-    char *unit_name = NULL;
-    unsigned pid = 0;
-    int trc_level = 1;
-    unsigned wait_sec = 0;
-} cfg;
+// flags of verb_t
+enum {
+    NEED_UNIT   = 1,            // -u is mandatory
+    NEED_PID    = 2,            // -p is mandatory
+    BARRIER     = 4,            // Batch runs it after all earlier commands
+                                // and before all later ones
+    MULTI       = 8,            // -u may be repeated and a pattern
+    ONE_CALL    = 16            // a MULTI verb passes all units at once
+};
+
+typedef struct cmd_s cmd_t;
+
+typedef struct {
+    const char *name;
+    const char *opts;           // of getopt()
+    int flags;
+    int (*fn)(cmd_t *c);
+} verb_t;
+
+// one parsed command and its result line
+struct cmd_s {
+    const verb_t *verb;         // NULL: invalid command
+    char *unit_name;            // the first -u
+    char **units;               // all -u of a MULTI verb
+    unsigned n_units;
+    unsigned jobs;              // -j, 0 if not given
+    unsigned pid;
+    int trc_level;              // -1 if not given
+    unsigned wait_sec;
+    int rc;
+    char out[MAX_OUT_LEN];
+    cmd_t *next;                // see batch
+    bool started;
+    bool done;
+};
+
+// units of one multi-unit command, see run_units()
+typedef struct {
+    cmd_t *cmds;                // one per unit
+    unsigned n;
+    unsigned next;              // first not yet taken by a worker
+    uint64_t deadline;          // CLOCK_MONOTONIC usec, if waiting
+} units_t;
+
+// commands read by Batch, written in input order
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cmd_t *head;                // next result to write
+    cmd_t *tail;
+    unsigned pending;
+    bool eof;
+    int rc;                     // 1 if a command failed
+} batch = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, 0, false, 0
+};
+
+// unit state kept current by the PropertiesChanged signals
+typedef struct serve_unit_s serve_unit_t;
+struct serve_unit_s {
+    char *name;
+    int valid;                  // SDW_CHANGE_* of the cached fields
+    char active[MAX_STATE_LEN];
+    char sub[MAX_STATE_LEN];
+    uint32_t main_pid;
+    uint64_t used;              // serve.clock when last asked for
+    serve_unit_t *next;         // in the bucket
+};
+
+typedef struct {
+    int fd;
+    char in[MAX_SERVE_LINE];    // partial request
+    size_t in_len;
+    char out[MAX_SERVE_OUT];    // replies not yet sent
+    size_t out_len;
+    bool eof;                   // no more requests, dropped once replied
+} serve_client_t;
+
+// state of Serve, all on the thread of main()
+static struct {
+    sdw_watch_t *watch;         // NULL: connection lost, nothing cached
+    serve_unit_t *buckets[SERVE_BUCKETS];
+    unsigned units;
+    uint64_t clock;             // of serve_unit_t.used
+    serve_client_t clients[MAX_SERVE_CLIENTS];
+    unsigned n_clients;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t changes;
+} serve;
+
+static volatile sig_atomic_t stop_requested = 0;     // SIGINT, SIGTERM
+
+// changes Watch or events Pressure printed, exit after watch_limit if not 0
+static unsigned long watch_count = 0;
+static unsigned long watch_limit = 0;
 
 static void usage(void) {
     printf("usage:\n"
            "    Start -u <UNIT> [-w <WAIT_SECONDS>]\n"
            "    Restart -u <UNIT> [-w <WAIT_SECONDS>]\n"
            "    Stop -u <UNIT> [-w <WAIT_SECONDS>]\n"
+           "      # -u may be repeated and a pattern of loaded units,\n"
+           "      # then [-j <PARALLEL>] jobs run at once (default all),\n"
+           "      # WAIT_SECONDS is one deadline for all of them. Prints a\n"
+           "      # line per unit, fails with the first failed unit\n"
            "    GetUnitByPID -p <PID>\n"
            "    GetMainPID -u <UNIT>\n"
+           "    WaitMainPID -u <UNIT> [-w <WAIT_SECONDS>]\n"
+           "      # waits on a pidfd until the main process exited\n"
+           "    GetControlPID -u <UNIT>\n"
+           "    GetNRestarts -u <UNIT>\n"
+           "    GetMemoryCurrent -u <UNIT>\n"
+           "    GetResources -u <UNIT>\n"
+           "      # memory, CPU, IO and tasks from the cgroup v2 files\n"
+           "    GetUnitPIDs -u <UNIT>\n"
            "    CheckPID -p <PID> -u <UNIT>\n"
            "    CheckControlPID -p <PID> -u <UNIT>\n"
            "    GetActiveState -u <UNIT>\n"
            "    GetSubState -u <UNIT>\n"
+           "    GetLoadState -u <UNIT>\n"
            "    GetUnitFileState -u <UNIT>\n"
            "    IsSupported\n"
            "    GetVersion\n"
@@ -51,324 +177,1639 @@ static void usage(void) {
            "    Decode -u <UNIT>\n"
            "    Enable -u <UNIT>\n"
            "    Disable -u <UNIT>\n"
+           "      # -u may be repeated and a pattern of loaded units, all\n"
+           "      # go to one EnableUnitFiles or DisableUnitFiles call\n"
+           "      # followed by one Reload\n"
            "    Reload\n"
+           "    Batch [-f <FILE>] [-j <PARALLEL>] [-r <RELOAD_MS>]\n"
+           "      # runs the commands above, one per line, from FILE or\n"
+           "      # stdin over one connection and writes '<rc> <result>'\n"
+           "      # per command in input order. With PARALLEL > 1 commands\n"
+           "      # on different units run concurrently, Reload waits for\n"
+           "      # all earlier commands. With RELOAD_MS Enable and\n"
+           "      # Disable share one Reload RELOAD_MS after the first of\n"
+           "      # them, the last one runs before Batch exits. A command\n"
+           "      # with its own -v is refused with PARALLEL > 1\n"
+           "    Serve -s <SOCKET> [-m <MODE>]\n"
+           "      # answers '<VERB> <UNIT>' per line from local clients on\n"
+           "      # the UNIX socket with '<rc> <value>', VERB is\n"
+           "      # ActiveState, SubState or MainPID. The values come from\n"
+           "      # a cache the unit signals keep current, 'Stats' reports\n"
+           "      # its hits. The socket is created with the octal MODE\n"
+           "      # (0600)\n"
+           "    Watch -u <UNIT|PATTERN> [-u ...] [-n <COUNT>]\n"
+           "      # prints '<MONOTONIC_SEC> <UNIT> ActiveState=<STATE>\n"
+           "      # SubState=<STATE> MainPID=<PID>' per change of the\n"
+           "      # units with the changed fields only, the current state\n"
+           "      # of the units given without pattern first. Exits after\n"
+           "      # COUNT changes\n"
+           "    Pressure -u <UNIT> [-u ...] [-s <STALL_MS>] [-w <WINDOW_MS>]\n"
+           "             [-n <COUNT>]\n"
+           "      # prints '<MONOTONIC_SEC> <UNIT> <memory|cpu|io> some=<PCT>\n"
+           "      # full=<PCT>' when the tasks of a unit stalled more than\n"
+           "      # STALL_MS (100) per WINDOW_MS (2000) and '<UNIT> oom\n"
+           "      # oom=<N> oom_kill=<N>' per OOM event, from the cgroup v2\n"
+           "      # PSI triggers\n"
            "    # valid for all commands:\n"
-           "      [-v <0-2>]    # verbose (ERROR, INFO, DEBUG)\n");
+           "      [-v <0-2>]    # verbose (ERROR, INFO, DEBUG),\n"
+           "                    # Batch, Serve, Watch and Pressure default 0\n");
     exit(1);
 }
 
-static int my_getopt(int ac, char **av, const char *opt) {
-    int c;
+static void reply(cmd_t *c, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(c->out, sizeof(c->out), fmt, ap);
+    va_end(ap);
+}
+
+// map rc to valid range of OS
+static inline int map_rc(int rc) {
+    return abs(rc) & 0xff;
+}
+
+static int cmd_start(cmd_t *c) {
+    int rc;
+
+    if (c->wait_sec)
+        rc = sdw_start(c->unit_name, c->wait_sec);
+    else
+        rc = sdw_start(c->unit_name);
+
+    if (0 == rc)
+        reply(c, "started '%s'", c->unit_name);
+    else
+        reply(c, "Start '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_stop(cmd_t *c) {
+    int rc;
+
+    if (c->wait_sec)
+        rc = sdw_stop(c->unit_name, c->wait_sec);
+    else
+        rc = sdw_stop(c->unit_name);
+
+    if (0 == rc)
+        reply(c, "stopped '%s'", c->unit_name);
+    else
+        reply(c, "Stop '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_restart(cmd_t *c) {
+    int rc;
+
+    if (c->wait_sec)
+        rc = sdw_restart(c->unit_name, c->wait_sec);
+    else
+        rc = sdw_restart(c->unit_name);
+
+    if (0 == rc)
+        reply(c, "restarted '%s'", c->unit_name);
+    else
+        reply(c, "Restart '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_get_version(cmd_t *c) {
+    char *version = NULL;
+    int rc;
+
+    rc = sdw_get_version(&version);
+    if (0 == rc)
+        reply(c, "version: '%s'", version);
+    else
+        reply(c, "GetVersion failed (rc=%d)", rc);
+
+    free(version);
+    return rc;
+}
+
+static int cmd_get_unit_by_pid(cmd_t *c) {
+    char *unit_name = NULL;
+    int rc;
+
+    rc = sdw_get_unit_by_pid(c->pid, &unit_name);
+    if (0 == rc)
+        reply(c, "found unit '%s' for pid '%u' (rc=%d)", unit_name, c->pid,
+              rc);
+    else
+        reply(c, "GetUnitByPID '%u' failed (rc=%d)", c->pid, rc);
+
+    free(unit_name);
+    return rc;
+}
+
+static int cmd_check_pid(cmd_t *c) {
+    int rc;
+
+    if (0 == c->pid)
+        c->pid = getpid();
+
+    rc = sdw_check_pid(c->unit_name, c->pid);
+    if (0 == rc)
+        reply(c, "found unit '%s' for pid '%u'", c->unit_name, c->pid);
+    else
+        reply(c, "CheckPid '%s' pid '%u' failed (rc=%d)", c->unit_name,
+              c->pid, rc);
+
+    return rc;
+}
+
+static int cmd_check_controlpid(cmd_t *c) {
+    int rc;
+
+    rc = sdw_check_controlpid(c->unit_name, c->pid);
+    if (0 == rc)
+        reply(c, "found unit '%s' for control pid '%u'", c->unit_name,
+              c->pid);
+    else
+        reply(c, "CheckControlPID '%s' pid '%u' failed (rc=%d)",
+              c->unit_name, c->pid, rc);
+
+    return rc;
+}
+
+static int cmd_get_mainpid(cmd_t *c) {
+    unsigned pid = 0;
+    int rc;
+
+    rc = sdw_get_mainpid(c->unit_name, &pid);
+    if (0 == rc)
+        reply(c, "mainPID: '%u'", pid);
+    else
+        reply(c, "GetMainPID '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_wait_mainpid(cmd_t *c) {
+    struct pollfd pfd;
+    unsigned pid = 0;
+    int fd, rc;
+
+    rc = sdw_get_mainpid_fd(c->unit_name, &pid, &fd);
+    if (0 != rc) {
+        reply(c, "WaitMainPID '%s' failed (rc=%d)", c->unit_name, rc);
+        return rc;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+        rc = poll(&pfd, 1, c->wait_sec ? (int) c->wait_sec * 1000 : -1);
+    } while (rc < 0 && EINTR == errno && !stop_requested);
+    close(fd);
+
+    if (rc > 0) {
+        reply(c, "mainPID '%u' exited", pid);
+        return 0;
+    }
+
+    reply(c, "WaitMainPID '%s' pid '%u' %s", c->unit_name, pid,
+          0 == rc ? "timed out" : "interrupted");
+
+    return 0 == rc ? SDW_ETIMEOUT : SDW_EINVAL;
+}
+
+static int cmd_get_controlpid(cmd_t *c) {
+    unsigned pid = 0;
+    int rc;
+
+    rc = sdw_get_controlpid(c->unit_name, &pid);
+    if (0 == rc)
+        reply(c, "controlPID: '%u'", pid);
+    else
+        reply(c, "GetControlPID '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_get_nrestarts(cmd_t *c) {
+    unsigned count = 0;
+    int rc;
+
+    rc = sdw_get_nrestarts(c->unit_name, &count);
+    if (0 == rc)
+        reply(c, "NRestarts: '%u'", count);
+    else
+        reply(c, "GetNRestarts '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_get_memory_current(cmd_t *c) {
+    uint64_t bytes = 0;
+    int rc;
+
+    rc = sdw_get_memory_current(c->unit_name, &bytes);
+    if (0 == rc)
+        reply(c, "MemoryCurrent: '%" PRIu64 "'", bytes);
+    else
+        reply(c, "GetMemoryCurrent '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_get_resources(cmd_t *c) {
+    sdw_unit_resources_t res;
+    size_t len = 0;
+    int rc;
+
+    rc = sdw_get_unit_resources(c->unit_name, &res);
+    if (0 != rc) {
+        reply(c, "GetResources '%s' failed (rc=%d)", c->unit_name, rc);
+        return rc;
+    }
+
+    len += snprintf(c->out + len, sizeof(c->out) - len, "Resources:");
+    if (res.valid & SDW_RES_MEMORY)
+        len += snprintf(c->out + len, sizeof(c->out) - len,
+                        " memory=%" PRIu64 " anon=%" PRIu64 " file=%" PRIu64
+                        " pgmajfault=%" PRIu64, res.memory_current,
+                        res.memory_anon, res.memory_file,
+                        res.memory_pgmajfault);
+    if ((res.valid & SDW_RES_CPU) && len < sizeof(c->out))
+        len += snprintf(c->out + len, sizeof(c->out) - len,
+                        " cpu_usec=%" PRIu64 " throttled_usec=%" PRIu64,
+                        res.cpu_usage_usec, res.cpu_throttled_usec);
+    if ((res.valid & SDW_RES_IO) && len < sizeof(c->out))
+        len += snprintf(c->out + len, sizeof(c->out) - len,
+                        " rbytes=%" PRIu64 " wbytes=%" PRIu64,
+                        res.io_rbytes, res.io_wbytes);
+    if ((res.valid & SDW_RES_PIDS) && len < sizeof(c->out))
+        snprintf(c->out + len, sizeof(c->out) - len,
+                 " pids=%" PRIu64, res.pids_current);
+
+    return rc;
+}
+
+static int cmd_get_unit_pids(cmd_t *c) {
+    unsigned *pids = NULL;
+    size_t len;
+    int rc;
+
+    rc = sdw_get_unit_pids(c->unit_name, &pids);
+    if (rc < 0) {
+        reply(c, "GetUnitPIDs '%s' failed (rc=%d)", c->unit_name, rc);
+        return rc;
+    }
+
+    len = snprintf(c->out, sizeof(c->out), "PIDs: %d", rc);
+    for (int i = 0; i < rc && len < sizeof(c->out); i++)
+        len += snprintf(c->out + len, sizeof(c->out) - len, " %u", pids[i]);
+
+    free(pids);
+    return 0;
+}
+
+#define CMD_STATE(NAME, FN)                                             \
+static int cmd_get_##FN(cmd_t *c) {                                     \
+    char *state = NULL;                                                 \
+    int rc;                                                             \
+                                                                        \
+    rc = sdw_get_##FN(c->unit_name, &state);                            \
+    if (rc > 0 && NULL != state)                                        \
+        reply(c, NAME ": %d '%s'", rc, state);                          \
+    else                                                                \
+        reply(c, "Get" NAME " '%s' failed (rc=%d)", c->unit_name, rc);  \
+                                                                        \
+    free(state);                                                        \
+    return rc;                                                          \
+}
+
+CMD_STATE("ActiveState", activestate)
+CMD_STATE("SubState", substate)
+CMD_STATE("LoadState", loadstate)
+CMD_STATE("UnitFileState", unitfilestate)
+
+static int cmd_is_supported(cmd_t *c) {
+    int rc;
+
+    rc = sdw_is_supported();
+    reply(c, "systemd version is%s supported", 0 == rc ? "" : " not");
+
+    return rc;
+}
+
+static int cmd_encode(cmd_t *c) {
+    char *encoded = NULL;
+    int rc;
+
+    rc = sdw_encode(c->unit_name, &encoded);
+    if (0 == rc)
+        reply(c, "encoded: '%s'", encoded);
+    else
+        reply(c, "Encode '%s' failed (rc=%d)", c->unit_name, rc);
+
+    free(encoded);
+    return rc;
+}
+
+static int cmd_decode(cmd_t *c) {
+    char *decoded = NULL;
+    int rc;
+
+    rc = sdw_decode(c->unit_name, &decoded);
+    if (0 == rc)
+        reply(c, "decoded: '%s'", decoded);
+    else
+        reply(c, "Decode '%s' failed (rc=%d)", c->unit_name, rc);
+
+    free(decoded);
+    return rc;
+}
+
+static bool is_multi(const cmd_t *c);
+static int expand_units(const cmd_t *c, char ***ret_names);
+
+// Enable/Disable of several units in one call and with one Reload
+static int unit_files(cmd_t *c, bool enable) {
+    const char *verb = enable ? "Enable" : "Disable";
+    char **names = NULL;
+    const char **list;
+    int n, rc;
+
+    n = expand_units(c, &names);
+    if (n <= 0) {
+        reply(c, "%s: no unit matches (rc=%d)", verb, n < 0 ? n : SDW_EINVAL);
+        return n < 0 ? n : SDW_EINVAL;
+    }
+
+    list = (const char **) malloc((n + 1) * sizeof(char *));
+    if (NULL == list) {
+        rc = SDW_EINVAL;
+        reply(c, "%s: out of memory", verb);
+        goto cleanup;
+    }
+    memcpy(list, names, n * sizeof(char *));
+    list[n] = NULL;
+
+    rc = enable ? sdw_enable_units(list) : sdw_disable_units(list);
+    if (0 == rc)
+        reply(c, "%s %d units", enable ? "enabled" : "disabled", n);
+    else
+        reply(c, "%s of %d units failed (rc=%d)", verb, n, rc);
+    free(list);
+
+cleanup:
+    for (int i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+
+    return rc;
+}
+
+static int cmd_enable(cmd_t *c) {
+    int rc;
+
+    if (is_multi(c))
+        return unit_files(c, true);
+
+    rc = sdw_enable(c->unit_name);
+    if (0 == rc)
+        reply(c, "enabled '%s'", c->unit_name);
+    else
+        reply(c, "Enable '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_disable(cmd_t *c) {
+    int rc;
+
+    if (is_multi(c))
+        return unit_files(c, false);
+
+    rc = sdw_disable(c->unit_name);
+    if (0 == rc)
+        reply(c, "disabled '%s'", c->unit_name);
+    else
+        reply(c, "Disable '%s' failed (rc=%d)", c->unit_name, rc);
+
+    return rc;
+}
+
+static int cmd_reload(cmd_t *c) {
+    int rc;
+
+    rc = sdw_reload();
+    if (0 == rc)
+        reply(c, "reloaded units");
+    else
+        reply(c, "Reload failed (rc=%d)", rc);
+
+    return rc;
+}
+
+static const verb_t verbs[] = {
+    { "Start", "u:w:v:j:", NEED_UNIT | MULTI, cmd_start },
+    { "Stop", "u:w:v:j:", NEED_UNIT | MULTI, cmd_stop },
+    { "Restart", "u:w:v:j:", NEED_UNIT | MULTI, cmd_restart },
+    { "GetVersion", "v:", 0, cmd_get_version },
+    { "GetUnitByPID", "p:v:", NEED_PID, cmd_get_unit_by_pid },
+    { "CheckPID", "p:u:v:", NEED_UNIT, cmd_check_pid },
+    { "CheckControlPID", "p:u:v:", NEED_UNIT, cmd_check_controlpid },
+    { "GetMainPID", "u:v:", NEED_UNIT, cmd_get_mainpid },
+    { "WaitMainPID", "u:w:v:", NEED_UNIT, cmd_wait_mainpid },
+    { "GetControlPID", "u:v:", NEED_UNIT, cmd_get_controlpid },
+    { "GetNRestarts", "u:v:", NEED_UNIT, cmd_get_nrestarts },
+    { "GetMemoryCurrent", "u:v:", NEED_UNIT, cmd_get_memory_current },
+    { "GetResources", "u:v:", NEED_UNIT, cmd_get_resources },
+    { "GetUnitPIDs", "u:v:", NEED_UNIT, cmd_get_unit_pids },
+    { "GetActiveState", "u:v:", NEED_UNIT, cmd_get_activestate },
+    { "GetSubState", "u:v:", NEED_UNIT, cmd_get_substate },
+    { "GetLoadState", "u:v:", NEED_UNIT, cmd_get_loadstate },
+    { "GetUnitFileState", "u:v:", NEED_UNIT, cmd_get_unitfilestate },
+    { "IsSupported", "v:", 0, cmd_is_supported },
+    { "Encode", "u:v:", NEED_UNIT, cmd_encode },
+    { "Decode", "u:v:", NEED_UNIT, cmd_decode },
+    { "Enable", "u:v:", NEED_UNIT | MULTI | ONE_CALL, cmd_enable },
+    { "Disable", "u:v:", NEED_UNIT | MULTI | ONE_CALL, cmd_disable },
+    { "Reload", "v:", BARRIER, cmd_reload },
+};
+
+// -u, only MULTI verbs take it more than once
+static bool add_unit(cmd_t *c, const char *unit) {
+    char **units;
+
+    if (NULL != c->unit_name && !(c->verb->flags & MULTI))
+        return false;
+
+    units = (char **) realloc(c->units, (c->n_units + 1) * sizeof(char *));
+    if (NULL == units)
+        return false;
+    c->units = units;
+
+    c->units[c->n_units] = strdup(unit);
+    if (NULL == c->units[c->n_units])
+        return false;
+
+    c->unit_name = c->units[0];
+    c->n_units++;
+
+    return true;
+}
+
+static void free_command(cmd_t *c) {
+    for (unsigned i = 0; i < c->n_units; i++)
+        free(c->units[i]);
+    free(c->units);
+}
+
+// a MULTI verb given several units or a pattern
+static bool is_multi(const cmd_t *c) {
+    return NULL != c->verb && (c->verb->flags & MULTI) &&
+        (c->n_units > 1 || NULL != strpbrk(c->unit_name, "*?[") ||
+         0 != c->jobs);
+}
+
+// fill c from argv, argv[0] is the verb, returns -1 if invalid
+static int parse_command(cmd_t *c, int ac, char **av) {
+    int o;
+
+    memset(c, 0, sizeof(*c));
+    c->trc_level = -1;
+
+    for (const verb_t &v : verbs)
+        if (strcmp(av[0], v.name) == 0)
+            c->verb = &v;
+
+    if (NULL == c->verb)
+        return -1;
 
     opterr = 0;
+    optind = 0;                 // restart, getopt() runs once per command
 
-    while ((c = getopt(ac, av, opt)) != -1) {
-        switch (c) {
+    while ((o = getopt(ac, av, c->verb->opts)) != -1) {
+        switch (o) {
             case 'p':
-                {
-                    cfg.pid = (unsigned) atoi(optarg);
-                    break;
-                }
+                c->pid = (unsigned) atoi(optarg);
+                break;
             case 'u':
-                {
-                    cfg.unit_name = strdup(optarg);
-                    break;
+                if (!add_unit(c, optarg)) {
+                    c->verb = NULL;
+                    return -1;
                 }
+                break;
+            case 'j':
+                c->jobs = (unsigned) atoi(optarg);
+                break;
             case 'v':
-                {
-                    cfg.trc_level = atoi(optarg);
-                    break;
-                }
+                c->trc_level = atoi(optarg);
+                break;
             case 'w':
-                {
-                    cfg.wait_sec = (unsigned) atoi(optarg);
-                    break;
-                }
+                c->wait_sec = (unsigned) atoi(optarg);
+                break;
             default:
-                {
-                    usage();
+                c->verb = NULL;
+                return -1;
+        }
+    }
+
+    if (((c->verb->flags & NEED_UNIT) && NULL == c->unit_name) ||
+        ((c->verb->flags & NEED_PID) && 0 == c->pid)) {
+        c->verb = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_units(cmd_t *c);
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void run_command(cmd_t *c) {
+    if (is_multi(c) && !(c->verb->flags & ONE_CALL))
+        c->rc = run_units(c);
+    else
+        c->rc = c->verb->fn(c);
+}
+
+// each worker runs the jobs on the bus connection of its thread
+static void *units_worker(void *arg) {
+    units_t *u = (units_t *) arg;
+    uint64_t now;
+    unsigned i;
+    cmd_t *c;
+
+    while ((i = __atomic_fetch_add(&u->next, 1, __ATOMIC_RELAXED)) < u->n) {
+        c = &u->cmds[i];
+
+        if (0 != c->wait_sec) {
+            now = now_usec();
+            if (now >= u->deadline) {
+                c->rc = SDW_ETIMEOUT;
+                reply(c, "%s '%s' not queued, deadline passed (rc=%d)",
+                      c->verb->name, c->unit_name, c->rc);
+                continue;
+            }
+            // the jobs wait in whole seconds, rounded up
+            c->wait_sec = (unsigned) ((u->deadline - now + 999999) / 1000000);
+        }
+
+        c->rc = c->verb->fn(c);
+    }
+
+    return NULL;
+}
+
+// the units of c without duplicates, patterns expanded to the loaded
+// units matching them, returns the number or < 0
+static int expand_units(const cmd_t *c, char ***ret_names) {
+    char **names = NULL, **grown, **found;
+    const char *single[2] = { NULL, NULL };
+    const char *const *list;
+    unsigned n = 0, max = 0, i, k, d;
+    int rc = 0;
+
+    for (i = 0; i < c->n_units && rc >= 0; i++) {
+        found = NULL;
+        single[0] = c->units[i];
+        list = single;
+
+        if (NULL != strpbrk(c->units[i], "*?[")) {
+            rc = sdw_list_units(single, &found);
+            if (rc < 0)
+                break;
+            list = found;
+        }
+
+        for (k = 0; NULL != list[k]; k++) {
+            for (d = 0; d < n && strcmp(names[d], list[k]) != 0; d++)
+                ;
+            if (d < n)
+                continue;
+
+            if (n == max) {
+                max = 0 == max ? 64 : 2 * max;
+                grown = (char **) realloc(names, max * sizeof(char *));
+                if (NULL == grown) {
+                    rc = SDW_EINVAL;
                     break;
                 }
+                names = grown;
+            }
+
+            names[n] = strdup(list[k]);
+            if (NULL == names[n]) {
+                rc = SDW_EINVAL;
+                break;
+            }
+            n++;
         }
+        free(found);
     }
 
-    sdw_set_tracelevel(cfg.trc_level);
+    if (rc < 0) {
+        for (i = 0; i < n; i++)
+            free(names[i]);
+        free(names);
+        return rc;
+    }
 
-    return 0;
+    *ret_names = names;
+    return (int) n;
 }
 
-// map rc to valid range of OS
-static inline int map_rc(int rc) {
-    return abs(rc) & 0xff;
+// Start/Stop/Restart of several units: up to c->jobs jobs run at once,
+// each waited for against the deadline shared by all, the per unit
+// results are printed in order, c gets the summary
+static int run_units(cmd_t *c) {
+    pthread_t workers[MAX_BATCH_JOBS];
+    unsigned i, started = 0, failed = 0, jobs;
+    char **names = NULL;
+    int n, rc = 0;
+    units_t u;
+
+    n = expand_units(c, &names);
+    if (n <= 0) {
+        reply(c, "%s: no unit matches (rc=%d)", c->verb->name,
+              n < 0 ? n : SDW_EINVAL);
+        return n < 0 ? n : SDW_EINVAL;
+    }
+
+    memset(&u, 0, sizeof(u));
+    u.n = (unsigned) n;
+    u.deadline = now_usec() + (uint64_t) c->wait_sec * 1000000;
+    u.cmds = (cmd_t *) calloc(u.n, sizeof(cmd_t));
+    if (NULL == u.cmds) {
+        reply(c, "%s: out of memory", c->verb->name);
+        rc = SDW_EINVAL;
+        goto cleanup;
+    }
+
+    for (i = 0; i < u.n; i++) {
+        u.cmds[i].verb = c->verb;
+        u.cmds[i].unit_name = names[i];
+        u.cmds[i].wait_sec = c->wait_sec;
+        u.cmds[i].trc_level = -1;
+    }
+
+    jobs = 0 == c->jobs ? u.n : c->jobs;
+    if (jobs > u.n)
+        jobs = u.n;
+    if (jobs > MAX_BATCH_JOBS)
+        jobs = MAX_BATCH_JOBS;
+
+    for (; started < jobs && jobs > 1; started++)
+        if (pthread_create(&workers[started], NULL, units_worker, &u) != 0)
+            break;
+
+    if (0 == started)
+        units_worker(&u);       // one job at a time on this thread
+
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    for (i = 0; i < u.n; i++) {
+        printf("%s\n", u.cmds[i].out);
+        if (u.cmds[i].rc < 0 && 0 == failed++)
+            rc = u.cmds[i].rc;
+    }
+
+    reply(c, "%s: %u of %u units succeeded", c->verb->name, u.n - failed,
+          u.n);
+
+cleanup:
+    for (i = 0; i < (unsigned) n; i++)
+        free(names[i]);
+    free(names);
+    free(u.cmds);
+
+    return rc;
 }
 
-int main(int argc, char **argv) {
-    int rc;
+// whether a has to finish before b may start
+static bool batch_depends(const cmd_t *a, const cmd_t *b) {
+    if (NULL == a->verb || NULL == b->verb)
+        return false;
 
-    if (argc < 2 ||
-        strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    if ((a->verb->flags | b->verb->flags) & BARRIER)
+        return true;
+
+    // a pattern may match any unit of the other command
+    for (unsigned i = 0; i < a->n_units; i++)
+        for (unsigned k = 0; k < b->n_units; k++)
+            if (NULL != strpbrk(a->units[i], "*?[") ||
+                NULL != strpbrk(b->units[k], "*?[") ||
+                strcmp(a->units[i], b->units[k]) == 0)
+                return true;
+
+    return false;
+}
+
+// first command that may start now, called with batch.lock held
+static cmd_t *batch_next(void) {
+    for (cmd_t *c = batch.head; NULL != c; c = c->next) {
+        bool ready = !c->started && !c->done;
+
+        for (cmd_t *p = batch.head; ready && p != c; p = p->next)
+            if (!p->done && batch_depends(p, c))
+                ready = false;
+
+        if (ready)
+            return c;
+    }
+
+    return NULL;
+}
+
+// write the finished results in input order, called with batch.lock held
+static void batch_write(void) {
+    cmd_t *c;
+
+    while (NULL != batch.head && batch.head->done) {
+        c = batch.head;
+        batch.head = c->next;
+        if (NULL == batch.head)
+            batch.tail = NULL;
+
+        if (c->rc < 0)
+            batch.rc = 1;
+        printf("%d %s\n", c->rc, c->out);
+
+        free_command(c);
+        free(c);
+        batch.pending--;
+    }
+
+    fflush(stdout);
+    pthread_cond_broadcast(&batch.cond);
+}
+
+// each worker calls libsdw over the bus connection of its thread
+static void *batch_worker(void *arg) {
+    cmd_t *c;
+
+    (void) arg;
+
+    pthread_mutex_lock(&batch.lock);
+    for (;;) {
+        c = batch_next();
+        if (NULL != c) {
+            c->started = true;
+            pthread_mutex_unlock(&batch.lock);
+
+            run_command(c);
+
+            pthread_mutex_lock(&batch.lock);
+            c->done = true;
+            batch_write();
+            continue;
+        }
+
+        if (batch.eof && NULL == batch.head)
+            break;
+
+        pthread_cond_wait(&batch.cond, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    return NULL;
+}
+
+// split line into av, returns the number of words
+static int batch_split(char *line, char **av) {
+    char *save = NULL;
+    int ac = 0;
+
+    for (char *s = strtok_r(line, " \t\r\n", &save);
+         NULL != s && ac < MAX_BATCH_ARGS; s = strtok_r(NULL, " \t\r\n", &save))
+        av[ac++] = s;
+    av[ac] = NULL;
+
+    return ac;
+}
+
+static int run_batch(int argc, char **argv) {
+    pthread_t workers[MAX_BATCH_JOBS];
+    const char *file = NULL;
+    unsigned jobs = 1, started = 0;
+    char *av[MAX_BATCH_ARGS + 1];
+    char *line = NULL, *text;
+    size_t size = 0;
+    FILE *in = stdin;
+    int o, ac, trc_level = 0, reload_ms = -1;
+    cmd_t *c;
+
+    opterr = 0;
+    while ((o = getopt(argc, argv, "f:j:r:v:")) != -1) {
+        switch (o) {
+            case 'f':
+                file = optarg;
+                break;
+            case 'r':
+                reload_ms = atoi(optarg);
+                break;
+            case 'j':
+                jobs = (unsigned) atoi(optarg);
+                break;
+            case 'v':
+                trc_level = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (0 == jobs || jobs > MAX_BATCH_JOBS)
         usage();
 
-    argc--;
-    argv++;
+    if (reload_ms >= 0)
+        sdw_set_reload_policy(SDW_RELOAD_DEFERRED, (unsigned) reload_ms);
 
-    if (strcmp(argv[0], "Start") == 0) {
-        if (my_getopt(argc, argv, "u:w:v:") != 0)
-            usage();
+    if (NULL != file) {
+        in = fopen(file, "r");
+        if (NULL == in) {
+            fprintf(stderr, "%s: %s\n", file, strerror(errno));
+            return 1;
+        }
+    }
 
-        if (NULL == cfg.unit_name)
-            usage();
+    // INFO and DEBUG records would go between the result lines
+    sdw_log_set_errors(1);
+    sdw_set_tracelevel(trc_level);
 
-        if (cfg.wait_sec)
-            rc = sdw_start(cfg.unit_name, cfg.wait_sec);
-        else
-            rc = sdw_start(cfg.unit_name);
+    for (; started < jobs && jobs > 1; started++)
+        if (pthread_create(&workers[started], NULL, batch_worker, NULL) != 0)
+            break;
 
-        if (0 == rc)
-            printf("started '%s'\n", cfg.unit_name);
-        else
-            printf("Start '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+    while (getline(&line, &size, in) >= 0) {
+        text = strdup(line);
+        c = (cmd_t *) malloc(sizeof(cmd_t));
+        if (NULL == text || NULL == c) {
+            fprintf(stderr, "Batch: out of memory\n");
+            exit(1);
+        }
+        text[strcspn(text, "\r\n")] = '\0';
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "Stop") == 0) {
-        if (my_getopt(argc, argv, "u:w:v:") != 0)
-            usage();
+        ac = batch_split(line, av);
+        if (0 == ac || '#' == av[0][0]) {
+            free(text);
+            free(c);
+            continue;
+        }
 
-        if (NULL == cfg.unit_name)
-            usage();
+        // the result of a command is one line, and the trace level is
+        // one for the process, the workers can't have their own
+        if (parse_command(c, ac, av) != 0 ||
+            (is_multi(c) && !(c->verb->flags & ONE_CALL)) ||
+            (c->trc_level >= 0 && 0 != started)) {
+            c->rc = SDW_EINVAL;
+            reply(c, "invalid command '%s'", text);
+            c->verb = NULL;
+            c->done = true;
+        } else if (0 == started) {
+            // no workers, one command at a time at its own level
+            sdw_set_tracelevel(c->trc_level >= 0 ? c->trc_level : trc_level);
+            run_command(c);
+            c->done = true;
+        }
+        free(text);
 
-        if (cfg.wait_sec)
-            rc = sdw_stop(cfg.unit_name, cfg.wait_sec);
-        else
-            rc = sdw_stop(cfg.unit_name);
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending >= MAX_BATCH_PENDING)
+            pthread_cond_wait(&batch.cond, &batch.lock);
 
-        if (0 == rc)
-            printf("stopped '%s'\n", cfg.unit_name);
+        if (NULL == batch.tail)
+            batch.head = c;
         else
-            printf("Stop '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+            batch.tail->next = c;
+        batch.tail = c;
+        batch.pending++;
+        batch_write();
+        pthread_mutex_unlock(&batch.lock);
+    }
 
-        return map_rc(rc);
+    pthread_mutex_lock(&batch.lock);
+    batch.eof = true;
+    pthread_cond_broadcast(&batch.cond);
+    pthread_mutex_unlock(&batch.lock);
+
+    for (unsigned w = 0; w < started; w++)
+        pthread_join(workers[w], NULL);
+
+    free(line);
+    if (stdin != in)
+        fclose(in);
+
+    // the changes of the last window are not reloaded yet
+    if (reload_ms >= 0 && sdw_reload_flush() != 0) {
+        fprintf(stderr, "Batch: deferred Reload failed\n");
+        batch.rc = 1;
     }
-    if (strcmp(argv[0], "Restart") == 0) {
-        if (my_getopt(argc, argv, "u:w:v:") != 0)
-            usage();
 
-        if (NULL == cfg.unit_name)
-            usage();
+    return batch.rc;
+}
 
-        if (cfg.wait_sec)
-            rc = sdw_restart(cfg.unit_name, cfg.wait_sec);
-        else
-            rc = sdw_restart(cfg.unit_name);
+// FNV-1a
+static unsigned serve_hash(const char *name) {
+    uint32_t h = 2166136261u;
 
-        if (0 == rc)
-            printf("restarted '%s'\n", cfg.unit_name);
-        else
-            printf("Restart '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+    for (; '\0' != *name; name++)
+        h = (h ^ (unsigned char) *name) * 16777619u;
 
-        return map_rc(rc);
+    return h % SERVE_BUCKETS;
+}
+
+static serve_unit_t *serve_find(const char *name) {
+    serve_unit_t *u = serve.buckets[serve_hash(name)];
+
+    while (NULL != u && strcmp(u->name, name) != 0)
+        u = u->next;
+
+    return u;
+}
+
+// drop the unit asked for least recently, the cache is full
+static void serve_evict(void) {
+    serve_unit_t **lru = NULL, **pu, *u;
+
+    for (unsigned b = 0; b < SERVE_BUCKETS; b++)
+        for (pu = &serve.buckets[b]; NULL != *pu; pu = &(*pu)->next)
+            if (NULL == lru || (*pu)->used < (*lru)->used)
+                lru = pu;
+
+    if (NULL == lru)
+        return;
+
+    u = *lru;
+    *lru = u->next;
+    free(u->name);
+    free(u);
+    serve.units--;
+}
+
+static serve_unit_t *serve_add(const char *name) {
+    unsigned b = serve_hash(name);
+    serve_unit_t *u;
+
+    if (serve.units >= SERVE_MAX_UNITS)
+        serve_evict();
+
+    u = (serve_unit_t *) calloc(1, sizeof(*u));
+    if (NULL == u)
+        return NULL;
+
+    u->name = strdup(name);
+    if (NULL == u->name) {
+        free(u);
+        return NULL;
     }
-    if (strcmp(argv[0], "GetVersion") == 0) {
-        char *version = NULL;
 
-        if (my_getopt(argc, argv, "v:") != 0)
-            usage();
+    u->next = serve.buckets[b];
+    serve.buckets[b] = u;
+    serve.units++;
 
-        rc = sdw_get_version(&version);
-        if (0 == rc)
-            printf("version: '%s'\n", version);
-        else
-            printf("GetVersion failed (rc=%d)\n", rc);
+    return u;
+}
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "GetUnitByPID") == 0) {
-        if (my_getopt(argc, argv, "p:v:") != 0)
-            usage();
+static void serve_clear(void) {
+    serve_unit_t *u;
 
-        if (0 == cfg.pid)
-            usage();
+    for (unsigned b = 0; b < SERVE_BUCKETS; b++)
+        while (NULL != (u = serve.buckets[b])) {
+            serve.buckets[b] = u->next;
+            free(u->name);
+            free(u);
+        }
 
-        rc = sdw_get_unit_by_pid(cfg.pid, &cfg.unit_name);
-        if (0 == rc)
-            printf("found unit '%s' for pid '%u' (rc=%d)\n", cfg.unit_name,
-                   cfg.pid, rc);
-        else
-            printf("GetUnitByPID '%u' failed (rc=%d)\n", cfg.pid, rc);
+    serve.units = 0;
+}
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "CheckPID") == 0) {
-        if (my_getopt(argc, argv, "p:u:v:") != 0)
-            usage();
+// a cached unit changed, the others are read when first asked for
+static void serve_changed(const sdw_unit_change_t *change, void *userdata) {
+    serve_unit_t *u = serve_find(change->unit_name);
 
-        if (NULL == cfg.unit_name)
-            usage();
+    (void) userdata;
 
-        if (0 == cfg.pid)
-            cfg.pid = getpid();
+    if (NULL == u)
+        return;
 
-        rc = sdw_check_pid(cfg.unit_name, cfg.pid);
-        if (0 == rc)
-            printf("found unit '%s' for pid '%u'\n", cfg.unit_name, cfg.pid);
-        else
-            printf("CheckPid '%s' pid '%u' failed (rc=%d)\n",
-                   cfg.unit_name, cfg.pid, rc);
+    serve.changes++;
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "CheckControlPID") == 0) {
-        if (my_getopt(argc, argv, "p:u:v:") != 0)
-            usage();
+    if (change->changed & SDW_CHANGE_INVALIDATED)
+        u->valid = 0;
 
-        if (NULL == cfg.unit_name)
-            usage();
+    if (change->changed & SDW_CHANGE_ACTIVE_STATE)
+        snprintf(u->active, sizeof(u->active), "%s", change->active_state);
+    if (change->changed & SDW_CHANGE_SUB_STATE)
+        snprintf(u->sub, sizeof(u->sub), "%s", change->sub_state);
+    if (change->changed & SDW_CHANGE_MAIN_PID)
+        u->main_pid = change->main_pid;
 
-        rc = sdw_check_controlpid(cfg.unit_name, cfg.pid);
-        if (0 == rc)
-            printf("found unit '%s' for control pid '%u'\n", cfg.unit_name,
-                   cfg.pid);
-        else
-            printf("CheckControlPID '%s' pid '%u' failed (rc=%d)\n",
-                   cfg.unit_name, cfg.pid, rc);
+    u->valid |= change->changed & (SDW_CHANGE_ACTIVE_STATE |
+                                   SDW_CHANGE_SUB_STATE | SDW_CHANGE_MAIN_PID);
+}
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "GetMainPID") == 0) {
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+// read field of the unit from the cache or the manager, returns the rc
+// of the sdw_get_*() call
+static int serve_get(const char *name, int field, char *buf, size_t len) {
+    char state[MAX_STATE_LEN], *encoded = NULL;
+    serve_unit_t *u = serve_find(name);
+    unsigned pid = 0;
+    int rc;
 
-        if (NULL == cfg.unit_name)
-            usage();
+    if (NULL != u)
+        u->used = ++serve.clock;
 
-        rc = sdw_get_mainpid(cfg.unit_name, &cfg.pid);
-        if (0 == rc)
-            printf("mainPID: '%u'\n", cfg.pid);
-        else
-            printf("GetMainPID '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+    if (NULL != u && (u->valid & field)) {
+        serve.hits++;
+        if (SDW_CHANGE_ACTIVE_STATE == field) {
+            snprintf(buf, len, "%s", u->active);
+            return sdw_parse_activestate(u->active);
+        }
+        if (SDW_CHANGE_SUB_STATE == field) {
+            snprintf(buf, len, "%s", u->sub);
+            return sdw_parse_substate(u->sub);
+        }
+        snprintf(buf, len, "%u", u->main_pid);
+        return 0;
+    }
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "GetActiveState") == 0) {
-        char *state = NULL;
+    // a name the library can't encode never reaches the cache
+    if (NULL == u) {
+        rc = sdw_encode(name, &encoded);
+        free(encoded);
+        if (0 != rc) {
+            snprintf(buf, len, "-");
+            return rc;
+        }
+    }
 
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    serve.misses++;
+    if (SDW_CHANGE_ACTIVE_STATE == field)
+        rc = sdw_get_activestate_r(name, state, sizeof(state));
+    else if (SDW_CHANGE_SUB_STATE == field)
+        rc = sdw_get_substate_r(name, state, sizeof(state));
+    else {
+        rc = sdw_get_mainpid(name, &pid);
+        snprintf(state, sizeof(state), "%u", pid);
+    }
 
-        if (NULL == cfg.unit_name)
-            usage();
+    if (rc < 0) {
+        snprintf(buf, len, "-");
+        return rc;
+    }
+    snprintf(buf, len, "%s", state);
 
-        rc = sdw_get_activestate(cfg.unit_name, &state);
-        if (rc > 0 && NULL != state)
-            printf("ActiveState: %d '%s'\n", rc, state);
-        else
-            printf("GetActiveState '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+    // without the watch nothing would keep it current
+    if (NULL == serve.watch)
+        return rc;
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "GetSubState") == 0) {
-        char *state = NULL;
+    if (NULL == u) {
+        u = serve_add(name);
+        if (NULL == u)
+            return rc;
+        u->used = ++serve.clock;
+    }
 
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    if (SDW_CHANGE_ACTIVE_STATE == field)
+        snprintf(u->active, sizeof(u->active), "%s", state);
+    else if (SDW_CHANGE_SUB_STATE == field)
+        snprintf(u->sub, sizeof(u->sub), "%s", state);
+    else
+        u->main_pid = pid;
+    u->valid |= field;
 
-        if (NULL == cfg.unit_name)
-            usage();
+    return rc;
+}
 
-        rc = sdw_get_substate(cfg.unit_name, &state);
-        if (rc > 0 && NULL != state)
-            printf("SubState: %d '%s'\n", rc, state);
-        else
-            printf("GetSubState '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+// answer one request line, false if the client has to be dropped
+static bool serve_request(serve_client_t *cl, char *line) {
+    char value[MAX_STATE_LEN], *verb, *name, *save = NULL;
+    int field = 0, n, rc;
+
+    verb = strtok_r(line, " \t\r", &save);
+    name = strtok_r(NULL, " \t\r", &save);
+
+    if (NULL != verb && strcmp(verb, "Stats") == 0) {
+        n = snprintf(cl->out + cl->out_len, sizeof(cl->out) - cl->out_len,
+                     "0 units=%u hits=%" PRIu64 " misses=%" PRIu64
+                     " changes=%" PRIu64 " clients=%u watch=%d\n",
+                     serve.units, serve.hits, serve.misses, serve.changes,
+                     serve.n_clients, NULL != serve.watch);
+        goto done;
+    }
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "GetUnitFileState") == 0) {
-        char *state = NULL;
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    if (NULL != verb && strcmp(verb, "ActiveState") == 0)
+        field = SDW_CHANGE_ACTIVE_STATE;
+    else if (NULL != verb && strcmp(verb, "SubState") == 0)
+        field = SDW_CHANGE_SUB_STATE;
+    else if (NULL != verb && strcmp(verb, "MainPID") == 0)
+        field = SDW_CHANGE_MAIN_PID;
+
+    if (0 == field || NULL == name) {
+        rc = SDW_EINVAL;
+        snprintf(value, sizeof(value), "-");
+    } else {
+        rc = serve_get(name, field, value, sizeof(value));
+    }
 
-        if (NULL == cfg.unit_name)
-            usage();
+    n = snprintf(cl->out + cl->out_len, sizeof(cl->out) - cl->out_len,
+                 "%d %s\n", rc, value);
 
-        rc = sdw_get_unitfilestate(cfg.unit_name, &state);
-        if (rc > 0 && NULL != state)
-            printf("UnitFileState: %d '%s'\n", rc, state);
-        else
-            printf("GetUnitFileState '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+done:
+    // a client that does not read its replies is dropped
+    if (n < 0 || (size_t) n >= sizeof(cl->out) - cl->out_len)
+        return false;
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "IsSupported") == 0) {
-        if (my_getopt(argc, argv, "v:") != 0)
-            usage();
+    cl->out_len += (size_t) n;
+    return true;
+}
 
-        rc = sdw_is_supported();
-        printf("systemd version is%s supported\n", 0 == rc ? "" : " not");
+// read the requests of a client and queue the replies, false once the
+// client is gone or misbehaves
+static bool serve_read(serve_client_t *cl) {
+    char *nl, *line;
+    ssize_t n;
+    size_t used;
+
+    n = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len, 0);
+    if (n < 0)
+        return EAGAIN == errno || EINTR == errno;
+    if (0 == n) {
+        cl->eof = true;
+        return true;
+    }
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "Encode") == 0) {
-        char *encoded = NULL;
+    cl->in_len += (size_t) n;
 
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    line = cl->in;
+    while (NULL != (nl = (char *) memchr(line, '\n',
+                                         cl->in_len - (line - cl->in)))) {
+        *nl = '\0';
+        if (!serve_request(cl, line))
+            return false;
+        line = nl + 1;
+    }
 
-        if (NULL == cfg.unit_name)
-            usage();
+    used = (size_t) (line - cl->in);
+    if (0 == used && cl->in_len == sizeof(cl->in))
+        return false;           // request exceeds MAX_SERVE_LINE
 
-        rc = sdw_encode(cfg.unit_name, &encoded);
-        if (0 == rc)
-            printf("encoded: '%s'\n", encoded);
+    memmove(cl->in, line, cl->in_len - used);
+    cl->in_len -= used;
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "Decode") == 0) {
-        char *decoded = NULL;
+    return true;
+}
 
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+static bool serve_write(serve_client_t *cl) {
+    ssize_t n;
 
-        if (NULL == cfg.unit_name)
-            usage();
+    if (0 == cl->out_len)
+        return true;
 
-        rc = sdw_decode(cfg.unit_name, &decoded);
-        if (0 == rc)
-            printf("decoded: '%s'\n", decoded);
+    n = send(cl->fd, cl->out, cl->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0)
+        return EAGAIN == errno || EINTR == errno;
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "Enable") == 0) {
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    memmove(cl->out, cl->out + n, cl->out_len - (size_t) n);
+    cl->out_len -= (size_t) n;
 
-        if (NULL == cfg.unit_name)
-            usage();
+    return true;
+}
 
-        rc = sdw_enable(cfg.unit_name);
+static void serve_drop(unsigned c) {
+    close(serve.clients[c].fd);
+    serve.clients[c] = serve.clients[--serve.n_clients];
+}
+
+static void stop_signal(int sig) {
+    (void) sig;
+    stop_requested = 1;
+}
+
+// the socket file gets mode, not what the umask leaves of 0777
+static int serve_listen(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd, rc = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // a stale socket of an earlier Serve, never another file
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        // no window in which the socket is more open than mode
+        mask = umask(~mode & 0777);
+        rc = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+        umask(mask);
+    }
+    if (rc < 0 || chmod(path, mode) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
         if (0 == rc)
-            printf("enabled '%s'\n", cfg.unit_name);
-        else
-            printf("Enable '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+            unlink(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
 
-        return map_rc(rc);
-    } else if (strcmp(argv[0], "Disable") == 0) {
-        if (my_getopt(argc, argv, "u:v:") != 0)
-            usage();
+    return fd;
+}
 
-        if (NULL == cfg.unit_name)
-            usage();
+// one thread serves all clients, the cache needs no locking and the
+// watch belongs to the thread that reads the missing values
+static int run_serve(int argc, char **argv) {
+    struct pollfd pfd[MAX_SERVE_CLIENTS + 2];
+    struct sigaction sa;
+    const char *path = NULL;
+    mode_t mode = SERVE_SOCKET_MODE;
+    time_t retry = 0;
+    char *end;
+    int o, rc, lfd, trc_level = 0;
+    unsigned c;
 
-        rc = sdw_disable(cfg.unit_name);
-        if (0 == rc)
-            printf("disabled '%s'\n", cfg.unit_name);
-        else
-            printf("Disable '%s' failed (rc=%d)\n", cfg.unit_name, rc);
+    opterr = 0;
+    while ((o = getopt(argc, argv, "s:m:v:")) != -1) {
+        switch (o) {
+            case 's':
+                path = optarg;
+                break;
+            case 'm':
+                mode = (mode_t) strtoul(optarg, &end, 8);
+                if (end == optarg || '\0' != *end || mode > 0777)
+                    usage();
+                break;
+            case 'v':
+                trc_level = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (NULL == path)
+        usage();
 
+    sdw_log_set_errors(1);
+    sdw_set_tracelevel(trc_level);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;       // no SA_RESTART, poll() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    lfd = serve_listen(path, mode);
+    if (lfd < 0)
+        return 1;
+
+    rc = sdw_watch_new(NULL, serve_changed, NULL, &serve.watch);
+    if (0 != rc) {
+        fprintf(stderr, "Serve: watch failed (rc=%d)\n", rc);
+        close(lfd);
+        unlink(path);
         return map_rc(rc);
-    } else if (strcmp(argv[0], "Reload") == 0) {
-        if (my_getopt(argc, argv, "v:") != 0)
-            usage();
+    }
 
-        rc = sdw_reload();
-        if (0 == rc)
-            printf("reloaded units\n");
-        else
-            printf("Reload failed (rc=%d)\n", rc);
+    if (NULL != getenv("NOTIFY_SOCKET"))
+        sdw_notify_ready();
+
+    while (!stop_requested) {
+        // the signals may have been read by the calls of the last round
+        if (NULL != serve.watch &&
+            sdw_watch_process(serve.watch, 0) == SDW_EINIT) {
+            fprintf(stderr, "Serve: connection lost, cache dropped\n");
+            sdw_watch_free(serve.watch);
+            serve.watch = NULL;
+            serve_clear();
+            retry = time(NULL);
+        }
+
+        if (NULL == serve.watch && time(NULL) >= retry) {
+            retry = time(NULL) + 1;
+            if (sdw_watch_new(NULL, serve_changed, NULL, &serve.watch) == 0)
+                fprintf(stderr, "Serve: watching again\n");
+        }
+
+        pfd[0].fd = serve.n_clients < MAX_SERVE_CLIENTS ? lfd : -1;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = NULL != serve.watch ? sdw_watch_get_fd(serve.watch) : -1;
+        pfd[1].events = POLLIN;
+        for (c = 0; c < serve.n_clients; c++) {
+            pfd[c + 2].fd = serve.clients[c].fd;
+            pfd[c + 2].events = (short) ((serve.clients[c].eof ? 0 : POLLIN) |
+                (serve.clients[c].out_len > 0 ? POLLOUT : 0));
+        }
+
+        rc = poll(pfd, serve.n_clients + 2, NULL != serve.watch ? -1 : 1000);
+        if (rc < 0) {
+            if (EINTR == errno)
+                continue;
+            fprintf(stderr, "Serve: poll: %s\n", strerror(errno));
+            break;
+        }
+
+        // clients first, dropping one moves the last into its slot
+        for (c = serve.n_clients; c-- > 0;) {
+            short ev = pfd[c + 2].revents;
+            serve_client_t *cl = &serve.clients[c];
+
+            if (0 == ev)
+                continue;
+
+            if (((ev & (POLLIN | POLLHUP | POLLERR)) && !cl->eof &&
+                 !serve_read(cl)) || !serve_write(cl) ||
+                (cl->eof && 0 == cl->out_len) || (ev & POLLNVAL))
+                serve_drop(c);
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            while (serve.n_clients < MAX_SERVE_CLIENTS) {
+                int fd = accept4(lfd, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                    break;
+
+                memset(&serve.clients[serve.n_clients], 0,
+                       sizeof(serve_client_t));
+                serve.clients[serve.n_clients++].fd = fd;
+            }
+        }
+    }
+
+    for (c = serve.n_clients; c-- > 0;)
+        serve_drop(c);
+    sdw_watch_free(serve.watch);
+    serve_clear();
+    close(lfd);
+    unlink(path);
+
+    return 0;
+}
+
+static void watch_print(const sdw_unit_change_t *change, void *userdata) {
+    (void) userdata;
+
+    printf("%" PRIu64 ".%06" PRIu64 " %s", change->ts_usec / 1000000,
+           change->ts_usec % 1000000, change->unit_name);
+    if (change->changed & SDW_CHANGE_ACTIVE_STATE)
+        printf(" ActiveState=%s", change->active_state);
+    if (change->changed & SDW_CHANGE_SUB_STATE)
+        printf(" SubState=%s", change->sub_state);
+    if (change->changed & SDW_CHANGE_MAIN_PID)
+        printf(" MainPID=%u", change->main_pid);
+    if (change->changed & SDW_CHANGE_INVALIDATED)
+        printf(" invalidated");
+    printf("\n");
+    fflush(stdout);
+
+    if (0 != watch_limit && ++watch_count >= watch_limit)
+        stop_requested = 1;
+}
+
+// print the state of the units given by name, read after subscribing so
+// that no change in between gets lost
+static void watch_initial(const char *const *units) {
+    sdw_unit_change_t change;
+    char active[MAX_STATE_LEN], sub[MAX_STATE_LEN];
+    unsigned pid = 0;
+
+    for (; NULL != *units; units++) {
+        if (NULL != strpbrk(*units, "*?["))
+            continue;
+
+        memset(&change, 0, sizeof(change));
+        change.unit_name = *units;
+        if (sdw_get_activestate_r(*units, active, sizeof(active)) > 0) {
+            change.active_state = active;
+            change.changed |= SDW_CHANGE_ACTIVE_STATE;
+        }
+        if (sdw_get_substate_r(*units, sub, sizeof(sub)) > 0) {
+            change.sub_state = sub;
+            change.changed |= SDW_CHANGE_SUB_STATE;
+        }
+        if (sdw_get_mainpid(*units, &pid) == 0) {
+            change.main_pid = pid;
+            change.changed |= SDW_CHANGE_MAIN_PID;
+        }
+
+        if (0 == change.changed)
+            continue;
+
+        change.ts_usec = now_usec();
+        watch_print(&change, NULL);
+    }
+}
+
+static int run_watch(int argc, char **argv) {
+    const char *units[MAX_WATCH_UNITS + 1];
+    sdw_watch_t *watch = NULL;
+    struct sigaction sa;
+    unsigned n = 0;
+    bool lost = false;          // retry until the bus is back
+    int o, rc, trc_level = 0;
+
+    opterr = 0;
+    while ((o = getopt(argc, argv, "u:n:v:")) != -1) {
+        switch (o) {
+            case 'u':
+                if (n >= MAX_WATCH_UNITS)
+                    usage();
+                units[n++] = optarg;
+                break;
+            case 'n':
+                watch_limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                trc_level = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    units[n] = NULL;
+
+    if (0 == n)
+        usage();
+
+    sdw_log_set_errors(1);
+    sdw_set_tracelevel(trc_level);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;       // no SA_RESTART, the wait returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop_requested) {
+        if (NULL == watch) {
+            rc = sdw_watch_new(units, watch_print, NULL, &watch);
+            if (0 != rc && !lost) {
+                fprintf(stderr, "Watch: subscribe failed (rc=%d)\n", rc);
+                return map_rc(rc);
+            }
+            if (0 != rc) {
+                sleep(1);
+                continue;
+            }
+            lost = false;
+            watch_initial(units);
+        }
+
+        // blocks in the bus until a change or a signal arrives
+        rc = sdw_watch_process(watch, -1);
+        if (SDW_EINIT == rc) {
+            fprintf(stderr, "Watch: connection lost, subscribing again\n");
+            sdw_watch_free(watch);
+            watch = NULL;
+            lost = true;
+        }
+    }
 
+    sdw_watch_free(watch);
+
+    return 0;
+}
+
+static void pressure_print(const sdw_pressure_event_t *ev, void *userdata) {
+    const char *what;
+    int type = ev->type & ~SDW_PRESSURE_REMOVED;
+
+    (void) userdata;
+
+    what = SDW_PRESSURE_MEMORY == type ? "memory" :
+           SDW_PRESSURE_CPU == type ? "cpu" :
+           SDW_PRESSURE_IO == type ? "io" : "oom";
+
+    printf("%" PRIu64 ".%06" PRIu64 " %s %s", ev->ts_usec / 1000000,
+           ev->ts_usec % 1000000, ev->unit_name, what);
+    if (ev->type & SDW_PRESSURE_REMOVED)
+        printf(" removed");
+    else if (SDW_PRESSURE_OOM == type)
+        printf(" oom=%" PRIu64 " oom_kill=%" PRIu64, ev->oom, ev->oom_kill);
+    else
+        printf(" some=%u.%02u full=%u.%02u", ev->some_avg10 / 100,
+               ev->some_avg10 % 100, ev->full_avg10 / 100,
+               ev->full_avg10 % 100);
+    printf("\n");
+    fflush(stdout);
+
+    if (0 != watch_limit && ++watch_count >= watch_limit)
+        stop_requested = 1;
+}
+
+static int run_pressure(int argc, char **argv) {
+    const char *units[MAX_WATCH_UNITS];
+    sdw_pressure_t *pressure = NULL;
+    struct sigaction sa;
+    unsigned n = 0, stall_ms = 100, window_ms = 2000;
+    int o, rc, trc_level = 0;
+
+    opterr = 0;
+    while ((o = getopt(argc, argv, "u:s:w:n:v:")) != -1) {
+        switch (o) {
+            case 'u':
+                if (n >= MAX_WATCH_UNITS)
+                    usage();
+                units[n++] = optarg;
+                break;
+            case 's':
+                stall_ms = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                window_ms = (unsigned) strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                watch_limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'v':
+                trc_level = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (0 == n || 0 == stall_ms || stall_ms > window_ms)
+        usage();
+
+    sdw_log_set_errors(1);
+    sdw_set_tracelevel(trc_level);
+
+    // memory.events is only there with the memory controller
+    rc = sdw_pressure_new(pressure_print, NULL, &pressure);
+    for (unsigned i = 0; i < n && 0 == rc; i++) {
+        rc = sdw_pressure_add(pressure, units[i], SDW_PRESSURE_MEMORY |
+                              SDW_PRESSURE_CPU | SDW_PRESSURE_IO,
+                              stall_ms * 1000, window_ms * 1000);
+        if (0 == rc && sdw_pressure_add(pressure, units[i], SDW_PRESSURE_OOM,
+                                        0, 0) != 0)
+            fprintf(stderr, "Pressure: no OOM events of '%s'\n", units[i]);
+    }
+    if (0 != rc) {
+        fprintf(stderr, "Pressure: watching failed (rc=%d)\n", rc);
+        sdw_pressure_free(pressure);
         return map_rc(rc);
     }
 
-    usage();
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_signal;       // no SA_RESTART, the wait returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop_requested && sdw_pressure_process(pressure, -1) >= 0)
+        ;
+
+    sdw_pressure_free(pressure);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    cmd_t c;
+
+    if (argc < 2 ||
+        strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+        usage();
+
+    argc--;
+    argv++;
+
+    if (strcmp(argv[0], "Batch") == 0)
+        return run_batch(argc, argv);
+
+    if (strcmp(argv[0], "Serve") == 0)
+        return run_serve(argc, argv);
+
+    if (strcmp(argv[0], "Watch") == 0)
+        return run_watch(argc, argv);
+
+    if (strcmp(argv[0], "Pressure") == 0)
+        return run_pressure(argc, argv);
+
+    if (parse_command(&c, argc, argv) != 0)
+        usage();
+
+    sdw_log_set_errors(1);
+    sdw_set_tracelevel(c.trc_level < 0 ? 1 : c.trc_level);
+
+    run_command(&c);
+    printf("%s\n", c.out);
+    free_command(&c);
 
-    return 1;
+    return map_rc(c.rc);
 }
@@ -0,0 +1,1016 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+ * capture and replay of the D-Bus traffic of libsdw, see
+ * sdw_capture_transport() and sdw_replay_transport()
+ *
+ * Both serve libsdw over a peer-to-peer sd-bus connection on a
+ * socketpair, like sdwsim.cpp. The capture proxy forwards every call
+ * to the inner transport and the manager and unit PropertiesChanged
+ * signals back, the replay server answers from the file. They serve
+ * one connection, so one thread of libsdw, a second open fails with
+ * -EBUSY. one_connection of the transport tells libsdw to keep the
+ * deferred Reload on that thread.
+ *
+ * File format, host byte order:
+ *     "SDWREC1\n"
+ *     record*
+ * record:
+ *     u8  kind             REC_CALL or REC_SIGNAL
+ *     u8  flags            REC_ERROR if the call failed
+ *     u64 ts_usec          since the capture was opened
+ *     u32 duration_usec    from the request to the reply, 0 for signals
+ *     str path, str interface, str member
+ *     body                 request of a call, signal arguments
+ *     body                 reply, or str error name, str error message
+ * str:  u32 length, bytes, '\0'
+ * body: item* REC_END
+ * item: u8 basic type, value (str for s, o and g)
+ *     | u8 container type, str contents, body
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+
+#include "sdw.h"
+
+#define REC_END                 0       // of a body or container
+#define REC_CALL                1
+#define REC_SIGNAL              2
+#define REC_ERROR               0x01
+#define REC_DURATION_OFFSET     10      // kind, flags, ts_usec
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+} rec_buf_t;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} rec_reader_t;
+
+// server end of the socketpair, libsdw gets the client end
+typedef struct {
+    sd_bus *server;
+    int fds[2];
+    pthread_t thread;
+    bool thread_started;
+    bool opened;                // the one connection is taken
+} rec_peer_t;
+
+typedef struct {
+    sdw_transport_t inner;      // open == NULL: system bus
+    FILE *file;
+    sd_bus *upstream;
+    rec_peer_t peer;
+    uint64_t ts_start;
+    rec_buf_t rec;              // record being written
+} capture_t;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t flags;
+    bool used;                  // call already served
+    uint64_t ts_usec;
+    uint32_t duration_usec;
+    const char *path;
+    const char *interface;
+    const char *member;
+    const uint8_t *request;     // encoded body of a call
+    size_t request_len;
+    const char *error_name;
+    const char *error_message;
+    const uint8_t *body;        // reply or signal
+} rec_entry_t;
+
+typedef struct {
+    sdw_replay_config_t cfg;
+    uint8_t *data;              // the file
+    size_t len;
+    rec_entry_t *entries;
+    size_t n_entries;
+    size_t next_call;           // entries before are served calls or signals
+    size_t next_signal;
+    size_t signal_end;          // signals before are released
+    uint64_t ts_base;           // now at the last reply ...
+    uint64_t rec_base;          // ... and its recorded time
+    rec_buf_t key;              // encoded body of the current request
+    rec_peer_t peer;
+} replay_t;
+
+static const char rec_magic[8] = { 'S', 'D', 'W', 'R', 'E', 'C', '1', '\n' };
+static const char rec_service[] = "org.freedesktop.systemd1";
+static const char rec_match[] = "type='signal',"
+    "sender='org.freedesktop.systemd1',"
+    "interface='org.freedesktop.systemd1.Manager',"
+    "path='/org/freedesktop/systemd1'";
+// the unit changes sdw_watch_new() follows
+static const char rec_match_changed[] = "type='signal',"
+    "sender='org.freedesktop.systemd1',"
+    "interface='org.freedesktop.DBus.Properties',"
+    "member='PropertiesChanged',"
+    "path_namespace='/org/freedesktop/systemd1/unit'";
+static const char rec_error_failed[] = "org.freedesktop.DBus.Error.Failed";
+
+static uint64_t sdwi_rec_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// size of a fixed size basic type, 0 for strings
+static int sdwi_rec_basic_size(char type) {
+    switch (type) {
+        case SD_BUS_TYPE_BYTE:
+            return 1;
+        case SD_BUS_TYPE_INT16:
+        case SD_BUS_TYPE_UINT16:
+            return 2;
+        case SD_BUS_TYPE_BOOLEAN:
+        case SD_BUS_TYPE_INT32:
+        case SD_BUS_TYPE_UINT32:
+            return 4;
+        case SD_BUS_TYPE_INT64:
+        case SD_BUS_TYPE_UINT64:
+        case SD_BUS_TYPE_DOUBLE:
+            return 8;
+        case SD_BUS_TYPE_STRING:
+        case SD_BUS_TYPE_OBJECT_PATH:
+        case SD_BUS_TYPE_SIGNATURE:
+            return 0;
+        default:
+            return -EOPNOTSUPP; // unix fds are not recorded
+    }
+}
+
+static bool sdwi_rec_is_container(char type) {
+    return SD_BUS_TYPE_ARRAY == type || SD_BUS_TYPE_STRUCT == type ||
+        SD_BUS_TYPE_DICT_ENTRY == type || SD_BUS_TYPE_VARIANT == type;
+}
+
+static int sdwi_rec_put(rec_buf_t *b, const void *p, size_t n) {
+    uint8_t *data;
+    size_t size;
+
+    if (b->len + n > b->size) {
+        for (size = b->size ? b->size * 2 : 4096; size < b->len + n;)
+            size *= 2;
+
+        data = (uint8_t *) realloc(b->data, size);
+        if (NULL == data)
+            return -ENOMEM;
+
+        b->data = data;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+
+    return 0;
+}
+
+static int sdwi_rec_put_u8(rec_buf_t *b, uint8_t v) {
+    return sdwi_rec_put(b, &v, sizeof(v));
+}
+
+// NULL is recorded as ""
+static int sdwi_rec_put_str(rec_buf_t *b, const char *s) {
+    uint32_t len;
+    int rc;
+
+    if (NULL == s)
+        s = "";
+
+    len = (uint32_t) strlen(s);
+    rc = sdwi_rec_put(b, &len, sizeof(len));
+    if (rc < 0)
+        return rc;
+
+    return sdwi_rec_put(b, s, len + 1);
+}
+
+static int sdwi_rec_put_head(rec_buf_t *b, uint8_t kind, uint64_t ts_usec,
+                             sd_bus_message *m) {
+    uint32_t duration = 0;
+    int rc;
+
+    b->len = 0;
+
+    rc = sdwi_rec_put_u8(b, kind);
+    if (rc >= 0)
+        rc = sdwi_rec_put_u8(b, 0);
+    if (rc >= 0)
+        rc = sdwi_rec_put(b, &ts_usec, sizeof(ts_usec));
+    if (rc >= 0)
+        rc = sdwi_rec_put(b, &duration, sizeof(duration));
+    if (rc >= 0)
+        rc = sdwi_rec_put_str(b, sd_bus_message_get_path(m));
+    if (rc >= 0)
+        rc = sdwi_rec_put_str(b, sd_bus_message_get_interface(m));
+    if (rc >= 0)
+        rc = sdwi_rec_put_str(b, sd_bus_message_get_member(m));
+
+    return rc;
+}
+
+static int sdwi_rec_get(rec_reader_t *r, void *p, size_t n) {
+    if ((size_t) (r->end - r->p) < n)
+        return -EBADMSG;
+
+    memcpy(p, r->p, n);
+    r->p += n;
+
+    return 0;
+}
+
+// points into the file, "" for NULL
+static int sdwi_rec_get_str(rec_reader_t *r, const char **ret_s) {
+    uint32_t len;
+    int rc;
+
+    rc = sdwi_rec_get(r, &len, sizeof(len));
+    if (rc < 0)
+        return rc;
+
+    if ((size_t) (r->end - r->p) <= len || '\0' != r->p[len])
+        return -EBADMSG;
+
+    *ret_s = (const char *) r->p;
+    r->p += len + 1;
+
+    return 0;
+}
+
+/*
+ * encode the rest of the message or container src into out and append
+ * it to dst unless NULL, src is left at its end
+ */
+static int sdwi_rec_walk(sd_bus_message *src, sd_bus_message *dst,
+                         rec_buf_t *out) {
+    union {
+        uint8_t y;
+        int b;
+        int16_t n;
+        uint16_t q;
+        int32_t i;
+        uint32_t u;
+        int64_t x;
+        uint64_t t;
+        double d;
+        const char *s;
+    } v;
+    const char *contents;
+    char type;
+    int rc, size;
+
+    for (;;) {
+        rc = sd_bus_message_peek_type(src, &type, &contents);
+        if (rc < 0)
+            return rc;
+        if (0 == rc)
+            return sdwi_rec_put_u8(out, REC_END);
+
+        rc = sdwi_rec_put_u8(out, (uint8_t) type);
+
+        if (sdwi_rec_is_container(type)) {
+            if (rc >= 0)
+                rc = sdwi_rec_put_str(out, contents);
+            if (rc >= 0)
+                rc = sd_bus_message_enter_container(src, type, contents);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_open_container(dst, type, contents);
+            if (rc >= 0)
+                rc = sdwi_rec_walk(src, dst, out);
+            if (rc >= 0)
+                rc = sd_bus_message_exit_container(src);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_close_container(dst);
+        } else {
+            size = sdwi_rec_basic_size(type);
+            if (rc >= 0)
+                rc = size;
+            if (rc >= 0)
+                rc = sd_bus_message_read_basic(src, type, &v);
+            if (rc >= 0)
+                rc = 0 == size ? sdwi_rec_put_str(out, v.s) :
+                    sdwi_rec_put(out, &v, (size_t) size);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_append_basic(dst, type, 0 == size ?
+                                                 (const void *) v.s : &v);
+        }
+
+        if (rc < 0)
+            return rc;
+    }
+}
+
+// append an encoded body to dst, skip it if dst is NULL
+static int sdwi_rec_build(rec_reader_t *r, sd_bus_message *dst) {
+    uint8_t v[8];
+    const char *s;
+    uint8_t type;
+    int rc, size;
+
+    for (;;) {
+        rc = sdwi_rec_get(r, &type, sizeof(type));
+        if (rc < 0)
+            return rc;
+        if (REC_END == type)
+            return 0;
+
+        if (sdwi_rec_is_container((char) type)) {
+            rc = sdwi_rec_get_str(r, &s);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_open_container(dst, (char) type, s);
+            if (rc >= 0)
+                rc = sdwi_rec_build(r, dst);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_close_container(dst);
+        } else {
+            size = sdwi_rec_basic_size((char) type);
+            if (size < 0)
+                return -EBADMSG;
+
+            if (0 == size)
+                rc = sdwi_rec_get_str(r, &s);
+            else
+                rc = sdwi_rec_get(r, v, (size_t) size);
+            if (rc >= 0 && NULL != dst)
+                rc = sd_bus_message_append_basic(dst, (char) type, 0 == size ?
+                                                 (const void *) s : v);
+        }
+
+        if (rc < 0)
+            return rc;
+    }
+}
+
+static void sdwi_rec_peer_close(rec_peer_t *peer) {
+    if (peer->thread_started) {
+        shutdown(peer->fds[0], SHUT_RDWR);
+        pthread_join(peer->thread, NULL);
+    }
+
+    if (NULL != peer->server)
+        sd_bus_unref(peer->server);     // closes fds[0]
+    else if (peer->fds[0] >= 0)
+        close(peer->fds[0]);
+}
+
+/*
+ * start the server end with filter seeing every call and the thread
+ * serving it, the client end is returned for libsdw
+ */
+static int sdwi_rec_peer_open(rec_peer_t *peer,
+                              sd_bus_message_handler_t filter,
+                              void *(*thread)(void *), void *arg,
+                              sd_bus **ret_bus) {
+    sd_bus *client = NULL;
+    sd_id128_t id = { };
+    int rc;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, peer->fds) != 0)
+        return -errno;
+
+    rc = sd_bus_new(&peer->server);
+    if (rc >= 0)
+        rc = sd_bus_set_fd(peer->server, peer->fds[0], peer->fds[0]);
+    if (rc >= 0)
+        rc = sd_bus_set_server(peer->server, 1, id);
+    if (rc >= 0)
+        rc = sd_bus_add_filter(peer->server, NULL, filter, arg);
+    if (rc >= 0)
+        rc = sd_bus_start(peer->server);
+    if (rc < 0) {
+        close(peer->fds[1]);
+        return rc;
+    }
+
+    rc = -pthread_create(&peer->thread, NULL, thread, arg);
+    if (rc < 0) {
+        close(peer->fds[1]);
+        return rc;
+    }
+    peer->thread_started = true;
+
+    rc = sd_bus_new(&client);
+    if (rc >= 0)
+        rc = sd_bus_set_fd(client, peer->fds[1], peer->fds[1]);
+    if (rc >= 0)
+        rc = sd_bus_start(client);
+    if (rc < 0) {
+        if (NULL == client)
+            close(peer->fds[1]);
+        sd_bus_unref(client);
+        return rc;
+    }
+
+    *ret_bus = client;
+
+    return 0;
+}
+
+static void sdwi_cap_write(capture_t *cap) {
+    fwrite(cap->rec.data, 1, cap->rec.len, cap->file);
+}
+
+// forward a call of libsdw upstream and its reply back
+static int sdwi_cap_call(sd_bus_message *m, void *userdata,
+                         sd_bus_error *error) {
+    capture_t *cap = (capture_t *) userdata;
+    sd_bus_message *request = NULL, *reply = NULL, *ret = NULL;
+    sd_bus_error call_error = SD_BUS_ERROR_NULL;
+    const char *destination = sd_bus_message_get_destination(m);
+    uint64_t ts = sdwi_rec_now_usec();
+    uint32_t duration;
+    int rc;
+
+    (void) error;
+
+    if (!sd_bus_message_is_method_call(m, NULL, NULL))
+        return 0;
+
+    rc = sdwi_rec_put_head(&cap->rec, REC_CALL, ts - cap->ts_start, m);
+    if (rc >= 0)
+        rc = sd_bus_message_new_method_call(cap->upstream, &request,
+                                            NULL != destination ?
+                                            destination : rec_service,
+                                            sd_bus_message_get_path(m),
+                                            sd_bus_message_get_interface(m),
+                                            sd_bus_message_get_member(m));
+    if (rc >= 0)
+        rc = sdwi_rec_walk(m, request, &cap->rec);
+    if (rc < 0) {
+        // not forwarded, not recorded
+        sd_bus_message_unref(request);
+        sd_bus_error_set_errno(&call_error, rc);
+        rc = sd_bus_reply_method_error(m, &call_error);
+        sd_bus_error_free(&call_error);
+        return rc < 0 ? rc : 1;
+    }
+
+    rc = sd_bus_call(cap->upstream, request, 0, &call_error, &reply);
+    sd_bus_message_unref(request);
+
+    duration = (uint32_t) (sdwi_rec_now_usec() - ts);
+    memcpy(cap->rec.data + REC_DURATION_OFFSET, &duration, sizeof(duration));
+
+    if (rc >= 0) {
+        rc = sd_bus_message_new_method_return(m, &ret);
+        if (rc >= 0)
+            rc = sdwi_rec_walk(reply, ret, &cap->rec);
+        if (rc >= 0)
+            rc = sd_bus_send(NULL, ret, NULL);
+        sd_bus_message_unref(ret);
+        sd_bus_message_unref(reply);
+    } else {
+        if (!sd_bus_error_is_set(&call_error))
+            sd_bus_error_set_errno(&call_error, rc);
+
+        cap->rec.data[1] = REC_ERROR;
+        rc = sdwi_rec_put_str(&cap->rec, call_error.name);
+        if (rc >= 0)
+            rc = sdwi_rec_put_str(&cap->rec, call_error.message);
+        if (rc >= 0)
+            rc = sd_bus_reply_method_error(m, &call_error);
+        sd_bus_error_free(&call_error);
+    }
+
+    if (rc >= 0)
+        sdwi_cap_write(cap);
+
+    return rc < 0 ? rc : 1;
+}
+
+// forward a manager or unit signal to libsdw
+static int sdwi_cap_signal(sd_bus_message *m, void *userdata,
+                           sd_bus_error *error) {
+    capture_t *cap = (capture_t *) userdata;
+    sd_bus_message *msg = NULL;
+    uint64_t ts = sdwi_rec_now_usec();
+    int rc;
+
+    (void) error;
+
+    rc = sd_bus_message_rewind(m, 1);
+    if (rc >= 0)
+        rc = sdwi_rec_put_head(&cap->rec, REC_SIGNAL, ts - cap->ts_start, m);
+    if (rc >= 0)
+        rc = sd_bus_message_new_signal(cap->peer.server, &msg,
+                                       sd_bus_message_get_path(m),
+                                       sd_bus_message_get_interface(m),
+                                       sd_bus_message_get_member(m));
+    if (rc >= 0)
+        rc = sd_bus_message_set_sender(msg, rec_service);
+    if (rc >= 0)
+        rc = sdwi_rec_walk(m, msg, &cap->rec);
+    if (rc >= 0)
+        rc = sd_bus_send(cap->peer.server, msg, NULL);
+    if (rc >= 0)
+        sdwi_cap_write(cap);
+
+    sd_bus_message_unref(msg);
+
+    return 0;
+}
+
+static int sdwi_cap_poll_timeout(capture_t *cap) {
+    uint64_t t1, t2, now;
+
+    if (sd_bus_get_timeout(cap->peer.server, &t1) < 0)
+        t1 = UINT64_MAX;
+    if (sd_bus_get_timeout(cap->upstream, &t2) < 0)
+        t2 = UINT64_MAX;
+    if (t2 < t1)
+        t1 = t2;
+
+    if (UINT64_MAX == t1)
+        return -1;
+
+    now = sdwi_rec_now_usec();
+    return t1 > now ? (int) ((t1 - now + 999) / 1000) : 0;
+}
+
+static void *sdwi_cap_thread(void *arg) {
+    capture_t *cap = (capture_t *) arg;
+    struct pollfd pfd[2];
+    int rc, rc_up;
+
+    for (;;) {
+        rc = sd_bus_process(cap->peer.server, NULL);
+        rc_up = sd_bus_process(cap->upstream, NULL);
+        if (rc < 0 || rc_up < 0)
+            break;              // client gone, upstream lost or close
+        if (rc > 0 || rc_up > 0)
+            continue;
+
+        fflush(cap->file);      // idle, keep the file readable
+
+        pfd[0].fd = sd_bus_get_fd(cap->peer.server);
+        pfd[0].events = (short) sd_bus_get_events(cap->peer.server);
+        pfd[1].fd = sd_bus_get_fd(cap->upstream);
+        pfd[1].events = (short) sd_bus_get_events(cap->upstream);
+
+        if (poll(pfd, 2, sdwi_cap_poll_timeout(cap)) < 0 && EINTR != errno)
+            break;
+    }
+
+    // pending calls of libsdw fail instead of timing out
+    shutdown(cap->peer.fds[0], SHUT_RDWR);
+
+    return NULL;
+}
+
+static void sdwi_cap_close(void *userdata) {
+    capture_t *cap = (capture_t *) userdata;
+
+    sdwi_rec_peer_close(&cap->peer);
+
+    if (NULL != cap->upstream)
+        sd_bus_unref(cap->upstream);
+    if (NULL != cap->inner.close)
+        cap->inner.close(cap->inner.userdata);
+
+    fclose(cap->file);
+    free(cap->rec.data);
+    free(cap);
+}
+
+static int sdwi_cap_open(sd_bus **ret_bus, void *userdata) {
+    capture_t *cap = (capture_t *) userdata;
+    int rc;
+
+    if (__atomic_exchange_n(&cap->peer.opened, true, __ATOMIC_ACQ_REL))
+        return -EBUSY;
+
+    if (NULL == cap->inner.open)
+        rc = sd_bus_open_system(&cap->upstream);
+    else
+        rc = cap->inner.open(&cap->upstream, cap->inner.userdata);
+    if (rc < 0) {
+        cap->upstream = NULL;
+        return rc;
+    }
+
+    rc = sd_bus_add_match(cap->upstream, NULL, rec_match, sdwi_cap_signal,
+                          cap);
+    if (rc >= 0)
+        rc = sd_bus_add_match(cap->upstream, NULL, rec_match_changed,
+                              sdwi_cap_signal, cap);
+    if (rc < 0)
+        return rc;
+
+    cap->ts_start = sdwi_rec_now_usec();
+
+    return sdwi_rec_peer_open(&cap->peer, sdwi_cap_call, sdwi_cap_thread, cap,
+                              ret_bus);
+}
+
+int sdw_capture_transport(const char *file, const sdw_transport_t *inner,
+                          sdw_transport_t *ret_transport) {
+    capture_t *cap;
+
+    if (NULL == file || NULL == ret_transport)
+        return SDW_EINVAL;
+
+    cap = (capture_t *) calloc(1, sizeof(capture_t));
+    if (NULL == cap)
+        return SDW_EINVAL;
+
+    cap->file = fopen(file, "we");
+    if (NULL == cap->file ||
+        fwrite(rec_magic, sizeof(rec_magic), 1, cap->file) != 1) {
+        if (NULL != cap->file)
+            fclose(cap->file);
+        free(cap);
+        return SDW_EINVAL;
+    }
+
+    if (NULL != inner)
+        cap->inner = *inner;
+    cap->peer.fds[0] = cap->peer.fds[1] = -1;
+
+    ret_transport->name = "capture";
+    ret_transport->open = sdwi_cap_open;
+    ret_transport->close = sdwi_cap_close;
+    ret_transport->userdata = cap;
+    ret_transport->one_connection = 1;
+
+    return 0;
+}
+
+static uint64_t sdwi_replay_scale(replay_t *rp, uint64_t usec) {
+    return usec * rp->cfg.latency_percent / 100;
+}
+
+static int sdwi_replay_signal(replay_t *rp, const rec_entry_t *e) {
+    rec_reader_t r = { e->body, rp->data + rp->len };
+    sd_bus_message *msg = NULL;
+    int rc;
+
+    rc = sd_bus_message_new_signal(rp->peer.server, &msg, e->path,
+                                   e->interface, e->member);
+    if (rc >= 0)
+        rc = sd_bus_message_set_sender(msg, rec_service);
+    if (rc >= 0)
+        rc = sdwi_rec_build(&r, msg);
+    if (rc >= 0)
+        rc = sd_bus_send(rp->peer.server, msg, NULL);
+
+    sd_bus_message_unref(msg);
+
+    return rc;
+}
+
+/*
+ * send the released signals that are due, all of them if flush,
+ * returns the next due time
+ */
+static uint64_t sdwi_replay_signals(replay_t *rp, bool flush) {
+    uint64_t now = sdwi_rec_now_usec(), due;
+    rec_entry_t *e;
+
+    for (; rp->next_signal < rp->signal_end; rp->next_signal++) {
+        e = &rp->entries[rp->next_signal];
+        if (REC_SIGNAL != e->kind)
+            continue;
+
+        if (!flush) {
+            due = rp->ts_base + (e->ts_usec > rp->rec_base ?
+                                 sdwi_replay_scale(rp, e->ts_usec -
+                                                   rp->rec_base) : 0);
+            if (due > now)
+                return due;
+        }
+
+        sdwi_replay_signal(rp, e);
+    }
+
+    return UINT64_MAX;
+}
+
+static bool sdwi_replay_match(replay_t *rp, const rec_entry_t *e,
+                              sd_bus_message *m) {
+    const char *interface = sd_bus_message_get_interface(m);
+    const char *path = sd_bus_message_get_path(m);
+
+    return REC_CALL == e->kind && !e->used &&
+        strcmp(e->member, sd_bus_message_get_member(m)) == 0 &&
+        strcmp(e->path, NULL != path ? path : "") == 0 &&
+        strcmp(e->interface, NULL != interface ? interface : "") == 0 &&
+        e->request_len == rp->key.len &&
+        memcmp(e->request, rp->key.data, rp->key.len) == 0;
+}
+
+// first unserved call recorded with the same request, -1 if none
+static ssize_t sdwi_replay_find(replay_t *rp, sd_bus_message *m) {
+    for (size_t i = rp->next_call; i < rp->n_entries; i++)
+        if (sdwi_replay_match(rp, &rp->entries[i], m))
+            return (ssize_t) i;
+
+    if (!rp->cfg.loop || 0 == rp->next_call)
+        return -1;
+
+    // start over
+    for (size_t i = 0; i < rp->n_entries; i++)
+        rp->entries[i].used = false;
+    rp->next_call = rp->next_signal = rp->signal_end = 0;
+
+    for (size_t i = 0; i < rp->n_entries; i++)
+        if (sdwi_replay_match(rp, &rp->entries[i], m))
+            return (ssize_t) i;
+
+    return -1;
+}
+
+static int sdwi_replay_reply(replay_t *rp, sd_bus_message *m,
+                             const rec_entry_t *e) {
+    rec_reader_t r = { e->body, rp->data + rp->len };
+    sd_bus_message *reply = NULL;
+    sd_bus_error error;
+    int rc;
+
+    if (e->flags & REC_ERROR) {
+        error = SD_BUS_ERROR_MAKE_CONST(e->error_name, e->error_message);
+        return sd_bus_reply_method_error(m, &error);
+    }
+
+    rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc >= 0)
+        rc = sdwi_rec_build(&r, reply);
+    if (rc >= 0)
+        rc = sd_bus_send(NULL, reply, NULL);
+
+    sd_bus_message_unref(reply);
+
+    return rc;
+}
+
+static int sdwi_replay_call(sd_bus_message *m, void *userdata,
+                            sd_bus_error *error) {
+    replay_t *rp = (replay_t *) userdata;
+    rec_entry_t *e;
+    ssize_t i;
+    size_t k;
+    int rc;
+
+    (void) error;
+
+    if (!sd_bus_message_is_method_call(m, NULL, NULL))
+        return 0;
+
+    rp->key.len = 0;
+    rc = sdwi_rec_walk(m, NULL, &rp->key);
+    i = rc < 0 ? -1 : sdwi_replay_find(rp, m);
+    if (i < 0) {
+        rc = sd_bus_reply_method_errorf(m, rec_error_failed,
+                                        "%s %s not in the recording",
+                                        sd_bus_message_get_path(m),
+                                        sd_bus_message_get_member(m));
+        return rc < 0 ? rc : 1;
+    }
+
+    k = (size_t) i;
+    e = &rp->entries[k];
+    e->used = true;
+    while (rp->next_call < rp->n_entries &&
+           (REC_CALL != rp->entries[rp->next_call].kind ||
+            rp->entries[rp->next_call].used))
+        rp->next_call++;
+
+    // signals recorded before the call go out before its reply
+    if (k > rp->signal_end)
+        rp->signal_end = k;
+    sdwi_replay_signals(rp, true);
+
+    if (0 != e->duration_usec)
+        usleep((useconds_t) sdwi_replay_scale(rp, e->duration_usec));
+
+    rc = sdwi_replay_reply(rp, m, e);
+
+    // release the signals up to the next recorded call
+    if (k >= rp->next_signal) {
+        rp->next_signal = k + 1;
+        for (rp->signal_end = k + 1; rp->signal_end < rp->n_entries &&
+             REC_CALL != rp->entries[rp->signal_end].kind;)
+            rp->signal_end++;
+        rp->ts_base = sdwi_rec_now_usec();
+        rp->rec_base = e->ts_usec + e->duration_usec;
+    }
+
+    return rc < 0 ? rc : 1;
+}
+
+static void *sdwi_replay_thread(void *arg) {
+    replay_t *rp = (replay_t *) arg;
+    uint64_t due, now;
+    int rc;
+
+    for (;;) {
+        rc = sd_bus_process(rp->peer.server, NULL);
+        if (rc < 0)
+            break;              // client gone or sdwi_replay_close()
+
+        due = sdwi_replay_signals(rp, false);
+        if (rc > 0)
+            continue;
+
+        now = sdwi_rec_now_usec();
+        rc = sd_bus_wait(rp->peer.server, UINT64_MAX == due ? (uint64_t) -1 :
+                         due > now ? due - now : 0);
+        if (rc < 0 && -EINTR != rc)
+            break;
+    }
+
+    return NULL;
+}
+
+static void sdwi_replay_close(void *userdata) {
+    replay_t *rp = (replay_t *) userdata;
+
+    sdwi_rec_peer_close(&rp->peer);
+
+    free(rp->key.data);
+    free(rp->entries);
+    free(rp->data);
+    free(rp);
+}
+
+static int sdwi_replay_open(sd_bus **ret_bus, void *userdata) {
+    replay_t *rp = (replay_t *) userdata;
+
+    if (__atomic_exchange_n(&rp->peer.opened, true, __ATOMIC_ACQ_REL))
+        return -EBUSY;
+
+    return sdwi_rec_peer_open(&rp->peer, sdwi_replay_call,
+                              sdwi_replay_thread, rp, ret_bus);
+}
+
+static int sdwi_replay_entry(rec_reader_t *r, rec_entry_t *e) {
+    const uint8_t *start;
+    int rc;
+
+    memset(e, 0, sizeof(*e));
+
+    rc = sdwi_rec_get(r, &e->kind, sizeof(e->kind));
+    if (rc >= 0)
+        rc = sdwi_rec_get(r, &e->flags, sizeof(e->flags));
+    if (rc >= 0)
+        rc = sdwi_rec_get(r, &e->ts_usec, sizeof(e->ts_usec));
+    if (rc >= 0)
+        rc = sdwi_rec_get(r, &e->duration_usec, sizeof(e->duration_usec));
+    if (rc >= 0)
+        rc = sdwi_rec_get_str(r, &e->path);
+    if (rc >= 0)
+        rc = sdwi_rec_get_str(r, &e->interface);
+    if (rc >= 0)
+        rc = sdwi_rec_get_str(r, &e->member);
+    if (rc < 0)
+        return rc;
+
+    if (REC_SIGNAL == e->kind) {
+        e->body = r->p;
+        return sdwi_rec_build(r, NULL);
+    }
+
+    if (REC_CALL != e->kind)
+        return -EBADMSG;
+
+    start = r->p;
+    rc = sdwi_rec_build(r, NULL);
+    if (rc < 0)
+        return rc;
+
+    e->request = start;
+    e->request_len = (size_t) (r->p - start);
+
+    if (e->flags & REC_ERROR) {
+        rc = sdwi_rec_get_str(r, &e->error_name);
+        if (rc >= 0)
+            rc = sdwi_rec_get_str(r, &e->error_message);
+        return rc;
+    }
+
+    e->body = r->p;
+    return sdwi_rec_build(r, NULL);
+}
+
+static int sdwi_replay_load(replay_t *rp, const char *file) {
+    rec_reader_t r;
+    rec_entry_t *entries;
+    size_t size = 0;
+    uint8_t *data;
+    FILE *f;
+    size_t n;
+    int rc = -EBADMSG;
+
+    f = fopen(file, "re");
+    if (NULL == f)
+        return -errno;
+
+    for (;;) {
+        if (rp->len == size) {
+            size = size ? size * 2 : 65536;
+            data = (uint8_t *) realloc(rp->data, size);
+            if (NULL == data) {
+                rc = -ENOMEM;
+                goto cleanup;
+            }
+            rp->data = data;
+        }
+
+        n = fread(rp->data + rp->len, 1, size - rp->len, f);
+        if (0 == n)
+            break;
+        rp->len += n;
+    }
+
+    if (rp->len < sizeof(rec_magic) ||
+        memcmp(rp->data, rec_magic, sizeof(rec_magic)) != 0)
+        goto cleanup;
+
+    r.p = rp->data + sizeof(rec_magic);
+    r.end = rp->data + rp->len;
+    size = 0;
+
+    while (r.p < r.end) {
+        if (rp->n_entries == size) {
+            size = size ? size * 2 : 1024;
+            entries = (rec_entry_t *) realloc(rp->entries,
+                                              size * sizeof(rec_entry_t));
+            if (NULL == entries) {
+                rc = -ENOMEM;
+                goto cleanup;
+            }
+            rp->entries = entries;
+        }
+
+        // a capture cut short ends with a partial record
+        if (sdwi_replay_entry(&r, &rp->entries[rp->n_entries]) < 0)
+            break;
+        rp->n_entries++;
+    }
+
+    rc = 0;
+
+cleanup:
+    fclose(f);
+
+    return rc;
+}
+
+int sdw_replay_transport(const sdw_replay_config_t *config,
+                         sdw_transport_t *ret_transport) {
+    replay_t *rp;
+
+    if (NULL == config || NULL == config->file || NULL == ret_transport)
+        return SDW_EINVAL;
+
+    rp = (replay_t *) calloc(1, sizeof(replay_t));
+    if (NULL == rp)
+        return SDW_EINVAL;
+
+    rp->cfg = *config;
+    rp->peer.fds[0] = rp->peer.fds[1] = -1;
+
+    if (sdwi_replay_load(rp, config->file) < 0) {
+        free(rp->entries);
+        free(rp->data);
+        free(rp);
+        return SDW_EINVAL;
+    }
+
+    ret_transport->name = "replay";
+    ret_transport->open = sdwi_replay_open;
+    ret_transport->close = sdwi_replay_close;
+    ret_transport->userdata = rp;
+    ret_transport->one_connection = 1;
+
+    return 0;
+}
@@ -0,0 +1,855 @@
+/*
+    Copyright 2023 SAP SE
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/*
+ * simulated systemd manager, see sdw_sim_transport()
+ *
+ * The manager runs on its own thread and serves a peer-to-peer sd-bus
+ * connection over a socketpair for every open, libsdw talks to it through
+ * the same sd-bus calls it uses for the system bus. Each thread of libsdw
+ * opens its own connection. JobRemoved goes to the connections with a
+ * job in flight, the ones a JobRemoved match is active on, the unit
+ * PropertiesChanged to the ones that called Subscribe. Like PID 1
+ * the manager handles one call at a time, so latency_usec adds up under
+ * concurrent callers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+
+#include "sdw.h"
+
+#define SIM_MAIN_PID_BASE       10000   // MainPID of fake-<i> is base + i
+#define SIM_JOB_QUEUE_LEN       4096    // pending JobRemoved signals
+#define SIM_PATH_LEN            256
+
+typedef struct {
+    const char *active;
+    const char *sub;
+    unsigned main_pid;
+    unsigned n_restarts;
+    bool enabled;
+} sim_unit_t;
+
+// JobRemoved signal due at ts_due
+typedef struct {
+    uint64_t ts_due;
+    unsigned id;
+    unsigned unit;
+    unsigned conn;              // id of the connection that queued it
+} sim_job_t;
+
+// server end of an opened connection
+typedef struct {
+    sd_bus *server;
+    unsigned id;
+    unsigned jobs;              // queued on it, not yet removed
+    bool subscribed;            // gets PropertiesChanged
+} sim_conn_t;
+
+typedef struct {
+    sdw_sim_config_t cfg;
+    pthread_mutex_t lock;       // conns, n_conns, stop
+    sim_conn_t *conns;
+    unsigned n_conns;
+    unsigned conn_id;
+    unsigned max_conns;
+    int wake[2];                // pipe, wakes the manager thread
+    bool stop;
+    pthread_t thread;
+    bool thread_started;
+    unsigned seed;
+    unsigned job_id;
+    sim_unit_t *units;
+    sim_job_t jobs[SIM_JOB_QUEUE_LEN];
+    unsigned job_head;          // next due
+    unsigned job_tail;
+} sim_t;
+
+static const char sim_service[] = "org.freedesktop.systemd1";
+static const char sim_object_path[] = "/org/freedesktop/systemd1";
+static const char sim_unit_path[] = "/org/freedesktop/systemd1/unit";
+static const char sim_interface_mgr[] = "org.freedesktop.systemd1.Manager";
+static const char sim_interface_props[] = "org.freedesktop.DBus.Properties";
+static const char sim_interface_unit[] = "org.freedesktop.systemd1.Unit";
+static const char sim_interface_srv[] = "org.freedesktop.systemd1.Service";
+static const char sim_no_such_unit[] = "org.freedesktop.systemd1.NoSuchUnit";
+static const char sim_error_failed[] = "org.freedesktop.DBus.Error.Failed";
+
+static uint64_t sdwi_sim_now_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// index of fake-<i>.service, -1 if unknown
+static int sdwi_sim_unit(sim_t *sim, const char *name) {
+    unsigned i;
+    int n = 0;
+
+    if (sscanf(name, "fake-%u.service%n", &i, &n) != 1 ||
+        '\0' != name[n] || i >= sim->cfg.units)
+        return -1;
+
+    return (int) i;
+}
+
+// index of the unit object path fake_2d<i>_2eservice, -1 if unknown
+static int sdwi_sim_unit_path(sim_t *sim, const char *path) {
+    size_t len = sizeof(sim_unit_path) - 1;
+    unsigned i;
+    int n = 0;
+
+    if (NULL == path || strncmp(path, sim_unit_path, len) != 0 ||
+        sscanf(path + len, "/fake_2d%u_2eservice%n", &i, &n) != 1 ||
+        '\0' != path[len + n] || i >= sim->cfg.units)
+        return -1;
+
+    return (int) i;
+}
+
+// delay the reply and roll the injected error, true if the call fails
+static bool sdwi_sim_enter(sim_t *sim, sd_bus_message *m) {
+    if (0 != sim->cfg.latency_usec)
+        usleep(sim->cfg.latency_usec);
+
+    if (0 == sim->cfg.error_permille ||
+        (unsigned) rand_r(&sim->seed) % 1000 >= sim->cfg.error_permille)
+        return false;
+
+    sd_bus_reply_method_errorf(m, NULL != sim->cfg.error_name ?
+                               sim->cfg.error_name : sim_error_failed,
+                               "injected error");
+    return true;
+}
+
+static int sdwi_sim_append(sim_t *sim, sd_bus_message *msg, int i,
+                           const char *prop) {
+    sim_unit_t *u;
+
+    if (i < 0) {
+        if (strcmp(prop, "Version") == 0)
+            return sd_bus_message_append(msg, "v", "s", "252 (sim)");
+        return -ENOENT;
+    }
+
+    u = &sim->units[i];
+
+    if (strcmp(prop, "ActiveState") == 0)
+        return sd_bus_message_append(msg, "v", "s", u->active);
+    if (strcmp(prop, "SubState") == 0)
+        return sd_bus_message_append(msg, "v", "s", u->sub);
+    if (strcmp(prop, "LoadState") == 0)
+        return sd_bus_message_append(msg, "v", "s", "loaded");
+    if (strcmp(prop, "MainPID") == 0)
+        return sd_bus_message_append(msg, "v", "u", u->main_pid);
+    if (strcmp(prop, "ControlPID") == 0)
+        return sd_bus_message_append(msg, "v", "u", 0);
+    if (strcmp(prop, "NRestarts") == 0)
+        return sd_bus_message_append(msg, "v", "u", u->n_restarts);
+    if (strcmp(prop, "ControlGroup") == 0) {
+        char cgroup[64];
+
+        snprintf(cgroup, sizeof(cgroup), "/system.slice/fake-%d.service", i);
+        return sd_bus_message_append(msg, "v", "s", cgroup);
+    }
+    if (strcmp(prop, "ExecMainStatus") == 0)
+        return sd_bus_message_append(msg, "v", "i", 0);
+    if (strcmp(prop, "MemoryCurrent") == 0)
+        return sd_bus_message_append(msg, "v", "t", (uint64_t) 1 << 20);
+    if (strcmp(prop, "ActiveEnterTimestampMonotonic") == 0)
+        return sd_bus_message_append(msg, "v", "t", (uint64_t) 1000000);
+    if (strcmp(prop, "NeedDaemonReload") == 0)
+        return sd_bus_message_append(msg, "v", "b", 0);
+    if (strcmp(prop, "Job") == 0)
+        return sd_bus_message_append(msg, "v", "(uo)", 0, "/");
+
+    return -ENOENT;
+}
+
+static int sdwi_sim_get_property(sim_t *sim, sd_bus_message *m, int i) {
+    sd_bus_message *reply = NULL;
+    const char *interface, *prop;
+    int rc;
+
+    rc = sd_bus_message_read(m, "ss", &interface, &prop);
+    if (rc < 0)
+        return rc;
+
+    rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc < 0)
+        return rc;
+
+    if (sdwi_sim_append(sim, reply, i, prop) < 0) {
+        sd_bus_message_unref(reply);
+        return sd_bus_reply_method_errorf(m,
+                        "org.freedesktop.DBus.Error.UnknownProperty",
+                        "Unknown property %s", prop);
+    }
+
+    rc = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+// signals carry the sender the JobRemoved match of libsdw asks for and
+// go out on every connection with a job in flight, like the system bus
+// routes them to every client waiting on a job
+static void sdwi_sim_job_signal(sim_t *sim, unsigned id, const char *job,
+                                const char *unit, const char *result) {
+    sd_bus_message *msg;
+    sim_conn_t *conn;
+    int rc;
+
+    for (unsigned c = 0; c < sim->n_conns; c++) {
+        conn = &sim->conns[c];
+        if (0 == conn->jobs)
+            continue;
+
+        msg = NULL;
+        rc = sd_bus_message_new_signal(conn->server, &msg, sim_object_path,
+                                       sim_interface_mgr, "JobRemoved");
+        if (rc >= 0)
+            rc = sd_bus_message_set_sender(msg, sim_service);
+        if (rc >= 0)
+            rc = sd_bus_message_append(msg, "uoss", id, job, unit, result);
+        if (rc >= 0)
+            sd_bus_send(conn->server, msg, NULL);
+
+        sd_bus_message_unref(msg);
+    }
+}
+
+static void sdwi_sim_job_removed(sim_t *sim, const sim_job_t *job) {
+    char path[SIM_PATH_LEN], unit[64];
+
+    snprintf(path, sizeof(path), "%s/job/%u", sim_object_path, job->id);
+    snprintf(unit, sizeof(unit), "fake-%u.service", job->unit);
+
+    sdwi_sim_job_signal(sim, job->id, path, unit, "done");
+
+    for (unsigned c = 0; c < sim->n_conns; c++)
+        if (sim->conns[c].id == job->conn)
+            sim->conns[c].jobs--;
+}
+
+// connection a call came in on
+static sim_conn_t *sdwi_sim_find_conn(sim_t *sim, sd_bus_message *m) {
+    sd_bus *server = sd_bus_message_get_bus(m);
+
+    for (unsigned c = 0; c < sim->n_conns; c++)
+        if (sim->conns[c].server == server)
+            return &sim->conns[c];
+
+    return NULL;
+}
+
+// id of the connection a job is queued on
+static unsigned sdwi_sim_conn(sim_t *sim, sd_bus_message *m) {
+    sim_conn_t *conn = sdwi_sim_find_conn(sim, m);
+
+    if (NULL == conn)
+        return 0;
+
+    conn->jobs++;
+    return conn->id;
+}
+
+// PropertiesChanged of unit i on each subscribed connection, the states
+// on the Unit interface and MainPID on the Service one like PID 1
+static void sdwi_sim_unit_changed(sim_t *sim, int i) {
+    char path[SIM_PATH_LEN];
+    sd_bus_message *msg;
+    sim_conn_t *conn;
+    sim_unit_t *u = &sim->units[i];
+    int rc;
+
+    snprintf(path, sizeof(path), "%s/fake_2d%d_2eservice", sim_unit_path, i);
+
+    for (unsigned c = 0; c < sim->n_conns; c++) {
+        conn = &sim->conns[c];
+        if (!conn->subscribed)
+            continue;
+
+        msg = NULL;
+        rc = sd_bus_message_new_signal(conn->server, &msg, path,
+                                       sim_interface_props,
+                                       "PropertiesChanged");
+        if (rc >= 0)
+            rc = sd_bus_message_set_sender(msg, sim_service);
+        if (rc >= 0)
+            rc = sd_bus_message_append(msg, "sa{sv}as", sim_interface_unit,
+                                       2, "ActiveState", "s", u->active,
+                                       "SubState", "s", u->sub, 0);
+        if (rc >= 0)
+            sd_bus_send(conn->server, msg, NULL);
+        sd_bus_message_unref(msg);
+
+        msg = NULL;
+        rc = sd_bus_message_new_signal(conn->server, &msg, path,
+                                       sim_interface_props,
+                                       "PropertiesChanged");
+        if (rc >= 0)
+            rc = sd_bus_message_set_sender(msg, sim_service);
+        if (rc >= 0)
+            rc = sd_bus_message_append(msg, "sa{sv}as", sim_interface_srv,
+                                       1, "MainPID", "u", u->main_pid, 0);
+        if (rc >= 0)
+            sd_bus_send(conn->server, msg, NULL);
+        sd_bus_message_unref(msg);
+    }
+}
+
+// send the JobRemoved signals that are due, returns the next due time
+static uint64_t sdwi_sim_jobs(sim_t *sim) {
+    uint64_t now = sdwi_sim_now_usec();
+    sim_job_t *job;
+
+    while (sim->job_head != sim->job_tail) {
+        job = &sim->jobs[sim->job_head % SIM_JOB_QUEUE_LEN];
+        if (job->ts_due > now)
+            return job->ts_due;
+
+        sdwi_sim_job_removed(sim, job);
+        sim->job_head++;
+    }
+
+    return UINT64_MAX;
+}
+
+static int sdwi_sim_job(sim_t *sim, sd_bus_message *m, const char *member) {
+    char path[SIM_PATH_LEN];
+    const char *name, *mode;
+    sim_unit_t *u;
+    sim_job_t job;
+    int i, rc;
+
+    rc = sd_bus_message_read(m, "ss", &name, &mode);
+    if (rc < 0)
+        return rc;
+
+    i = sdwi_sim_unit(sim, name);
+    if (i < 0)
+        return sd_bus_reply_method_errorf(m, sim_no_such_unit,
+                                          "Unit %s not found.", name);
+
+    job.id = ++sim->job_id;
+    job.unit = (unsigned) i;
+    job.conn = sdwi_sim_conn(sim, m);
+    job.ts_due = sdwi_sim_now_usec() + sim->cfg.job_usec;
+
+    snprintf(path, sizeof(path), "%s/job/%u", sim_object_path, job.id);
+    rc = sd_bus_reply_method_return(m, "o", path);
+    if (rc < 0)
+        return rc;
+
+    u = &sim->units[i];
+    if (strcmp(member, "StopUnit") == 0) {
+        u->active = "inactive";
+        u->sub = "dead";
+        u->main_pid = 0;
+    } else {
+        if (strcmp(member, "RestartUnit") == 0)
+            u->n_restarts++;
+        u->active = "active";
+        u->sub = "running";
+        u->main_pid = SIM_MAIN_PID_BASE + (unsigned) i;
+    }
+    sdwi_sim_unit_changed(sim, i);
+
+    // unrelated completions the waiting callers have to skip
+    for (unsigned s = 0; s < sim->cfg.storm; s++)
+        sdwi_sim_job_signal(sim, 0, "/org/freedesktop/systemd1/job/0",
+                            "storm.service", "done");
+
+    if (0 == sim->cfg.job_usec ||
+        sim->job_tail - sim->job_head >= SIM_JOB_QUEUE_LEN) {
+        sdwi_sim_job_removed(sim, &job);
+        return 1;
+    }
+
+    sim->jobs[sim->job_tail++ % SIM_JOB_QUEUE_LEN] = job;
+
+    return 1;
+}
+
+static int sdwi_sim_unit_files(sim_t *sim, sd_bus_message *m, bool enable) {
+    sd_bus_message *reply = NULL;
+    const char *name;
+    int i, rc;
+
+    rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc < 0)
+        return rc;
+
+    if (enable)
+        sd_bus_message_append(reply, "b", 0);   // carries_install_info
+
+    sd_bus_message_enter_container(m, 'a', "s");
+    sd_bus_message_open_container(reply, 'a', "(sss)");
+    while (sd_bus_message_read(m, "s", &name) > 0) {
+        i = sdwi_sim_unit(sim, name);
+        if (i < 0 || sim->units[i].enabled == enable)
+            continue;
+
+        sim->units[i].enabled = enable;
+        sd_bus_message_append(reply, "(sss)", enable ? "symlink" : "unlink",
+                              "/etc/systemd/system/multi-user.target.wants",
+                              name);
+    }
+    sd_bus_message_exit_container(m);
+    sd_bus_message_close_container(reply);
+
+    rc = sd_bus_send(NULL, reply, NULL);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+static int sdwi_sim_list_units(sim_t *sim, sd_bus_message *m) {
+    char name[64], path[SIM_PATH_LEN];
+    sd_bus_message *reply = NULL;
+    char **patterns = NULL;
+    bool match;
+    int rc;
+
+    rc = sd_bus_message_skip(m, "as");  // states
+    if (rc >= 0)
+        rc = sd_bus_message_read_strv(m, &patterns);
+    if (rc >= 0)
+        rc = sd_bus_message_new_method_return(m, &reply);
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(reply, 'a', "(ssssssouso)");
+
+    for (unsigned i = 0; rc >= 0 && i < sim->cfg.units; i++) {
+        snprintf(name, sizeof(name), "fake-%u.service", i);
+        match = NULL == patterns || NULL == patterns[0];
+        for (char **p = patterns; !match && NULL != *p; p++)
+            match = fnmatch(*p, name, 0) == 0;
+        if (!match)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/fake_2d%u_2eservice",
+                 sim_unit_path, i);
+        rc = sd_bus_message_append(reply, "(ssssssouso)", name, "sim unit",
+                                   "loaded", sim->units[i].active,
+                                   sim->units[i].sub, "", path, 0, "", "/");
+    }
+
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(reply);
+    if (rc >= 0)
+        rc = sd_bus_send(NULL, reply, NULL);
+
+    for (char **p = patterns; NULL != p && NULL != *p; p++)
+        free(*p);
+    free(patterns);
+    sd_bus_message_unref(reply);
+
+    return rc < 0 ? rc : 1;
+}
+
+static int sdwi_sim_manager(sd_bus_message *m, void *userdata,
+                            sd_bus_error *error) {
+    sim_t *sim = (sim_t *) userdata;
+    const char *member = sd_bus_message_get_member(m);
+    const char *name;
+    unsigned pid;
+    int i, rc;
+
+    (void) error;
+
+    if (sd_bus_message_is_method_call(m, sim_interface_props, "Get"))
+        return sdwi_sim_enter(sim, m) ? 1 : sdwi_sim_get_property(sim, m, -1);
+
+    if (!sd_bus_message_is_method_call(m, sim_interface_mgr, NULL) ||
+        NULL == member)
+        return 0;
+
+    if (sdwi_sim_enter(sim, m))
+        return 1;
+
+    if (strcmp(member, "StartUnit") == 0 || strcmp(member, "StopUnit") == 0 ||
+        strcmp(member, "RestartUnit") == 0)
+        return sdwi_sim_job(sim, m, member);
+
+    if (strcmp(member, "GetUnitByPID") == 0) {
+        char path[SIM_PATH_LEN];
+
+        rc = sd_bus_message_read(m, "u", &pid);
+        if (rc < 0)
+            return rc;
+
+        i = (int) (pid - SIM_MAIN_PID_BASE);
+        if (pid < SIM_MAIN_PID_BASE || (unsigned) i >= sim->cfg.units ||
+            sim->units[i].main_pid != pid)
+            return sd_bus_reply_method_errorf(m,
+                        "org.freedesktop.systemd1.NoUnitForPID",
+                        "PID %u does not belong to any loaded unit.", pid);
+
+        snprintf(path, sizeof(path), "%s/fake_2d%d_2eservice",
+                 sim_unit_path, i);
+        return sd_bus_reply_method_return(m, "o", path);
+    }
+
+    if (strcmp(member, "GetUnitFileState") == 0) {
+        rc = sd_bus_message_read(m, "s", &name);
+        if (rc < 0)
+            return rc;
+
+        i = sdwi_sim_unit(sim, name);
+        if (i < 0)
+            return sd_bus_reply_method_errorf(m, sim_no_such_unit,
+                                              "Unit %s not found.", name);
+
+        return sd_bus_reply_method_return(m, "s", sim->units[i].enabled ?
+                                          "enabled" : "disabled");
+    }
+
+    if (strcmp(member, "GetUnitProcesses") == 0) {
+        char cgroup[64];
+
+        rc = sd_bus_message_read(m, "s", &name);
+        if (rc < 0)
+            return rc;
+
+        i = sdwi_sim_unit(sim, name);
+        if (i < 0)
+            return sd_bus_reply_method_errorf(m, sim_no_such_unit,
+                                              "Unit %s not found.", name);
+
+        snprintf(cgroup, sizeof(cgroup), "/system.slice/fake-%d.service", i);
+        if (0 == sim->units[i].main_pid)
+            return sd_bus_reply_method_return(m, "a(sus)", 0);
+        return sd_bus_reply_method_return(m, "a(sus)", 1, cgroup,
+                                          sim->units[i].main_pid,
+                                          "/usr/bin/sim");
+    }
+
+    if (strcmp(member, "ListUnitsByPatterns") == 0)
+        return sdwi_sim_list_units(sim, m);
+
+    if (strcmp(member, "EnableUnitFiles") == 0)
+        return sdwi_sim_unit_files(sim, m, true);
+    if (strcmp(member, "DisableUnitFiles") == 0)
+        return sdwi_sim_unit_files(sim, m, false);
+
+    if (strcmp(member, "Subscribe") == 0) {
+        sim_conn_t *conn = sdwi_sim_find_conn(sim, m);
+
+        if (NULL != conn && conn->subscribed)
+            return sd_bus_reply_method_errorf(m,
+                        "org.freedesktop.systemd1.AlreadySubscribed",
+                        "Client is already subscribed.");
+        if (NULL != conn)
+            conn->subscribed = true;
+        return sd_bus_reply_method_return(m, "");
+    }
+
+    if (strcmp(member, "Reload") == 0)
+        return sd_bus_reply_method_return(m, "");
+
+    return 0;
+}
+
+static int sdwi_sim_unit_object(sd_bus_message *m, void *userdata,
+                                sd_bus_error *error) {
+    sim_t *sim = (sim_t *) userdata;
+    int i;
+
+    (void) error;
+
+    if (!sd_bus_message_is_method_call(m, sim_interface_props, "Get"))
+        return 0;
+
+    if (sdwi_sim_enter(sim, m))
+        return 1;
+
+    i = sdwi_sim_unit_path(sim, sd_bus_message_get_path(m));
+    if (i < 0)
+        return sd_bus_reply_method_errorf(m, sim_no_such_unit,
+                                          "Unit %s not found.",
+                                          sd_bus_message_get_path(m));
+
+    return sdwi_sim_get_property(sim, m, i);
+}
+
+// handle what is pending on every connection, drops the connections
+// whose client is gone, true if anything was processed
+static bool sdwi_sim_process(sim_t *sim) {
+    bool busy = false;
+    unsigned c = 0;
+    int rc;
+
+    while (c < sim->n_conns) {
+        rc = sd_bus_process(sim->conns[c].server, NULL);
+        if (rc < 0) {
+            sd_bus_unref(sim->conns[c].server);
+            sim->conns[c] = sim->conns[--sim->n_conns];
+            continue;
+        }
+
+        busy |= rc > 0;
+        c++;
+    }
+
+    return busy;
+}
+
+// poll timeout in ms until the next JobRemoved or sd-bus timeout is due
+static int sdwi_sim_poll_timeout(sim_t *sim, uint64_t due) {
+    uint64_t t, now;
+
+    for (unsigned c = 0; c < sim->n_conns; c++)
+        if (sd_bus_get_timeout(sim->conns[c].server, &t) >= 0 && t < due)
+            due = t;
+
+    if (UINT64_MAX == due)
+        return -1;
+
+    now = sdwi_sim_now_usec();
+    return due > now ? (int) ((due - now + 999) / 1000) : 0;
+}
+
+static void *sdwi_sim_thread(void *arg) {
+    sim_t *sim = (sim_t *) arg;
+    struct pollfd *pfd = NULL, *p;      // wake pipe, then conns
+    unsigned n, max = 0;
+    int timeout;
+    char drain[64];
+
+    for (;;) {
+        pthread_mutex_lock(&sim->lock);
+        if (sim->stop) {
+            pthread_mutex_unlock(&sim->lock);
+            break;
+        }
+
+        if (sdwi_sim_process(sim)) {
+            sdwi_sim_jobs(sim);
+            pthread_mutex_unlock(&sim->lock);
+            continue;
+        }
+
+        timeout = sdwi_sim_poll_timeout(sim, sdwi_sim_jobs(sim));
+
+        n = sim->n_conns;
+        if (n + 1 > max) {
+            p = (struct pollfd *) realloc(pfd, (n + 1) * sizeof(*pfd));
+            if (NULL == p) {
+                pthread_mutex_unlock(&sim->lock);
+                break;
+            }
+            pfd = p;
+            max = n + 1;
+        }
+
+        pfd[0].fd = sim->wake[0];
+        pfd[0].events = POLLIN;
+        for (unsigned c = 0; c < n; c++) {
+            pfd[c + 1].fd = sd_bus_get_fd(sim->conns[c].server);
+            pfd[c + 1].events =
+                (short) sd_bus_get_events(sim->conns[c].server);
+        }
+        pthread_mutex_unlock(&sim->lock);
+
+        if (poll(pfd, n + 1, timeout) < 0 && EINTR != errno)
+            break;
+
+        if (pfd[0].revents & POLLIN)
+            while (read(sim->wake[0], drain, sizeof(drain)) > 0)
+                ;
+    }
+
+    free(pfd);
+
+    return NULL;
+}
+
+static void sdwi_sim_wake(sim_t *sim) {
+    char c = 0;
+
+    if (write(sim->wake[1], &c, 1) < 0 && EAGAIN != errno)
+        perror("sdwsim: wake");
+}
+
+static void sdwi_sim_close(void *userdata) {
+    sim_t *sim = (sim_t *) userdata;
+
+    if (sim->thread_started) {
+        pthread_mutex_lock(&sim->lock);
+        sim->stop = true;
+        pthread_mutex_unlock(&sim->lock);
+        sdwi_sim_wake(sim);
+        pthread_join(sim->thread, NULL);
+    }
+
+    // closes the server ends, pending calls of the clients fail
+    for (unsigned c = 0; c < sim->n_conns; c++)
+        sd_bus_unref(sim->conns[c].server);
+
+    close(sim->wake[0]);
+    close(sim->wake[1]);
+    pthread_mutex_destroy(&sim->lock);
+    free(sim->conns);
+    free(sim->units);
+    free(sim);
+}
+
+// make room for one more connection, called with the lock held
+static int sdwi_sim_grow(sim_t *sim) {
+    sim_conn_t *conns;
+    unsigned max;
+
+    if (sim->n_conns < sim->max_conns)
+        return 0;
+
+    max = 0 == sim->max_conns ? 8 : 2 * sim->max_conns;
+
+    conns = (sim_conn_t *) realloc(sim->conns, max * sizeof(sim_conn_t));
+    if (NULL == conns)
+        return -ENOMEM;
+    sim->conns = conns;
+    sim->max_conns = max;
+    return 0;
+}
+
+static int sdwi_sim_open(sd_bus **ret_bus, void *userdata) {
+    sim_t *sim = (sim_t *) userdata;
+    sd_bus *server = NULL, *client = NULL;
+    sd_id128_t id = { };
+    int fds[2];
+    int rc;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        return -errno;
+
+    rc = sd_bus_new(&server);
+    if (rc >= 0)
+        rc = sd_bus_set_fd(server, fds[0], fds[0]);
+    if (rc >= 0)
+        rc = sd_bus_set_server(server, 1, id);
+    if (rc >= 0)
+        rc = sd_bus_add_object(server, NULL, sim_object_path,
+                               sdwi_sim_manager, sim);
+    if (rc >= 0)
+        rc = sd_bus_add_fallback(server, NULL, sim_unit_path,
+                                 sdwi_sim_unit_object, sim);
+    if (rc >= 0)
+        rc = sd_bus_start(server);
+    if (rc < 0) {
+        if (NULL == server)
+            close(fds[0]);
+        sd_bus_unref(server);           // closes fds[0]
+        close(fds[1]);
+        return rc;
+    }
+
+    pthread_mutex_lock(&sim->lock);
+    rc = sdwi_sim_grow(sim);
+    if (rc >= 0 && !sim->thread_started) {
+        rc = -pthread_create(&sim->thread, NULL, sdwi_sim_thread, sim);
+        sim->thread_started = rc >= 0;
+    }
+    if (rc >= 0) {
+        sim->conns[sim->n_conns].server = server;
+        sim->conns[sim->n_conns].id = ++sim->conn_id;
+        sim->conns[sim->n_conns].jobs = 0;
+        sim->conns[sim->n_conns].subscribed = false;
+        sim->n_conns++;
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    if (rc < 0) {
+        sd_bus_unref(server);
+        close(fds[1]);
+        return rc;
+    }
+
+    sdwi_sim_wake(sim);
+
+    rc = sd_bus_new(&client);
+    if (rc >= 0)
+        rc = sd_bus_set_fd(client, fds[1], fds[1]);
+    if (rc >= 0)
+        rc = sd_bus_start(client);
+    if (rc < 0) {
+        if (NULL == client)
+            close(fds[1]);
+        sd_bus_unref(client);           // the manager drops the server end
+        return rc;
+    }
+
+    *ret_bus = client;
+
+    return 0;
+}
+
+int sdw_sim_transport(const sdw_sim_config_t *config,
+                      sdw_transport_t *ret_transport) {
+    sim_t *sim;
+
+    if (NULL == config || NULL == ret_transport || 0 == config->units ||
+        config->error_permille > 1000)
+        return SDW_EINVAL;
+
+    sim = (sim_t *) calloc(1, sizeof(sim_t));
+    if (NULL == sim)
+        return SDW_EINVAL;
+
+    sim->units = (sim_unit_t *) calloc(config->units, sizeof(sim_unit_t));
+    if (NULL == sim->units) {
+        free(sim);
+        return SDW_EINVAL;
+    }
+
+    if (pipe2(sim->wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        free(sim->units);
+        free(sim);
+        return SDW_EINVAL;
+    }
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->cfg = *config;
+    sim->seed = config->seed;
+
+    for (unsigned i = 0; i < config->units; i++) {
+        sim->units[i].active = "active";
+        sim->units[i].sub = "running";
+        sim->units[i].main_pid = SIM_MAIN_PID_BASE + i;
+        sim->units[i].enabled = true;
+    }
+
+    ret_transport->name = "sim";
+    ret_transport->open = sdwi_sim_open;
+    ret_transport->close = sdwi_sim_close;
+    ret_transport->userdata = sim;
+    ret_transport->one_connection = 0;
+
+    return 0;
+}